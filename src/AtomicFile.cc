@@ -0,0 +1,62 @@
+#include "AtomicFile.hh"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <thread>
+
+namespace ResourceDASM {
+
+std::string temp_filename_for(const std::string& filename) {
+  return std::format("{}.{}.{}.tmp", filename, getpid(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+void write_file_atomic(const std::string& filename, const std::function<void(FILE*)>& write_fn) {
+  std::string temp_filename = temp_filename_for(filename);
+  FILE* f = fopen(temp_filename.c_str(), "wb");
+  if (!f) {
+    throw phosg::cannot_open_file(temp_filename);
+  }
+  try {
+    write_fn(f);
+    // The data must be on disk before the rename; otherwise a failed write (e.g. if the disk is full) or a crash could
+    // replace a good file with a truncated one
+    if (fflush(f) != 0) {
+      throw std::runtime_error(std::format("cannot write {}: {}", temp_filename, strerror(errno)));
+    }
+    if (fsync(fileno(f)) != 0) {
+      throw std::runtime_error(std::format("cannot sync {}: {}", temp_filename, strerror(errno)));
+    }
+  } catch (...) {
+    fclose(f);
+    std::error_code ec;
+    std::filesystem::remove(temp_filename, ec);
+    throw;
+  }
+  if (fclose(f) != 0) {
+    int close_errno = errno;
+    std::error_code ec;
+    std::filesystem::remove(temp_filename, ec);
+    throw std::runtime_error(std::format("cannot close {}: {}", temp_filename, strerror(close_errno)));
+  }
+  try {
+    std::filesystem::rename(temp_filename, filename);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(temp_filename, ec);
+    throw;
+  }
+}
+
+void save_file_atomic(const std::string& filename, const std::string& data) {
+  write_file_atomic(filename, [&](FILE* f) -> void {
+    phosg::fwritex(f, data.data(), data.size());
+  });
+}
+
+} // namespace ResourceDASM
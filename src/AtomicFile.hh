@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <functional>
+#include <string>
+
+namespace ResourceDASM {
+
+// Returns a name for a temporary file in the same directory as filename. The name is unique to the calling process
+// and thread, so caches and indexes shared between processes (or written from multiple threads) never collide.
+std::string temp_filename_for(const std::string& filename);
+
+// Writes a file by calling write_fn with a new temporary file, then renaming the temporary file over filename. Readers
+// (including other processes that have the existing file open or mapped) therefore see either the old file or the
+// complete new one, never a partially written file. The temporary file is flushed and synced to disk before the
+// rename. If write_fn throws or any of these steps fails, the temporary file is deleted and filename is left unchanged.
+void write_file_atomic(const std::string& filename, const std::function<void(FILE*)>& write_fn);
+void save_file_atomic(const std::string& filename, const std::string& data);
+
+} // namespace ResourceDASM
@@ -3,22 +3,29 @@
 #include <inttypes.h>
 #include <stdlib.h>
 
+#include <array>
 #include <stdexcept>
 #include <vector>
 
 namespace ResourceDASM {
 namespace Audio {
 
-std::vector<float> convert_samples_dynamic(const void* data, size_t size, size_t bits_per_sample) {
+void convert_samples_dynamic_into(std::vector<float>& out, const void* data, size_t size, size_t bits_per_sample) {
   if (bits_per_sample == 8) {
-    return convert_samples<float, uint8_t>(static_cast<const uint8_t*>(data), size);
+    convert_samples_into<float, uint8_t>(out, static_cast<const uint8_t*>(data), size);
   } else if (bits_per_sample == 16) {
-    return convert_samples<float, phosg::be_int16_t>(static_cast<const phosg::be_int16_t*>(data), size / 2);
+    convert_samples_into<float, phosg::be_int16_t>(out, static_cast<const phosg::be_int16_t*>(data), size / 2);
   } else {
     throw std::runtime_error("Unknown sample bit width");
   }
 }
 
+std::vector<float> convert_samples_dynamic(const void* data, size_t size, size_t bits_per_sample) {
+  std::vector<float> ret;
+  convert_samples_dynamic_into(ret, data, size, bits_per_sample);
+  return ret;
+}
+
 // This decoder is based on the MACE decoder in libavcodec/ffmpeg. See original decoder and license information at
 // https://github.com/FFmpeg/FFmpeg/blob/master/libavcodec/mace.c
 
@@ -179,21 +186,20 @@ static int16_t read_table(ChannelData& channel, uint8_t value, size_t table_inde
   return current;
 }
 
-std::vector<float> decode_mace(
-    const void* vdata, size_t size, bool stereo, bool is_mace3) {
+void decode_mace(float* result_data, const void* vdata, size_t size, bool stereo, bool is_mace3) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
-  std::vector<ChannelData> channel_data(stereo ? 2 : 1);
-  std::vector<float> result_data(size * (is_mace3 ? 3 : 6));
+  ChannelData channel_data[2];
+  size_t num_channels = stereo ? 2 : 1;
 
-  size_t bytes_per_frame = (is_mace3 ? 2 : 1) * channel_data.size();
+  size_t bytes_per_frame = (is_mace3 ? 2 : 1) * num_channels;
   size_t output_offset = 0;
   for (size_t input_offset = 0; input_offset < size;) {
     if (input_offset + bytes_per_frame > size) {
       throw std::runtime_error("odd number of bytes remaining");
     }
 
-    for (size_t which_channel = 0; which_channel < channel_data.size(); which_channel++) {
+    for (size_t which_channel = 0; which_channel < num_channels; which_channel++) {
       ChannelData& channel = channel_data[which_channel];
 
       if (is_mace3) {
@@ -251,8 +257,12 @@ std::vector<float> decode_mace(
       }
     }
   }
+}
 
-  return result_data;
+std::vector<float> decode_mace(const void* data, size_t size, bool stereo, bool is_mace3) {
+  std::vector<float> ret(mace_decoded_sample_count(size, is_mace3));
+  decode_mace(ret.data(), data, size, stereo, is_mace3);
+  return ret;
 }
 
 struct IMA4Packet {
@@ -269,39 +279,78 @@ struct IMA4Packet {
   }
 };
 
-std::vector<float> decode_ima4(const void* vdata, size_t size, bool stereo) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+// IMA4 decoding is inherently serial (each sample depends on the previous one), but the per-nybble arithmetic only
+// depends on the current step index and the nybble, so we precompute it. Each entry holds the value to add to the
+// predictor and the next step index.
+struct IMA4Transition {
+  int32_t diff;
+  uint8_t next_step_index;
+};
 
-  static const int16_t index_table[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
-  static const int16_t step_table[89] = {
-      7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107,
-      118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876,
-      963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
-      5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086,
-      29794, 32767};
+static const std::array<std::array<IMA4Transition, 16>, 89>& ima4_transitions() {
+  static const auto table = []() -> std::array<std::array<IMA4Transition, 16>, 89> {
+    static const int16_t index_table[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+    static const int16_t step_table[89] = {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+        107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+        876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+        5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+        27086, 29794, 32767};
+
+    std::array<std::array<IMA4Transition, 16>, 89> ret;
+    for (size_t step_index = 0; step_index < 89; step_index++) {
+      int32_t step = step_table[step_index];
+      for (size_t nybble = 0; nybble < 16; nybble++) {
+        int32_t diff = 0;
+        if (nybble & 4) {
+          diff += step;
+        }
+        if (nybble & 2) {
+          diff += step >> 1;
+        }
+        if (nybble & 1) {
+          diff += step >> 2;
+        }
+        diff += step >> 3;
+        if (nybble & 8) {
+          diff = -diff;
+        }
+        auto& t = ret[step_index][nybble];
+        t.diff = diff;
+        t.next_step_index = std::clamp<int32_t>(static_cast<int32_t>(step_index) + index_table[nybble], 0, 88);
+      }
+    }
+    return ret;
+  }();
+  return table;
+}
+
+void decode_ima4(float* result_data, const void* vdata, size_t size, bool stereo) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const auto& transitions = ima4_transitions();
 
   if (size % (stereo ? 68 : 34)) {
     throw std::runtime_error("ima4 data size must be a multiple of 34 bytes");
   }
-  std::vector<float> result_data((size * 64) / 34);
+  if (size == 0) {
+    return;
+  }
 
   struct ChannelState {
     int32_t predictor;
-    int32_t step_index;
-    int32_t step;
+    uint8_t step_index;
   } channel_state[2];
 
+  // The header's step index field is 7 bits wide, but only values up to 88 are meaningful
   {
     const IMA4Packet* base_packet = reinterpret_cast<const IMA4Packet*>(data);
     channel_state[0].predictor = base_packet->predictor();
-    channel_state[0].step_index = base_packet->step_index();
-    channel_state[0].step = step_table[channel_state[0].step_index];
+    channel_state[0].step_index = std::min<uint8_t>(base_packet->step_index(), 88);
   }
   if (stereo) {
     const IMA4Packet* base_packet = reinterpret_cast<const IMA4Packet*>(data + 34);
     channel_state[1].predictor = base_packet->predictor();
-    channel_state[1].step_index = base_packet->step_index();
-    channel_state[1].step = step_table[channel_state[1].step_index];
+    channel_state[1].step_index = std::min<uint8_t>(base_packet->step_index(), 88);
   }
 
   for (size_t packet_offset = 0; packet_offset < size; packet_offset += 34) {
@@ -309,100 +358,114 @@ std::vector<float> decode_ima4(const void* vdata, size_t size, bool stereo) {
     size_t packet_index = packet_offset / 34;
     auto& channel = channel_state[stereo ? (packet_index & 1) : 0];
 
-    // Interleave stereo samples appropriately
-    size_t output_offset;
-    size_t output_step = stereo ? 2 : 1;
-    if (stereo) {
-      output_offset = (packet_index & ~1) * 64 + (packet_index & 1);
-    } else {
-      output_offset = packet_index * 64;
-    }
-
+    // Run the serial part of the decoder into a small integer buffer first, so the conversion to float below is a
+    // simple loop that the compiler can vectorize
+    int16_t packet_samples[64];
+    int32_t predictor = channel.predictor;
+    uint8_t step_index = channel.step_index;
     for (size_t x = 0; x < 32; x++) {
       uint8_t value = packet->data[x];
       for (size_t y = 0; y < 2; y++) {
-        uint8_t nybble = value & 0x0F;
+        const auto& t = transitions[step_index][value & 0x0F];
         value >>= 4;
+        predictor = std::clamp<int32_t>(predictor + t.diff, -0x8000, 0x7FFF);
+        packet_samples[x * 2 + y] = predictor;
+        step_index = t.next_step_index;
+      }
+    }
+    channel.predictor = predictor;
+    channel.step_index = step_index;
 
-        int32_t diff = 0;
-        if (nybble & 4) {
-          diff += channel.step;
-        }
-        if (nybble & 2) {
-          diff += channel.step >> 1;
-        }
-        if (nybble & 1) {
-          diff += channel.step >> 2;
-        }
-        diff += channel.step >> 3;
-        if (nybble & 8) {
-          diff = -diff;
-        }
+    // Interleave stereo samples appropriately
+    if (stereo) {
+      float* out = result_data + (packet_index & ~1) * 64 + (packet_index & 1);
+      for (size_t z = 0; z < 64; z++) {
+        out[z * 2] = sample_to_float<int16_t>(packet_samples[z]);
+      }
+    } else {
+      float* out = result_data + packet_index * 64;
+      for (size_t z = 0; z < 64; z++) {
+        out[z] = sample_to_float<int16_t>(packet_samples[z]);
+      }
+    }
+  }
+}
 
-        channel.predictor += diff;
+std::vector<float> decode_ima4(const void* data, size_t size, bool stereo) {
+  std::vector<float> ret(ima4_decoded_sample_count(size));
+  decode_ima4(ret.data(), data, size, stereo);
+  return ret;
+}
 
-        if (channel.predictor > 0x7FFF) {
-          channel.predictor = 0x7FFF;
-        } else if (channel.predictor < -0x8000) {
-          channel.predictor = -0x8000;
-        }
+// A-law and u-law samples are only 8 bits wide, so we decode each possible value once and use lookup tables after
+// that.
 
-        result_data[output_offset] = sample_to_float<int16_t>(channel.predictor);
-        output_offset += output_step;
+static float decode_alaw_sample(uint8_t value) {
+  int8_t sample = static_cast<int8_t>(value) ^ 0x55;
+  int8_t sign = (sample & 0x80) ? -1 : 1;
 
-        channel.step_index += index_table[nybble];
-        if (channel.step_index < 0) {
-          channel.step_index = 0;
-        } else if (channel.step_index > 88) {
-          channel.step_index = 88;
-        }
-        channel.step = step_table[channel.step_index];
-      }
-    }
+  if (sign == -1) {
+    sample &= 0x7F;
   }
 
-  return result_data;
+  uint8_t shift = ((sample & 0xF0) >> 4) + 4;
+  if (shift == 4) {
+    return sample_to_float<int16_t>(sign * ((sample << 1) | 1));
+  } else {
+    return sample_to_float<int16_t>(sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))));
+  }
 }
 
-std::vector<float> decode_alaw(const void* vdata, size_t size) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+static float decode_ulaw_sample(uint8_t value) {
+  static const uint16_t ULAW_BIAS = 33;
 
-  std::vector<float> ret(size);
-  for (size_t x = 0; x < size; x++) {
-    int8_t sample = static_cast<int8_t>(data[x]) ^ 0x55;
-    int8_t sign = (sample & 0x80) ? -1 : 1;
+  int8_t sample = ~static_cast<int8_t>(value);
+  int8_t sign = (sample & 0x80) ? -1 : 1;
+  if (sign == -1) {
+    sample &= 0x7F;
+  }
+  uint8_t shift = ((sample & 0xF0) >> 4) + 5;
+  return sample_to_float<int16_t>(
+      sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS);
+}
 
-    if (sign == -1) {
-      sample &= 0x7F;
+template <float (*DecodeSample)(uint8_t)>
+static const std::array<float, 0x100>& companded_sample_table() {
+  static const auto table = []() -> std::array<float, 0x100> {
+    std::array<float, 0x100> ret;
+    for (size_t z = 0; z < 0x100; z++) {
+      ret[z] = DecodeSample(z);
     }
+    return ret;
+  }();
+  return table;
+}
 
-    uint8_t shift = ((sample & 0xF0) >> 4) + 4;
-    if (shift == 4) {
-      ret[x] = sample_to_float<int16_t>(sign * ((sample << 1) | 1));
-    } else {
-      ret[x] = sample_to_float<int16_t>(sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))));
-    }
+static void decode_companded(float* out, const void* vdata, size_t size, const std::array<float, 0x100>& table) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  const float* table_data = table.data();
+  for (size_t x = 0; x < size; x++) {
+    out[x] = table_data[data[x]];
   }
-  return ret;
 }
 
-std::vector<float> decode_ulaw(const void* vdata, size_t size) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+void decode_alaw(float* out, const void* data, size_t size) {
+  decode_companded(out, data, size, companded_sample_table<decode_alaw_sample>());
+}
 
-  static const uint16_t ULAW_BIAS = 33;
+void decode_ulaw(float* out, const void* data, size_t size) {
+  decode_companded(out, data, size, companded_sample_table<decode_ulaw_sample>());
+}
 
-  std::vector<float> ret(size);
-  for (size_t x = 0; x < size; x++) {
-    int8_t sample = ~static_cast<int8_t>(data[x]);
+std::vector<float> decode_alaw(const void* data, size_t size) {
+  std::vector<float> ret(alaw_decoded_sample_count(size));
+  decode_alaw(ret.data(), data, size);
+  return ret;
+}
 
-    int8_t sign = (sample & 0x80) ? -1 : 1;
-    if (sign == -1) {
-      sample &= 0x7F;
-    }
-    uint8_t shift = ((sample & 0xF0) >> 4) + 5;
-    ret[x] = sample_to_float<int16_t>(
-        sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS);
-  }
+std::vector<float> decode_ulaw(const void* data, size_t size) {
+  std::vector<float> ret(ulaw_decoded_sample_count(size));
+  decode_ulaw(ret.data(), data, size);
   return ret;
 }
 
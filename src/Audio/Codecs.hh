@@ -68,12 +68,17 @@ inline float sample_from_float<float>(float sample) {
 }
 
 template <typename ToT, typename FromT>
-std::vector<ToT> convert_samples(const FromT* samples, size_t count) {
-  std::vector<ToT> ret;
-  ret.reserve(count);
+void convert_samples_into(std::vector<ToT>& out, const FromT* samples, size_t count) {
+  out.resize(count);
+  ToT* out_data = out.data();
   for (size_t z = 0; z < count; z++) {
-    ret.emplace_back(sample_from_float<ToT>(sample_to_float<FromT>(samples[z])));
+    out_data[z] = sample_from_float<ToT>(sample_to_float<FromT>(samples[z]));
   }
+}
+template <typename ToT, typename FromT>
+std::vector<ToT> convert_samples(const FromT* samples, size_t count) {
+  std::vector<ToT> ret;
+  convert_samples_into<ToT, FromT>(ret, samples, count);
   return ret;
 }
 template <typename ToT, typename FromT>
@@ -85,12 +90,36 @@ std::vector<ToT> convert_samples(const std::string& data) {
   return convert_samples<ToT, FromT>(reinterpret_cast<const FromT*>(data.data()), data.size() / sizeof(FromT));
 }
 
+void convert_samples_dynamic_into(std::vector<float>& out, const void* data, size_t size, size_t bits_per_sample);
 std::vector<float> convert_samples_dynamic(const void* data, size_t size, size_t bits_per_sample);
 
 inline std::vector<float> convert_samples_dynamic(const std::string& data, size_t bits_per_sample) {
   return convert_samples_dynamic(data.data(), data.size(), bits_per_sample);
 }
 
+// These return the number of samples that the corresponding decoder below produces for size bytes of input. For
+// stereo data, this is the total number of samples across both channels (output samples are interleaved).
+inline size_t mace_decoded_sample_count(size_t size, bool is_mace3) {
+  return size * (is_mace3 ? 3 : 6);
+}
+inline size_t ima4_decoded_sample_count(size_t size) {
+  return (size * 64) / 34;
+}
+inline size_t alaw_decoded_sample_count(size_t size) {
+  return size;
+}
+inline size_t ulaw_decoded_sample_count(size_t size) {
+  return size;
+}
+
+// These decode into a caller-provided buffer, which must have room for at least the number of samples returned by
+// the corresponding *_decoded_sample_count function. They don't allocate any memory, so they're preferable when
+// decoding many sounds in a row.
+void decode_mace(float* out, const void* data, size_t size, bool stereo, bool is_mace3);
+void decode_ima4(float* out, const void* data, size_t size, bool stereo);
+void decode_alaw(float* out, const void* data, size_t size);
+void decode_ulaw(float* out, const void* data, size_t size);
+
 std::vector<float> decode_mace(const void* data, size_t size, bool stereo, bool is_mace3);
 std::vector<float> decode_ima4(const void* data, size_t size, bool stereo);
 std::vector<float> decode_alaw(const void* data, size_t size);
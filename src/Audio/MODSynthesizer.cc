@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <array>
 #include <deque>
 #include <filesystem>
@@ -12,6 +13,7 @@
 #include <phosg/Time.hh>
 #include <string>
 
+#include "../Parallel.hh"
 #include "MODSynthesizer.hh"
 #include "SampleCache.hh"
 #include "WAVFile.hh"
@@ -448,7 +450,10 @@ MODSynthesizer::MODSynthesizer(std::shared_ptr<const Module> mod, std::shared_pt
       timing(this->opts->sample_rate),
       pos(this->mod->partition_count, this->opts->skip_partitions, this->opts->skip_divisions),
       tracks(this->mod->num_tracks),
-      sample_cache(this->opts->resample_method) {
+      sample_cache(this->opts->sample_cache
+              ? this->opts->sample_cache
+              : std::make_shared<SampleCache<const Module::Instrument*>>(
+                    this->opts->resample_method, this->opts->max_sample_cache_bytes)) {
   // Initialize track state which depends on track index
   for (size_t x = 0; x < this->tracks.size(); x++) {
     this->tracks[x].index = x;
@@ -950,7 +955,7 @@ bool MODSynthesizer::render_current_division_audio() {
       track.last_effective_volume = effective_volume;
 
       // Apply the appropriate portion of the instrument's sample data to the tick output data.
-      const std::vector<float>* resampled_data = nullptr;
+      std::shared_ptr<const std::vector<float>> resampled_data;
       ssize_t segment_index = -1;
       double src_ratio = -1.0;
       double resampled_offset = -1.0;
@@ -977,7 +982,7 @@ bool MODSynthesizer::render_current_division_audio() {
           //   out_samples_per_in_sample = (sample_rate * 2 * period) / hardware_freq
           // This gives how many samples to generate for each input sample.
           src_ratio = static_cast<double>(2 * this->timing.sample_rate * segment.second) / this->opts->amiga_hardware_frequency;
-          resampled_data = &this->sample_cache.resample_add(track.instrument_num, i.sample_data, 1, src_ratio);
+          resampled_data = this->sample_cache->resample_add(&i, i.sample_data, 1, src_ratio);
           resampled_offset = track.input_sample_offset * src_ratio;
 
           // The sample has a loop if the length in words is > 1. We convert words to samples long before this point,
@@ -1163,5 +1168,87 @@ const std::vector<float>& MODRenderer::result() {
   return this->all_tick_samples;
 }
 
+// Collects the samples produced by a single track, without the per-tick buffers that MODRenderer keeps
+class TrackRenderer : public MODSynthesizer {
+public:
+  TrackRenderer(std::shared_ptr<const Module> mod, std::shared_ptr<const Options> opts, std::vector<float>& output)
+      : MODSynthesizer(mod, opts),
+        output(output) {}
+
+  virtual bool on_tick_samples_ready(std::vector<float>&& samples) {
+    this->output.insert(this->output.end(), samples.begin(), samples.end());
+    return true;
+  }
+
+private:
+  std::vector<float>& output;
+};
+
+void render_tracks_parallel(
+    std::shared_ptr<const Module> mod,
+    std::shared_ptr<const MODSynthesizer::Options> opts,
+    const std::function<void(const float*, size_t)>& write_samples,
+    size_t num_threads) {
+  std::vector<size_t> audible_tracks;
+  for (size_t z = 0; z < mod->num_tracks; z++) {
+    if (!opts->mute_tracks.count(z) && (opts->solo_tracks.empty() || opts->solo_tracks.count(z))) {
+      audible_tracks.emplace_back(z);
+    }
+  }
+  if (audible_tracks.empty()) {
+    MODRenderer renderer(mod, opts);
+    renderer.run_all();
+    const auto& samples = renderer.result();
+    write_samples(samples.data(), samples.size());
+    return;
+  }
+
+  // All workers share one sample cache, since they all use the same instruments
+  std::shared_ptr<SampleCache<const Module::Instrument*>> sample_cache = opts->sample_cache
+      ? opts->sample_cache
+      : std::make_shared<SampleCache<const Module::Instrument*>>(opts->resample_method, opts->max_sample_cache_bytes);
+
+  // Each worker runs the entire song (all tracks still execute their commands, since effects like Bxx and Fxx affect
+  // the global song position and timing), but only one track produces audio. Tracks don't affect each other's audio,
+  // so each worker's output is exactly that track's contribution to the mix.
+  std::vector<std::vector<float>> track_samples(audible_tracks.size());
+  parallel_for_each(audible_tracks, [&](const size_t& track_index) -> void {
+    auto track_opts = std::make_shared<MODSynthesizer::Options>(*opts);
+    track_opts->mute_tracks.clear();
+    track_opts->solo_tracks = {track_index};
+    track_opts->print_status_while_playing = false;
+    track_opts->print_track_debug_while_playing = false;
+    track_opts->sample_cache = sample_cache;
+    // Only show warnings from one of the workers, since they'd all be the same
+    if (track_index != audible_tracks[0]) {
+      track_opts->log_level = phosg::LogLevel::L_ERROR;
+    }
+    size_t z = std::lower_bound(audible_tracks.begin(), audible_tracks.end(), track_index) - audible_tracks.begin();
+    TrackRenderer renderer(mod, track_opts, track_samples[z]);
+    renderer.run_all();
+  }, num_threads);
+
+  // All workers produce the same number of samples, since the song timing doesn't depend on which tracks are audible.
+  // The mix is done in the same order as in render_current_division_audio so the floating-point sums are identical.
+  // It's written in fixed-size blocks, so the mixed result is never held in memory all at once.
+  size_t num_samples = track_samples[0].size();
+  for (const auto& samples : track_samples) {
+    if (samples.size() != num_samples) {
+      throw std::logic_error("tracks produced different amounts of audio");
+    }
+  }
+  static constexpr size_t MIX_BLOCK_SAMPLES = 0x10000;
+  std::vector<float> block;
+  for (size_t offset = 0; offset < num_samples; offset += MIX_BLOCK_SAMPLES) {
+    block.assign(std::min<size_t>(MIX_BLOCK_SAMPLES, num_samples - offset), 0.0f);
+    for (const auto& samples : track_samples) {
+      for (size_t z = 0; z < block.size(); z++) {
+        block[z] += samples[offset + z];
+      }
+    }
+    write_samples(block.data(), block.size());
+  }
+}
+
 } // namespace Audio
 } // namespace ResourceDASM
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <phosg/Strings.hh>
@@ -130,6 +131,13 @@ public:
     // Log level for the synthesizer. This is generally used for warnings (e.g. unimplemented effect types), so set
     // this to L_ERROR if you don't want to see those.
     phosg::LogLevel log_level = phosg::LogLevel::L_INFO;
+    // Maximum total size in bytes of resampled instrument data to keep in memory. If zero, the cache is unbounded.
+    // This has no effect if sample_cache is given.
+    size_t max_sample_cache_bytes = 0;
+    // If not null, the synthesizer uses this cache for resampled instruments instead of creating its own, so that
+    // multiple synthesizers can share resampled data. The cache is keyed by instrument address, so all modules used
+    // with a shared cache must remain allocated as long as the cache exists.
+    std::shared_ptr<SampleCache<const Module::Instrument*>> sample_cache;
   };
 
   MODSynthesizer(std::shared_ptr<const Module> mod, std::shared_ptr<const Options> opts);
@@ -144,6 +152,9 @@ public:
   inline std::shared_ptr<const Options> get_options() const {
     return this->opts;
   }
+  inline std::shared_ptr<const SampleCache<const Module::Instrument*>> get_sample_cache() const {
+    return this->sample_cache;
+  }
 
 protected:
   struct Timing {
@@ -231,7 +242,7 @@ protected:
   Timing timing;
   SongPosition pos;
   std::vector<TrackState> tracks;
-  SampleCache<uint8_t> sample_cache;
+  std::shared_ptr<SampleCache<const Module::Instrument*>> sample_cache;
   float dc_offset_decay = 0.001;
 
   [[nodiscard]] virtual bool on_tick_samples_ready(std::vector<float>&&) = 0;
@@ -264,5 +275,16 @@ public:
   const std::vector<float>& result();
 };
 
+// Renders each audible track on its own thread, then mixes the tracks together in track order and passes the mix to
+// write_samples in blocks. The result is bit-identical to the result of MODRenderer::run_all() followed by
+// MODRenderer::result(), but rendering scales with the number of tracks in the module. If num_threads is zero, uses
+// as many threads as there are CPU cores. Note that the mix can't start until every track has been rendered, so each
+// track's entire output is held in memory until then (but the mix itself isn't).
+void render_tracks_parallel(
+    std::shared_ptr<const Module> mod,
+    std::shared_ptr<const MODSynthesizer::Options> opts,
+    const std::function<void(const float*, size_t)>& write_samples,
+    size_t num_threads = 0);
+
 } // namespace Audio
 } // namespace ResourceDASM
@@ -0,0 +1,328 @@
+#include "PersistentSampleCache.hh"
+
+#include <phosg/Platform.hh>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifndef PHOSG_WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <filesystem>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+
+#include "../AtomicFile.hh"
+
+namespace ResourceDASM {
+namespace Audio {
+
+// Cache file format:
+//   CacheFileHeader
+//   CacheFileEntry[header.entry_count]
+//   sample data (little-endian floats) for each entry, referenced by the entries' data_offset fields
+
+static constexpr uint32_t CACHE_FILE_MAGIC = 0x534D5343; // 'SMSC'
+static constexpr uint32_t CACHE_FILE_VERSION = 1;
+
+struct CacheFileHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_uint64_t env_hash;
+  phosg::le_uint32_t output_sample_rate;
+  phosg::le_uint32_t resample_method;
+  phosg::le_uint64_t entry_count;
+} __attribute__((packed));
+
+struct CacheFileEntry {
+  phosg::le_uint64_t sound_hash;
+  phosg::le_float ratio;
+  phosg::le_uint32_t unused;
+  phosg::le_uint64_t data_offset;
+  phosg::le_uint64_t sample_count;
+} __attribute__((packed));
+
+static const char* name_for_resample_method(ResampleMethod method) {
+  switch (method) {
+    case ResampleMethod::EXTEND:
+      return "hold";
+    case ResampleMethod::LINEAR_INTERPOLATE:
+      return "linear";
+    default:
+      throw std::logic_error("Invalid resampling method");
+  }
+}
+
+PersistentSampleCache::PersistentSampleCache(
+    const std::string& directory, const SoundEnvironment& env, size_t output_sample_rate, ResampleMethod method)
+    : env(env),
+      output_sample_rate(output_sample_rate),
+      method(method),
+      env_hash(phosg::fnv1a64(nullptr, 0)) {
+  // Hash all sounds in a consistent order, so the environment hash is the same in every run
+  std::vector<uint32_t> bank_ids;
+  for (const auto& it : this->env.sample_banks) {
+    bank_ids.emplace_back(it.first);
+  }
+  std::sort(bank_ids.begin(), bank_ids.end());
+  for (uint32_t bank_id : bank_ids) {
+    for (const auto& sound : this->env.sample_banks.at(bank_id)) {
+      if (!sound.afc_data.empty()) {
+        this->compressed_sounds.emplace(&sound);
+      }
+      uint64_t sound_hash = this->hash_for_sound(&sound);
+      this->sound_hashes.emplace(&sound, sound_hash);
+      this->env_hash = phosg::fnv1a64(&sound_hash, sizeof(sound_hash), this->env_hash);
+    }
+  }
+
+  std::filesystem::create_directories(directory);
+  this->filename = std::format("{}/{:016X}-{}-{}.smscache",
+      directory, this->env_hash, this->output_sample_rate, name_for_resample_method(this->method));
+  this->map_file();
+}
+
+PersistentSampleCache::~PersistentSampleCache() {
+  this->unmap_file();
+}
+
+uint64_t PersistentSampleCache::hash_for_sound(const Sound* sound) const {
+  uint64_t ret;
+  if (!sound->afc_data.empty()) {
+    ret = phosg::fnv1a64(sound->afc_data.data(), sound->afc_data.size());
+    uint8_t large_frames = sound->afc_large_frames ? 1 : 0;
+    ret = phosg::fnv1a64(&large_frames, sizeof(large_frames), ret);
+  } else {
+    ret = phosg::fnv1a64(sound->decoded_samples.data(), sound->decoded_samples.size() * sizeof(float));
+  }
+  uint64_t num_channels = sound->num_channels;
+  return phosg::fnv1a64(&num_channels, sizeof(num_channels), ret);
+}
+
+void PersistentSampleCache::map_file() {
+#ifndef PHOSG_WINDOWS
+  int fd = open(this->filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return; // The cache file doesn't exist yet; it will be created by save()
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      this->map_data = reinterpret_cast<const uint8_t*>(data);
+      this->map_size = st.st_size;
+    }
+  }
+  close(fd);
+#else
+  try {
+    this->map_fallback_data = phosg::load_file(this->filename);
+    this->map_data = reinterpret_cast<const uint8_t*>(this->map_fallback_data.data());
+    this->map_size = this->map_fallback_data.size();
+  } catch (const phosg::cannot_open_file&) {
+    return;
+  }
+#endif
+
+  // If the file is truncated or was written for a different environment, ignore it; save() will replace it
+  auto ignore_file = [&](const char* reason) -> void {
+    phosg::fwrite_fmt(stderr, "warning: ignoring sample cache file {} ({})\n", this->filename, reason);
+    this->stored_entries.clear();
+    this->unmap_file();
+  };
+
+  if (this->map_size < sizeof(CacheFileHeader)) {
+    return ignore_file("file is too small");
+  }
+  const auto* header = reinterpret_cast<const CacheFileHeader*>(this->map_data);
+  if ((header->magic != CACHE_FILE_MAGIC) || (header->version != CACHE_FILE_VERSION)) {
+    return ignore_file("unknown file format");
+  }
+  if ((header->env_hash != this->env_hash) ||
+      (header->output_sample_rate != this->output_sample_rate) ||
+      (header->resample_method != static_cast<uint32_t>(this->method))) {
+    return ignore_file("file is for a different environment");
+  }
+  uint64_t entry_count = header->entry_count;
+  if (entry_count > (this->map_size - sizeof(CacheFileHeader)) / sizeof(CacheFileEntry)) {
+    return ignore_file("entry table is truncated");
+  }
+
+  const auto* entries = reinterpret_cast<const CacheFileEntry*>(this->map_data + sizeof(CacheFileHeader));
+  for (size_t z = 0; z < entry_count; z++) {
+    const auto& entry = entries[z];
+    uint64_t offset = entry.data_offset;
+    uint64_t count = entry.sample_count;
+    if ((offset > this->map_size) || (count > (this->map_size - offset) / sizeof(float))) {
+      return ignore_file("sample data is truncated");
+    }
+    this->stored_entries.emplace(Key{entry.sound_hash, entry.ratio}, StoredEntry{offset, count});
+  }
+}
+
+void PersistentSampleCache::unmap_file() {
+#ifndef PHOSG_WINDOWS
+  if (this->map_data) {
+    munmap(const_cast<uint8_t*>(this->map_data), this->map_size);
+  }
+#else
+  this->map_fallback_data.clear();
+#endif
+  this->map_data = nullptr;
+  this->map_size = 0;
+}
+
+bool PersistentSampleCache::get_resampled(const Sound* sound, float ratio, std::vector<float>& out) const {
+  auto hash_it = this->sound_hashes.find(sound);
+  if (hash_it == this->sound_hashes.end()) {
+    return false;
+  }
+
+  std::lock_guard g(this->lock);
+  Key key{hash_it->second, ratio};
+  auto stored_it = this->stored_entries.find(key);
+  if (stored_it != this->stored_entries.end()) {
+    const auto* src = reinterpret_cast<const phosg::le_float*>(this->map_data + stored_it->second.data_offset);
+    out.assign(src, src + stored_it->second.sample_count);
+    this->stats_data.hits++;
+    return true;
+  }
+  auto new_it = this->new_entries.find(key);
+  if (new_it != this->new_entries.end()) {
+    out = *new_it->second;
+    this->stats_data.hits++;
+    return true;
+  }
+  this->stats_data.misses++;
+  return false;
+}
+
+void PersistentSampleCache::add_resampled(
+    const Sound* sound, float ratio, std::shared_ptr<const std::vector<float>> data) {
+  auto hash_it = this->sound_hashes.find(sound);
+  if ((ratio == 0.0f) || (hash_it == this->sound_hashes.end())) {
+    return;
+  }
+  std::lock_guard g(this->lock);
+  Key key{hash_it->second, ratio};
+  if (!this->stored_entries.count(key)) {
+    this->new_entries.emplace(key, std::move(data));
+  }
+}
+
+bool PersistentSampleCache::restore_decoded_samples(const Sound* sound) const {
+  if (!sound->decoded_samples.empty()) {
+    return true;
+  }
+  if (!this->compressed_sounds.count(sound)) {
+    return false;
+  }
+
+  std::lock_guard g(this->lock);
+  auto stored_it = this->stored_entries.find(Key{this->sound_hashes.at(sound), 0.0f});
+  if (stored_it == this->stored_entries.end()) {
+    return false;
+  }
+  const auto* src = reinterpret_cast<const phosg::le_float*>(this->map_data + stored_it->second.data_offset);
+  sound->decoded_samples.assign(src, src + stored_it->second.sample_count);
+  sound->afc_data.clear();
+  return true;
+}
+
+void PersistentSampleCache::restore_all_decoded_samples() const {
+  for (const Sound* sound : this->compressed_sounds) {
+    this->restore_decoded_samples(sound);
+  }
+}
+
+void PersistentSampleCache::save() {
+  std::lock_guard g(this->lock);
+
+  // Sounds decoded during this run (that weren't restored from the cache) are saved too
+  std::vector<std::pair<Key, const std::vector<float>*>> decoded_entries;
+  for (const Sound* sound : this->compressed_sounds) {
+    Key key{this->sound_hashes.at(sound), 0.0f};
+    if (!sound->decoded_samples.empty() && !this->stored_entries.count(key)) {
+      decoded_entries.emplace_back(key, &sound->decoded_samples);
+    }
+  }
+  if (this->new_entries.empty() && decoded_entries.empty()) {
+    return;
+  }
+
+  // Lay out the new file: all existing entries followed by all new entries
+  size_t entry_count = this->stored_entries.size() + this->new_entries.size() + decoded_entries.size();
+  std::vector<CacheFileEntry> entries;
+  entries.reserve(entry_count);
+  uint64_t data_offset = sizeof(CacheFileHeader) + entry_count * sizeof(CacheFileEntry);
+  auto add_entry = [&](const Key& key, size_t sample_count) -> void {
+    auto& entry = entries.emplace_back();
+    entry.sound_hash = key.sound_hash;
+    entry.ratio = key.ratio;
+    entry.unused = 0;
+    entry.data_offset = data_offset;
+    entry.sample_count = sample_count;
+    data_offset += sample_count * sizeof(float);
+  };
+  for (const auto& it : this->stored_entries) {
+    add_entry(it.first, it.second.sample_count);
+  }
+  for (const auto& it : this->new_entries) {
+    add_entry(it.first, it.second->size());
+  }
+  for (const auto& it : decoded_entries) {
+    add_entry(it.first, it.second->size());
+  }
+
+  // The existing file is replaced atomically, so other processes that have it mapped (or are reading it) aren't
+  // affected
+  write_file_atomic(this->filename, [&](FILE* f) -> void {
+    CacheFileHeader header;
+    header.magic = CACHE_FILE_MAGIC;
+    header.version = CACHE_FILE_VERSION;
+    header.env_hash = this->env_hash;
+    header.output_sample_rate = this->output_sample_rate;
+    header.resample_method = static_cast<uint32_t>(this->method);
+    header.entry_count = entry_count;
+    phosg::fwritex(f, &header, sizeof(header));
+    phosg::fwritex(f, entries.data(), entries.size() * sizeof(CacheFileEntry));
+
+    // Existing entries are already in the on-disk format, so they can be copied directly
+    for (const auto& it : this->stored_entries) {
+      phosg::fwritex(f, this->map_data + it.second.data_offset, it.second.sample_count * sizeof(float));
+    }
+    auto write_samples = [&](const std::vector<float>& samples) -> void {
+      std::vector<phosg::le_float> le_samples(samples.begin(), samples.end());
+      phosg::fwritex(f, le_samples.data(), le_samples.size() * sizeof(phosg::le_float));
+    };
+    for (const auto& it : this->new_entries) {
+      write_samples(*it.second);
+    }
+    for (const auto& it : decoded_entries) {
+      write_samples(*it.second);
+    }
+  });
+
+  // Map the new file, so that the next save() doesn't write any entries twice
+  this->stats_data.new_entries += this->new_entries.size() + decoded_entries.size();
+  this->new_entries.clear();
+  this->stored_entries.clear();
+  this->unmap_file();
+  this->map_file();
+}
+
+PersistentSampleCache::Stats PersistentSampleCache::stats() const {
+  std::lock_guard g(this->lock);
+  Stats ret = this->stats_data;
+  ret.stored_entries = this->stored_entries.size();
+  ret.new_entries += this->new_entries.size();
+  return ret;
+}
+
+} // namespace Audio
+} // namespace ResourceDASM
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Instrument.hh"
+#include "SampleCache.hh"
+#include "SoundEnvironment.hh"
+
+namespace ResourceDASM {
+namespace Audio {
+
+// An on-disk cache of decoded and resampled instrument samples, so that rendering many songs from the same sound
+// environment doesn't repeat the same AFC decoding and resampling work in every run. There is one cache file per
+// combination of sound environment, output sample rate, and resampling method; the filename includes a hash of all of
+// the environment's sample data, so any change to the bank files results in a new cache file.
+//
+// Existing cache files are memory-mapped when opened, so only the entries that are actually used are read from disk.
+// New entries are held in memory until save() is called, which rewrites the file with both the existing and new
+// entries (old entries are never discarded, so it may be useful to delete cache files occasionally).
+//
+// Sounds are identified by a hash of their compressed data (or their decoded data, if they were never compressed), so
+// the cache must be constructed before any of the environment's sounds are decoded.
+class PersistentSampleCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t stored_entries = 0;
+    size_t new_entries = 0;
+  };
+
+  PersistentSampleCache(
+      const std::string& directory, const SoundEnvironment& env, size_t output_sample_rate, ResampleMethod method);
+  PersistentSampleCache(const PersistentSampleCache&) = delete;
+  PersistentSampleCache(PersistentSampleCache&&) = delete;
+  PersistentSampleCache& operator=(const PersistentSampleCache&) = delete;
+  PersistentSampleCache& operator=(PersistentSampleCache&&) = delete;
+  ~PersistentSampleCache();
+
+  inline const std::string& get_filename() const {
+    return this->filename;
+  }
+
+  // Looks up the resampled data for the given sound and ratio. Returns false if it isn't cached. This function is
+  // thread-safe.
+  bool get_resampled(const Sound* sound, float ratio, std::vector<float>& out) const;
+  // Records resampled data to be written by the next save() call. This function is thread-safe.
+  void add_resampled(const Sound* sound, float ratio, std::shared_ptr<const std::vector<float>> data);
+
+  // If the sound hasn't been decoded yet and its decoded samples are in the cache, fills in the sound's decoded
+  // samples from the cache. Returns true if the sound's samples are now available without decoding. This modifies the
+  // Sound, so it must not be called while any other thread is using it.
+  bool restore_decoded_samples(const Sound* sound) const;
+  // Calls restore_decoded_samples for all sounds in the environment.
+  void restore_all_decoded_samples() const;
+
+  // Writes the cache file if anything was added since it was opened or last saved. Decoded samples for all compressed
+  // sounds that were decoded in the meantime are added to the file as well.
+  void save();
+
+  Stats stats() const;
+
+private:
+  struct Key {
+    uint64_t sound_hash;
+    float ratio; // 0 for decoded (not resampled) samples
+
+    bool operator==(const Key& other) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return k.sound_hash ^ (std::hash<float>()(k.ratio) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+  struct StoredEntry {
+    uint64_t data_offset; // Relative to the beginning of the mapped file
+    uint64_t sample_count;
+  };
+
+  void map_file();
+  void unmap_file();
+  uint64_t hash_for_sound(const Sound* sound) const;
+
+  const SoundEnvironment& env;
+  size_t output_sample_rate;
+  ResampleMethod method;
+  uint64_t env_hash;
+  std::string filename;
+
+  std::unordered_map<const Sound*, uint64_t> sound_hashes;
+  // Sounds whose samples must be decoded before use; only these have their decoded samples saved in the cache
+  std::unordered_set<const Sound*> compressed_sounds;
+
+  const uint8_t* map_data = nullptr;
+  size_t map_size = 0;
+  std::string map_fallback_data; // Used if mmap isn't available
+
+  mutable std::mutex lock;
+  std::unordered_map<Key, StoredEntry, KeyHash> stored_entries;
+  std::unordered_map<Key, std::shared_ptr<const std::vector<float>>, KeyHash> new_entries;
+  mutable Stats stats_data;
+};
+
+} // namespace Audio
+} // namespace ResourceDASM
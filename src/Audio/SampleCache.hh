@@ -6,6 +6,9 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <unordered_map>
 #include <vector>
@@ -81,37 +84,122 @@ std::vector<SampleT> resample_audio(
   }
 }
 
+// Memoizes resampled waveforms, keyed by (source, ratio). If max_bytes is not zero, the least-recently-used entries
+// are evicted when the total size of the cached waveforms exceeds it. Entries are returned as shared_ptrs, so evicting
+// an entry doesn't invalidate any references to it that callers still hold. All methods are thread-safe, so a single
+// cache may be shared by multiple synthesizers (e.g. when rendering many songs that use the same instruments).
 template <typename KeyT>
 class SampleCache {
 public:
-  explicit SampleCache(ResampleMethod method) : method(method) {}
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  explicit SampleCache(ResampleMethod method, size_t max_bytes = 0) : method(method), max_bytes(max_bytes) {}
   ~SampleCache() = default;
 
-  const std::vector<float>& at(const KeyT& k, float ratio) const {
-    return this->cache.at(k).at(ratio);
+  std::shared_ptr<const std::vector<float>> at(const KeyT& k, float ratio) {
+    std::lock_guard g(this->lock);
+    auto it = this->index.find(Key{k, ratio});
+    if (it == this->index.end()) {
+      throw std::out_of_range("sample not in cache");
+    }
+    this->stats_data.hits++;
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    return it->second->data;
   }
 
-  const std::vector<float>& add(const KeyT& k, float ratio, std::vector<float>&& data) {
-    return this->cache[k].emplace(ratio, std::move(data)).first->second;
+  std::shared_ptr<const std::vector<float>> add(const KeyT& k, float ratio, std::vector<float>&& data) {
+    std::lock_guard g(this->lock);
+    return this->add_locked(Key{k, ratio}, std::make_shared<const std::vector<float>>(std::move(data)));
   }
 
-  const std::vector<float>& resample_add(
+  std::shared_ptr<const std::vector<float>> resample_add(
       const KeyT& k, const std::vector<float>& input_samples, size_t num_channels, float ratio) {
-    try {
-      return this->at(k, ratio);
-    } catch (const std::out_of_range&) {
-      auto data = resample_audio<float>(input_samples, num_channels, ratio, this->method);
-      return this->add(k, ratio, std::move(data));
+    Key key{k, ratio};
+    {
+      std::lock_guard g(this->lock);
+      auto it = this->index.find(key);
+      if (it != this->index.end()) {
+        this->stats_data.hits++;
+        this->lru.splice(this->lru.begin(), this->lru, it->second);
+        return it->second->data;
+      }
+      this->stats_data.misses++;
     }
+
+    // Resample without holding the lock, so other threads can use the cache in the meantime. If another thread
+    // resampled the same sound at the same time, add_locked returns whichever copy was added first.
+    auto data = std::make_shared<const std::vector<float>>(
+        resample_audio<float>(input_samples, num_channels, ratio, this->method));
+    std::lock_guard g(this->lock);
+    return this->add_locked(key, std::move(data));
   }
 
   std::vector<float> resample(const std::vector<float>& input_samples, size_t num_channels, double src_ratio) const {
     return resample_audio<float>(input_samples, num_channels, src_ratio, this->method);
   }
 
+  Stats stats() const {
+    std::lock_guard g(this->lock);
+    Stats ret = this->stats_data;
+    ret.entries = this->index.size();
+    ret.bytes = this->total_bytes;
+    return ret;
+  }
+
 private:
+  struct Key {
+    KeyT source;
+    float ratio;
+
+    bool operator==(const Key& other) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return std::hash<KeyT>()(k.source) ^ (std::hash<float>()(k.ratio) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+  struct Entry {
+    Key key;
+    std::shared_ptr<const std::vector<float>> data;
+  };
+
+  std::shared_ptr<const std::vector<float>> add_locked(
+      const Key& key, std::shared_ptr<const std::vector<float>>&& data) {
+    auto it = this->index.find(key);
+    if (it != this->index.end()) {
+      this->lru.splice(this->lru.begin(), this->lru, it->second);
+      return it->second->data;
+    }
+
+    this->lru.emplace_front(Entry{key, std::move(data)});
+    this->index.emplace(key, this->lru.begin());
+    this->total_bytes += this->lru.front().data->size() * sizeof(float);
+
+    // Evict entries from the back of the list, but never the entry that was just added (the caller is about to use
+    // it, and if it alone exceeds the limit, there's nothing better to do than to keep it)
+    while (this->max_bytes && (this->total_bytes > this->max_bytes) && (this->lru.size() > 1)) {
+      const auto& victim = this->lru.back();
+      this->total_bytes -= victim.data->size() * sizeof(float);
+      this->index.erase(victim.key);
+      this->lru.pop_back();
+      this->stats_data.evictions++;
+    }
+    return this->lru.front().data;
+  }
+
   ResampleMethod method;
-  std::unordered_map<KeyT, std::unordered_map<float, std::vector<float>>> cache;
+  size_t max_bytes;
+  mutable std::mutex lock;
+  std::list<Entry> lru; // Most recently used entries are at the front
+  std::unordered_map<Key, typename std::list<Entry>::iterator, KeyHash> index;
+  size_t total_bytes = 0;
+  Stats stats_data;
 };
 
 } // namespace Audio
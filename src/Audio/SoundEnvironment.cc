@@ -377,6 +377,20 @@ void SoundEnvironment::merge_from(SoundEnvironment&& other) {
   }
 }
 
+void SoundEnvironment::decode_all_samples() const {
+  for (const auto& bank_it : this->instrument_banks) {
+    for (const auto& instrument_it : bank_it.second.id_to_instrument) {
+      for (const auto& key_region : instrument_it.second.key_regions) {
+        for (const auto& vel_region : key_region.vel_regions) {
+          if (vel_region.sound) {
+            vel_region.sound->samples();
+          }
+        }
+      }
+    }
+  }
+}
+
 SoundEnvironment aaf_decode(const void* vdata, size_t size, const char* base_directory) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
   size_t offset = 0;
@@ -36,6 +36,8 @@ struct SoundEnvironment {
 
   void resolve_pointers();
   void merge_from(SoundEnvironment&& other);
+  // Decodes all sounds referenced by instruments, so the environment can subsequently be used from multiple threads
+  void decode_all_samples() const;
 };
 
 struct InstrumentMetadata {
@@ -1,7 +1,9 @@
 #include "WAVFile.hh"
 
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <format>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
@@ -204,6 +206,133 @@ std::string serialize_wav(
   return std::move(w.str());
 }
 
+struct StreamingWAVHeader {
+  phosg::be_uint32_t riff_magic = 0x52494646; // 'RIFF'
+  phosg::le_uint32_t file_size = 0; // RIFF chunk data size (file size - 8)
+  phosg::be_uint32_t wave_magic = 0x57415645; // 'WAVE'
+
+  phosg::be_uint32_t fmt_magic = 0x666d7420; // 'fmt '
+  phosg::le_uint32_t fmt_size = 16;
+  phosg::le_uint16_t format = 3; // 1 = PCM, 3 = float
+  phosg::le_uint16_t num_channels = 0;
+  phosg::le_uint32_t sample_rate = 0;
+  phosg::le_uint32_t byte_rate = 0; // num_channels * sample_rate * bits_per_sample / 8
+  phosg::le_uint16_t block_align = 0; // num_channels * bits_per_sample / 8
+  phosg::le_uint16_t bits_per_sample = 0;
+
+  phosg::be_uint32_t data_magic = 0x64617461; // 'data'
+  phosg::le_uint32_t data_size = 0; // Number of bytes of sample data that follow
+} __attribute__((packed));
+
+WAVWriter::WAVWriter(
+    const std::string& filename,
+    size_t sample_rate,
+    size_t num_channels,
+    bool trim_ending_silence,
+    bool normalize)
+    : f(fopen(filename.c_str(), "w+b")),
+      sample_rate(sample_rate),
+      num_channels(num_channels),
+      trim_ending_silence(trim_ending_silence),
+      normalize(normalize) {
+  if (!this->f) {
+    throw phosg::cannot_open_file(filename);
+  }
+  if (this->num_channels == 0) {
+    fclose(this->f);
+    throw std::invalid_argument("WAV file must have at least one channel");
+  }
+  this->write_header();
+}
+
+WAVWriter::~WAVWriter() {
+  if (this->f) {
+    try {
+      this->close();
+    } catch (const std::exception&) {
+    }
+  }
+}
+
+void WAVWriter::write_header() {
+  constexpr size_t bits_per_sample = sizeof(float) * 8;
+  StreamingWAVHeader header;
+  header.file_size = this->num_samples * sizeof(float) + sizeof(StreamingWAVHeader) - 8;
+  header.num_channels = this->num_channels;
+  header.sample_rate = this->sample_rate;
+  header.byte_rate = this->num_channels * this->sample_rate * bits_per_sample / 8;
+  header.block_align = this->num_channels * bits_per_sample / 8;
+  header.bits_per_sample = bits_per_sample;
+  header.data_size = this->num_samples * sizeof(float);
+  fseek(this->f, 0, SEEK_SET);
+  phosg::fwritex(this->f, &header, sizeof(header));
+}
+
+void WAVWriter::write(const float* samples, size_t count) {
+  if (!this->f) {
+    throw std::logic_error("cannot write to closed WAV file");
+  }
+  phosg::StringWriter w;
+  for (size_t z = 0; z < count; z++) {
+    float sample = samples[z];
+    if (sample != 0.0f) {
+      this->audible_samples = this->num_samples + z + 1;
+    }
+    if (sample > this->max_amplitude) {
+      this->max_amplitude = sample;
+    }
+    if (sample < -this->max_amplitude) {
+      this->max_amplitude = -sample;
+    }
+    w.put_f32l(sample);
+  }
+  phosg::fwritex(this->f, w.str());
+  this->num_samples += count;
+}
+
+void WAVWriter::close() {
+  if (!this->f) {
+    return;
+  }
+  fflush(this->f);
+
+  // Silence is trimmed in whole frames, so round up to the end of the frame containing the last audible sample
+  if (this->trim_ending_silence) {
+    size_t end_samples = ((this->audible_samples + this->num_channels - 1) / this->num_channels) * this->num_channels;
+    if (end_samples < this->num_samples) {
+      this->num_samples = end_samples;
+      if (ftruncate(fileno(this->f), sizeof(StreamingWAVHeader) + this->num_samples * sizeof(float))) {
+        throw std::runtime_error("cannot truncate WAV file");
+      }
+    }
+  }
+  this->write_header();
+
+  // Make a second pass over the data to normalize it, in fixed-size chunks
+  if (this->normalize && (this->max_amplitude != 0.0f)) {
+    static constexpr size_t CHUNK_SAMPLES = 0x10000;
+    for (size_t offset = 0; offset < this->num_samples; offset += CHUNK_SAMPLES) {
+      size_t count = std::min<size_t>(CHUNK_SAMPLES, this->num_samples - offset);
+      long file_offset = sizeof(StreamingWAVHeader) + offset * sizeof(float);
+      fseek(this->f, file_offset, SEEK_SET);
+      std::string data = phosg::freadx(this->f, count * sizeof(float));
+      phosg::StringReader r(data);
+      phosg::StringWriter w;
+      while (!r.eof()) {
+        w.put_f32l(r.get_f32l() / this->max_amplitude);
+      }
+      fseek(this->f, file_offset, SEEK_SET);
+      phosg::fwritex(this->f, w.str());
+    }
+  }
+
+  FILE* f = this->f;
+  this->f = nullptr;
+  if (fclose(f)) {
+    throw std::runtime_error("cannot close WAV file");
+  }
+}
+
 void normalize_amplitude(std::vector<float>& data) {
   float max_amplitude = 0.0f;
   for (float sample : data) {
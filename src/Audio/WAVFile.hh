@@ -6,6 +6,7 @@
 
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
+#include <string>
 #include <vector>
 
 namespace ResourceDASM {
@@ -86,5 +87,50 @@ std::string serialize_wav(
 void normalize_amplitude(std::vector<float>& data);
 void trim_ending_silence(std::vector<float>& data);
 
+// Writes a 32-bit floating-point WAV file incrementally, so long renders don't have to be held in memory all at once.
+// The header is written with placeholder sizes when the file is opened, and close() patches it to match the data that
+// was written. If trim_ending_silence is true, close() also truncates the file to remove silent frames at the end; if
+// normalize is true, close() then makes a second pass over the file to scale the samples so that the maximum
+// amplitude is 1.0. The sample data is the same as calling trim_ending_silence and normalize_amplitude on the entire
+// sample buffer, but the file isn't byte-identical to serialize_wav's output: WAVWriter writes only the fmt and data
+// chunks (serialize_wav also writes a smpl chunk), and its RIFF and data chunk sizes are the number of bytes actually
+// written (serialize_wav multiplies them by the number of channels).
+class WAVWriter {
+public:
+  WAVWriter(
+      const std::string& filename,
+      size_t sample_rate,
+      size_t num_channels,
+      bool trim_ending_silence = false,
+      bool normalize = false);
+  WAVWriter(const WAVWriter&) = delete;
+  WAVWriter(WAVWriter&&) = delete;
+  WAVWriter& operator=(const WAVWriter&) = delete;
+  WAVWriter& operator=(WAVWriter&&) = delete;
+  ~WAVWriter();
+
+  void write(const float* samples, size_t count);
+  inline void write(const std::vector<float>& samples) {
+    this->write(samples.data(), samples.size());
+  }
+  void close();
+
+  inline size_t samples_written() const {
+    return this->num_samples;
+  }
+
+private:
+  FILE* f;
+  size_t sample_rate;
+  size_t num_channels;
+  bool trim_ending_silence;
+  bool normalize;
+  size_t num_samples = 0;
+  size_t audible_samples = 0; // Number of samples up to and including the last nonzero sample
+  float max_amplitude = 0.0f;
+
+  void write_header();
+};
+
 } // namespace Audio
 } // namespace ResourceDASM
@@ -0,0 +1,366 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <format>
+#include <functional>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Codecs.hh"
+
+void print_usage() {
+  phosg::fwrite_fmt(stderr, "\
+Usage: codecbench [options]\n\
+\n\
+Measures the decoding speed of the compressed sound formats used in snd\n\
+resources (MACE3, MACE6, IMA4, A-law, and u-law), for both the allocating and\n\
+caller-provided-buffer decoder APIs. For IMA4, A-law, and u-law, the original\n\
+decoder implementations are also timed, and their output is checked against\n\
+the current decoders. (The MACE decoder's algorithm hasn\'t changed, so there\n\
+is no separate original version of it.)\n\
+\n\
+Options:\n\
+  --size=N\n\
+      Decode N bytes of input per iteration (default 4194304). The input is\n\
+      rounded down to a multiple of the largest frame size (68 bytes).\n\
+  --iterations=N\n\
+      Decode the input N times for each codec (default 20).\n\
+  --input=FILENAME\n\
+      Use the contents of this file as the compressed input instead of\n\
+      generating random data. The data is decoded in every format regardless\n\
+      of what format it was actually compressed in, which is fine since the\n\
+      decoders accept arbitrary input.\n\
+  --stereo\n\
+      Decode MACE and IMA4 data as stereo.\n\
+");
+}
+
+// These are the IMA4, A-law, and u-law decoders as they were before the table-driven versions in Codecs.cc, for
+// comparison
+
+struct OriginalIMA4Packet {
+  phosg::be_uint16_t header;
+  uint8_t data[32];
+
+  uint16_t predictor() const {
+    // Note: the lack of a shift here is not a bug - these 9 bits actually do store the high bits of the predictor
+    return this->header & 0xFF80;
+  }
+
+  uint8_t step_index() const {
+    return this->header & 0x007F;
+  }
+};
+
+static std::vector<float> decode_ima4_original(const void* vdata, size_t size, bool stereo) {
+  using ResourceDASM::Audio::sample_to_float;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  static const int16_t index_table[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+  static const int16_t step_table[89] = {
+      7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107,
+      118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876,
+      963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+      5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086,
+      29794, 32767};
+
+  if (size % (stereo ? 68 : 34)) {
+    throw std::runtime_error("ima4 data size must be a multiple of 34 bytes");
+  }
+  std::vector<float> result_data((size * 64) / 34);
+
+  struct ChannelState {
+    int32_t predictor;
+    int32_t step_index;
+    int32_t step;
+  } channel_state[2];
+
+  {
+    const OriginalIMA4Packet* base_packet = reinterpret_cast<const OriginalIMA4Packet*>(data);
+    channel_state[0].predictor = base_packet->predictor();
+    channel_state[0].step_index = base_packet->step_index();
+    channel_state[0].step = step_table[channel_state[0].step_index];
+  }
+  if (stereo) {
+    const OriginalIMA4Packet* base_packet = reinterpret_cast<const OriginalIMA4Packet*>(data + 34);
+    channel_state[1].predictor = base_packet->predictor();
+    channel_state[1].step_index = base_packet->step_index();
+    channel_state[1].step = step_table[channel_state[1].step_index];
+  }
+
+  for (size_t packet_offset = 0; packet_offset < size; packet_offset += 34) {
+    const OriginalIMA4Packet* packet = reinterpret_cast<const OriginalIMA4Packet*>(data + packet_offset);
+    size_t packet_index = packet_offset / 34;
+    auto& channel = channel_state[stereo ? (packet_index & 1) : 0];
+
+    // Interleave stereo samples appropriately
+    size_t output_offset;
+    size_t output_step = stereo ? 2 : 1;
+    if (stereo) {
+      output_offset = (packet_index & ~1) * 64 + (packet_index & 1);
+    } else {
+      output_offset = packet_index * 64;
+    }
+
+    for (size_t x = 0; x < 32; x++) {
+      uint8_t value = packet->data[x];
+      for (size_t y = 0; y < 2; y++) {
+        uint8_t nybble = value & 0x0F;
+        value >>= 4;
+
+        int32_t diff = 0;
+        if (nybble & 4) {
+          diff += channel.step;
+        }
+        if (nybble & 2) {
+          diff += channel.step >> 1;
+        }
+        if (nybble & 1) {
+          diff += channel.step >> 2;
+        }
+        diff += channel.step >> 3;
+        if (nybble & 8) {
+          diff = -diff;
+        }
+
+        channel.predictor += diff;
+
+        if (channel.predictor > 0x7FFF) {
+          channel.predictor = 0x7FFF;
+        } else if (channel.predictor < -0x8000) {
+          channel.predictor = -0x8000;
+        }
+
+        result_data[output_offset] = sample_to_float<int16_t>(channel.predictor);
+        output_offset += output_step;
+
+        channel.step_index += index_table[nybble];
+        if (channel.step_index < 0) {
+          channel.step_index = 0;
+        } else if (channel.step_index > 88) {
+          channel.step_index = 88;
+        }
+        channel.step = step_table[channel.step_index];
+      }
+    }
+  }
+
+  return result_data;
+}
+
+static std::vector<float> decode_alaw_original(const void* vdata, size_t size) {
+  using ResourceDASM::Audio::sample_to_float;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  std::vector<float> ret(size);
+  for (size_t x = 0; x < size; x++) {
+    int8_t sample = static_cast<int8_t>(data[x]) ^ 0x55;
+    int8_t sign = (sample & 0x80) ? -1 : 1;
+
+    if (sign == -1) {
+      sample &= 0x7F;
+    }
+
+    uint8_t shift = ((sample & 0xF0) >> 4) + 4;
+    if (shift == 4) {
+      ret[x] = sample_to_float<int16_t>(sign * ((sample << 1) | 1));
+    } else {
+      ret[x] = sample_to_float<int16_t>(sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))));
+    }
+  }
+  return ret;
+}
+
+static std::vector<float> decode_ulaw_original(const void* vdata, size_t size) {
+  using ResourceDASM::Audio::sample_to_float;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+
+  static const uint16_t ULAW_BIAS = 33;
+
+  std::vector<float> ret(size);
+  for (size_t x = 0; x < size; x++) {
+    int8_t sample = ~static_cast<int8_t>(data[x]);
+
+    int8_t sign = (sample & 0x80) ? -1 : 1;
+    if (sign == -1) {
+      sample &= 0x7F;
+    }
+    uint8_t shift = ((sample & 0xF0) >> 4) + 5;
+    ret[x] = sample_to_float<int16_t>(
+        sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS);
+  }
+  return ret;
+}
+
+struct BenchmarkResult {
+  uint64_t original_usecs = 0; // 0 if there is no original decoder
+  uint64_t alloc_usecs = 0;
+  uint64_t buffer_usecs = 0;
+};
+
+static BenchmarkResult run_benchmark(
+    const char* name,
+    size_t iterations,
+    size_t output_samples,
+    std::function<std::vector<float>()> decode_original,
+    std::function<std::vector<float>()> decode_alloc,
+    std::function<void(float*)> decode_buffer) {
+  BenchmarkResult ret;
+
+  // Check that all the implementations produce the same result before timing them
+  std::vector<float> buffer(output_samples);
+  decode_buffer(buffer.data());
+  if (decode_alloc() != buffer) {
+    throw std::logic_error(std::format("{}: allocating and buffer decoders produced different results", name));
+  }
+  if (decode_original) {
+    // Compare bit patterns rather than float values, so that this also checks the signs of zeroes
+    auto expected = decode_original();
+    if ((expected.size() != buffer.size()) ||
+        memcmp(expected.data(), buffer.data(), buffer.size() * sizeof(float))) {
+      throw std::logic_error(std::format("{}: current decoder does not match original decoder", name));
+    }
+
+    uint64_t start = phosg::now();
+    for (size_t z = 0; z < iterations; z++) {
+      auto decoded = decode_original();
+    }
+    ret.original_usecs = std::max<uint64_t>(phosg::now() - start, 1);
+  }
+
+  uint64_t start = phosg::now();
+  for (size_t z = 0; z < iterations; z++) {
+    auto decoded = decode_alloc();
+  }
+  ret.alloc_usecs = phosg::now() - start;
+
+  start = phosg::now();
+  for (size_t z = 0; z < iterations; z++) {
+    decode_buffer(buffer.data());
+  }
+  ret.buffer_usecs = phosg::now() - start;
+
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  size_t size = 0x400000;
+  size_t iterations = 20;
+  const char* input_filename = nullptr;
+  bool stereo = false;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--size=", 7)) {
+      size = strtoull(&argv[x][7], nullptr, 0);
+    } else if (!strncmp(argv[x], "--iterations=", 13)) {
+      iterations = strtoull(&argv[x][13], nullptr, 0);
+    } else if (!strncmp(argv[x], "--input=", 8)) {
+      input_filename = &argv[x][8];
+    } else if (!strcmp(argv[x], "--stereo")) {
+      stereo = true;
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else {
+      phosg::fwrite_fmt(stderr, "invalid option: {}\n", argv[x]);
+      print_usage();
+      return 2;
+    }
+  }
+
+  std::string data;
+  if (input_filename) {
+    data = phosg::load_file(input_filename);
+  } else {
+    std::mt19937 rng(0);
+    data.resize(size);
+    for (auto& ch : data) {
+      ch = rng();
+    }
+  }
+  data.resize(data.size() - (data.size() % 68));
+  if (data.empty() || (iterations == 0)) {
+    throw std::invalid_argument("input must be at least 68 bytes and iterations must be nonzero");
+  }
+
+  // IMA4 packet headers carry a 7-bit step index, but only values up to 88 are valid; random data would often be
+  // out of range, so fix up the headers here
+  std::string ima4_data = data;
+  for (size_t offset = 0; offset < ima4_data.size(); offset += 34) {
+    ima4_data[offset + 1] = (ima4_data[offset + 1] & 0x80) | (static_cast<uint8_t>(ima4_data[offset + 1]) % 89);
+  }
+
+  using namespace ResourceDASM::Audio;
+  struct Codec {
+    const char* name;
+    const std::string* input;
+    size_t output_samples;
+    std::function<std::vector<float>()> decode_original;
+    std::function<std::vector<float>()> decode_alloc;
+    std::function<void(float*)> decode_buffer;
+  };
+  std::vector<Codec> codecs;
+  for (bool is_mace3 : {true, false}) {
+    codecs.emplace_back(Codec{
+        is_mace3 ? "MACE3" : "MACE6",
+        &data,
+        mace_decoded_sample_count(data.size(), is_mace3),
+        nullptr,
+        [&data, stereo, is_mace3]() { return decode_mace(data.data(), data.size(), stereo, is_mace3); },
+        [&data, stereo, is_mace3](float* out) { decode_mace(out, data.data(), data.size(), stereo, is_mace3); }});
+  }
+  codecs.emplace_back(Codec{
+      "IMA4",
+      &ima4_data,
+      ima4_decoded_sample_count(ima4_data.size()),
+      [&ima4_data, stereo]() { return decode_ima4_original(ima4_data.data(), ima4_data.size(), stereo); },
+      [&ima4_data, stereo]() { return decode_ima4(ima4_data.data(), ima4_data.size(), stereo); },
+      [&ima4_data, stereo](float* out) { decode_ima4(out, ima4_data.data(), ima4_data.size(), stereo); }});
+  codecs.emplace_back(Codec{
+      "A-law",
+      &data,
+      alaw_decoded_sample_count(data.size()),
+      [&data]() { return decode_alaw_original(data.data(), data.size()); },
+      [&data]() { return decode_alaw(data.data(), data.size()); },
+      [&data](float* out) { decode_alaw(out, data.data(), data.size()); }});
+  codecs.emplace_back(Codec{
+      "u-law",
+      &data,
+      ulaw_decoded_sample_count(data.size()),
+      [&data]() { return decode_ulaw_original(data.data(), data.size()); },
+      [&data]() { return decode_ulaw(data.data(), data.size()); },
+      [&data](float* out) { decode_ulaw(out, data.data(), data.size()); }});
+
+  phosg::fwrite_fmt(stdout, "Decoding {} bytes {} times per codec ({})\n",
+      data.size(), iterations, stereo ? "stereo" : "mono");
+  phosg::fwrite_fmt(stdout, "CODEC  ORIGINAL MB/s  ALLOC MB/s  BUFFER MB/s  BUFFER MSAMPLES/s  SPEEDUP\n");
+  for (const auto& codec : codecs) {
+    auto result = run_benchmark(codec.name, iterations, codec.output_samples, codec.decode_original,
+        codec.decode_alloc, codec.decode_buffer);
+    double total_bytes = static_cast<double>(codec.input->size()) * iterations;
+    double total_samples = static_cast<double>(codec.output_samples) * iterations;
+    std::string original_str = "-";
+    std::string speedup_str = "-";
+    if (result.original_usecs) {
+      original_str = std::format("{:.1f}", total_bytes / result.original_usecs);
+      speedup_str = std::format("{:.1f}x",
+          static_cast<double>(result.original_usecs) / std::max<uint64_t>(result.buffer_usecs, 1));
+    }
+    phosg::fwrite_fmt(stdout, "{:<5}  {:>13}  {:10.1f}  {:11.1f}  {:17.1f}  {:>7}\n",
+        codec.name,
+        original_str,
+        total_bytes / std::max<uint64_t>(result.alloc_usecs, 1),
+        total_bytes / std::max<uint64_t>(result.buffer_usecs, 1),
+        total_samples / std::max<uint64_t>(result.buffer_usecs, 1),
+        speedup_str);
+  }
+
+  return 0;
+}
@@ -31,6 +31,23 @@ public:
   }
 };
 
+class MODWAVWriter : public ResourceDASM::Audio::MODSynthesizer {
+protected:
+  ResourceDASM::Audio::WAVWriter& wav;
+
+public:
+  MODWAVWriter(
+      std::shared_ptr<const ResourceDASM::Audio::Module> mod,
+      std::shared_ptr<const Options> opts,
+      ResourceDASM::Audio::WAVWriter& wav)
+      : MODSynthesizer(mod, opts), wav(wav) {}
+
+  virtual bool on_tick_samples_ready(std::vector<float>&& samples) {
+    this->wav.write(samples);
+    return true;
+  }
+};
+
 #ifdef SDL3_AVAILABLE
 class SDLMODPlayer : public ResourceDASM::Audio::MODSynthesizer {
 protected:
@@ -139,6 +156,10 @@ Options for --render and --play:\n\
       to align arpeggio boundaries to ticks.\n\
   --vibrato-resolution=N\n\
       Evaluate vibrato effects this many times each tick (default 1).\n\
+  --sample-cache-limit=N\n\
+      Keep at most N megabytes of resampled instrument data in memory,\n\
+      discarding the least recently used data when the limit is exceeded. The\n\
+      default is no limit.\n\
 \n\
 Options for --render only:\n\
   --skip-trim-silence\n\
@@ -148,6 +169,11 @@ Options for --render only:\n\
       By default, modsynth will normalize the output so the maximum sample\n\
       amplitude is 1.0 or -1.0. This option skips that step, so the output may\n\
       contain samples with higher amplitudes.\n\
+  --parallel=N\n\
+      Render each track on a separate thread, using at most N threads, then\n\
+      mix the tracks together. If N is 0, use as many threads as there are CPU\n\
+      cores. The result is identical to the result of rendering serially, but\n\
+      each track\'s audio is kept in memory until all tracks are rendered.\n\
   --write-stdout\n\
       Instead of saving to a file, write raw float32 data to stdout, which can\n\
       be piped to audiocat --play --format=stereo-f32. Generally only useful\n\
@@ -176,6 +202,7 @@ int main(int argc, char** argv) {
   bool use_default_global_volume = true;
   bool trim_ending_silence_after_render = true;
   bool normalize_after_render = true;
+  ssize_t parallelism = -1;
   auto opts = std::make_shared<ResourceDASM::Audio::MODSynthesizer::Options>();
   opts->print_status_while_playing = true;
   for (int x = 1; x < argc; x++) {
@@ -237,6 +264,8 @@ int main(int argc, char** argv) {
       trim_ending_silence_after_render = false;
     } else if (!strcmp(argv[x], "--skip-normalize")) {
       normalize_after_render = false;
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
 
     } else if (!strncmp(argv[x], "--arpeggio-frequency=", 21)) {
       opts->arpeggio_frequency = atoi(&argv[x][21]);
@@ -255,6 +284,8 @@ int main(int argc, char** argv) {
       opts->volume_exponent = strtof(&argv[x][18], nullptr);
     } else if (!strncmp(argv[x], "--sample-rate=", 14)) {
       opts->sample_rate = atoi(&argv[x][14]);
+    } else if (!strncmp(argv[x], "--sample-cache-limit=", 21)) {
+      opts->max_sample_cache_bytes = std::stoull(&argv[x][21], nullptr, 0) << 20;
 
     } else if (!input_filename) {
       input_filename = argv[x];
@@ -323,19 +354,26 @@ int main(int argc, char** argv) {
         writer.run_all();
       } else {
         std::string output_filename = std::string(input_filename) + ".wav";
-        ResourceDASM::Audio::MODRenderer renderer(mod, opts);
-        phosg::fwrite_fmt(stderr, "Synthesis:\n");
-        renderer.run_all();
-        phosg::fwrite_fmt(stderr, "Assembling result\n");
-        auto result = renderer.result();
-        if (trim_ending_silence_after_render) {
-          ResourceDASM::Audio::trim_ending_silence(result);
-        }
-        if (normalize_after_render) {
-          ResourceDASM::Audio::normalize_amplitude(result);
+        using SampleCacheT = ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Module::Instrument*>;
+        auto sample_cache = std::make_shared<SampleCacheT>(opts->resample_method, opts->max_sample_cache_bytes);
+        opts->sample_cache = sample_cache;
+        ResourceDASM::Audio::WAVWriter wav(
+            output_filename, opts->sample_rate, 2, trim_ending_silence_after_render, normalize_after_render);
+        if (parallelism >= 0) {
+          phosg::fwrite_fmt(stderr, "Synthesizing tracks in parallel\n");
+          ResourceDASM::Audio::render_tracks_parallel(mod, opts, [&](const float* samples, size_t count) -> void {
+            wav.write(samples, count);
+          }, parallelism);
+        } else {
+          MODWAVWriter writer(mod, opts, wav);
+          phosg::fwrite_fmt(stderr, "Synthesis:\n");
+          writer.run_all();
         }
+        auto cache_stats = sample_cache->stats();
+        phosg::fwrite_fmt(stderr, "Sample cache: {} hits, {} misses, {} evictions; {} entries ({} bytes)\n",
+            cache_stats.hits, cache_stats.misses, cache_stats.evictions, cache_stats.entries, cache_stats.bytes);
         phosg::fwrite_fmt(stderr, "... {}\n", output_filename);
-        phosg::save_file(output_filename, ResourceDASM::Audio::serialize_wav(result, opts->sample_rate, 2));
+        wav.close();
       }
       break;
     }
@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <format>
+#include <functional>
 #include <map>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
@@ -12,7 +13,9 @@
 #include <string>
 #include <unordered_map>
 
+#include "../Parallel.hh"
 #include "Constants.hh"
+#include "PersistentSampleCache.hh"
 #include "SampleCache.hh"
 #include "SoundEnvironment.hh"
 #include "WAVFile.hh"
@@ -739,6 +742,7 @@ public:
   int8_t note;
   int8_t vel;
   std::shared_ptr<Channel> channel;
+  size_t seq = 0; // Order in which this voice was started on its track
 };
 
 class SilentVoice : public Voice {
@@ -807,6 +811,7 @@ public:
       size_t output_sample_rate,
       std::shared_ptr<const ResourceDASM::Audio::SoundEnvironment> env,
       std::shared_ptr<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>> cache,
+      std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache,
       uint16_t bank_id,
       uint16_t instrument_id,
       int8_t note,
@@ -819,7 +824,8 @@ public:
         vel_region(&this->key_region->region_for_velocity(vel)),
         adsr_attack_end_samples(this->output_sample_rate * this->vel_region->adsr.attack_time_secs),
         adsr_decay_end_samples(this->adsr_attack_end_samples + this->output_sample_rate * this->vel_region->adsr.decay_time_secs),
-        cache(cache) {
+        cache(cache),
+        persistent_cache(persistent_cache) {
     if (!this->vel_region->sound) {
       throw std::out_of_range("instrument sound is missing");
     }
@@ -901,7 +907,8 @@ public:
     return ret;
   }
 
-  const std::vector<float>& get_samples(float pitch_bend, float pitch_bend_semitone_range, float freq_mult) {
+  std::shared_ptr<const std::vector<float>> get_samples(
+      float pitch_bend, float pitch_bend_semitone_range, float freq_mult) {
     const auto& freq = ResourceDASM::Audio::frequency_for_note;
 
     // Stretch it out by the sample rate difference (on modern systems, the output sample rate is nearly always higher
@@ -926,9 +933,19 @@ public:
     try {
       return this->cache->at(this->vel_region->sound, this->src_ratio);
     } catch (const std::out_of_range&) {
-      const auto& ret = this->cache->resample_add(
+      if (this->persistent_cache) {
+        std::vector<float> data;
+        if (this->persistent_cache->get_resampled(this->vel_region->sound, this->src_ratio, data)) {
+          return this->cache->add(this->vel_region->sound, this->src_ratio, std::move(data));
+        }
+        this->persistent_cache->restore_decoded_samples(this->vel_region->sound);
+      }
+      auto ret = this->cache->resample_add(
           this->vel_region->sound, this->vel_region->sound->samples(),
           this->vel_region->sound->num_channels, this->src_ratio);
+      if (this->persistent_cache) {
+        this->persistent_cache->add_resampled(this->vel_region->sound, this->src_ratio, ret);
+      }
       if (debug_flags & DebugFlag::SHOW_RESAMPLE_EVENTS) {
         std::string key_low_str = ResourceDASM::Audio::name_for_note(this->key_region->key_low);
         std::string key_high_str = ResourceDASM::Audio::name_for_note(this->key_region->key_high);
@@ -956,7 +973,7 @@ public:
             this->loop_end_offset,
             this->src_ratio,
             this->vel_region->sound->samples().size(),
-            ret.size());
+            ret->size());
       }
       return ret;
     }
@@ -965,8 +982,9 @@ public:
   virtual std::vector<float> render(size_t count, float freq_mult, float volume_bias) {
     std::vector<float> data(count * 2, 0.0f);
 
-    const auto& samples = this->get_samples(
+    auto samples_ptr = this->get_samples(
         this->channel->pitch_bend.get(), this->channel->pitch_bend_semitone_range, freq_mult);
+    const auto& samples = *samples_ptr;
 
     float vol_factor = volume_bias * (static_cast<float>(this->vel) / 0x7F) * this->vel_region->volume_mult * this->channel->volume.get();
     for (size_t x = 0; (x < count) && (this->offset < samples.size()); x++) {
@@ -1008,6 +1026,7 @@ public:
   bool release_started = false;
 
   std::shared_ptr<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>> cache;
+  std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache;
 };
 
 class RendererBase {
@@ -1018,14 +1037,25 @@ public:
   virtual std::vector<float> render_time_step(double remaining_secs = 0.0) = 0;
   virtual std::vector<float> render_until(uint64_t time) = 0;
   virtual std::vector<float> render_until_seconds(float seconds) = 0;
+  virtual void stream_until_seconds(float seconds, const std::function<void(std::vector<float>&&)>& on_samples) = 0;
   virtual std::vector<float> render_all() = 0;
+
+  // persistent_cache may be null
+  virtual void set_sample_cache(
+      std::shared_ptr<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>> cache,
+      std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache) = 0;
+  virtual void set_track_partition(size_t part_index, size_t num_parts) = 0;
+  virtual void clear_track_samples() = 0;
+  virtual std::map<size_t, std::vector<float>>& get_track_samples() = 0;
+  virtual size_t get_track_samples_size() const = 0;
 };
 
 template <typename TrackT>
 class Renderer : public RendererBase {
 protected:
   std::string output_data;
-  std::unordered_set<std::shared_ptr<TrackT>> tracks;
+  // Tracks are kept in creation order so that they're always mixed in the same order
+  std::vector<std::shared_ptr<TrackT>> tracks;
   std::multimap<uint64_t, std::shared_ptr<TrackT>> next_event_to_track;
 
   size_t sample_rate;
@@ -1043,6 +1073,16 @@ protected:
   std::unordered_set<int16_t> disable_tracks;
 
   std::shared_ptr<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>> cache;
+  std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache;
+
+  // When rendering in parallel, each renderer executes all tracks' opcodes (since any track can change the tempo or
+  // start other tracks), but only produces audio for the tracks whose index is congruent to track_part_index modulo
+  // num_track_parts. Those tracks' samples are saved individually in track_samples (keyed by track index) so they can
+  // be mixed after all renderers are done.
+  size_t track_part_index = 0;
+  size_t num_track_parts = 1;
+  std::map<size_t, std::vector<float>> track_samples;
+  size_t track_samples_start = 0;
 
   virtual void execute_opcode(std::multimap<uint64_t, std::shared_ptr<TrackT>>::iterator track_it) = 0;
 
@@ -1051,10 +1091,12 @@ protected:
     std::shared_ptr<Channel> c = t->channel(channel_id);
 
     std::shared_ptr<Voice> voice;
-    if (this->env) {
+    if (!this->renders_track(*t)) {
+      voice = std::make_shared<SilentVoice>(this->sample_rate, key, vel, c);
+    } else if (this->env) {
       try {
         voice = std::make_shared<SampleVoice>(
-            this->sample_rate, this->env, this->cache, t->bank, t->instrument, key, vel, c);
+            this->sample_rate, this->env, this->cache, this->persistent_cache, t->bank, t->instrument, key, vel, c);
       } catch (const std::out_of_range& e) {
         std::string key_str = ResourceDASM::Audio::name_for_note(key);
         if (debug_flags & DebugFlag::SHOW_MISSING_NOTES) {
@@ -1071,10 +1113,20 @@ protected:
     } else {
       voice = std::make_shared<SineVoice>(this->sample_rate, key, vel, c);
     }
+    voice->seq = t->voices_created++;
     t->voices[voice_id] = voice;
     return voice;
   }
 
+  void add_track(std::shared_ptr<TrackT> t) {
+    t->index = this->tracks.size();
+    this->tracks.emplace_back(std::move(t));
+  }
+
+  inline bool renders_track(const TrackT& t) const {
+    return (t.index % this->num_track_parts) == this->track_part_index;
+  }
+
 public:
   explicit Renderer(
       size_t sample_rate,
@@ -1152,19 +1204,25 @@ public:
     double usecs_per_pulse = static_cast<double>(usecs_per_qnote) / this->pulse_rate;
     size_t samples_per_pulse = (usecs_per_pulse * this->sample_rate) / 1000000;
 
-    // Render this timestep
+    // Render this timestep. Each track's voices are mixed in the order they were started, then the tracks are mixed
+    // in the order they were created, so the floating-point sums are the same regardless of how the tracks are
+    // partitioned between renderers.
     std::vector<float> step_samples(2 * samples_per_pulse, 0);
     char notes_table[0x81];
     memset(notes_table, ' ', 0x80);
     notes_table[0x80] = 0;
     for (const auto& t : this->tracks) {
       // Get all voices, including those that are fading
-      std::unordered_set<std::shared_ptr<Voice>> all_voices = t->voices_off;
+      std::vector<std::shared_ptr<Voice>> all_voices(t->voices_off.begin(), t->voices_off.end());
       for (auto& it : t->voices) {
-        all_voices.insert(it.second);
+        all_voices.emplace_back(it.second);
       }
+      std::sort(all_voices.begin(), all_voices.end(), [](const auto& a, const auto& b) -> bool {
+        return a->seq < b->seq;
+      });
 
       // Render all the voices
+      std::vector<float> track_step_samples(step_samples.size(), 0.0f);
       for (auto v : all_voices) {
         std::vector<float> voice_samples;
         try {
@@ -1179,10 +1237,8 @@ public:
               "voice produced incorrect sample count (returned {} samples, expected {} samples)",
               voice_samples.size(), step_samples.size()));
         }
-        if (!this->mute_tracks.count(t->id)) {
-          for (size_t y = 0; y < voice_samples.size(); y++) {
-            step_samples[y] += voice_samples[y];
-          }
+        for (size_t y = 0; y < voice_samples.size(); y++) {
+          track_step_samples[y] += voice_samples[y];
         }
 
         // Only draw the note in the text view if it's on
@@ -1207,6 +1263,17 @@ public:
         }
       }
 
+      if (!this->mute_tracks.count(t->id)) {
+        for (size_t y = 0; y < track_step_samples.size(); y++) {
+          step_samples[y] += track_step_samples[y];
+        }
+        if ((this->num_track_parts > 1) && this->renders_track(*t)) {
+          auto& samples = this->track_samples[t->index];
+          samples.resize(2 * (this->samples_rendered - this->track_samples_start), 0.0f);
+          samples.insert(samples.end(), track_step_samples.begin(), track_step_samples.end());
+        }
+      }
+
       // Attenuate off voices and delete those that are fully off
       for (auto it = t->voices_off.begin(); it != t->voices_off.end();) {
         if ((*it)->complete()) {
@@ -1301,12 +1368,17 @@ public:
 
   virtual std::vector<float> render_until_seconds(float seconds) {
     std::vector<float> samples;
+    this->stream_until_seconds(seconds, [&](std::vector<float>&& step_samples) -> void {
+      samples.insert(samples.end(), step_samples.begin(), step_samples.end());
+    });
+    return samples;
+  }
+
+  virtual void stream_until_seconds(float seconds, const std::function<void(std::vector<float>&&)>& on_samples) {
     size_t target_size = seconds * this->sample_rate;
     while (this->can_render() && (this->samples_rendered < target_size)) {
-      auto step_samples = this->render_time_step();
-      samples.insert(samples.end(), step_samples.begin(), step_samples.end());
+      on_samples(this->render_time_step());
     }
-    return samples;
   }
 
   virtual std::vector<float> render_all() {
@@ -1317,10 +1389,40 @@ public:
     }
     return samples;
   }
+
+  virtual void set_sample_cache(
+      std::shared_ptr<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>> cache,
+      std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache) {
+    this->cache = cache;
+    this->persistent_cache = persistent_cache;
+  }
+
+  virtual void set_track_partition(size_t part_index, size_t num_parts) {
+    if (part_index >= num_parts) {
+      throw std::invalid_argument("invalid track partition");
+    }
+    this->track_part_index = part_index;
+    this->num_track_parts = num_parts;
+  }
+
+  virtual void clear_track_samples() {
+    this->track_samples.clear();
+    this->track_samples_start = this->samples_rendered;
+  }
+
+  virtual std::map<size_t, std::vector<float>>& get_track_samples() {
+    return this->track_samples;
+  }
+
+  virtual size_t get_track_samples_size() const {
+    return 2 * (this->samples_rendered - this->track_samples_start);
+  }
 };
 
 struct BaseTrack {
   int16_t id;
+  size_t index = 0; // Order in which this track was created
+  size_t voices_created = 0;
   std::unordered_map<size_t, std::shared_ptr<Channel>> channels;
   float freq_mult = 1.0;
   int32_t bank = -1; // Technically uint16, but uninitialized as -1
@@ -1394,7 +1496,7 @@ public:
             volume_bias),
         seq(seq) {
     std::shared_ptr<BMSTrack> default_track(new BMSTrack(-1, this->seq->data, 0, this->seq->index));
-    this->tracks.emplace(default_track);
+    this->add_track(default_track);
     this->next_event_to_track.emplace(0, default_track);
     default_track->freq_mult = this->freq_bias;
   }
@@ -1562,7 +1664,7 @@ protected:
         if ((this->solo_tracks.empty() || this->solo_tracks.count(track_id)) &&
             !this->disable_tracks.count(track_id)) {
           std::shared_ptr<BMSTrack> new_track(new BMSTrack(track_id, this->seq->data, offset, this->seq->index));
-          this->tracks.emplace(new_track);
+          this->add_track(new_track);
           this->next_event_to_track.emplace(this->current_time, new_track);
           new_track->freq_mult = this->freq_bias;
         }
@@ -1822,7 +1924,7 @@ public:
 
       if (!this->disable_tracks.count(track_id)) {
         std::shared_ptr<MIDITrack> t(new MIDITrack(track_id, this->seq->data, r.where()));
-        this->tracks.emplace(t);
+        this->add_track(t);
         this->next_event_to_track.emplace(0, t);
         t->freq_mult = this->freq_bias;
       }
@@ -1998,7 +2100,7 @@ public:
         t->channel(0)->pitch_bend_semitone_range = 1.0;
         t->freq_mult = this->freq_bias;
         t->events.emplace_back(ev.get());
-        this->tracks.emplace(t);
+        this->add_track(t);
         id_to_track.emplace(t->id, t);
       } else {
         track_it->second->events.emplace_back(ev.get());
@@ -2117,6 +2219,17 @@ Synthesis options:\n\
   --sample-rate=N: generate output at this sample rate (default 48000).\n\
   --resample-method=METHOD: use this method for resampling waveforms. Values\n\
       are hold or linear.\n\
+  --sample-cache-limit=N: keep at most N megabytes of resampled instrument\n\
+      data in memory, discarding the least recently used data when the limit\n\
+      is exceeded. The default is no limit.\n\
+  --sample-cache-dir=DIR: save decoded and resampled instrument data in this\n\
+      directory, and reuse it in later runs with the same instrument banks,\n\
+      sample rate, and resampling method. This makes rendering many songs from\n\
+      the same game faster. The cache files can be deleted at any time.\n\
+  --parallel=N: when writing an output file, render the tracks on N threads\n\
+      and mix them afterward. If N is 0, use as many threads as there are CPU\n\
+      cores. The result is identical to the result of rendering serially, but\n\
+      each track\'s audio is kept in memory until all tracks are rendered.\n\
 \n\
 Logging options:\n\
   --silent: don't print any status information.\n\
@@ -2133,6 +2246,57 @@ Debugging options:\n\
 ");
 }
 
+// Renders the sequence on multiple threads and passes the mix to write_samples in blocks. The mix can't start until
+// every renderer is done, so each track's entire output is held in memory until then (but the mix itself isn't).
+static void render_tracks_parallel(
+    std::function<std::shared_ptr<RendererBase>()> make_renderer,
+    float start_time,
+    float time_limit,
+    const std::function<void(const float*, size_t)>& write_samples,
+    size_t num_threads) {
+  num_threads = ResourceDASM::resolve_num_threads(num_threads);
+
+  // Each renderer executes the entire sequence, but only produces audio for its share of the tracks. Tracks are only
+  // discovered as the sequence runs, so they're assigned to renderers by creation order rather than by ID.
+  std::vector<size_t> part_indexes;
+  for (size_t z = 0; z < num_threads; z++) {
+    part_indexes.emplace_back(z);
+  }
+  std::vector<std::map<size_t, std::vector<float>>> part_track_samples(part_indexes.size());
+  std::vector<size_t> part_sizes(part_indexes.size(), 0);
+  ResourceDASM::parallel_for_each(part_indexes, [&](const size_t& part_index) -> void {
+    auto r = make_renderer();
+    r->set_track_partition(part_index, part_indexes.size());
+    if (start_time) {
+      r->render_until_seconds(start_time);
+    }
+    r->clear_track_samples();
+    r->render_until_seconds(time_limit);
+    part_track_samples[part_index] = std::move(r->get_track_samples());
+    part_sizes[part_index] = r->get_track_samples_size();
+  }, part_indexes.size());
+
+  // Renderers stop as soon as their own tracks' voices are done, so the serial result's length is the longest of
+  // them. Tracks are mixed in creation order, just as Renderer::render_time_step does it.
+  std::map<size_t, std::vector<float>> track_samples;
+  for (auto& samples : part_track_samples) {
+    track_samples.merge(samples);
+  }
+  size_t num_samples = *std::max_element(part_sizes.begin(), part_sizes.end());
+  static constexpr size_t MIX_BLOCK_SAMPLES = 0x10000;
+  std::vector<float> block;
+  for (size_t offset = 0; offset < num_samples; offset += MIX_BLOCK_SAMPLES) {
+    block.assign(std::min<size_t>(MIX_BLOCK_SAMPLES, num_samples - offset), 0.0f);
+    for (const auto& it : track_samples) {
+      size_t end = std::min<size_t>(it.second.size(), offset + block.size());
+      for (size_t z = offset; z < end; z++) {
+        block[z - offset] += it.second[z];
+      }
+    }
+    write_samples(block.data(), block.size());
+  }
+}
+
 static double parse_fraction(const std::string& arg) {
   size_t slash_pos = arg.find('/');
   if (slash_pos == std::string::npos) {
@@ -2168,6 +2332,9 @@ int main(int argc, char** argv) {
   double volume_bias = 1.0;
   bool list_sequences = false;
   int32_t default_bank = -1;
+  ssize_t parallelism = -1;
+  size_t max_sample_cache_bytes = 0;
+  const char* sample_cache_dir = nullptr;
   ResourceDASM::Audio::ResampleMethod resample_method = ResourceDASM::Audio::ResampleMethod::LINEAR_INTERPOLATE;
   std::string env_json_filename;
   for (int x = 1; x < argc; x++) {
@@ -2225,6 +2392,12 @@ int main(int argc, char** argv) {
       resample_method = ResourceDASM::Audio::ResampleMethod::EXTEND;
     } else if (!strcmp(argv[x], "--resample-method=linear")) {
       resample_method = ResourceDASM::Audio::ResampleMethod::LINEAR_INTERPOLATE;
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
+    } else if (!strncmp(argv[x], "--sample-cache-limit=", 21)) {
+      max_sample_cache_bytes = std::stoull(&argv[x][21], nullptr, 0) << 20;
+    } else if (!strncmp(argv[x], "--sample-cache-dir=", 19)) {
+      sample_cache_dir = &argv[x][19];
     } else if (!strncmp(argv[x], "--default-bank=", 15)) {
       default_bank = atoi(&argv[x][15]);
     } else if (!strncmp(argv[x], "--tempo-bias=", 13)) {
@@ -2355,77 +2528,141 @@ int main(int argc, char** argv) {
     return 0;
   }
 
-  std::shared_ptr<RendererBase> r;
-  switch (seq->type) {
-    case ResourceDASM::Audio::SequenceProgram::Type::BMS:
-      r.reset(new BMSRenderer(
-          seq,
-          sample_rate,
-          resample_method,
-          env,
-          mute_tracks,
-          solo_tracks,
-          disable_tracks,
-          tempo_bias,
-          freq_bias,
-          volume_bias));
-      break;
-
-    case ResourceDASM::Audio::SequenceProgram::Type::TUNE:
-      if (!seq->source_tune) {
-        throw std::logic_error("TunePlayer requires a parsed TuneResource");
+  // MIDI has some extra params; get them from the JSON if possible
+  uint8_t percussion_instrument = 0;
+  bool allow_program_change = true;
+  if ((seq->type == ResourceDASM::Audio::SequenceProgram::Type::MIDI) && !env_json.is_null()) {
+    percussion_instrument = env_json.get_int("percussion_instrument", 0);
+    allow_program_change = env_json.get_bool("allow_program_change", true);
+    tempo_bias *= env_json.get_float("tempo_bias", 1.0);
+  }
+
+  // All renderers share the same sample cache, so parallel renderers don't each resample the same sounds
+  auto cache = std::make_shared<ResourceDASM::Audio::SampleCache<const ResourceDASM::Audio::Sound*>>(
+      resample_method, max_sample_cache_bytes);
+  // The persistent cache must be created before any sounds are decoded, since it identifies sounds by the hashes of
+  // their compressed data
+  std::shared_ptr<ResourceDASM::Audio::PersistentSampleCache> persistent_cache;
+  if (sample_cache_dir && env) {
+    persistent_cache = std::make_shared<ResourceDASM::Audio::PersistentSampleCache>(
+        sample_cache_dir, *env, sample_rate, resample_method);
+  }
+  auto make_renderer_for_type = [&]() -> std::shared_ptr<RendererBase> {
+    switch (seq->type) {
+      case ResourceDASM::Audio::SequenceProgram::Type::BMS:
+        return std::make_shared<BMSRenderer>(
+            seq,
+            sample_rate,
+            resample_method,
+            env,
+            mute_tracks,
+            solo_tracks,
+            disable_tracks,
+            tempo_bias,
+            freq_bias,
+            volume_bias);
+
+      case ResourceDASM::Audio::SequenceProgram::Type::TUNE:
+        if (!seq->source_tune) {
+          throw std::logic_error("TunePlayer requires a parsed TuneResource");
+        }
+        return std::make_shared<TuneRenderer>(
+            seq->source_tune,
+            sample_rate,
+            resample_method,
+            env,
+            mute_tracks,
+            solo_tracks,
+            disable_tracks,
+            tempo_bias,
+            freq_bias,
+            volume_bias);
+
+      case ResourceDASM::Audio::SequenceProgram::Type::MIDI:
+        return std::make_shared<MIDIRenderer>(
+            seq,
+            sample_rate,
+            resample_method,
+            env,
+            mute_tracks,
+            solo_tracks,
+            disable_tracks,
+            tempo_bias,
+            freq_bias,
+            volume_bias,
+            percussion_instrument,
+            allow_program_change);
+
+      default:
+        throw std::logic_error("Invalid sequence type");
+    }
+  };
+  auto make_renderer = [&]() -> std::shared_ptr<RendererBase> {
+    auto r = make_renderer_for_type();
+    r->set_sample_cache(cache, persistent_cache);
+    return r;
+  };
+  auto print_cache_stats = [&]() -> void {
+    if (debug_flags & DebugFlag::SHOW_RESAMPLE_EVENTS) {
+      auto stats = cache->stats();
+      phosg::fwrite_fmt(stderr, "sample cache: {} hits, {} misses, {} evictions; {} entries ({} bytes)\n",
+          stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+      if (persistent_cache) {
+        auto p_stats = persistent_cache->stats();
+        phosg::fwrite_fmt(stderr, "persistent sample cache: {} hits, {} misses; {} stored entries, {} new entries\n",
+            p_stats.hits, p_stats.misses, p_stats.stored_entries, p_stats.new_entries);
       }
-      r.reset(new TuneRenderer(
-          seq->source_tune,
-          sample_rate,
-          resample_method,
-          env,
-          mute_tracks,
-          solo_tracks,
-          disable_tracks,
-          tempo_bias,
-          freq_bias,
-          volume_bias));
-      break;
-
-    case ResourceDASM::Audio::SequenceProgram::Type::MIDI: {
-      // MIDI has some extra params; get them from the JSON if possible
-      uint8_t percussion_instrument = 0;
-      bool allow_program_change = true;
-      if (!env_json.is_null()) {
-        percussion_instrument = env_json.get_int("percussion_instrument", 0);
-        allow_program_change = env_json.get_bool("allow_program_change", true);
-        tempo_bias *= env_json.get_float("tempo_bias", 1.0);
+    }
+  };
+  auto save_persistent_cache = [&]() -> void {
+    if (persistent_cache) {
+      try {
+        persistent_cache->save();
+      } catch (const std::exception& e) {
+        phosg::fwrite_fmt(stderr, "warning: cannot save sample cache file {}: {}\n",
+            persistent_cache->get_filename(), e.what());
       }
-      r.reset(new MIDIRenderer(
-          seq,
-          sample_rate,
-          resample_method,
-          env,
-          mute_tracks,
-          solo_tracks,
-          disable_tracks,
-          tempo_bias,
-          freq_bias,
-          volume_bias,
-          percussion_instrument,
-          allow_program_change));
-      break;
-    }
-
-    default:
-      throw std::logic_error("Invalid sequence type");
+    }
+  };
+
+  if (output_filename && (parallelism >= 0)) {
+    // The status display can't be shown when multiple renderers are running, and sounds must all be decoded before
+    // the renderers start since they're decoded lazily otherwise
+    debug_flags &= ~DebugFlag::SHOW_NOTES_ON;
+    if (env) {
+      if (persistent_cache) {
+        persistent_cache->restore_all_decoded_samples();
+      }
+      env->decode_all_samples();
+    }
+    ResourceDASM::Audio::WAVWriter wav(output_filename, sample_rate, 2);
+    render_tracks_parallel(make_renderer, start_time, time_limit, [&](const float* samples, size_t count) -> void {
+      wav.write(samples, count);
+    }, parallelism);
+    phosg::fwrite_fmt(stderr, "saving output file: {}\n", output_filename);
+    print_cache_stats();
+    wav.close();
+    save_persistent_cache();
+    return 0;
   }
 
+  std::shared_ptr<RendererBase> r = make_renderer();
+
   // Skip the first bit if requested
   if (start_time) {
     r->render_until_seconds(start_time);
   }
 
   if (output_filename) {
-    auto samples = r->render_until_seconds(time_limit);
+    // Write the audio to the file as it's generated, so long renders don't have to be held in memory
+    ResourceDASM::Audio::WAVWriter wav(output_filename, sample_rate, 2);
+    r->stream_until_seconds(time_limit, [&](std::vector<float>&& step_samples) -> void {
+      wav.write(step_samples);
+    });
     phosg::fwrite_fmt(stderr, "\nsaving output file: {}\n", output_filename);
-    phosg::save_file(output_filename, ResourceDASM::Audio::serialize_wav(samples, sample_rate, 2));
+    print_cache_stats();
+    wav.close();
+    save_persistent_cache();
 
 #ifdef SDL3_AVAILABLE
   } else if (play) {
@@ -2447,6 +2684,7 @@ int main(int argc, char** argv) {
       stream.drain();
     }
     SDL_Quit();
+    save_persistent_cache();
 #endif
   }
 
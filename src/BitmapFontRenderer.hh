@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <functional>
 #include <utility>
 #include <vector>
@@ -40,30 +41,38 @@ public:
   // Computes the width and height of the area required to render all of the given text.
   std::pair<size_t, size_t> pixel_dimensions_for_text(const std::string& text) const;
 
+  // Computes the set of pixels to be written to render a single glyph, as horizontal runs. Calls write_span(x, y, w)
+  // once for each run of w pixels starting at (x, y). Returns the width of the rendered glyph.
+  template <typename FnT>
+    requires(std::is_invocable_r_v<void, FnT, ssize_t, ssize_t, size_t>)
+  size_t render_glyph_spans_custom(char ch, ssize_t x, ssize_t y, FnT&& write_span) const {
+    const auto& glyph = this->font->glyph_for_char(ch);
+    for (const auto& span : glyph.spans) {
+      write_span(x + span.x, y + span.y, span.width);
+    }
+    return glyph.width;
+  }
+
   // Computes the set of pixels to be written to render a single glyph. Calls write(x, y) once for each pixel to be
   // drawn. Returns the width of the rendered glyph.
   template <typename FnT>
     requires(std::is_invocable_r_v<void, FnT, ssize_t, ssize_t>)
   size_t render_glyph_custom(char ch, ssize_t x, ssize_t y, FnT&& write) const {
-    const auto& glyph = this->font->glyph_for_char(ch);
-    for (ssize_t py = 0; py < static_cast<ssize_t>(this->font->full_bitmap.get_height()); py++) {
-      for (ssize_t px = 0; px < glyph.bitmap_width; px++) {
-        if (this->font->full_bitmap.read(glyph.bitmap_offset + px, py) == 0x000000FF) {
-          write(x + glyph.offset + px, y + py);
-        }
+    return this->render_glyph_spans_custom(ch, x, y, [&](ssize_t sx, ssize_t sy, size_t w) -> void {
+      for (size_t z = 0; z < w; z++) {
+        write(sx + static_cast<ssize_t>(z), sy);
       }
-    }
-    return glyph.width;
+    });
   }
 
-  // Computes the set of pixels to be written to render text. Calls write(x, y) once for each pixel to be drawn. The y
-  // value passed to write() is relative to the top of the text. The x value depends on the alignment mode: if it's
-  // LEFT, x is nonnegative and relative to the left edge of the text; if it's RIGHT, x is negative and relative to the
-  // right edge of the text; if it's CENTER, x may be zero, positive, or negative and is relative to the center line of
-  // the text.
+  // Computes the set of pixels to be written to render text, as horizontal runs. Calls write_span(x, y, w) once for
+  // each run of w pixels starting at (x, y). The y value passed to write_span() is relative to the top of the text.
+  // The x value depends on the alignment mode: if it's LEFT, x is nonnegative and relative to the left edge of the
+  // text; if it's RIGHT, x is negative and relative to the right edge of the text; if it's CENTER, x may be zero,
+  // positive, or negative and is relative to the center line of the text.
   template <typename FnT>
-    requires(std::is_invocable_r_v<void, FnT, ssize_t, ssize_t>)
-  void render_text_custom(const std::string& text, HorizontalAlignment align, FnT&& write) const {
+    requires(std::is_invocable_r_v<void, FnT, ssize_t, ssize_t, size_t>)
+  void render_text_spans_custom(const std::string& text, HorizontalAlignment align, FnT&& write_span) const {
     if (align == HorizontalAlignment::LEFT) {
       // Left alignment: no need to render entire lines at once; just render char by char (this skips splitting/copying
       // the string)
@@ -74,7 +83,7 @@ public:
           x = 0;
           y += this->font->full_bitmap.get_height() + this->font->leading;
         } else {
-          x += this->render_glyph_custom(ch, x, y, std::move(write));
+          x += this->render_glyph_spans_custom(ch, x, y, write_span);
         }
       }
 
@@ -93,13 +102,25 @@ public:
         line_h += this->font->leading;
         ssize_t x = -static_cast<ssize_t>((align == HorizontalAlignment::RIGHT) ? line_w : (line_w / 2));
         for (size_t z = 0; z < line.size(); z++) {
-          x += this->render_glyph_custom(line[z], x, y, std::move(write));
+          x += this->render_glyph_spans_custom(line[z], x, y, write_span);
         }
         y += line_h;
       }
     }
   }
 
+  // Computes the set of pixels to be written to render text. Calls write(x, y) once for each pixel to be drawn. The
+  // coordinates passed to write() are the same as for render_text_spans_custom.
+  template <typename FnT>
+    requires(std::is_invocable_r_v<void, FnT, ssize_t, ssize_t>)
+  void render_text_custom(const std::string& text, HorizontalAlignment align, FnT&& write) const {
+    this->render_text_spans_custom(text, align, [&](ssize_t sx, ssize_t sy, size_t w) -> void {
+      for (size_t z = 0; z < w; z++) {
+        write(sx + static_cast<ssize_t>(z), sy);
+      }
+    });
+  }
+
   // Renders text to an image, anchored by its upper-left corner at (x, y) within the canvas image. Pixels that would
   // be written outside of the canvas' range are silently skipped. The text color is given as RGBA8888.
   template <phosg::PixelFormat Format>
@@ -127,11 +148,18 @@ public:
         throw std::logic_error("Unknown horizontal alignment mode");
     }
 
-    this->render_text_custom(text, align, [&](ssize_t px, ssize_t py) -> void {
-      px += x_delta;
+    // Clip each run once instead of checking every pixel
+    ssize_t max_x = std::min<ssize_t>(x2, ret.get_width());
+    ssize_t max_y = std::min<ssize_t>(y2, ret.get_height());
+    this->render_text_spans_custom(text, align, [&](ssize_t px, ssize_t py, size_t w) -> void {
       py += y1;
-      if ((px < x2) && (py < y2) && ret.check(px, py)) {
-        ret.write(px, py, color);
+      if ((py < 0) || (py >= max_y)) {
+        return;
+      }
+      ssize_t start_x = std::max<ssize_t>(px + x_delta, 0);
+      ssize_t end_x = std::min<ssize_t>(px + x_delta + static_cast<ssize_t>(w), max_x);
+      for (ssize_t x = start_x; x < end_x; x++) {
+        ret.write(x, py, color);
       }
     });
   }
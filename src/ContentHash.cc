@@ -0,0 +1,128 @@
+#include "ContentHash.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <format>
+#include <phosg/Encoding.hh>
+#include <stdexcept>
+
+namespace ResourceDASM {
+
+static inline uint64_t rotl64(uint64_t x, int8_t r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xFF51AFD7ED558CCDULL;
+  k ^= k >> 33;
+  k *= 0xC4CEB9FE1A85EC53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t get_block(const uint8_t* p) {
+  phosg::le_uint64_t ret;
+  memcpy(&ret, p, sizeof(ret));
+  return ret;
+}
+
+ContentHash content_hash(const void* data, size_t size, uint64_t seed) {
+  static constexpr uint64_t C1 = 0x87C37B91114253D5ULL;
+  static constexpr uint64_t C2 = 0x4CF5AD432745937FULL;
+
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  size_t num_blocks = size / 16;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+
+  for (size_t z = 0; z < num_blocks; z++) {
+    uint64_t k1 = get_block(bytes + z * 16);
+    uint64_t k2 = get_block(bytes + z * 16 + 8);
+
+    k1 *= C1;
+    k1 = rotl64(k1, 31);
+    k1 *= C2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52DCE729;
+
+    k2 *= C2;
+    k2 = rotl64(k2, 33);
+    k2 *= C1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495AB5;
+  }
+
+  // Bytes 0-7 of the tail go into k1 and bytes 8-15 go into k2, in little-endian order
+  const uint8_t* tail = bytes + num_blocks * 16;
+  size_t tail_size = size & 15;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t z = tail_size; z > 8; z--) {
+    k2 = (k2 << 8) | tail[z - 1];
+  }
+  for (size_t z = std::min<size_t>(tail_size, 8); z > 0; z--) {
+    k1 = (k1 << 8) | tail[z - 1];
+  }
+  if (tail_size > 8) {
+    k2 *= C2;
+    k2 = rotl64(k2, 33);
+    k2 *= C1;
+    h2 ^= k2;
+  }
+  if (tail_size > 0) {
+    k1 *= C1;
+    k1 = rotl64(k1, 31);
+    k1 *= C2;
+    h1 ^= k1;
+  }
+
+  h1 ^= size;
+  h2 ^= size;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  return ContentHash{h1, h2};
+}
+
+ContentHash content_hash(const std::string& data, uint64_t seed) {
+  return content_hash(data.data(), data.size(), seed);
+}
+
+std::string ContentHash::hex() const {
+  return std::format("{:016X}{:016X}", this->high, this->low);
+}
+
+ContentHash ContentHash::from_hex(const std::string& s) {
+  if (s.size() != 32) {
+    throw std::invalid_argument("content hash must be 32 hex digits");
+  }
+  ContentHash ret;
+  for (size_t z = 0; z < 32; z++) {
+    char ch = s[z];
+    uint8_t value;
+    if ((ch >= '0') && (ch <= '9')) {
+      value = ch - '0';
+    } else if ((ch >= 'A') && (ch <= 'F')) {
+      value = ch - 'A' + 10;
+    } else if ((ch >= 'a') && (ch <= 'f')) {
+      value = ch - 'a' + 10;
+    } else {
+      throw std::invalid_argument("content hash contains a non-hex character");
+    }
+    uint64_t& word = (z < 16) ? ret.high : ret.low;
+    word = (word << 4) | value;
+  }
+  return ret;
+}
+
+} // namespace ResourceDASM
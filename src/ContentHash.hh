@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <compare>
+#include <string>
+
+namespace ResourceDASM {
+
+// A 128-bit hash of a block of data, used to identify resources by their contents (for example, when looking for
+// duplicate resources). This is MurmurHash3 (the x64 128-bit variant), which is much faster than a cryptographic hash.
+// It isn't designed to resist deliberately constructed collisions, but accidental collisions are vanishingly unlikely.
+// The result doesn't depend on the host's byte order, so hashes can be stored in files and compared across machines.
+struct ContentHash {
+  uint64_t high = 0;
+  uint64_t low = 0;
+
+  // Returns the hash as 32 hex digits
+  std::string hex() const;
+  // Parses a hash produced by hex(). Throws std::invalid_argument if the string isn't a valid hash.
+  static ContentHash from_hex(const std::string& s);
+
+  bool operator==(const ContentHash& other) const = default;
+  std::strong_ordering operator<=>(const ContentHash& other) const = default;
+};
+
+ContentHash content_hash(const void* data, size_t size, uint64_t seed = 0);
+ContentHash content_hash(const std::string& data, uint64_t seed = 0);
+
+} // namespace ResourceDASM
+
+template <>
+struct std::hash<ResourceDASM::ContentHash> {
+  size_t operator()(const ResourceDASM::ContentHash& h) const {
+    // The hash is already well-mixed, so there's no need to hash it again
+    return h.low;
+  }
+};
@@ -0,0 +1,135 @@
+#include "ContentStore.hh"
+
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "AtomicFile.hh"
+
+namespace ResourceDASM {
+
+// Store layout:
+//   DIR/XX/<hash>.entry: the entry's exported flag ("1" or "0") on the first line, then one suffix per line
+//   DIR/XX/<hash><suffix>: the entry's files
+// where XX is the first two hex digits of the hash. The .entry file is written last, so entries whose files weren't
+// all written (e.g. because the process was interrupted) are never used.
+
+ContentStore::ContentStore(const std::string& directory) : directory(directory) {
+  std::filesystem::create_directories(this->directory);
+}
+
+std::string ContentStore::entry_prefix(const ContentHash& key) const {
+  std::string hex = key.hex();
+  return std::format("{}/{}/{}", this->directory, hex.substr(0, 2), hex);
+}
+
+std::string ContentStore::filename_for_entry(const ContentHash& key, const std::string& suffix) const {
+  return this->entry_prefix(key) + suffix;
+}
+
+std::optional<ContentStore::Entry> ContentStore::get(const ContentHash& key) const {
+  std::string data;
+  try {
+    data = phosg::load_file(this->entry_prefix(key) + ".entry");
+  } catch (const phosg::cannot_open_file&) {
+    return std::nullopt;
+  }
+
+  auto lines = phosg::split(data, '\n');
+  if (lines.empty() || ((lines[0] != "0") && (lines[0] != "1"))) {
+    phosg::log_warning_f("Ignoring invalid content store entry {}", key.hex());
+    return std::nullopt;
+  }
+  Entry ret;
+  ret.exported = (lines[0] == "1");
+  for (size_t z = 1; z < lines.size(); z++) {
+    if (!lines[z].empty()) {
+      ret.suffixes.emplace_back(std::move(lines[z]));
+    }
+  }
+  return ret;
+}
+
+bool ContentStore::can_store(const std::string& output_prefix, const std::vector<std::string>& filenames) {
+  for (const auto& filename : filenames) {
+    if ((filename.size() <= output_prefix.size()) || !filename.starts_with(output_prefix)) {
+      return false;
+    }
+    // Suffixes are stored one per line, and all files in an entry are in the same directory
+    for (size_t z = output_prefix.size(); z < filename.size(); z++) {
+      if ((filename[z] == '/') || (filename[z] == '\n')) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void ContentStore::link_or_copy(const std::string& src_filename, const std::string& dest_filename) {
+  std::string temp_filename = temp_filename_for(dest_filename);
+  std::error_code ec;
+  std::filesystem::create_hard_link(src_filename, temp_filename, ec);
+  if (ec) {
+    std::filesystem::copy_file(src_filename, temp_filename, std::filesystem::copy_options::overwrite_existing);
+  }
+  std::filesystem::rename(temp_filename, dest_filename);
+}
+
+ContentStore::Entry ContentStore::put(const ContentHash& key, bool exported, const std::string& output_prefix,
+    const std::vector<std::string>& filenames, bool move) {
+  if (!can_store(output_prefix, filenames)) {
+    throw std::logic_error("output filenames cannot be stored in content store entry");
+  }
+
+  std::string prefix = this->entry_prefix(key);
+  std::filesystem::create_directories(std::filesystem::path(prefix).parent_path());
+
+  Entry entry;
+  entry.exported = exported;
+  std::string entry_data = exported ? "1\n" : "0\n";
+  for (const auto& filename : filenames) {
+    std::string suffix = filename.substr(output_prefix.size());
+    if (std::find(entry.suffixes.begin(), entry.suffixes.end(), suffix) != entry.suffixes.end()) {
+      continue; // The same file was written more than once
+    }
+    std::string stored_filename = prefix + suffix;
+    if (move) {
+      std::error_code ec;
+      std::filesystem::rename(filename, stored_filename, ec);
+      if (ec) {
+        // This can happen if the store is on a different filesystem
+        link_or_copy(filename, stored_filename);
+        std::filesystem::remove(filename);
+      }
+    } else {
+      link_or_copy(filename, stored_filename);
+    }
+    entry_data += suffix;
+    entry_data += '\n';
+    entry.suffixes.emplace_back(std::move(suffix));
+  }
+
+  std::string entry_filename = prefix + ".entry";
+  save_file_atomic(entry_filename, entry_data);
+  return entry;
+}
+
+std::vector<std::string> ContentStore::link_entry(
+    const ContentHash& key, const Entry& entry, const std::string& output_prefix) const {
+  std::vector<std::string> ret;
+  std::string parent_path = std::filesystem::path(output_prefix).parent_path();
+  if (!parent_path.empty()) {
+    std::filesystem::create_directories(parent_path);
+  }
+  for (const auto& suffix : entry.suffixes) {
+    std::string filename = output_prefix + suffix;
+    link_or_copy(this->filename_for_entry(key, suffix), filename);
+    ret.emplace_back(std::move(filename));
+  }
+  return ret;
+}
+
+} // namespace ResourceDASM
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ContentHash.hh"
+
+namespace ResourceDASM {
+
+// A content-addressed store of exported files, shared between exports of many archives. Each entry holds all of the
+// files produced by exporting one resource, identified by a key that the caller computes from everything the output
+// depends on (usually the resource's type, ID, and data, and the exporter's options). An entry's files are named by
+// the suffix that followed the resource's own output filename when they were exported (e.g. ".bmp" or
+// "_description.txt"), so they can be placed under any other resource's output filename.
+//
+// Stored files are linked into (or listed in a manifest in) each output directory instead of being written again, so
+// the store must be on the same filesystem as the output directories for hard links to work; if it isn't, files are
+// copied instead. Since a linked output file shares its data with the store entry (and every other output directory
+// it's linked into), callers must never overwrite an output file in place; they must delete or rename over it instead.
+// Entries are written with temporary files and renames, so multiple processes can share a store. Nothing is ever
+// deleted from the store.
+class ContentStore {
+public:
+  struct Entry {
+    // Whether the export produced any output (this is the exporter's return value, which may be false even if some
+    // files were written)
+    bool exported = false;
+    std::vector<std::string> suffixes;
+  };
+
+  explicit ContentStore(const std::string& directory);
+  ContentStore(const ContentStore&) = delete;
+  ContentStore(ContentStore&&) = delete;
+  ContentStore& operator=(const ContentStore&) = delete;
+  ContentStore& operator=(ContentStore&&) = delete;
+  ~ContentStore() = default;
+
+  inline const std::string& get_directory() const {
+    return this->directory;
+  }
+
+  // Returns the path of the stored file with the given suffix in the given entry
+  std::string filename_for_entry(const ContentHash& key, const std::string& suffix) const;
+
+  // Returns the entry for the given key, or nullopt if it isn't in the store
+  std::optional<Entry> get(const ContentHash& key) const;
+
+  // Returns true if all of the given filenames are output_prefix followed by a suffix that can be used in an entry
+  static bool can_store(const std::string& output_prefix, const std::vector<std::string>& filenames);
+
+  // Adds an entry containing the given files, each of which must be output_prefix followed by a suffix. If move is
+  // true, the files are moved into the store; otherwise, they're left in place and the store's copies are hard links
+  // to them. Returns the entry that was stored.
+  Entry put(const ContentHash& key, bool exported, const std::string& output_prefix,
+      const std::vector<std::string>& filenames, bool move);
+
+  // Creates output_prefix + suffix for each of the entry's files, as a hard link to (or copy of) the stored file.
+  // Returns the created filenames.
+  std::vector<std::string> link_entry(const ContentHash& key, const Entry& entry, const std::string& output_prefix) const;
+
+private:
+  std::string entry_prefix(const ContentHash& key) const;
+  // Makes dest_filename refer to the same data as src_filename, via a hard link if possible or a copy otherwise
+  static void link_or_copy(const std::string& src_filename, const std::string& dest_filename);
+
+  std::string directory;
+};
+
+} // namespace ResourceDASM
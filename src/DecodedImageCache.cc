@@ -0,0 +1,202 @@
+#include "DecodedImageCache.hh"
+
+#include <filesystem>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+#include <vector>
+
+#include "AtomicFile.hh"
+
+namespace ResourceDASM {
+
+// Cache entry file format:
+//   EntryFileHeader
+//   pixel data (big-endian RGBA8888, row-major; width * height entries)
+
+static constexpr uint32_t ENTRY_FILE_MAGIC = 0x44494D43; // 'DIMC'
+static constexpr uint32_t ENTRY_FILE_VERSION = 1;
+
+// ENTRY_FILE_VERSION only describes the file format. Change this if any decoder (or post-processing step) that
+// produces cached images changes its output, so that images decoded by the old version aren't used
+static constexpr uint32_t DECODERS_VERSION = 1;
+
+struct EntryFileHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_uint32_t width;
+  phosg::le_uint32_t height;
+} __attribute__((packed));
+
+DecodedImageCache::DecodedImageCache(const std::string& directory) : directory(directory) {
+  if (!this->directory.empty()) {
+    std::filesystem::create_directories(this->directory);
+  }
+}
+
+size_t DecodedImageCache::KeyHash::operator()(const Key& k) const {
+  uint64_t ret = phosg::fnv1a64(k.file_key.data(), k.file_key.size());
+  ret = phosg::fnv1a64(&k.type, sizeof(k.type), ret);
+  ret = phosg::fnv1a64(&k.id, sizeof(k.id), ret);
+  return phosg::fnv1a64(k.options.data(), k.options.size(), ret);
+}
+
+std::string DecodedImageCache::filename_for_entry(const Key& key, uint64_t source_hash) const {
+  // The file key, type, and options are hashed together with the source hash and the decoders version, so that
+  // different options, different versions of the same resource, and images from older decoders never share a file.
+  // The ID is left visible to make the directory easier to inspect.
+  uint64_t key_hash = KeyHash()(key);
+  key_hash = phosg::fnv1a64(&source_hash, sizeof(source_hash), key_hash);
+  key_hash = phosg::fnv1a64(&DECODERS_VERSION, sizeof(DECODERS_VERSION), key_hash);
+  return std::format("{}/{:08X}-{}-{:016X}.dimc", this->directory, key.type, key.id, key_hash);
+}
+
+std::shared_ptr<const phosg::ImageRGBA8888N> DecodedImageCache::load_entry(const std::string& filename) const {
+  std::string data;
+  try {
+    data = phosg::load_file(filename);
+  } catch (const phosg::cannot_open_file&) {
+    return nullptr;
+  }
+
+  if (data.size() < sizeof(EntryFileHeader)) {
+    phosg::log_warning_f("Ignoring decoded image cache file {} (file is too small)", filename);
+    return nullptr;
+  }
+  const auto* header = reinterpret_cast<const EntryFileHeader*>(data.data());
+  if ((header->magic != ENTRY_FILE_MAGIC) || (header->version != ENTRY_FILE_VERSION)) {
+    phosg::log_warning_f("Ignoring decoded image cache file {} (unknown file format)", filename);
+    return nullptr;
+  }
+  size_t w = header->width;
+  size_t h = header->height;
+  if ((data.size() - sizeof(EntryFileHeader)) / sizeof(phosg::be_uint32_t) != w * h) {
+    phosg::log_warning_f("Ignoring decoded image cache file {} (pixel data is truncated)", filename);
+    return nullptr;
+  }
+
+  auto ret = std::make_shared<phosg::ImageRGBA8888N>(w, h);
+  const auto* pixels = reinterpret_cast<const phosg::be_uint32_t*>(data.data() + sizeof(EntryFileHeader));
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      ret->write(x, y, pixels[y * w + x]);
+    }
+  }
+  return ret;
+}
+
+void DecodedImageCache::save_entry(const std::string& filename, const phosg::ImageRGBA8888N& img) const {
+  size_t w = img.get_width();
+  size_t h = img.get_height();
+  std::vector<phosg::be_uint32_t> pixels;
+  pixels.reserve(w * h);
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      pixels.emplace_back(img.read(x, y));
+    }
+  }
+
+  EntryFileHeader header;
+  header.magic = ENTRY_FILE_MAGIC;
+  header.version = ENTRY_FILE_VERSION;
+  header.width = w;
+  header.height = h;
+
+  // Renderers can decode the same image on multiple threads (or in multiple processes), so the entry is written
+  // atomically to keep them from seeing (or writing) a partial entry
+  write_file_atomic(filename, [&](FILE* f) -> void {
+    phosg::fwritex(f, &header, sizeof(header));
+    phosg::fwritex(f, pixels.data(), pixels.size() * sizeof(phosg::be_uint32_t));
+  });
+}
+
+std::shared_ptr<const phosg::ImageRGBA8888N> DecodedImageCache::get(
+    const std::string& file_key,
+    uint32_t type,
+    int16_t id,
+    const std::string& options,
+    uint64_t source_hash,
+    const std::function<std::shared_ptr<const phosg::ImageRGBA8888N>()>& decode) {
+  Key key{file_key, type, id, options};
+  {
+    std::lock_guard g(this->lock);
+    auto it = this->entries.find(key);
+    if (it != this->entries.end()) {
+      this->stats_data.memory_hits++;
+      return it->second;
+    }
+  }
+
+  std::string filename;
+  std::shared_ptr<const phosg::ImageRGBA8888N> ret;
+  bool from_disk = false;
+  if (!this->directory.empty()) {
+    filename = this->filename_for_entry(key, source_hash);
+    ret = this->load_entry(filename);
+    from_disk = (ret != nullptr);
+  }
+  if (!from_disk) {
+    ret = decode();
+    if (ret && !filename.empty()) {
+      try {
+        this->save_entry(filename, *ret);
+      } catch (const std::exception& e) {
+        // Failing to write the cache isn't fatal; the image just has to be decoded again next time
+        phosg::log_warning_f("Cannot write decoded image cache file {}: {}", filename, e.what());
+      }
+    }
+  }
+
+  // If another thread decoded the same image in the meantime, use its result so all callers share one object
+  std::lock_guard g(this->lock);
+  auto [it, inserted] = this->entries.emplace(std::move(key), std::move(ret));
+  if (inserted) {
+    if (from_disk) {
+      this->stats_data.disk_hits++;
+    } else {
+      this->stats_data.misses++;
+    }
+  } else {
+    this->stats_data.memory_hits++;
+  }
+  return it->second;
+}
+
+std::shared_ptr<const phosg::ImageRGBA8888N> DecodedImageCache::get_resource(
+    const std::string& file_key,
+    const ResourceFile& rf,
+    uint32_t type,
+    int16_t id,
+    const std::string& options,
+    const std::function<phosg::ImageRGBA8888N(const ResourceFile::Resource&)>& decode) {
+  std::shared_ptr<const ResourceFile::Resource> res;
+  uint64_t source_hash = 0;
+  if (rf.resource_exists(type, id)) {
+    res = rf.get_resource(type, id);
+    source_hash = phosg::fnv1a64(res->data.data(), res->data.size());
+  }
+  return this->get(file_key, type, id, options, source_hash, [&]() -> std::shared_ptr<const phosg::ImageRGBA8888N> {
+    if (!res) {
+      return nullptr;
+    }
+    return std::make_shared<phosg::ImageRGBA8888N>(decode(*res));
+  });
+}
+
+bool DecodedImageCache::was_requested(const std::string& file_key, uint32_t type, int16_t id) const {
+  std::lock_guard g(this->lock);
+  for (const auto& it : this->entries) {
+    if ((it.first.id == id) && (it.first.type == type) && (it.first.file_key == file_key)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DecodedImageCache::Stats DecodedImageCache::stats() const {
+  std::lock_guard g(this->lock);
+  return this->stats_data;
+}
+
+} // namespace ResourceDASM
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <phosg/Image.hh>
+#include <string>
+#include <unordered_map>
+
+#include "ResourceFile.hh"
+
+namespace ResourceDASM {
+
+// A cache of decoded images, for tools (like the level renderers) that use the same images many times. Entries are
+// identified by the file they came from, the resource type and ID, and a string describing any decode options or
+// post-processing steps that affect the result (for example, "white_transparent"); callers can use any strings they
+// like here, as long as different decodings of the same resource have different option strings.
+//
+// If a directory is given, decoded images are also stored there (one file per image), so later runs don't have to
+// decode them again. Each entry's filename includes a hash of the source data and of the decoders version (see
+// DecodedImageCache.cc), so entries for resources that have since changed, or that were decoded by an older version
+// of the decoders, are simply never used again. As with the sample cache, nothing is ever deleted from the directory;
+// to purge it (e.g. to reclaim the space used by stale entries), delete the directory or the .dimc files in it. This
+// is always safe, even while a renderer is using the directory; the images will just be decoded again.
+//
+// All functions are thread-safe. Decoding happens outside the cache's lock, so multiple threads can decode different
+// images at the same time.
+class DecodedImageCache {
+public:
+  struct Stats {
+    size_t memory_hits = 0;
+    size_t disk_hits = 0;
+    size_t misses = 0;
+  };
+
+  // If directory is empty, the cache is process-local (memory only)
+  explicit DecodedImageCache(const std::string& directory = "");
+  DecodedImageCache(const DecodedImageCache&) = delete;
+  DecodedImageCache(DecodedImageCache&&) = delete;
+  DecodedImageCache& operator=(const DecodedImageCache&) = delete;
+  DecodedImageCache& operator=(DecodedImageCache&&) = delete;
+  ~DecodedImageCache() = default;
+
+  inline const std::string& get_directory() const {
+    return this->directory;
+  }
+
+  // Returns the cached image for the given key, or calls decode and caches the result. source_hash should be a hash
+  // of all the data the decoded image depends on (e.g. the resource data and the color table); it is not needed for
+  // lookups within a single process, but makes stale on-disk entries unreachable. If decode returns nullptr (e.g.
+  // because the resource doesn't exist), that result is cached in memory but not on disk.
+  std::shared_ptr<const phosg::ImageRGBA8888N> get(
+      const std::string& file_key,
+      uint32_t type,
+      int16_t id,
+      const std::string& options,
+      uint64_t source_hash,
+      const std::function<std::shared_ptr<const phosg::ImageRGBA8888N>()>& decode);
+
+  // Like get(), but for images decoded from a single resource. The source hash is computed from the resource's data,
+  // and nullptr is returned (and cached) if the resource doesn't exist.
+  std::shared_ptr<const phosg::ImageRGBA8888N> get_resource(
+      const std::string& file_key,
+      const ResourceFile& rf,
+      uint32_t type,
+      int16_t id,
+      const std::string& options,
+      const std::function<phosg::ImageRGBA8888N(const ResourceFile::Resource&)>& decode);
+
+  // Returns true if the given resource was requested with any options at any point in this process (whether or not
+  // it existed)
+  bool was_requested(const std::string& file_key, uint32_t type, int16_t id) const;
+
+  Stats stats() const;
+
+private:
+  struct Key {
+    std::string file_key;
+    uint32_t type;
+    int16_t id;
+    std::string options;
+
+    bool operator==(const Key& other) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const;
+  };
+
+  std::string filename_for_entry(const Key& key, uint64_t source_hash) const;
+  std::shared_ptr<const phosg::ImageRGBA8888N> load_entry(const std::string& filename) const;
+  void save_entry(const std::string& filename, const phosg::ImageRGBA8888N& img) const;
+
+  std::string directory;
+
+  mutable std::mutex lock;
+  std::unordered_map<Key, std::shared_ptr<const phosg::ImageRGBA8888N>, KeyHash> entries;
+  Stats stats_data;
+};
+
+} // namespace ResourceDASM
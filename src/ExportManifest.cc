@@ -0,0 +1,150 @@
+#include "ExportManifest.hh"
+
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "AtomicFile.hh"
+
+namespace ResourceDASM {
+
+// Manifest file format:
+//   ManifestHeader
+//   For each file:
+//     ManifestFileEntry
+//     path (path_size bytes)
+//     outputs (num_outputs strings)
+//     For each resource:
+//       ManifestResourceEntry
+//       outputs (num_outputs strings)
+// where each string is a le_uint32_t size followed by that many bytes.
+
+static constexpr uint32_t MANIFEST_MAGIC = 0x5244584D; // 'RDXM'
+static constexpr uint32_t MANIFEST_VERSION = 1;
+
+struct ManifestHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_uint64_t options_hash_high;
+  phosg::le_uint64_t options_hash_low;
+  phosg::le_uint64_t num_files;
+} __attribute__((packed));
+
+struct ManifestFileEntry {
+  phosg::le_uint64_t size;
+  phosg::le_int64_t mtime;
+  phosg::le_uint32_t path_size;
+  phosg::le_uint32_t num_outputs;
+  phosg::le_uint32_t num_resources;
+  uint8_t exported;
+  uint8_t unused[3];
+} __attribute__((packed));
+
+struct ManifestResourceEntry {
+  phosg::le_uint32_t type;
+  phosg::le_int16_t id;
+  uint8_t exported;
+  uint8_t context_dependent;
+  phosg::le_uint64_t key_high;
+  phosg::le_uint64_t key_low;
+  phosg::le_uint32_t num_outputs;
+} __attribute__((packed));
+
+const ExportManifest::Resource* ExportManifest::File::find_resource(uint32_t type, int16_t id) const {
+  auto it = std::lower_bound(this->resources.begin(), this->resources.end(), std::make_pair(type, id),
+      [](const Resource& res, const std::pair<uint32_t, int16_t>& key) -> bool {
+        return std::make_pair(res.type, res.id) < key;
+      });
+  return ((it != this->resources.end()) && (it->type == type) && (it->id == id)) ? &*it : nullptr;
+}
+
+ExportManifest::ExportManifest(const ContentHash& options_hash) : options_hash(options_hash) {}
+
+static std::vector<std::string> read_strings(phosg::StringReader& r, size_t count) {
+  std::vector<std::string> ret;
+  ret.reserve(count);
+  for (size_t z = 0; z < count; z++) {
+    ret.emplace_back(r.read(r.get<phosg::le_uint32_t>()));
+  }
+  return ret;
+}
+
+static void write_strings(phosg::StringWriter& w, const std::vector<std::string>& strs) {
+  for (const auto& s : strs) {
+    w.put<phosg::le_uint32_t>(s.size());
+    w.write(s);
+  }
+}
+
+ExportManifest ExportManifest::load(const std::string& filename, const ContentHash& options_hash) {
+  ExportManifest ret(options_hash);
+
+  std::string data;
+  try {
+    data = phosg::load_file(filename);
+  } catch (const phosg::cannot_open_file&) {
+    return ret;
+  }
+
+  try {
+    phosg::StringReader r(data);
+    const auto& header = r.get<ManifestHeader>();
+    if ((header.magic != MANIFEST_MAGIC) || (header.version != MANIFEST_VERSION)) {
+      throw std::runtime_error("unknown file format");
+    }
+    if ((header.options_hash_high != options_hash.high) || (header.options_hash_low != options_hash.low)) {
+      phosg::fwrite_fmt(stderr, "note: export options have changed since {} was written; exporting everything\n",
+          filename);
+      return ret;
+    }
+    for (size_t z = 0; z < header.num_files; z++) {
+      const auto& file_entry = r.get<ManifestFileEntry>();
+      std::string path = r.read(file_entry.path_size);
+      File& file = ret.files[path];
+      file.size = file_entry.size;
+      file.mtime = file_entry.mtime;
+      file.exported = file_entry.exported;
+      file.outputs = read_strings(r, file_entry.num_outputs);
+      file.resources.reserve(file_entry.num_resources);
+      for (size_t y = 0; y < file_entry.num_resources; y++) {
+        const auto& res_entry = r.get<ManifestResourceEntry>();
+        auto& res = file.resources.emplace_back(Resource{res_entry.type, res_entry.id,
+            ContentHash{res_entry.key_high, res_entry.key_low}, !!res_entry.exported, !!res_entry.context_dependent,
+            {}});
+        res.outputs = read_strings(r, res_entry.num_outputs);
+      }
+      std::sort(file.resources.begin(), file.resources.end(), [](const Resource& a, const Resource& b) -> bool {
+        return std::make_pair(a.type, a.id) < std::make_pair(b.type, b.id);
+      });
+    }
+  } catch (const std::exception& e) {
+    phosg::fwrite_fmt(stderr, "warning: ignoring export manifest {} ({})\n", filename, e.what());
+    ret.files.clear();
+  }
+  return ret;
+}
+
+void ExportManifest::save(const std::string& filename) const {
+  phosg::StringWriter w;
+  w.put<ManifestHeader>(ManifestHeader{
+      MANIFEST_MAGIC, MANIFEST_VERSION, this->options_hash.high, this->options_hash.low, this->files.size()});
+  for (const auto& [path, file] : this->files) {
+    w.put<ManifestFileEntry>(ManifestFileEntry{
+        file.size, file.mtime, path.size(), file.outputs.size(), file.resources.size(), file.exported, {}});
+    w.write(path);
+    write_strings(w, file.outputs);
+    for (const auto& res : file.resources) {
+      w.put<ManifestResourceEntry>(ManifestResourceEntry{res.type, res.id, res.exported, res.context_dependent,
+          res.key.high, res.key.low, res.outputs.size()});
+      write_strings(w, res.outputs);
+    }
+  }
+
+  save_file_atomic(filename, w.str());
+}
+
+} // namespace ResourceDASM
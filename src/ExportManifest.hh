@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ContentHash.hh"
+
+namespace ResourceDASM {
+
+// Records what resource_dasm exported from each input file into an output directory, so a later export into the same
+// directory can skip files (and resources) whose outputs are already up to date. Input files are identified by their
+// path, size, and modification time; resources are identified by a key that the exporter computes from their data and
+// the options that affect their outputs. Output filenames are stored relative to the output directory.
+//
+// The whole manifest is tied to a hash of the export options (and the decoders' version); if it doesn't match, load()
+// returns an empty manifest, so everything is exported again.
+class ExportManifest {
+public:
+  struct Resource {
+    uint32_t type;
+    int16_t id;
+    ContentHash key;
+    // The exporter's result for this resource (which may be false even if some files were written)
+    bool exported;
+    // True if the outputs depend on other resources in the same file, so they're only up to date if the entire file
+    // is unchanged
+    bool context_dependent;
+    std::vector<std::string> outputs;
+  };
+
+  struct File {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool exported = false;
+    // Outputs generated from the file as a whole (e.g. the smssynth environment template), not from one resource
+    std::vector<std::string> outputs;
+    std::vector<Resource> resources; // Sorted by type, then by ID
+
+    // Returns nullptr if the resource isn't in the manifest
+    const Resource* find_resource(uint32_t type, int16_t id) const;
+  };
+
+  ExportManifest() = default;
+  explicit ExportManifest(const ContentHash& options_hash);
+
+  // Returns an empty manifest (with the given options hash) if the file doesn't exist, can't be parsed, or was
+  // written with different options
+  static ExportManifest load(const std::string& filename, const ContentHash& options_hash);
+  void save(const std::string& filename) const;
+
+  ContentHash options_hash;
+  std::unordered_map<std::string, File> files;
+};
+
+} // namespace ResourceDASM
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <string>
+
+// This is header-only because it's used by tools that don't link with the resource_file library (gcmasm, gcmdump,
+// and rcfdump).
+
+namespace ResourceDASM {
+
+static constexpr size_t COPY_CHUNK_SIZE = 0x100000;
+
+// Copies size bytes from src_fd at src_offset to dest_fd at dest_offset, without reading more than COPY_CHUNK_SIZE
+// bytes into memory at once. This uses only positioned reads and writes, so multiple threads can call it with the same
+// fds, as long as the destination ranges don't overlap.
+inline void copy_fd_range(int src_fd, uint64_t src_offset, int dest_fd, uint64_t dest_offset, uint64_t size) {
+  off_t src_pos = src_offset;
+  off_t dest_pos = dest_offset;
+  uint64_t remaining = size;
+#ifdef __linux__
+  // copy_file_range copies the data within the kernel, and on filesystems that support reflinks it can share the
+  // source file's extents instead of copying them at all. It isn't supported for all combinations of filesystems; if
+  // it fails for that reason, fall through to the read/write loop below, which continues where this one left off.
+  while (remaining > 0) {
+    ssize_t bytes_copied = copy_file_range(src_fd, &src_pos, dest_fd, &dest_pos, remaining, 0);
+    if (bytes_copied < 0) {
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        break;
+      }
+      throw std::runtime_error(std::format("cannot copy data: {}", strerror(errno)));
+    } else if (bytes_copied == 0) {
+      throw std::runtime_error("source data ends before the end of the range to copy");
+    }
+    remaining -= bytes_copied;
+  }
+#endif
+
+  std::string buffer(std::min<uint64_t>(remaining, COPY_CHUNK_SIZE), '\0');
+  while (remaining > 0) {
+    size_t chunk_size = std::min<uint64_t>(remaining, buffer.size());
+    phosg::preadx(src_fd, buffer.data(), chunk_size, src_pos);
+    phosg::pwritex(dest_fd, buffer.data(), chunk_size, dest_pos);
+    src_pos += chunk_size;
+    dest_pos += chunk_size;
+    remaining -= chunk_size;
+  }
+}
+
+} // namespace ResourceDASM
@@ -0,0 +1,95 @@
+#include "ForkWriter.hh"
+
+#include <filesystem>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+
+namespace ResourceDASM {
+
+ForkWriter::ForkWriter(const std::string& output_filename, bool separate)
+    : data_filename(output_filename + (separate ? ".data" : "")),
+      resource_filename(output_filename + (separate ? ".rsrc" : "/..namedfork/rsrc")),
+      separate(separate) {}
+
+ForkWriter::~ForkWriter() {
+  this->close_files();
+}
+
+FILE* ForkWriter::data_file() {
+  if (!this->data_f) {
+    this->data_f = fopen(this->data_filename.c_str(), "wb");
+    if (!this->data_f) {
+      throw phosg::cannot_open_file(this->data_filename);
+    }
+    this->data_created = true;
+  }
+  return this->data_f;
+}
+
+FILE* ForkWriter::resource_file() {
+  if (!this->resource_f) {
+    // A file's resource fork can't be opened unless the file itself exists
+    if (!this->separate) {
+      this->data_file();
+    }
+    this->resource_f = fopen(this->resource_filename.c_str(), "wb");
+    if (!this->resource_f) {
+      throw phosg::cannot_open_file(this->resource_filename);
+    }
+    this->resource_created = true;
+  }
+  return this->resource_f;
+}
+
+void ForkWriter::write_data(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  phosg::fwritex(this->data_file(), data, size);
+}
+
+void ForkWriter::write_resource(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  phosg::fwritex(this->resource_file(), data, size);
+}
+
+void ForkWriter::close_files() {
+  if (this->resource_f) {
+    fclose(this->resource_f);
+    this->resource_f = nullptr;
+  }
+  if (this->data_f) {
+    fclose(this->data_f);
+    this->data_f = nullptr;
+  }
+}
+
+void ForkWriter::finish() {
+  this->data_file();
+  this->resource_file();
+  bool failed = fclose(this->resource_f) != 0;
+  this->resource_f = nullptr;
+  failed |= fclose(this->data_f) != 0;
+  this->data_f = nullptr;
+  if (failed) {
+    throw std::runtime_error("cannot close output file");
+  }
+}
+
+void ForkWriter::abort() {
+  this->close_files();
+  // Without separate, the resource fork is part of the data file, so deleting the data file deletes both forks
+  std::error_code ec;
+  if (this->separate && this->resource_created) {
+    std::filesystem::remove(this->resource_filename, ec);
+  }
+  if (this->data_created) {
+    std::filesystem::remove(this->data_filename, ec);
+  }
+  this->data_created = false;
+  this->resource_created = false;
+}
+
+} // namespace ResourceDASM
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <string>
+
+namespace ResourceDASM {
+
+// Writes a file's data and resource forks as they're decoded, either to output_filename and its resource fork, or to
+// output_filename.data and output_filename.rsrc if separate is true. Each output file is created only when the first
+// data is written to it (or by finish(), if its fork is empty), so nothing is created if the input is found to be
+// invalid before any fork data is decoded. If decoding fails after that, call abort() to delete the files that were
+// already created, so no partial output is left behind.
+class ForkWriter {
+public:
+  ForkWriter(const std::string& output_filename, bool separate);
+  ForkWriter(const ForkWriter&) = delete;
+  ForkWriter(ForkWriter&&) = delete;
+  ForkWriter& operator=(const ForkWriter&) = delete;
+  ForkWriter& operator=(ForkWriter&&) = delete;
+  ~ForkWriter();
+
+  void write_data(const void* data, size_t size);
+  void write_resource(const void* data, size_t size);
+
+  // Creates the output files for any empty forks and closes all output files
+  void finish();
+  // Closes and deletes all output files that were created
+  void abort();
+
+private:
+  std::string data_filename;
+  std::string resource_filename;
+  bool separate;
+  FILE* data_f = nullptr;
+  FILE* resource_f = nullptr;
+  bool data_created = false;
+  bool resource_created = false;
+
+  FILE* data_file();
+  FILE* resource_file();
+  void close_files();
+};
+
+} // namespace ResourceDASM
@@ -1,6 +1,8 @@
 #include "ImageSaver.hh"
 
+#include <algorithm>
 #include <cstring>
+#include <stdexcept>
 
 namespace ResourceDASM {
 
@@ -20,4 +22,65 @@ bool ImageSaver::process_cli_arg(const char* arg) {
   return false;
 }
 
+ImageWriteQueue::ImageWriteQueue(const ImageSaver& saver, size_t max_pending)
+    : image_format(saver.image_format),
+      max_pending(std::max<size_t>(max_pending, 1)),
+      writer_thread(&ImageWriteQueue::thread_fn, this) {}
+
+ImageWriteQueue::~ImageWriteQueue() {
+  try {
+    this->finish();
+  } catch (const std::exception&) {
+  }
+}
+
+void ImageWriteQueue::enqueue(const std::string& file_name, std::string&& data) {
+  std::unique_lock g(this->lock);
+  if (this->should_exit) {
+    throw std::logic_error("cannot save images after the write queue is finished");
+  }
+  this->queue_changed.wait(g, [&]() -> bool { return this->queue.size() < this->max_pending; });
+  this->queue.emplace_back(file_name, std::move(data));
+  this->queue_changed.notify_all();
+}
+
+void ImageWriteQueue::finish() {
+  {
+    std::lock_guard g(this->lock);
+    this->should_exit = true;
+    this->queue_changed.notify_all();
+  }
+  if (this->writer_thread.joinable()) {
+    this->writer_thread.join();
+  }
+  if (this->first_error) {
+    std::rethrow_exception(std::exchange(this->first_error, nullptr));
+  }
+}
+
+void ImageWriteQueue::thread_fn() {
+  std::unique_lock g(this->lock);
+  for (;;) {
+    this->queue_changed.wait(g, [&]() -> bool { return this->should_exit || !this->queue.empty(); });
+    if (this->queue.empty()) {
+      return; // should_exit is set and everything has been written
+    }
+    auto item = std::move(this->queue.front());
+    this->queue.pop_front();
+    this->queue_changed.notify_all();
+
+    g.unlock();
+    try {
+      phosg::save_file(item.first, item.second);
+    } catch (const std::exception&) {
+      g.lock();
+      if (!this->first_error) {
+        this->first_error = std::current_exception();
+      }
+      continue;
+    }
+    g.lock();
+  }
+}
+
 } // namespace ResourceDASM
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
 
 namespace ResourceDASM {
 
@@ -27,6 +35,11 @@ public:
   // Returns whether arg was processed
   bool process_cli_arg(const char* arg);
 
+  // Returns the extension (without the leading .) that save_image adds to filenames
+  inline std::string file_extension() const {
+    return file_extension_for_image_format(this->image_format);
+  }
+
   // Returns the filename *with* extension (e.g. for logging)
   template <phosg::PixelFormat Format>
   [[nodiscard]] std::string save_image(const phosg::Image<Format>& img, const std::string& file_name_without_ext) const {
@@ -41,7 +54,50 @@ public:
   }
 
 private:
+  friend class ImageWriteQueue;
+
   phosg::ImageFormat image_format;
 };
 
+// Saves images on a background thread, for tools that render many images (possibly on many threads) and shouldn't
+// wait for each file to be written before starting on the next image. Images are serialized on the calling thread,
+// since that's usually the expensive part (especially for PNGs); at most max_pending serialized images are held in
+// memory, and save_image blocks while the queue is full.
+class ImageWriteQueue {
+public:
+  explicit ImageWriteQueue(const ImageSaver& saver, size_t max_pending = 8);
+  ImageWriteQueue(const ImageWriteQueue&) = delete;
+  ImageWriteQueue(ImageWriteQueue&&) = delete;
+  ImageWriteQueue& operator=(const ImageWriteQueue&) = delete;
+  ImageWriteQueue& operator=(ImageWriteQueue&&) = delete;
+  ~ImageWriteQueue();
+
+  // Returns the filename *with* extension, like ImageSaver::save_image. The file may not exist yet when this returns.
+  // This function is thread-safe.
+  template <phosg::PixelFormat Format>
+  std::string save_image(const phosg::Image<Format>& img, const std::string& file_name_without_ext) {
+    std::string file_name = file_name_without_ext + "." + file_extension_for_image_format(this->image_format);
+    this->enqueue(file_name, img.serialize(this->image_format));
+    return file_name;
+  }
+
+  // Waits for all queued images to be written, then stops the writer thread. If any write failed, rethrows the first
+  // failure's exception. The destructor does the same, but ignores failures.
+  void finish();
+
+private:
+  void enqueue(const std::string& file_name, std::string&& data);
+  void thread_fn();
+
+  phosg::ImageFormat image_format;
+  size_t max_pending;
+
+  std::mutex lock;
+  std::condition_variable queue_changed;
+  std::deque<std::pair<std::string, std::string>> queue;
+  bool should_exit = false;
+  std::exception_ptr first_error;
+  std::thread writer_thread;
+};
+
 } // namespace ResourceDASM
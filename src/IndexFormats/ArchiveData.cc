@@ -0,0 +1,87 @@
+#include "Formats.hh"
+
+#include <phosg/Platform.hh>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef PHOSG_WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <string>
+
+namespace ResourceDASM {
+
+std::shared_ptr<const ArchiveData> ArchiveData::map_file(const std::string& filename) {
+  auto ret = std::shared_ptr<ArchiveData>(new ArchiveData());
+#ifndef PHOSG_WINDOWS
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw phosg::cannot_open_file(filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      ret->map_data = reinterpret_cast<const uint8_t*>(data);
+      ret->map_size = st.st_size;
+      ret->is_mapped = true;
+    }
+  }
+  close(fd);
+  if (ret->is_mapped) {
+    return ret;
+  }
+#endif
+  // mmap isn't available (or the file is empty), so just read the file into memory
+  ret->owned_data = phosg::load_file(filename);
+  ret->map_data = reinterpret_cast<const uint8_t*>(ret->owned_data.data());
+  ret->map_size = ret->owned_data.size();
+  return ret;
+}
+
+std::shared_ptr<const ArchiveData> ArchiveData::from_string(std::string&& data) {
+  auto ret = std::shared_ptr<ArchiveData>(new ArchiveData());
+  ret->owned_data = std::move(data);
+  ret->map_data = reinterpret_cast<const uint8_t*>(ret->owned_data.data());
+  ret->map_size = ret->owned_data.size();
+  return ret;
+}
+
+std::shared_ptr<const ArchiveData> ArchiveData::view(const void* data, size_t size) {
+  auto ret = std::shared_ptr<ArchiveData>(new ArchiveData());
+  ret->map_data = reinterpret_cast<const uint8_t*>(data);
+  ret->map_size = size;
+  return ret;
+}
+
+ArchiveData::~ArchiveData() {
+#ifndef PHOSG_WINDOWS
+  if (this->is_mapped) {
+    munmap(const_cast<uint8_t*>(this->map_data), this->map_size);
+  }
+#endif
+}
+
+std::string ArchiveData::read(size_t offset, size_t size) const {
+  if ((offset > this->map_size) || (size > this->map_size - offset)) {
+    throw std::out_of_range("resource data is beyond end of archive");
+  }
+  return std::string(reinterpret_cast<const char*>(this->map_data + offset), size);
+}
+
+std::function<std::string()> ArchiveData::loader(size_t offset, size_t size) const {
+  // Like StringReader::pread, this clamps the range to the end of the archive, so a resource that extends past the end
+  // (e.g. in a truncated archive) gets whatever data is present, instead of making the entire archive unreadable
+  offset = std::min(offset, this->map_size);
+  size = std::min(size, this->map_size - offset);
+  return [self = this->shared_from_this(), offset, size]() -> std::string {
+    return self->read(offset, size);
+  };
+}
+
+} // namespace ResourceDASM
@@ -9,6 +9,7 @@
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 #include "../TextCodecs.hh"
 
@@ -49,123 +50,254 @@ static uint16_t checksum(const void* data, size_t size, uint16_t crc = 0) {
   return crc;
 }
 
-DecodedBinHex parse_binhex(const std::string& data) {
-  size_t sentinel_offset = data.find("(This file must be converted with BinHex ");
-  if (sentinel_offset == std::string_view::npos) {
-    throw std::runtime_error("Input is not BinHex-encoded");
+static const std::string BINHEX_SENTINEL = "(This file must be converted with BinHex ";
+
+// Decoded fork data is passed to the write functions in chunks of at most this size
+static constexpr size_t OUTPUT_CHUNK_SIZE = 0x10000;
+
+BinHexDecoder::BinHexDecoder(WriteFn write_data_fork, WriteFn write_resource_fork)
+    : write_data_fork(std::move(write_data_fork)),
+      write_resource_fork(std::move(write_resource_fork)) {}
+
+void BinHexDecoder::write(const void* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t z = 0; z < size; z++) {
+    this->on_input_char(bytes[z]);
   }
-  // The sentinel string must start at the beginning of the file or the beginning of a line
-  if ((sentinel_offset == 0) || ((data[sentinel_offset - 1] != '\n') && (data[sentinel_offset - 1] == '\r'))) {
-    throw std::runtime_error("Input is not BinHex-encoded");
+  this->flush_output();
+}
+
+void BinHexDecoder::write(const std::string& data) {
+  this->write(data.data(), data.size());
+}
+
+void BinHexDecoder::finish() {
+  switch (this->input_state) {
+    case InputState::FIND_SENTINEL:
+      throw std::runtime_error("Input is not BinHex-encoded");
+    case InputState::FIND_SENTINEL_END:
+      throw std::runtime_error("No newline follows BinHex sentinel");
+    case InputState::FIND_START:
+      throw std::runtime_error("BinHex sentinel is not followed by start byte");
+    case InputState::DATA:
+      throw std::runtime_error("BinHex data segment is not terminated");
+    case InputState::DONE:
+      break;
   }
-  size_t start_offset = data.find(')', sentinel_offset + 41);
-  if (start_offset == std::string_view::npos) {
-    throw std::runtime_error("No newline follows BinHex sentinel");
+  if (this->output_state != OutputState::DONE) {
+    throw std::runtime_error("BinHex data is truncated");
   }
-  phosg::StringReader r(data);
-  r.go(start_offset + 1);
+}
 
-  // Skip any return characters after the sentinel text
-  while (is_return(r.get_u8(false))) {
-    r.skip(1);
-  }
+void BinHexDecoder::on_input_char(uint8_t v) {
+  switch (this->input_state) {
+    case InputState::FIND_SENTINEL:
+      // The sentinel string must start at the beginning of the file or the beginning of a line. Only the beginning of
+      // each line is kept, so this uses a constant amount of memory even if there's a lot of text before the sentinel
+      if (is_return(v)) {
+        this->line_prefix.clear();
+      } else if (this->line_prefix.size() < BINHEX_SENTINEL.size()) {
+        this->line_prefix.push_back(v);
+        if (this->line_prefix == BINHEX_SENTINEL) {
+          this->line_prefix.clear();
+          this->input_state = InputState::FIND_SENTINEL_END;
+        }
+      }
+      break;
 
-  if (r.get_u8() != ':') {
-    throw std::runtime_error("BinHex sentinel is not followed by start byte");
-  }
+    case InputState::FIND_SENTINEL_END:
+      if (v == ')') {
+        this->input_state = InputState::FIND_START;
+      }
+      break;
 
-  // Decode 6-bit encoding (similar to base64)
-  std::string decoded;
-  size_t input_char_count = 0;
-  uint8_t pending_bits = 0;
-  for (;;) {
-    uint8_t v = r.get_u8();
-    if (is_return(v)) {
-      continue;
-    } else if (v == ':') {
+    case InputState::FIND_START:
+      // Skip any return characters after the sentinel text
+      if (v == ':') {
+        this->input_state = InputState::DATA;
+      } else if (!is_return(v)) {
+        throw std::runtime_error("BinHex sentinel is not followed by start byte");
+      }
+      break;
+
+    case InputState::DATA: {
+      // Decode 6-bit encoding (similar to base64)
+      if (is_return(v)) {
+        break;
+      } else if (v == ':') {
+        this->input_state = InputState::DONE;
+        break;
+      }
+      int8_t decoded = BINHEX_DECODE_MAP[v];
+      if (decoded < 0) {
+        throw std::runtime_error("Invalid character in BinHex data segment");
+      } else if ((this->input_char_count & 3) == 0) {
+        this->pending_bits = decoded << 2;
+      } else if ((this->input_char_count & 3) == 1) {
+        this->on_decoded_byte(this->pending_bits | (decoded >> 4));
+        this->pending_bits = decoded << 4;
+      } else if ((this->input_char_count & 3) == 2) {
+        this->on_decoded_byte(this->pending_bits | (decoded >> 2));
+        this->pending_bits = decoded << 6;
+      } else {
+        this->on_decoded_byte(this->pending_bits | decoded);
+        // Don't need to clear pending_bits here since the 0 case above will overwrite it
+      }
+      this->input_char_count++;
       break;
-    } else if (BINHEX_DECODE_MAP[v] < 0) {
-      throw std::runtime_error("Invalid character in BinHex data segment");
-    } else if ((input_char_count & 3) == 0) {
-      pending_bits = BINHEX_DECODE_MAP[v] << 2;
-    } else if ((input_char_count & 3) == 1) {
-      decoded.push_back(pending_bits | (BINHEX_DECODE_MAP[v] >> 4));
-      pending_bits = BINHEX_DECODE_MAP[v] << 4;
-    } else if ((input_char_count & 3) == 2) {
-      decoded.push_back(pending_bits | (BINHEX_DECODE_MAP[v] >> 2));
-      pending_bits = BINHEX_DECODE_MAP[v] << 6;
-    } else {
-      decoded.push_back(pending_bits | BINHEX_DECODE_MAP[v]);
-      // Don't need to clear pending_bits here since the 0 case above will overwrite it
     }
-    input_char_count++;
+
+    case InputState::DONE:
+      break; // Anything after the end of the data segment is ignored
   }
+}
 
+void BinHexDecoder::on_decoded_byte(uint8_t v) {
   // Decode BinHex RLE
-  std::string decompressed;
-  phosg::StringReader decoded_r(decoded);
-  while (!decoded_r.eof()) {
-    uint8_t v = decoded_r.get_u8();
-    if (v == 0x90) {
-      size_t count = decoded_r.get_u8();
-      if (count == 0) {
-        decompressed.push_back(0x90);
-      } else {
-        decompressed.resize(decompressed.size() + count - 1, decompressed.back());
-      }
+  if (this->rle_marker_pending) {
+    this->rle_marker_pending = false;
+    if (v == 0) {
+      this->on_decompressed_byte(0x90);
+    } else if (!this->has_last_byte) {
+      throw std::runtime_error("BinHex data begins with a repeat marker");
     } else {
-      decompressed.push_back(v);
+      for (size_t z = 1; z < v; z++) {
+        this->on_decompressed_byte(this->last_byte);
+      }
     }
+  } else if (v == 0x90) {
+    this->rle_marker_pending = true;
+  } else {
+    this->on_decompressed_byte(v);
   }
+}
 
-  // Parse the header
-  phosg::StringReader decompressed_r(decompressed);
-  DecodedBinHex ret;
-  ret.file_name = decode_mac_roman(decompressed_r.read(decompressed_r.get_u8()), true);
-  if (decompressed_r.get_u8() != 0) {
+void BinHexDecoder::on_decompressed_byte(uint8_t v) {
+  this->last_byte = v;
+  this->has_last_byte = true;
+
+  switch (this->output_state) {
+    case OutputState::HEADER:
+      // The header is 1 byte (name length), the name, then 21 more bytes (including the checksum)
+      this->header_data.push_back(v);
+      if (this->header_data.size() == static_cast<size_t>(static_cast<uint8_t>(this->header_data[0])) + 22) {
+        this->parse_header();
+      }
+      break;
+
+    case OutputState::DATA_FORK:
+    case OutputState::RESOURCE_FORK:
+      if (this->fork_bytes_remaining == 0) {
+        this->checksum_data.push_back(v);
+        if (this->checksum_data.size() == 2) {
+          this->end_fork();
+        }
+      } else {
+        this->output_data.push_back(v);
+        this->fork_bytes_remaining--;
+        if (this->output_data.size() >= OUTPUT_CHUNK_SIZE) {
+          this->flush_output();
+        }
+      }
+      break;
+
+    case OutputState::DONE:
+      break; // Anything after the resource fork's checksum is ignored
+  }
+}
+
+void BinHexDecoder::parse_header() {
+  phosg::StringReader r(this->header_data);
+  this->decoded_header.file_name = decode_mac_roman(r.read(r.get_u8()), true);
+  if (r.get_u8() != 0) {
     throw std::runtime_error("Incorrect filename format in decoded header");
   }
-  ret.file_type = decompressed_r.get_u32b();
-  ret.creator_code = decompressed_r.get_u32b();
-  ret.finder_flags = decompressed_r.get_u16b();
-  size_t data_fork_size = decompressed_r.get_u32b();
-  size_t resource_fork_size = decompressed_r.get_u32b();
-  size_t header_checksum_offset = decompressed_r.where();
-  uint16_t header_checksum = decompressed_r.get_u16b();
-  ret.data_fork = decompressed_r.read(data_fork_size);
-  uint16_t data_fork_checksum = decompressed_r.get_u16b();
-  ret.resource_fork = decompressed_r.read(resource_fork_size);
-  uint16_t resource_fork_checksum = decompressed_r.get_u16b();
-
-  // Check checksums
-  uint16_t computed_header_checksum = checksum(
-      decompressed_r.pgetv(0, header_checksum_offset), header_checksum_offset);
+  this->decoded_header.file_type = r.get_u32b();
+  this->decoded_header.creator_code = r.get_u32b();
+  this->decoded_header.finder_flags = r.get_u16b();
+  this->data_fork_size = r.get_u32b();
+  this->resource_fork_size = r.get_u32b();
+  size_t header_checksum_offset = r.where();
+  uint16_t header_checksum = r.get_u16b();
+
+  uint16_t computed_header_checksum = checksum(this->header_data.data(), header_checksum_offset);
   computed_header_checksum = checksum("\0\0", 2, computed_header_checksum);
   if (header_checksum != computed_header_checksum) {
     throw std::runtime_error(std::format("Header checksum is incorrect (expected 0x{:04X}, received 0x{:04X})",
         computed_header_checksum, header_checksum));
   }
 
-  uint16_t computed_data_fork_checksum = checksum(ret.data_fork.data(), ret.data_fork.size());
-  computed_data_fork_checksum = checksum("\0\0", 2, computed_data_fork_checksum);
-  if (data_fork_checksum != computed_data_fork_checksum) {
-    throw std::runtime_error(std::format("Data fork checksum is incorrect (expected 0x{:04X}, received 0x{:04X})",
-        computed_data_fork_checksum, data_fork_checksum));
+  this->header_data.clear();
+  this->output_state = OutputState::DATA_FORK;
+  this->fork_bytes_remaining = this->data_fork_size;
+  this->fork_checksum = 0;
+  this->checksum_data.clear();
+}
+
+void BinHexDecoder::flush_output() {
+  if (this->output_data.empty()) {
+    return;
   }
+  this->fork_checksum = checksum(this->output_data.data(), this->output_data.size(), this->fork_checksum);
+  const auto& write_fn = (this->output_state == OutputState::DATA_FORK)
+      ? this->write_data_fork
+      : this->write_resource_fork;
+  if (write_fn) {
+    write_fn(this->output_data.data(), this->output_data.size());
+  }
+  this->output_data.clear();
+}
+
+void BinHexDecoder::end_fork() {
+  this->flush_output();
 
-  uint16_t computed_resource_fork_checksum = checksum(ret.resource_fork.data(), ret.resource_fork.size());
-  computed_resource_fork_checksum = checksum("\0\0", 2, computed_resource_fork_checksum);
-  if (resource_fork_checksum != computed_resource_fork_checksum) {
-    throw std::runtime_error(std::format("Resource fork checksum is incorrect (expected 0x{:04X}, received 0x{:04X})",
-        computed_resource_fork_checksum, resource_fork_checksum));
+  uint16_t expected_checksum = phosg::StringReader(this->checksum_data).get_u16b();
+  uint16_t computed_checksum = checksum("\0\0", 2, this->fork_checksum);
+  bool is_data_fork = (this->output_state == OutputState::DATA_FORK);
+  if (expected_checksum != computed_checksum) {
+    throw std::runtime_error(std::format("{} fork checksum is incorrect (expected 0x{:04X}, received 0x{:04X})",
+        is_data_fork ? "Data" : "Resource", computed_checksum, expected_checksum));
   }
 
+  this->checksum_data.clear();
+  this->fork_checksum = 0;
+  if (is_data_fork) {
+    this->output_state = OutputState::RESOURCE_FORK;
+    this->fork_bytes_remaining = this->resource_fork_size;
+  } else {
+    this->output_state = OutputState::DONE;
+  }
+}
+
+DecodedBinHex parse_binhex(const std::string& data) {
+  DecodedBinHex ret;
+  BinHexDecoder decoder(
+      [&](const void* fork_data, size_t size) -> void {
+        ret.data_fork.append(reinterpret_cast<const char*>(fork_data), size);
+      },
+      [&](const void* fork_data, size_t size) -> void {
+        ret.resource_fork.append(reinterpret_cast<const char*>(fork_data), size);
+      });
+  decoder.write(data);
+  decoder.finish();
+
+  const auto& header = decoder.header();
+  ret.file_name = header.file_name;
+  ret.file_type = header.file_type;
+  ret.creator_code = header.creator_code;
+  ret.finder_flags = header.finder_flags;
   return ret;
 }
 
 ResourceFile parse_binhex_resource_fork(const std::string& data) {
-  auto decoded = parse_binhex(data);
-  return parse_resource_fork(decoded.resource_fork);
+  // The data fork isn't needed, so don't keep it in memory
+  std::string resource_fork;
+  BinHexDecoder decoder(nullptr, [&](const void* fork_data, size_t size) -> void {
+    resource_fork.append(reinterpret_cast<const char*>(fork_data), size);
+  });
+  decoder.write(data);
+  decoder.finish();
+  return parse_resource_fork(resource_fork);
 }
 
 } // namespace ResourceDASM
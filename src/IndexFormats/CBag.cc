@@ -20,8 +20,8 @@ struct CBagEntry {
   char name[0x3F];
 } __attribute__((packed));
 
-ResourceFile parse_cbag(const std::string& data) {
-  phosg::StringReader r(data);
+ResourceFile parse_cbag(std::shared_ptr<const ArchiveData> data) {
+  phosg::StringReader r = data->reader();
 
   uint32_t count = r.get_u32b();
 
@@ -29,11 +29,17 @@ ResourceFile parse_cbag(const std::string& data) {
   for (size_t z = 0; z < count; z++) {
     const auto& entry = r.get<CBagEntry>();
     std::string name(entry.name, std::min<size_t>(sizeof(entry.name), entry.name_length));
-    std::string data = r.pread(entry.data_offset, entry.data_size);
-    ResourceFile::Resource res(entry.type, entry.id, 0, std::move(name), std::move(data));
-    ret.add(std::move(res));
+    auto res = std::make_shared<ResourceFile::Resource>(entry.type, entry.id, 0, std::move(name), std::string());
+    ret.add_unloaded(res, data->loader(entry.data_offset, entry.data_size));
   }
   return ret;
 }
 
+ResourceFile parse_cbag(const std::string& data) {
+  // The caller's string may not outlive the returned ResourceFile, so copy all the resources' data now
+  auto ret = parse_cbag(ArchiveData::view(data.data(), data.size()));
+  ret.load_all_data(1);
+  return ret;
+}
+
 } // namespace ResourceDASM
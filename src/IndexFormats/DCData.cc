@@ -4,6 +4,7 @@
 
 #include <phosg/Encoding.hh>
 #include <phosg/Strings.hh>
+#include <stdexcept>
 #include <string>
 
 #include "../ResourceFile.hh"
@@ -23,17 +24,29 @@ struct ResourceEntry {
   phosg::be_int16_t id;
 } __attribute__((packed));
 
-ResourceFile parse_dc_data(const std::string& data) {
-  phosg::StringReader r(data);
+ResourceFile parse_dc_data(std::shared_ptr<const ArchiveData> data) {
+  phosg::StringReader r = data->reader();
   const auto& h = r.get<ResourceHeader>();
 
   ResourceFile ret(IndexFormat::DC_DATA);
   for (size_t x = 0; x < h.resource_count; x++) {
     const auto& e = r.get<ResourceEntry>();
-    ret.add(ResourceFile::Resource(e.type, e.id, r.preadx(e.offset, e.size)));
+    // Unlike the other archive formats, DC Data archives have always been rejected if any entry extends past the end
+    if ((e.offset > data->size()) || (e.size > data->size() - e.offset)) {
+      throw std::out_of_range("resource data is beyond end of archive");
+    }
+    auto res = std::make_shared<ResourceFile::Resource>(e.type, e.id, std::string());
+    ret.add_unloaded(res, data->loader(e.offset, e.size));
   }
 
   return ret;
 }
 
+ResourceFile parse_dc_data(const std::string& data) {
+  // The caller's string may not outlive the returned ResourceFile, so copy all the resources' data now
+  auto ret = parse_dc_data(ArchiveData::view(data.data(), data.size()));
+  ret.load_all_data(1);
+  return ret;
+}
+
 } // namespace ResourceDASM
@@ -3,35 +3,102 @@
 #include <stdint.h>
 
 #include <filesystem>
+#include <optional>
 #include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <string>
+#include <vector>
 
+#include "../AtomicFile.hh"
 #include "../ResourceFile.hh"
 #include "../TextCodecs.hh"
 
 namespace ResourceDASM {
 
-ResourceFile load_resource_file_from_directory(const std::string& dir_path) {
-  ResourceFile ret;
+// Directory index file format:
+//   DirectoryIndexHeader
+//   For each type directory:
+//     DirectoryIndexTypeEntry
+//     directory name (dir_name_size bytes)
+//     For each resource:
+//       DirectoryIndexResourceEntry
+//       filename (filename_size bytes)
+//       resource name (name_size bytes)
+// The modification times of the directories are used to tell if the index is stale: adding, removing, or renaming a
+// resource file changes the modification time of its type directory, and adding or removing a type directory changes
+// the modification time of the top-level directory. (Changing a resource file's contents doesn't change either, but
+// that doesn't matter, since the index doesn't include any data.)
+
+static constexpr uint32_t DIRECTORY_INDEX_MAGIC = 0x52444449; // 'RDDI'
+static constexpr uint32_t DIRECTORY_INDEX_VERSION = 1;
+
+struct DirectoryIndexHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_int64_t dir_mtime;
+  phosg::le_uint32_t num_types;
+} __attribute__((packed));
+
+struct DirectoryIndexTypeEntry {
+  phosg::le_uint32_t type;
+  phosg::le_int64_t dir_mtime;
+  phosg::le_uint32_t dir_name_size;
+  phosg::le_uint32_t num_resources;
+} __attribute__((packed));
+
+struct DirectoryIndexResourceEntry {
+  phosg::le_int16_t id;
+  phosg::le_uint16_t unused;
+  phosg::le_uint32_t filename_size;
+  phosg::le_uint32_t name_size;
+} __attribute__((packed));
+
+struct IndexedResource {
+  int16_t id;
+  std::string name;
+  std::string filename; // Within the type's directory
+};
+
+struct IndexedTypeDirectory {
+  uint32_t type;
+  int64_t dir_mtime;
+  std::string dir_name;
+  std::vector<IndexedResource> resources;
+};
+
+struct DirectoryIndex {
+  int64_t dir_mtime;
+  std::vector<IndexedTypeDirectory> types;
+};
+
+static int64_t mtime_for_path(const std::filesystem::path& path) {
+  return std::filesystem::last_write_time(path).time_since_epoch().count();
+}
+
+static DirectoryIndex scan_directory(const std::string& dir_path) {
+  DirectoryIndex index;
+  index.dir_mtime = mtime_for_path(dir_path);
   for (const auto& type_item : std::filesystem::directory_iterator(dir_path)) {
     if (!type_item.is_directory()) {
       continue;
     }
 
-    std::string type_item_name = type_item.path().filename().string();
-    uint32_t type = resource_type_for_raw_string(unescape_hex_bytes_for_filename(type_item_name));
+    auto& type_dir = index.types.emplace_back();
+    type_dir.dir_name = type_item.path().filename().string();
+    type_dir.type = resource_type_for_raw_string(unescape_hex_bytes_for_filename(type_dir.dir_name));
+    type_dir.dir_mtime = mtime_for_path(type_item.path());
+
+    const auto& ext_it = ResourceFile::raw_filename_extension_for_type.find(type_dir.type);
+    std::string file_extension = (ext_it != ResourceFile::raw_filename_extension_for_type.end())
+        ? std::format(".{}", ext_it->second)
+        : ".bin";
 
-    for (const auto& res_item : std::filesystem::directory_iterator(std::filesystem::path(dir_path) / type_item_name)) {
+    for (const auto& res_item : std::filesystem::directory_iterator(type_item.path())) {
       if (!res_item.is_regular_file()) {
         continue;
       }
 
-      const auto& ext_it = ResourceFile::raw_filename_extension_for_type.find(type);
-      std::string file_extension = (ext_it != ResourceFile::raw_filename_extension_for_type.end())
-          ? std::format(".{}", ext_it->second)
-          : ".bin";
-
       std::string res_item_name = res_item.path().filename().string();
       if (!res_item_name.ends_with(file_extension)) {
         continue;
@@ -39,37 +106,151 @@ ResourceFile load_resource_file_from_directory(const std::string& dir_path) {
 
       // Filename is eiher like 20.bin (ID only) or 20_Resource_name.bin (ID + name; name has _XX => escaped byte).
       // Trim off the extension first
+      auto& res = type_dir.resources.emplace_back();
+      res.filename = res_item_name;
       res_item_name.resize(res_item_name.size() - file_extension.size());
 
       size_t offset = 0;
       int32_t res_id = stol(res_item_name, &offset, 10);
       if (res_id < -0x8000 || res_id > 0x7FFF) {
-        throw std::runtime_error(std::format("Invalid resource ID: {}/{}.bin", type_item_name, res_item_name));
+        throw std::runtime_error(std::format("Invalid resource ID: {}/{}.bin", type_dir.dir_name, res_item_name));
       }
       if (offset > res_item_name.size()) {
-        throw std::runtime_error(std::format("Invalid resource filename (parse error): {}/{}.bin", type_item_name, res_item_name));
+        throw std::runtime_error(std::format(
+            "Invalid resource filename (parse error): {}/{}.bin", type_dir.dir_name, res_item_name));
       }
+      res.id = res_id;
 
-      std::string res_name;
       if (offset < res_item_name.size()) {
         // Has resource name
         if (res_item_name[offset] != '_') {
-          throw std::runtime_error(std::format("Invalid resource filename (missing separator): {}/{}.bin", type_item_name, res_item_name));
+          throw std::runtime_error(std::format(
+              "Invalid resource filename (missing separator): {}/{}.bin", type_dir.dir_name, res_item_name));
         }
-        res_name = unescape_hex_bytes_for_filename(res_item_name.substr(offset + 1));
+        res.name = unescape_hex_bytes_for_filename(res_item_name.substr(offset + 1));
+      }
+    }
+  }
+  return index;
+}
+
+// Returns nullopt if the index file doesn't exist, can't be parsed, or doesn't match the directory
+static std::optional<DirectoryIndex> load_directory_index(
+    const std::string& index_filename, const std::string& dir_path) {
+  std::string data;
+  try {
+    data = phosg::load_file(index_filename);
+  } catch (const phosg::cannot_open_file&) {
+    return std::nullopt;
+  }
+
+  try {
+    DirectoryIndex index;
+    phosg::StringReader r(data);
+    const auto& header = r.get<DirectoryIndexHeader>();
+    if ((header.magic != DIRECTORY_INDEX_MAGIC) || (header.version != DIRECTORY_INDEX_VERSION)) {
+      throw std::runtime_error("unknown file format");
+    }
+    index.dir_mtime = header.dir_mtime;
+    if (index.dir_mtime != mtime_for_path(dir_path)) {
+      return std::nullopt;
+    }
+    for (size_t z = 0; z < header.num_types; z++) {
+      const auto& type_entry = r.get<DirectoryIndexTypeEntry>();
+      auto& type_dir = index.types.emplace_back();
+      type_dir.type = type_entry.type;
+      type_dir.dir_mtime = type_entry.dir_mtime;
+      type_dir.dir_name = r.readx(type_entry.dir_name_size);
+      std::filesystem::path type_dir_path = std::filesystem::path(dir_path) / type_dir.dir_name;
+      if (!std::filesystem::is_directory(type_dir_path) || (type_dir.dir_mtime != mtime_for_path(type_dir_path))) {
+        return std::nullopt;
+      }
+      type_dir.resources.reserve(type_entry.num_resources);
+      for (size_t y = 0; y < type_entry.num_resources; y++) {
+        const auto& res_entry = r.get<DirectoryIndexResourceEntry>();
+        auto& res = type_dir.resources.emplace_back();
+        res.id = res_entry.id;
+        res.filename = r.readx(res_entry.filename_size);
+        res.name = r.readx(res_entry.name_size);
+      }
+    }
+    return index;
+
+  } catch (const std::exception& e) {
+    phosg::log_warning_f("Ignoring directory index {} ({})", index_filename, e.what());
+    return std::nullopt;
+  }
+}
+
+static void save_directory_index(const std::string& index_filename, const DirectoryIndex& index) {
+  phosg::StringWriter w;
+  DirectoryIndexHeader header;
+  header.magic = DIRECTORY_INDEX_MAGIC;
+  header.version = DIRECTORY_INDEX_VERSION;
+  header.dir_mtime = index.dir_mtime;
+  header.num_types = index.types.size();
+  w.put<DirectoryIndexHeader>(header);
+  for (const auto& type_dir : index.types) {
+    DirectoryIndexTypeEntry type_entry;
+    type_entry.type = type_dir.type;
+    type_entry.dir_mtime = type_dir.dir_mtime;
+    type_entry.dir_name_size = type_dir.dir_name.size();
+    type_entry.num_resources = type_dir.resources.size();
+    w.put<DirectoryIndexTypeEntry>(type_entry);
+    w.write(type_dir.dir_name);
+    for (const auto& res : type_dir.resources) {
+      DirectoryIndexResourceEntry res_entry;
+      res_entry.id = res.id;
+      res_entry.unused = 0;
+      res_entry.filename_size = res.filename.size();
+      res_entry.name_size = res.name.size();
+      w.put<DirectoryIndexResourceEntry>(res_entry);
+      w.write(res.filename);
+      w.write(res.name);
+    }
+  }
+
+  save_file_atomic(index_filename, w.str());
+}
+
+ResourceFile load_resource_file_from_directory(const std::string& dir_path, const std::string& index_filename) {
+  // The resource index is built from the filenames alone; each resource's file is only read when the resource is
+  // requested (or when the caller uses ResourceFile::load_data to read many of them at once)
+  std::optional<DirectoryIndex> index;
+  if (!index_filename.empty()) {
+    index = load_directory_index(index_filename, dir_path);
+  }
+  if (!index) {
+    index = scan_directory(dir_path);
+    if (!index_filename.empty()) {
+      try {
+        save_directory_index(index_filename, *index);
+      } catch (const std::exception& e) {
+        // Failing to write the index isn't fatal; the directory just has to be scanned again next time
+        phosg::log_warning_f("Cannot write directory index {}: {}", index_filename, e.what());
       }
+    }
+  }
 
+  ResourceFile ret;
+  for (auto& type_dir : index->types) {
+    std::filesystem::path type_dir_path = std::filesystem::path(dir_path) / type_dir.dir_name;
+    for (auto& indexed_res : type_dir.resources) {
       auto res = std::make_shared<ResourceFile::Resource>();
-      res->type = type;
-      res->id = res_id;
+      res->type = type_dir.type;
+      res->id = indexed_res.id;
       res->flags = 0;
-      res->name = res_name;
-      res->data = phosg::load_file(res_item.path().string());
-      // Hack: the PICT file format has 0x200 unused bytes before the header, but the resource format omits this field
-      if (res->type == RESOURCE_TYPE_PICT) {
-        res->data = res->data.substr(0x200);
-      }
-      ret.add(res);
+      res->name = std::move(indexed_res.name);
+      std::string path = (type_dir_path / indexed_res.filename).string();
+      ret.add_unloaded(res, [path = std::move(path), type = type_dir.type]() -> std::string {
+        std::string data = phosg::load_file(path);
+        // Hack: the PICT file format has 0x200 unused bytes before the header, but the resource format omits this
+        // field
+        if (type == RESOURCE_TYPE_PICT) {
+          data = data.substr(0x200);
+        }
+        return data;
+      });
     }
   }
 
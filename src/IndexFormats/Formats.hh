@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <memory>
 #include <phosg/Strings.hh>
 #include <string>
 #include <utility>
@@ -32,6 +37,50 @@ DecodedAppleSingle parse_applesingle_appledouble(phosg::StringReader& r);
 DecodedAppleSingle parse_applesingle_appledouble(const std::string& data);
 ResourceFile parse_applesingle_appledouble_resource_fork(const std::string& data);
 
+// ArchiveData.cc
+// The contents of an archive file (Mohawk, HIRF, DC Data, or CBag). Parsers given one of these don't copy each
+// resource's data when parsing the index; instead, the data is copied out of the archive only when the resource is
+// first requested (see ResourceFile::add_unloaded), so listing or extracting a few resources from a large archive
+// doesn't need a second copy of all of it in memory. Each unloaded resource holds a reference to the ArchiveData, so
+// the file stays mapped until all of them have been loaded or the ResourceFile is destroyed.
+class ArchiveData : public std::enable_shared_from_this<ArchiveData> {
+public:
+  // Memory-maps the file if possible; otherwise, reads it into memory
+  static std::shared_ptr<const ArchiveData> map_file(const std::string& filename);
+  static std::shared_ptr<const ArchiveData> from_string(std::string&& data);
+  // Does not copy the data; the caller must keep it alive until all resources that refer to it have been loaded
+  static std::shared_ptr<const ArchiveData> view(const void* data, size_t size);
+  ArchiveData(const ArchiveData&) = delete;
+  ArchiveData(ArchiveData&&) = delete;
+  ArchiveData& operator=(const ArchiveData&) = delete;
+  ArchiveData& operator=(ArchiveData&&) = delete;
+  ~ArchiveData();
+
+  inline const void* data() const {
+    return this->map_data;
+  }
+  inline size_t size() const {
+    return this->map_size;
+  }
+  inline phosg::StringReader reader() const {
+    return phosg::StringReader(this->map_data, this->map_size);
+  }
+
+  // Throws std::out_of_range if the range isn't entirely within the archive
+  std::string read(size_t offset, size_t size) const;
+  // Returns a function that reads the given range, for use with ResourceFile::add_unloaded. The range is clamped to
+  // the end of the archive (as StringReader::pread does), so this never throws.
+  std::function<std::string()> loader(size_t offset, size_t size) const;
+
+private:
+  ArchiveData() = default;
+
+  const uint8_t* map_data = nullptr;
+  size_t map_size = 0;
+  bool is_mapped = false;
+  std::string owned_data;
+};
+
 // BinHex.cc
 struct DecodedBinHex {
   std::string file_name;
@@ -41,32 +90,222 @@ struct DecodedBinHex {
   uint32_t creator_code;
   uint16_t finder_flags;
 };
+
+// Decodes a BinHex file incrementally. The input can be given in chunks of any size, and the decoded fork data is
+// passed to the write functions as it's decoded (the data fork first, then the resource fork), so decoding needs only
+// a small, fixed amount of memory regardless of the file's size. Either write function may be null, in which case
+// that fork's data is discarded. Checksums are verified as each part of the file ends; if one is incorrect, write()
+// throws, but the fork's data will already have been passed to its write function.
+class BinHexDecoder {
+public:
+  using WriteFn = std::function<void(const void* data, size_t size)>;
+
+  BinHexDecoder(WriteFn write_data_fork, WriteFn write_resource_fork);
+  BinHexDecoder(const BinHexDecoder&) = delete;
+  BinHexDecoder(BinHexDecoder&&) = delete;
+  BinHexDecoder& operator=(const BinHexDecoder&) = delete;
+  BinHexDecoder& operator=(BinHexDecoder&&) = delete;
+  ~BinHexDecoder() = default;
+
+  void write(const void* data, size_t size);
+  void write(const std::string& data);
+  // Throws if the input ended before the entire file was decoded
+  void finish();
+
+  // Returns true once the header has been decoded, which happens before any fork data is written. The header's
+  // data_fork and resource_fork fields are always empty.
+  inline bool header_available() const {
+    return (this->output_state != OutputState::HEADER);
+  }
+  inline const DecodedBinHex& header() const {
+    return this->decoded_header;
+  }
+  inline uint32_t get_data_fork_size() const {
+    return this->data_fork_size;
+  }
+  inline uint32_t get_resource_fork_size() const {
+    return this->resource_fork_size;
+  }
+
+private:
+  enum class InputState {
+    FIND_SENTINEL = 0,
+    FIND_SENTINEL_END,
+    FIND_START,
+    DATA,
+    DONE,
+  };
+  enum class OutputState {
+    HEADER = 0,
+    DATA_FORK,
+    RESOURCE_FORK,
+    DONE,
+  };
+
+  void on_input_char(uint8_t v);
+  void on_decoded_byte(uint8_t v);
+  void on_decompressed_byte(uint8_t v);
+  void parse_header();
+  void flush_output();
+  void end_fork();
+
+  WriteFn write_data_fork;
+  WriteFn write_resource_fork;
+
+  InputState input_state = InputState::FIND_SENTINEL;
+  std::string line_prefix;
+  size_t input_char_count = 0;
+  uint8_t pending_bits = 0;
+  bool rle_marker_pending = false;
+  bool has_last_byte = false;
+  uint8_t last_byte = 0;
+
+  OutputState output_state = OutputState::HEADER;
+  std::string header_data;
+  DecodedBinHex decoded_header;
+  uint32_t data_fork_size = 0;
+  uint32_t resource_fork_size = 0;
+  uint32_t fork_bytes_remaining = 0;
+  uint16_t fork_checksum = 0;
+  std::string checksum_data;
+  std::string output_data; // Decoded but not yet passed to the write function
+};
+
 DecodedBinHex parse_binhex(const std::string& data);
 ResourceFile parse_binhex_resource_fork(const std::string& data);
 
 // CBag.cc
 ResourceFile parse_cbag(const std::string& data);
+ResourceFile parse_cbag(std::shared_ptr<const ArchiveData> data);
 
 // DCData.cc
 ResourceFile parse_dc_data(const std::string& data);
+ResourceFile parse_dc_data(std::shared_ptr<const ArchiveData> data);
 
 // Directory.cc
-ResourceFile load_resource_file_from_directory(const std::string& dir_path);
+// If index_filename is given, the list of resources is cached in that file, so later loads of the same directory don't
+// have to list the contents of every type directory (the cache is used only if none of the directories have changed).
+// Resource data is read lazily; see ResourceFile::add_unloaded.
+ResourceFile load_resource_file_from_directory(const std::string& dir_path, const std::string& index_filename = "");
 void save_resource_file_to_directory(const ResourceFile& rf, const std::string& dir_path);
 
 // HIRF.cc
 ResourceFile parse_hirf(const std::string& data);
+ResourceFile parse_hirf(std::shared_ptr<const ArchiveData> data);
 
 // MacBinary.cc
 std::pair<phosg::StringReader, phosg::StringReader> parse_macbinary(const std::string& data);
+
+// Decodes a MacBinary file incrementally, like BinHexDecoder does for BinHex files. The forks' data isn't buffered; the
+// write functions are called with parts of the input as soon as they're given to write().
+class MacBinaryDecoder {
+public:
+  using WriteFn = std::function<void(const void* data, size_t size)>;
+
+  MacBinaryDecoder(WriteFn write_data_fork, WriteFn write_resource_fork);
+  MacBinaryDecoder(const MacBinaryDecoder&) = delete;
+  MacBinaryDecoder(MacBinaryDecoder&&) = delete;
+  MacBinaryDecoder& operator=(const MacBinaryDecoder&) = delete;
+  MacBinaryDecoder& operator=(MacBinaryDecoder&&) = delete;
+  ~MacBinaryDecoder() = default;
+
+  // Throws if the header is invalid (as soon as all of it has been received)
+  void write(const void* data, size_t size);
+  void write(const std::string& data);
+  // Throws if the input ended before the end of either fork
+  void finish();
+
+  inline bool header_available() const {
+    return (this->offset >= 0x80);
+  }
+  inline uint32_t get_data_fork_size() const {
+    return this->data_fork_size;
+  }
+  inline uint32_t get_resource_fork_size() const {
+    return this->resource_fork_size;
+  }
+
+private:
+  void advance(const uint8_t*& bytes, size_t& size, size_t count);
+
+  WriteFn write_data_fork;
+  WriteFn write_resource_fork;
+
+  size_t offset = 0; // Number of input bytes received so far
+  std::string header_data;
+  size_t data_fork_offset = 0;
+  uint32_t data_fork_size = 0;
+  size_t resource_fork_offset = 0;
+  uint32_t resource_fork_size = 0;
+};
+
 ResourceFile parse_macbinary_resource_fork(const std::string& data);
 
 // Mohawk.cc
 ResourceFile parse_mohawk(const std::string& data);
+ResourceFile parse_mohawk(std::shared_ptr<const ArchiveData> data);
 
 // ResourceFork.cc
 ResourceFile parse_resource_fork(const std::string& data);
 ResourceFile parse_resource_fork(phosg::StringReader& data);
 std::string serialize_resource_fork(const ResourceFile& rf);
 
+// Edits a resource fork file without rewriting all of it. Only the fork's header and resource map are read when the
+// editor is created, and save() writes only the data of added resources, a new resource map, and the header; the data
+// of existing resources is never moved. The previous resource map and the data of deleted resources are left in the
+// file as unused space, which compact() removes by rewriting the entire file.
+class ResourceForkEditor {
+public:
+  // The file must exist, but may be empty
+  explicit ResourceForkEditor(const std::string& filename);
+  ResourceForkEditor(const ResourceForkEditor&) = delete;
+  ResourceForkEditor(ResourceForkEditor&&) = delete;
+  ResourceForkEditor& operator=(const ResourceForkEditor&) = delete;
+  ResourceForkEditor& operator=(ResourceForkEditor&&) = delete;
+  ~ResourceForkEditor() = default;
+
+  inline const std::string& get_filename() const {
+    return this->filename;
+  }
+  inline size_t size() const {
+    return this->entries.size();
+  }
+
+  // These functions behave like the ResourceFile functions with the same names, except that change_id returns false
+  // if a resource with the new ID already exists. Changes aren't written to the file until save() or compact() is
+  // called.
+  bool resource_exists(uint32_t type, int16_t id) const;
+  bool add(ResourceFile::Resource&& res);
+  bool remove(uint32_t type, int16_t id);
+  bool change_id(uint32_t type, int16_t current_id, int16_t new_id);
+  bool rename(uint32_t type, int16_t id, const std::string& new_name);
+
+  // Writes all changes to the file. Returns the number of bytes written (zero if nothing has changed).
+  size_t save();
+  // Writes all changes to the file and removes all unused space from it. This reads the data of every resource and
+  // rewrites the entire file. Returns the number of bytes written.
+  size_t compact();
+
+private:
+  struct Entry {
+    uint8_t flags;
+    std::string name;
+    // Relative to the start of the data segment; only used if new_data is null
+    uint32_t data_offset;
+    // Data that hasn't been written to the file yet
+    std::shared_ptr<const std::string> new_data;
+  };
+
+  void load();
+
+  std::string filename;
+  uint32_t resource_data_offset;
+  // The end of the resource data segment or the resource map, whichever is later. New data is written here.
+  uint64_t append_offset;
+  uint16_t map_attributes;
+  // Keys are (type, id), so the entries are in the order they're written to the resource map
+  std::map<std::pair<uint32_t, int16_t>, Entry> entries;
+  bool modified;
+};
+
 } // namespace ResourceDASM
@@ -34,8 +34,8 @@ struct HIRFTopLevelResourceHeader {
   // uint32_t size;
 } __attribute__((packed));
 
-ResourceFile parse_hirf(const std::string& data) {
-  phosg::StringReader r(data.data(), data.size());
+ResourceFile parse_hirf(std::shared_ptr<const ArchiveData> data) {
+  phosg::StringReader r = data->reader();
 
   const auto& header = r.get<HIRFFileHeader>();
   if (header.magic != 0x4952455A) {
@@ -51,8 +51,8 @@ ResourceFile parse_hirf(const std::string& data) {
     std::string name = r.read(res_header.name_length);
     uint32_t size = r.get_u32b();
 
-    ResourceFile::Resource res(res_header.type, res_header.id, r.read(size));
-    ret.add(std::move(res));
+    auto res = std::make_shared<ResourceFile::Resource>(res_header.type, res_header.id, std::string());
+    ret.add_unloaded(res, data->loader(r.where(), size));
 
     r.go(res_header.next_res_offset);
   }
@@ -60,4 +60,11 @@ ResourceFile parse_hirf(const std::string& data) {
   return ret;
 }
 
+ResourceFile parse_hirf(const std::string& data) {
+  // The caller's string may not outlive the returned ResourceFile, so copy all the resources' data now
+  auto ret = parse_hirf(ArchiveData::view(data.data(), data.size()));
+  ret.load_all_data(1);
+  return ret;
+}
+
 } // namespace ResourceDASM
@@ -2,9 +2,11 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <phosg/Encoding.hh>
 #include <phosg/Strings.hh>
 #include <string>
+#include <utility>
 
 #include "../ResourceFile.hh"
 
@@ -126,11 +128,7 @@ struct MacBinaryHeader {
   }
 } __attribute__((packed));
 
-std::pair<phosg::StringReader, phosg::StringReader> parse_macbinary(const std::string& data) {
-  phosg::StringReader r(data);
-
-  const auto& header = r.get<MacBinaryHeader>();
-
+static void check_header(const MacBinaryHeader& header) {
   // First, check some fields that are common to all versions
   header.assert_valid();
 
@@ -142,16 +140,98 @@ std::pair<phosg::StringReader, phosg::StringReader> parse_macbinary(const std::s
       throw std::runtime_error("input is not a MacBinary file");
     }
   }
+}
+
+// Data blocks always start on an 0x80-byte boundary
+static size_t data_fork_offset_for_header(const MacBinaryHeader& header) {
+  return ((sizeof(header) + header.extra_header_bytes) + 0x7F) & (~0x7F);
+}
 
-  // Data blocks always start on an 0x80-byte boundary
-  size_t data_fork_offset = ((sizeof(header) + header.extra_header_bytes) + 0x7F) & (~0x7F);
-  size_t resource_fork_offset = ((data_fork_offset + header.data_fork_bytes) + 0x7F) & (~0x7F);
+static size_t resource_fork_offset_for_header(const MacBinaryHeader& header) {
+  return ((data_fork_offset_for_header(header) + header.data_fork_bytes) + 0x7F) & (~0x7F);
+}
+
+std::pair<phosg::StringReader, phosg::StringReader> parse_macbinary(const std::string& data) {
+  phosg::StringReader r(data);
+
+  const auto& header = r.get<MacBinaryHeader>();
+  check_header(header);
+
+  size_t data_fork_offset = data_fork_offset_for_header(header);
+  size_t resource_fork_offset = resource_fork_offset_for_header(header);
 
   phosg::StringReader data_r = r.subx(data_fork_offset, header.data_fork_bytes);
   phosg::StringReader resource_r = r.subx(resource_fork_offset, header.resource_fork_bytes);
   return std::make_pair(data_r, resource_r);
 }
 
+MacBinaryDecoder::MacBinaryDecoder(WriteFn write_data_fork, WriteFn write_resource_fork)
+    : write_data_fork(std::move(write_data_fork)),
+      write_resource_fork(std::move(write_resource_fork)) {}
+
+void MacBinaryDecoder::write(const void* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  while (size > 0) {
+    if (this->offset < sizeof(MacBinaryHeader)) {
+      size_t bytes_to_copy = std::min<size_t>(size, sizeof(MacBinaryHeader) - this->offset);
+      this->header_data.append(reinterpret_cast<const char*>(bytes), bytes_to_copy);
+      this->advance(bytes, size, bytes_to_copy);
+      if (this->offset == sizeof(MacBinaryHeader)) {
+        const auto* header = reinterpret_cast<const MacBinaryHeader*>(this->header_data.data());
+        check_header(*header);
+        this->data_fork_offset = data_fork_offset_for_header(*header);
+        this->data_fork_size = header->data_fork_bytes;
+        this->resource_fork_offset = resource_fork_offset_for_header(*header);
+        this->resource_fork_size = header->resource_fork_bytes;
+      }
+      continue;
+    }
+
+    // Pass along any bytes that are in either fork, and skip everything else (the secondary header and padding)
+    size_t data_fork_end = this->data_fork_offset + this->data_fork_size;
+    size_t resource_fork_end = this->resource_fork_offset + this->resource_fork_size;
+    if (this->offset < this->data_fork_offset) {
+      this->advance(bytes, size, std::min<size_t>(size, this->data_fork_offset - this->offset));
+    } else if (this->offset < data_fork_end) {
+      size_t bytes_to_write = std::min<size_t>(size, data_fork_end - this->offset);
+      if (this->write_data_fork) {
+        this->write_data_fork(bytes, bytes_to_write);
+      }
+      this->advance(bytes, size, bytes_to_write);
+    } else if (this->offset < this->resource_fork_offset) {
+      this->advance(bytes, size, std::min<size_t>(size, this->resource_fork_offset - this->offset));
+    } else if (this->offset < resource_fork_end) {
+      size_t bytes_to_write = std::min<size_t>(size, resource_fork_end - this->offset);
+      if (this->write_resource_fork) {
+        this->write_resource_fork(bytes, bytes_to_write);
+      }
+      this->advance(bytes, size, bytes_to_write);
+    } else {
+      break; // Anything after the resource fork is ignored
+    }
+  }
+}
+
+void MacBinaryDecoder::write(const std::string& data) {
+  this->write(data.data(), data.size());
+}
+
+void MacBinaryDecoder::finish() {
+  if (!this->header_available()) {
+    throw std::runtime_error("input is not a MacBinary file (header is truncated)");
+  }
+  if ((this->offset < this->data_fork_offset + this->data_fork_size) ||
+      ((this->resource_fork_size > 0) && (this->offset < this->resource_fork_offset + this->resource_fork_size))) {
+    throw std::runtime_error("MacBinary data is truncated");
+  }
+}
+
+void MacBinaryDecoder::advance(const uint8_t*& bytes, size_t& size, size_t count) {
+  bytes += count;
+  size -= count;
+  this->offset += count;
+}
+
 ResourceFile parse_macbinary_resource_fork(const std::string& data) {
   auto r = parse_macbinary(data).second;
   return parse_resource_fork(r);
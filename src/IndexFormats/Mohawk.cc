@@ -139,27 +139,38 @@ struct ResourceDataHeader {
   phosg::be_uint32_t type;
 } __attribute__((packed));
 
-std::string get_resource_data(phosg::StringReader& r, const ResourceEntry& e) {
+// Returns the offset and size of the resource's data within the archive
+static std::pair<uint32_t, uint32_t> get_resource_data_range(phosg::StringReader& r, const ResourceEntry& e) {
   const auto& h = r.pget<ResourceDataHeader>(e.offset);
   if (h.signature != 0x4D48574B) {
     throw std::runtime_error("Mohawk resource entry signature is incorrect");
   }
-  return r.pread(e.offset + sizeof(ResourceDataHeader), h.size - 4);
+  // If h.size is less than 4, the size wraps around, and the loader clamps the range to the end of the archive
+  return std::make_pair(e.offset + sizeof(ResourceDataHeader), h.size - 4);
 }
 
-ResourceFile parse_mohawk(const std::string& data) {
-  phosg::StringReader r(data.data(), data.size());
+ResourceFile parse_mohawk(std::shared_ptr<const ArchiveData> data) {
+  phosg::StringReader r = data->reader();
 
   ResourceFile ret(IndexFormat::MOHAWK);
   std::vector<ResourceEntry> resource_entries = load_index(r);
   for (const auto& e : resource_entries) {
-    // TODO: Some Mohawk versions apparently need just r.pread(e.offset, e.size) here instead of get_resource_data.
-    // (Prince of Persia 2 needs get_resource_data, for example.) Figure out which versions need what, and whether this
-    // is controlled by some header / format flag.
-    ret.add(ResourceFile::Resource{e.type, e.id, get_resource_data(r, e)});
+    // TODO: Some Mohawk versions apparently need just the range (e.offset, e.size) here instead of
+    // get_resource_data_range. (Prince of Persia 2 needs get_resource_data_range, for example.) Figure out which
+    // versions need what, and whether this is controlled by some header / format flag.
+    auto [offset, size] = get_resource_data_range(r, e);
+    auto res = std::make_shared<ResourceFile::Resource>(e.type, e.id, std::string());
+    ret.add_unloaded(res, data->loader(offset, size));
   }
 
   return ret;
 }
 
+ResourceFile parse_mohawk(const std::string& data) {
+  // The caller's string may not outlive the returned ResourceFile, so copy all the resources' data now
+  auto ret = parse_mohawk(ArchiveData::view(data.data(), data.size()));
+  ret.load_all_data(1);
+  return ret;
+}
+
 } // namespace ResourceDASM
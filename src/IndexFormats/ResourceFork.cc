@@ -1,5 +1,7 @@
 #include "Formats.hh"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +10,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <string>
@@ -54,19 +60,14 @@ struct ResourceReferenceListEntry {
   phosg::be_uint32_t reserved;
 } __attribute__((packed));
 
-ResourceFile parse_resource_fork(phosg::StringReader& r) {
-  ResourceFile ret(IndexFormat::RESOURCE_FORK);
-
-  // If the resource fork is empty, treat it as a valid index with no contents
-  if (r.eof()) {
-    return ret;
-  }
-
-  const auto& header = r.pget<ResourceForkHeader>(0);
-  const auto& map_header = r.pget<ResourceMapHeader>(header.resource_map_offset);
+// Calls fn(type, id, flags, name, data_offset) for each resource in the resource map that begins at map_offset in r.
+// data_offset is relative to the start of the resource data segment.
+template <typename FnT>
+static void parse_resource_map(phosg::StringReader& r, size_t map_offset, FnT&& fn) {
+  const auto& map_header = r.pget<ResourceMapHeader>(map_offset);
 
   // Overflow is ok here: the value 0xFFFF actually does mean the list is empty
-  size_t type_list_offset = header.resource_map_offset + map_header.resource_type_list_offset;
+  size_t type_list_offset = map_offset + map_header.resource_type_list_offset;
   uint16_t num_resource_types = r.pget_u16b(type_list_offset) + 1;
 
   std::vector<ResourceTypeListEntry> type_list_entries;
@@ -77,28 +78,41 @@ ResourceFile parse_resource_fork(phosg::StringReader& r) {
   }
 
   for (const auto& type_list_entry : type_list_entries) {
-    size_t base_offset = map_header.resource_type_list_offset +
-        header.resource_map_offset + type_list_entry.reference_list_offset;
+    size_t base_offset = type_list_offset + type_list_entry.reference_list_offset;
     for (size_t x = 0; x <= type_list_entry.num_items; x++) {
       const auto& ref_entry = r.pget<ResourceReferenceListEntry>(base_offset + x * sizeof(ResourceReferenceListEntry));
 
       std::string name;
       if (ref_entry.name_offset != 0xFFFF) {
-        size_t abs_name_offset = header.resource_map_offset + map_header.resource_name_list_offset + ref_entry.name_offset;
+        size_t abs_name_offset = map_offset + map_header.resource_name_list_offset + ref_entry.name_offset;
         uint8_t name_len = r.pget<uint8_t>(abs_name_offset);
         name = r.pread(abs_name_offset + 1, name_len);
       }
 
-      size_t data_offset = header.resource_data_offset + (ref_entry.attributes_and_offset & 0x00FFFFFF);
-      size_t data_size = r.pget_u32b(data_offset);
-      ret.add(ResourceFile::Resource{
-          type_list_entry.resource_type,
+      fn(type_list_entry.resource_type,
           ref_entry.resource_id,
-          static_cast<uint16_t>((ref_entry.attributes_and_offset >> 24) & 0xFF),
-          name,
-          r.preadx(data_offset + 4, data_size)});
+          static_cast<uint8_t>((ref_entry.attributes_and_offset >> 24) & 0xFF),
+          std::move(name),
+          static_cast<uint32_t>(ref_entry.attributes_and_offset & 0x00FFFFFF));
     }
   }
+}
+
+ResourceFile parse_resource_fork(phosg::StringReader& r) {
+  ResourceFile ret(IndexFormat::RESOURCE_FORK);
+
+  // If the resource fork is empty, treat it as a valid index with no contents
+  if (r.eof()) {
+    return ret;
+  }
+
+  const auto& header = r.pget<ResourceForkHeader>(0);
+  parse_resource_map(r, header.resource_map_offset,
+      [&](uint32_t type, int16_t id, uint8_t flags, std::string&& name, uint32_t data_offset) -> void {
+        size_t abs_data_offset = header.resource_data_offset + data_offset;
+        size_t data_size = r.pget_u32b(abs_data_offset);
+        ret.add(ResourceFile::Resource{type, id, flags, std::move(name), r.preadx(abs_data_offset + 4, data_size)});
+      });
 
   return ret;
 }
@@ -108,136 +122,358 @@ ResourceFile parse_resource_fork(const std::string& data) {
   return parse_resource_fork(r);
 }
 
-std::string serialize_resource_fork(const ResourceFile& rf) {
-  // We currently parse an empty resource fork as a valid resource map with no resources. It seems this is what Mac OS
-  // does too, so it should be safe to serialize an empty ResourceFile as an empty string.
-  auto all_res_ids = rf.all_resources();
-  if (all_res_ids.empty()) {
-    return "";
-  }
+struct ResourceMapEntry {
+  uint32_t type;
+  int16_t id;
+  uint8_t flags;
+  const std::string* name;
+  uint32_t data_offset; // Relative to the start of the data segment
+};
+
+// Returns the serialized resource map for the given resources, which must be sorted by type and then by ID
+static std::string serialize_resource_map(const std::vector<ResourceMapEntry>& entries, uint16_t attributes) {
+  // First, compute the size of each section, so the map can be written directly into a buffer of the final size. All
+  // resources of each type are contiguous since the entries are sorted.
+  struct TypeInfo {
+    uint32_t type;
+    size_t count;
+  };
+  std::vector<TypeInfo> types;
+  size_t name_bytes = 0;
+  for (const auto& entry : entries) {
+    if (types.empty() || (types.back().type != entry.type)) {
+      types.emplace_back(TypeInfo{entry.type, 0});
+    }
+    types.back().count++;
 
-  // First, count all resources by type
-  std::unordered_map<uint32_t, size_t> type_to_count;
-  for (const auto& it : all_res_ids) {
-    try {
-      type_to_count.at(it.first)++;
-    } catch (const std::out_of_range&) {
-      type_to_count[it.first] = 1;
+    if (!entry.name->empty()) {
+      if (name_bytes >= 0xFFFF) {
+        throw std::runtime_error("resource name segment is too large");
+      }
+      if (entry.name->size() > 0xFF) {
+        throw std::runtime_error("resource name is too long");
+      }
+      name_bytes += 1 + entry.name->size();
     }
   }
 
-  if (type_to_count.empty()) {
-    throw std::logic_error("no resources present, but did not catch this before");
-  }
-  if (type_to_count.size() > 0xFFFF) {
+  if (types.size() > 0xFFFF) {
     throw std::runtime_error("too many resource types present");
   }
+  size_t type_list_bytes = 2 + sizeof(ResourceTypeListEntry) * types.size();
+  size_t reflist_bytes = sizeof(ResourceReferenceListEntry) * entries.size();
+  size_t name_list_offset = sizeof(ResourceMapHeader) + type_list_bytes + reflist_bytes;
+  if (name_list_offset > 0xFFFF) {
+    throw std::runtime_error("name list offset is too large");
+  }
 
-  phosg::StringWriter type_list_w;
-  type_list_w.put_u16b(type_to_count.size() - 1);
-  size_t type_list_bytes = 2 + (8 * type_to_count.size());
+  std::string ret(name_list_offset + name_bytes, '\0');
+  auto put = [&ret]<typename T>(size_t offset, const T& value) -> void {
+    memcpy(ret.data() + offset, &value, sizeof(T));
+  };
 
-  phosg::StringWriter data_w;
-  phosg::StringWriter names_w;
-  phosg::StringWriter reflist_w;
-  uint64_t current_type = 0xFFFFFFFFFFFFFFFF;
-  for (const auto& it : all_res_ids) {
-    auto res = rf.get_resource(it.first, it.second);
-    if (current_type != res->type) {
-      current_type = res->type;
-      size_t count = type_to_count.at(res->type);
-      if (count == 0) {
-        throw std::logic_error("no resources of this type, but did not catch this before");
-      }
-      if (count > 0xFFFF) {
-        throw std::runtime_error("too many resources of this type");
-      }
-      size_t first_ref_offset = type_list_bytes + reflist_w.size();
-      if (first_ref_offset > 0xFFFF) {
-        throw std::runtime_error("reflist offset for type too large");
-      }
-      size_t start_offset = type_list_bytes + reflist_w.size();
-      if (start_offset > 0xFFFF) {
-        throw std::runtime_error("reference list too large");
-      }
-      ResourceTypeListEntry type_list_entry = {res->type, count - 1, start_offset};
-      type_list_w.put(type_list_entry);
+  ResourceMapHeader map_header;
+  memset(map_header.reserved, 0, sizeof(map_header.reserved));
+  map_header.reserved_handle = 0;
+  map_header.reserved_file_ref_num = 0;
+  map_header.attributes = attributes;
+  map_header.resource_type_list_offset = sizeof(map_header);
+  map_header.resource_name_list_offset = name_list_offset;
+  put(0, map_header);
+
+  size_t type_list_offset = sizeof(ResourceMapHeader);
+  // If there are no resources, this is 0xFFFF, which is correct
+  put(type_list_offset, phosg::be_uint16_t(types.size() - 1));
+  size_t reflist_start_offset = type_list_bytes; // Relative to the start of the type list
+  for (size_t z = 0; z < types.size(); z++) {
+    const auto& type = types[z];
+    if (type.count > 0xFFFF) {
+      throw std::runtime_error("too many resources of this type");
+    }
+    if (reflist_start_offset > 0xFFFF) {
+      throw std::runtime_error("reference list too large");
     }
+    ResourceTypeListEntry type_list_entry = {type.type, type.count - 1, reflist_start_offset};
+    put(type_list_offset + 2 + z * sizeof(ResourceTypeListEntry), type_list_entry);
+    reflist_start_offset += type.count * sizeof(ResourceReferenceListEntry);
+  }
 
+  size_t reflist_offset = type_list_offset + type_list_bytes;
+  size_t names_w_offset = 0; // Relative to the start of the name list
+  for (const auto& entry : entries) {
     ResourceReferenceListEntry reflist_entry;
-    reflist_entry.resource_id = res->id;
+    reflist_entry.resource_id = entry.id;
     reflist_entry.reserved = 0;
-
-    if (data_w.size() > 0x00FFFFFF) {
-      throw std::runtime_error("resource data segment is too large");
-    }
-    if (res->data.size() > 0xFFFFFFFF) {
-      throw std::runtime_error("resource is too large to serialize");
-    }
-    reflist_entry.attributes_and_offset = (res->flags << 24) | data_w.size();
-    data_w.put_u32b(res->data.size());
-    data_w.write(res->data);
-
-    if (!res->name.empty()) {
-      reflist_entry.name_offset = names_w.size();
-      if (names_w.size() >= 0xFFFF) {
-        throw std::runtime_error("resource name segment is too large");
-      }
-      if (res->name.size() > 0xFF) {
-        throw std::runtime_error("resource name is too long");
-      }
-      names_w.put_u8(res->name.size());
-      names_w.write(res->name);
-
+    reflist_entry.attributes_and_offset = (entry.flags << 24) | entry.data_offset;
+    if (!entry.name->empty()) {
+      reflist_entry.name_offset = names_w_offset;
+      ret[name_list_offset + names_w_offset] = entry.name->size();
+      memcpy(ret.data() + name_list_offset + names_w_offset + 1, entry.name->data(), entry.name->size());
+      names_w_offset += 1 + entry.name->size();
     } else {
       reflist_entry.name_offset = 0xFFFF;
     }
+    put(reflist_offset, reflist_entry);
+    reflist_offset += sizeof(ResourceReferenceListEntry);
+  }
 
-    reflist_w.put(reflist_entry);
+  if ((names_w_offset != name_bytes) || (reflist_offset != name_list_offset)) {
+    throw std::logic_error("incorrect amount of data produced for resource map");
   }
+  return ret;
+}
 
-  if (type_list_w.size() != type_list_bytes) {
-    throw std::logic_error("incorrect amount of data produced for type list");
+// Returns a complete resource fork containing the given resources, which must be sorted by type and then by ID.
+// data[z] is the data for entries[z]; the entries' data offsets are filled in by this function.
+static std::string build_resource_fork(
+    std::vector<ResourceMapEntry>& entries, const std::vector<const std::string*>& data, uint16_t map_attributes) {
+  // We currently parse an empty resource fork as a valid resource map with no resources. It seems this is what Mac OS
+  // does too, so it should be safe to serialize an empty resource map as an empty string.
+  if (entries.empty()) {
+    return "";
   }
 
-  phosg::StringWriter main_w;
+  size_t data_bytes = 0;
+  for (size_t z = 0; z < entries.size(); z++) {
+    // The data offset in each reference list entry is only 24 bits
+    if (data_bytes > 0x00FFFFFF) {
+      throw std::runtime_error("resource data segment is too large");
+    }
+    if (data[z]->size() > 0xFFFFFFFF) {
+      throw std::runtime_error("resource is too large to serialize");
+    }
+    entries[z].data_offset = data_bytes;
+    data_bytes += 4 + data[z]->size();
+  }
+  std::string map_data = serialize_resource_map(entries, map_attributes);
 
-  ResourceForkHeader header;
   // Note that a 112-byte reserved header follows the main header, and a 128-byte application zone follows that, so the
   // minimum offsets in the main header's offset fields are 0x00000100. It's not clear if this rule is enforced at load
   // time by the Resource Manager (and we don't enforce it in the parsing function above) but we'll generate the extra
   // space since it's clearly documented in Inside Macintosh.
+  ResourceForkHeader header;
   header.resource_data_offset = 0x100;
-  header.resource_map_offset = data_w.size() + header.resource_data_offset;
-  header.resource_data_size = data_w.size();
-  header.resource_map_size = sizeof(ResourceMapHeader) + type_list_w.size() + reflist_w.size() + names_w.size();
-  main_w.put(header);
-  main_w.extend_to(0x100);
-  main_w.write(data_w.str());
+  header.resource_map_offset = header.resource_data_offset + data_bytes;
+  header.resource_data_size = data_bytes;
+  header.resource_map_size = map_data.size();
+
+  std::string ret(header.resource_map_offset + header.resource_map_size, '\0');
+  memcpy(ret.data(), &header, sizeof(header));
+  for (size_t z = 0; z < entries.size(); z++) {
+    size_t offset = header.resource_data_offset + entries[z].data_offset;
+    phosg::be_uint32_t size = data[z]->size();
+    memcpy(ret.data() + offset, &size, sizeof(size));
+    memcpy(ret.data() + offset + 4, data[z]->data(), data[z]->size());
+  }
+  memcpy(ret.data() + header.resource_map_offset, map_data.data(), map_data.size());
 
-  if (main_w.size() != header.resource_map_offset) {
-    throw std::logic_error("resource map written at incorrect offset");
+  return ret;
+}
+
+std::string serialize_resource_fork(const ResourceFile& rf) {
+  // all_resources() returns resources sorted by type and then by ID, which is the order they're written in
+  auto all_res_ids = rf.all_resources();
+  std::vector<std::shared_ptr<const ResourceFile::Resource>> resources;
+  std::vector<ResourceMapEntry> entries;
+  std::vector<const std::string*> data;
+  resources.reserve(all_res_ids.size());
+  entries.reserve(all_res_ids.size());
+  data.reserve(all_res_ids.size());
+  for (const auto& it : all_res_ids) {
+    const auto& res = resources.emplace_back(rf.get_resource(it.first, it.second));
+    entries.emplace_back(ResourceMapEntry{res->type, res->id, static_cast<uint8_t>(res->flags), &res->name, 0});
+    data.emplace_back(&res->data);
   }
+  return build_resource_fork(entries, data, 0); // TODO: Should the map attributes be a specific value?
+}
 
-  size_t name_list_offset = sizeof(ResourceMapHeader) + type_list_w.size() + reflist_w.size();
-  if (name_list_offset > 0xFFFF) {
-    throw std::runtime_error("name list offset is too large");
+ResourceForkEditor::ResourceForkEditor(const std::string& filename) : filename(filename) {
+  this->load();
+}
+
+void ResourceForkEditor::load() {
+  this->entries.clear();
+  this->modified = false;
+
+  phosg::scoped_fd fd(this->filename, O_RDONLY);
+  uint64_t file_size = std::filesystem::file_size(this->filename);
+
+  // An empty file is a valid resource fork with no resources; if anything is added, it will get the same layout that
+  // serialize_resource_fork would produce
+  if (file_size == 0) {
+    this->resource_data_offset = 0x100;
+    this->append_offset = 0x100;
+    this->map_attributes = 0;
+    return;
   }
 
-  ResourceMapHeader map_header;
-  memset(map_header.reserved, 0, sizeof(map_header.reserved));
-  map_header.reserved_handle = 0;
-  map_header.reserved_file_ref_num = 0;
-  map_header.attributes = 0; // TODO: Should this be a specific value?
-  map_header.resource_type_list_offset = sizeof(map_header);
-  map_header.resource_name_list_offset = name_list_offset;
-  main_w.put(map_header);
+  if (file_size < sizeof(ResourceForkHeader)) {
+    throw std::runtime_error("resource fork is too small");
+  }
+  ResourceForkHeader header;
+  phosg::preadx(fd, &header, sizeof(header), 0);
+  uint64_t data_end = static_cast<uint64_t>(header.resource_data_offset) + header.resource_data_size;
+  uint64_t map_end = static_cast<uint64_t>(header.resource_map_offset) + header.resource_map_size;
+  if ((data_end > file_size) || (map_end > file_size)) {
+    throw std::runtime_error("resource fork header refers to data beyond the end of the file");
+  }
+  this->resource_data_offset = header.resource_data_offset;
+  this->append_offset = std::max<uint64_t>(data_end, map_end);
+
+  std::string map_data = phosg::preadx(fd, header.resource_map_size, header.resource_map_offset);
+  phosg::StringReader r(map_data.data(), map_data.size());
+  this->map_attributes = r.pget<ResourceMapHeader>(0).attributes;
+  parse_resource_map(r, 0, [&](uint32_t type, int16_t id, uint8_t flags, std::string&& name, uint32_t data_offset) {
+    this->entries.emplace(std::make_pair(type, id), Entry{flags, std::move(name), data_offset, nullptr});
+  });
+}
+
+bool ResourceForkEditor::resource_exists(uint32_t type, int16_t id) const {
+  return this->entries.count(std::make_pair(type, id));
+}
+
+bool ResourceForkEditor::add(ResourceFile::Resource&& res) {
+  if (res.name.size() > 0xFF) {
+    throw std::invalid_argument("name must be 255 bytes or shorter");
+  }
+  auto data = std::make_shared<const std::string>(std::move(res.data));
+  Entry entry{static_cast<uint8_t>(res.flags), std::move(res.name), 0, std::move(data)};
+  if (!this->entries.emplace(std::make_pair(res.type, res.id), std::move(entry)).second) {
+    return false;
+  }
+  this->modified = true;
+  return true;
+}
+
+bool ResourceForkEditor::remove(uint32_t type, int16_t id) {
+  if (!this->entries.erase(std::make_pair(type, id))) {
+    return false;
+  }
+  this->modified = true;
+  return true;
+}
+
+bool ResourceForkEditor::change_id(uint32_t type, int16_t current_id, int16_t new_id) {
+  auto it = this->entries.find(std::make_pair(type, current_id));
+  if (it == this->entries.end()) {
+    return false;
+  }
+  if (current_id != new_id) {
+    if (this->entries.count(std::make_pair(type, new_id))) {
+      return false;
+    }
+    auto node = this->entries.extract(it);
+    node.key().second = new_id;
+    this->entries.insert(std::move(node));
+    this->modified = true;
+  }
+  return true;
+}
 
-  main_w.write(type_list_w.str());
-  main_w.write(reflist_w.str());
-  main_w.write(names_w.str());
+bool ResourceForkEditor::rename(uint32_t type, int16_t id, const std::string& new_name) {
+  if (new_name.size() > 0xFF) {
+    throw std::invalid_argument("name must be 255 bytes or shorter");
+  }
+  auto it = this->entries.find(std::make_pair(type, id));
+  if (it == this->entries.end()) {
+    return false;
+  }
+  if (it->second.name != new_name) {
+    it->second.name = new_name;
+    this->modified = true;
+  }
+  return true;
+}
+
+size_t ResourceForkEditor::save() {
+  if (!this->modified) {
+    return 0;
+  }
+
+  // New data and the new map are written after everything that's currently in use, and the header is written last.
+  // Nothing the current header refers to is overwritten, so the file is still valid (with its previous contents) if
+  // this is interrupted before the header is written.
+  std::string new_data;
+  std::vector<ResourceMapEntry> map_entries;
+  map_entries.reserve(this->entries.size());
+  for (auto& [key, entry] : this->entries) {
+    if (entry.new_data) {
+      uint64_t data_offset = this->append_offset + new_data.size() - this->resource_data_offset;
+      // The data offset in each reference list entry is only 24 bits
+      if (data_offset > 0x00FFFFFF) {
+        throw std::runtime_error("resource data segment is too large (compacting the file may help)");
+      }
+      if (entry.new_data->size() > 0xFFFFFFFF) {
+        throw std::runtime_error("resource is too large to serialize");
+      }
+      entry.data_offset = data_offset;
+      phosg::be_uint32_t size = entry.new_data->size();
+      new_data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+      new_data += *entry.new_data;
+    }
+    map_entries.emplace_back(ResourceMapEntry{key.first, key.second, entry.flags, &entry.name, entry.data_offset});
+  }
+  std::string map_data = serialize_resource_map(map_entries, this->map_attributes);
+
+  uint64_t map_offset = this->append_offset + new_data.size();
+  if (map_offset + map_data.size() > 0xFFFFFFFF) {
+    throw std::runtime_error("resource fork is too large");
+  }
+  ResourceForkHeader header;
+  header.resource_data_offset = this->resource_data_offset;
+  header.resource_map_offset = map_offset;
+  header.resource_data_size = map_offset - this->resource_data_offset;
+  header.resource_map_size = map_data.size();
+
+  {
+    phosg::scoped_fd fd(this->filename, O_RDWR);
+    if (!new_data.empty()) {
+      phosg::pwritex(fd, new_data.data(), new_data.size(), this->append_offset);
+    }
+    phosg::pwritex(fd, map_data.data(), map_data.size(), map_offset);
+    if (ftruncate(fd, map_offset + map_data.size())) {
+      throw std::runtime_error(std::format("cannot truncate resource fork: {}", strerror(errno)));
+    }
+    phosg::pwritex(fd, &header, sizeof(header), 0);
+  }
+
+  for (auto& [key, entry] : this->entries) {
+    entry.new_data.reset();
+  }
+  this->append_offset = map_offset + map_data.size();
+  this->modified = false;
+  return new_data.size() + map_data.size() + sizeof(header);
+}
+
+size_t ResourceForkEditor::compact() {
+  // Read the data of all resources that are already in the file, then write everything back in the same layout that
+  // serialize_resource_fork would produce
+  std::vector<std::shared_ptr<const std::string>> data_objs;
+  std::vector<const std::string*> data;
+  std::vector<ResourceMapEntry> map_entries;
+  data_objs.reserve(this->entries.size());
+  data.reserve(this->entries.size());
+  map_entries.reserve(this->entries.size());
+  {
+    phosg::scoped_fd fd(this->filename, O_RDONLY);
+    for (const auto& [key, entry] : this->entries) {
+      if (entry.new_data) {
+        data_objs.emplace_back(entry.new_data);
+      } else {
+        uint64_t offset = static_cast<uint64_t>(this->resource_data_offset) + entry.data_offset;
+        phosg::be_uint32_t size;
+        phosg::preadx(fd, &size, sizeof(size), offset);
+        data_objs.emplace_back(std::make_shared<const std::string>(phosg::preadx(fd, size, offset + sizeof(size))));
+      }
+      data.emplace_back(data_objs.back().get());
+      map_entries.emplace_back(ResourceMapEntry{key.first, key.second, entry.flags, &entry.name, 0});
+    }
+  }
 
-  return main_w.str();
+  std::string contents = build_resource_fork(map_entries, data, this->map_attributes);
+  phosg::save_file(this->filename, contents);
+  this->load();
+  return contents.size();
 }
 
 } // namespace ResourceDASM
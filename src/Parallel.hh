@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <exception>
+#include <mutex>
+#include <phosg/Tools.hh>
+#include <thread>
+#include <vector>
+
+// This is header-only because it's used by tools that don't link with the resource_file library (gcmasm, gcmdump,
+// gvmdump, and rcfdump).
+
+namespace ResourceDASM {
+
+// Returns the number of threads to use for a --parallel=N option or num_threads argument: 0 means one thread per CPU
+// core, and a negative value (the option wasn't given) means 1.
+inline size_t resolve_num_threads(ssize_t num_threads) {
+  if (num_threads == 0) {
+    return std::thread::hardware_concurrency();
+  }
+  return (num_threads < 0) ? 1 : num_threads;
+}
+
+// Calls fn(item) for each item. num_threads is resolved as described above; if it's greater than 1, the calls are
+// spread across that many threads, and otherwise they're made in order on the calling thread. Exceptions can't
+// propagate out of the worker threads, so if any call throws, the first exception is rethrown after all the other
+// calls are done. (On the calling thread, an exception stops the loop immediately.)
+template <typename ItemT, typename FnT>
+void parallel_for_each(const std::vector<ItemT>& items, FnT&& fn, ssize_t num_threads) {
+  size_t resolved_num_threads = resolve_num_threads(num_threads);
+  if ((resolved_num_threads <= 1) || (items.size() <= 1)) {
+    for (const auto& item : items) {
+      fn(item);
+    }
+    return;
+  }
+
+  std::mutex error_lock;
+  std::exception_ptr first_error;
+  phosg::parallel_range(items, [&](const ItemT& item, size_t) -> bool {
+    try {
+      fn(item);
+    } catch (...) {
+      std::lock_guard g(error_lock);
+      if (!first_error) {
+        first_error = std::current_exception();
+      }
+    }
+    return false;
+  }, resolved_num_threads);
+  if (first_error) {
+    std::rethrow_exception(first_error);
+  }
+}
+
+// Calls fn(z) for each z in [0, count), in the same way as parallel_for_each.
+template <typename FnT>
+void parallel_for_each_index(size_t count, FnT&& fn, ssize_t num_threads) {
+  std::vector<size_t> indexes;
+  indexes.reserve(count);
+  for (size_t z = 0; z < count; z++) {
+    indexes.emplace_back(z);
+  }
+  parallel_for_each(indexes, fn, num_threads);
+}
+
+} // namespace ResourceDASM
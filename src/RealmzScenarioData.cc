@@ -10,6 +10,7 @@
 
 #include <array>
 #include <deque>
+#include <functional>
 #include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Image.hh>
@@ -22,6 +23,7 @@
 #include <vector>
 
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 
 namespace ResourceDASM {
@@ -34,7 +36,8 @@ std::string first_file_in_dir(const std::string& dir, std::initializer_list<cons
   return first_file_that_exists(paths);
 }
 
-RealmzScenarioData::RealmzScenarioData(const RealmzGlobalData& global, const std::string& scenario_dir, const std::string& name)
+RealmzScenarioData::RealmzScenarioData(
+    const RealmzGlobalData& global, const std::string& scenario_dir, const std::string& name, size_t num_threads)
     : global(global),
       scenario_dir(scenario_dir),
       name(name) {
@@ -66,72 +69,99 @@ RealmzScenarioData::RealmzScenarioData(const RealmzGlobalData& global, const std
   std::string solids_name = first_file_in_dir(this->scenario_dir, {"data_solids", "Data Solids", "DATA SOLIDS"});
   std::string scenario_resources_name = first_file_in_dir(this->scenario_dir, {"scenario.rsf", "Scenario.rsf", "SCENARIO.RSF", "scenario.rsrc", "Scenario.rsrc", "SCENARIO.RSRC", "scenario/rsrc", "Scenario/rsrc", "SCENARIO/rsrc", "scenario/..namedfork/rsrc", "Scenario/..namedfork/rsrc", "SCENARIO/..namedfork/rsrc"});
 
-  this->monsters = this->load_monster_index(monster_index_name);
-  this->battles = this->load_battle_index(battle_index_name);
-  this->dungeon_maps = this->load_dungeon_map_index(dungeon_map_index_name);
-  this->land_maps = this->load_land_map_index(land_map_index_name);
-  this->strings = this->load_string_index(string_index_name);
-  this->monster_descriptions = this->load_string_index(monster_description_index_name);
-  this->option_strings = this->load_option_string_index(option_string_index_name);
-  this->ecodes = this->load_ecodes_index(ecodes_index_name);
-  this->dungeon_aps = this->load_ap_index(dungeon_ap_index_name);
-  this->land_aps = this->load_ap_index(land_ap_index_name);
-  this->xaps = this->load_xap_index(extra_ap_index_name);
-  this->dungeon_metadata = this->load_map_metadata_index(dungeon_metadata_index_name);
-  this->land_metadata = this->load_map_metadata_index(land_metadata_index_name);
-  this->simple_encounters = this->load_simple_encounter_index(simple_encounter_index_name);
-  this->complex_encounters = this->load_complex_encounter_index(complex_encounter_index_name);
-  this->party_maps = this->load_party_map_index(party_map_index_name);
-  this->custom_item_definitions = RealmzGlobalData::load_item_definitions(custom_item_index_name);
-  this->shops = this->load_shop_index(shop_index_name);
-  this->treasures = this->load_treasure_index(treasure_index_name);
-  this->rogue_encounters = this->load_rogue_encounter_index(rogue_encounter_index_name);
-  this->time_encounters = this->load_time_encounter_index(time_encounter_index_name);
+  // Each of these tasks writes to different members, so they can run concurrently. Most of the time is spent reading
+  // the files, so this helps most for scenarios on slow storage.
+  std::vector<std::function<void()>> load_tasks;
+  load_tasks.emplace_back([&]() { this->monsters = this->load_monster_index(monster_index_name); });
+  load_tasks.emplace_back([&]() { this->battles = this->load_battle_index(battle_index_name); });
+  load_tasks.emplace_back([&]() { this->dungeon_maps = this->load_dungeon_map_index(dungeon_map_index_name); });
+  load_tasks.emplace_back([&]() { this->land_maps = this->load_land_map_index(land_map_index_name); });
+  load_tasks.emplace_back([&]() { this->strings = this->load_string_index(string_index_name); });
+  load_tasks.emplace_back([&]() {
+    this->monster_descriptions = this->load_string_index(monster_description_index_name);
+  });
+  load_tasks.emplace_back([&]() { this->option_strings = this->load_option_string_index(option_string_index_name); });
+  load_tasks.emplace_back([&]() { this->ecodes = this->load_ecodes_index(ecodes_index_name); });
+  load_tasks.emplace_back([&]() { this->dungeon_aps = this->load_ap_index(dungeon_ap_index_name); });
+  load_tasks.emplace_back([&]() { this->land_aps = this->load_ap_index(land_ap_index_name); });
+  load_tasks.emplace_back([&]() { this->xaps = this->load_xap_index(extra_ap_index_name); });
+  load_tasks.emplace_back([&]() {
+    this->dungeon_metadata = this->load_map_metadata_index(dungeon_metadata_index_name);
+  });
+  load_tasks.emplace_back([&]() { this->land_metadata = this->load_map_metadata_index(land_metadata_index_name); });
+  load_tasks.emplace_back([&]() {
+    this->simple_encounters = this->load_simple_encounter_index(simple_encounter_index_name);
+  });
+  load_tasks.emplace_back([&]() {
+    this->complex_encounters = this->load_complex_encounter_index(complex_encounter_index_name);
+  });
+  load_tasks.emplace_back([&]() { this->party_maps = this->load_party_map_index(party_map_index_name); });
+  load_tasks.emplace_back([&]() {
+    this->custom_item_definitions = RealmzGlobalData::load_item_definitions(custom_item_index_name);
+  });
+  load_tasks.emplace_back([&]() { this->shops = this->load_shop_index(shop_index_name); });
+  load_tasks.emplace_back([&]() { this->treasures = this->load_treasure_index(treasure_index_name); });
+  load_tasks.emplace_back([&]() {
+    this->rogue_encounters = this->load_rogue_encounter_index(rogue_encounter_index_name);
+  });
+  load_tasks.emplace_back([&]() {
+    this->time_encounters = this->load_time_encounter_index(time_encounter_index_name);
+  });
   // Some scenarios apparently don't have global metadata
-  if (!global_metadata_name.empty()) {
-    this->global_metadata = this->load_global_metadata(global_metadata_name);
-  }
-  if (!restrictions_name.empty()) {
-    this->restrictions = this->load_restrictions(restrictions_name);
-  } else {
-    this->restrictions.description_bytes = 0;
-    memset(this->restrictions.description, 0, sizeof(this->restrictions.description));
-    this->restrictions.max_characters = 0;
-    this->restrictions.max_level_per_character = 0;
-    memset(this->restrictions.forbidden_races, 0, sizeof(this->restrictions.forbidden_races));
-    memset(this->restrictions.forbidden_castes, 0, sizeof(this->restrictions.forbidden_castes));
-  }
-  if (!solids_name.empty()) {
-    this->solids = this->load_solids(solids_name);
-  }
-
-  this->scenario_metadata = this->load_scenario_metadata(scenario_metadata_name);
-  this->scenario_rsf = parse_resource_fork(phosg::load_file(scenario_resources_name));
-
-  this->item_strings = RealmzGlobalData::load_item_strings(this->scenario_rsf);
-  this->spell_names = RealmzGlobalData::load_spell_names(this->scenario_rsf);
+  load_tasks.emplace_back([&]() {
+    if (!global_metadata_name.empty()) {
+      this->global_metadata = this->load_global_metadata(global_metadata_name);
+    }
+  });
+  load_tasks.emplace_back([&]() {
+    if (!restrictions_name.empty()) {
+      this->restrictions = this->load_restrictions(restrictions_name);
+    } else {
+      this->restrictions.description_bytes = 0;
+      memset(this->restrictions.description, 0, sizeof(this->restrictions.description));
+      this->restrictions.max_characters = 0;
+      this->restrictions.max_level_per_character = 0;
+      memset(this->restrictions.forbidden_races, 0, sizeof(this->restrictions.forbidden_races));
+      memset(this->restrictions.forbidden_castes, 0, sizeof(this->restrictions.forbidden_castes));
+    }
+  });
+  load_tasks.emplace_back([&]() {
+    if (!solids_name.empty()) {
+      this->solids = this->load_solids(solids_name);
+    }
+  });
+  load_tasks.emplace_back([&]() { this->scenario_metadata = this->load_scenario_metadata(scenario_metadata_name); });
+  load_tasks.emplace_back([&]() {
+    this->scenario_rsf = parse_resource_fork(phosg::load_file(scenario_resources_name));
+    this->item_strings = RealmzGlobalData::load_item_strings(this->scenario_rsf);
+    this->spell_names = RealmzGlobalData::load_spell_names(this->scenario_rsf);
+  });
 
   // Load layout separately because it doesn't have to exist
-  {
+  load_tasks.emplace_back([&]() {
     std::string fname = first_file_in_dir(this->scenario_dir, {"layout", "Layout", "LAYOUT"});
     if (!fname.empty()) {
       this->layout = this->load_land_layout(fname);
     } else {
       phosg::fwrite_fmt(stderr, "note: this scenario has no land layout information\n");
     }
-  }
+  });
 
   // Load tilesets
-  for (int z = 1; z < 4; z++) {
-    std::string fname = first_file_that_exists({std::format("{}/data_custom_{}_bd", this->scenario_dir, z),
-        std::format("{}/Data Custom {} BD", this->scenario_dir, z),
-        std::format("{}/DATA CUSTOM {} BD", this->scenario_dir, z)});
-    if (!fname.empty()) {
-      std::string land_type = std::format("custom_{}", z);
-      this->land_type_to_tileset_definition.emplace(
-          std::move(land_type), RealmzGlobalData::load_tileset_definition(fname));
+  load_tasks.emplace_back([&]() {
+    for (int z = 1; z < 4; z++) {
+      std::string fname = first_file_that_exists({std::format("{}/data_custom_{}_bd", this->scenario_dir, z),
+          std::format("{}/Data Custom {} BD", this->scenario_dir, z),
+          std::format("{}/DATA CUSTOM {} BD", this->scenario_dir, z)});
+      if (!fname.empty()) {
+        std::string land_type = std::format("custom_{}", z);
+        this->land_type_to_tileset_definition.emplace(
+            std::move(land_type), RealmzGlobalData::load_tileset_definition(fname));
+      }
     }
-  }
+  });
+
+  parallel_for_each(load_tasks, [](const std::function<void()>& task) -> void { task(); }, num_threads);
 }
 
 const std::string& RealmzScenarioData::name_for_spell(uint16_t id) const {
@@ -166,6 +196,23 @@ std::string RealmzScenarioData::desc_for_item(uint16_t id) const {
   return std::format("{}", id);
 }
 
+std::shared_ptr<const phosg::ImageRGBA8888N> RealmzScenarioData::positive_pattern_for_land_type(
+    const std::string& land_type) const {
+  // Patterns are decoded while holding the lock, so each one is only decoded once even if many maps are being
+  // generated at the same time. There are only a few land types, so this doesn't cause much contention.
+  std::lock_guard g(this->positive_pattern_cache_lock);
+  auto it = this->positive_pattern_cache.find(land_type);
+  if (it == this->positive_pattern_cache.end()) {
+    int16_t resource_id = RealmzGlobalData::pict_resource_id_for_land_type(land_type);
+    auto decoded = this->scenario_rsf.resource_exists(RESOURCE_TYPE_PICT, resource_id)
+        ? this->scenario_rsf.decode_PICT(resource_id)
+        : this->global.global_rsf.decode_PICT(resource_id);
+    it = this->positive_pattern_cache.emplace(
+        land_type, std::make_shared<const phosg::ImageRGBA8888N>(std::move(decoded.image))).first;
+  }
+  return it->second;
+}
+
 static std::string render_string_reference(const std::vector<std::string>& strings, int index) {
   if (index == 0) {
     return "0";
@@ -393,7 +440,8 @@ std::vector<RealmzScenarioData::LandLayout> RealmzScenarioData::LandLayout::get_
 phosg::ImageRGB888 RealmzScenarioData::generate_layout_map(
     const LandLayout& l,
     bool show_random_rects,
-    std::function<phosg::ImageRGB888(int16_t, uint8_t, uint8_t, uint8_t, uint8_t, bool)> generate_level_map) const {
+    std::function<phosg::ImageRGB888(int16_t, uint8_t, uint8_t, uint8_t, uint8_t, bool)> generate_level_map,
+    size_t num_threads) const {
   ssize_t min_x = 16, min_y = 8, max_x = -1, max_y = -1;
   for (ssize_t y = 0; y < 8; y++) {
     for (ssize_t x = 0; x < 16; x++) {
@@ -424,38 +472,57 @@ phosg::ImageRGB888 RealmzScenarioData::generate_layout_map(
   max_y++;
 
   phosg::ImageRGB888 overall_map(90 * 32 * (max_x - min_x), 90 * 32 * (max_y - min_y));
+
+  struct LevelCell {
+    int16_t level_id;
+    int xp;
+    int yp;
+  };
+  std::vector<LevelCell> cells;
   for (ssize_t y = 0; y < (max_y - min_y); y++) {
     for (ssize_t x = 0; x < (max_x - min_x); x++) {
       int16_t level_id = l.layout[y + min_y][x + min_x];
-      if (level_id < 0) {
-        continue;
+      if (level_id >= 0) {
+        cells.emplace_back(LevelCell{level_id, static_cast<int>(90 * 32 * x), static_cast<int>(90 * 32 * y)});
       }
+    }
+  }
 
-      int xp = 90 * 32 * x;
-      int yp = 90 * 32 * y;
+  // Each level is copied into a different region of overall_map, so levels can be generated concurrently. Failures
+  // are drawn afterward, since the error text may extend past the level's region.
+  std::vector<std::string> errors(cells.size());
+  auto generate_cell = [&](const size_t& cell_index) -> void {
+    const auto& cell = cells[cell_index];
+    try {
+      phosg::ImageRGB888 this_level_map = generate_level_map
+          ? generate_level_map(cell.level_id, 0, 0, 90, 90, show_random_rects)
+          : this->generate_land_map(cell.level_id, 0, 0, 90, 90, show_random_rects);
 
+      // If get_level_neighbors fails, then we would not have written any boundary information on the original map,
+      // so we can just ignore this
+      int sx = 0, sy = 0;
       try {
-        phosg::ImageRGB888 this_level_map = generate_level_map
-            ? generate_level_map(level_id, 0, 0, 90, 90, show_random_rects)
-            : this->generate_land_map(level_id, 0, 0, 90, 90, show_random_rects);
-
-        // If get_level_neighbors fails, then we would not have written any boundary information on the original map,
-        // so we can just ignore this
-        int sx = 0, sy = 0;
-        try {
-          LevelNeighbors n = l.get_level_neighbors(level_id);
-          sx = (n.left >= 0) ? 9 : 0;
-          sy = (n.top >= 0) ? 9 : 0;
-        } catch (const std::runtime_error&) {
-        }
+        LevelNeighbors n = l.get_level_neighbors(cell.level_id);
+        sx = (n.left >= 0) ? 9 : 0;
+        sy = (n.top >= 0) ? 9 : 0;
+      } catch (const std::runtime_error&) {
+      }
 
-        overall_map.copy_from(this_level_map, xp, yp, 90 * 32, 90 * 32, sx, sy);
+      overall_map.copy_from(this_level_map, cell.xp, cell.yp, 90 * 32, 90 * 32, sx, sy);
 
-      } catch (const std::exception& e) {
-        overall_map.write_rect(xp, yp, 90 * 32, 90 * 32, 0xFFFFFFFF);
-        overall_map.draw_text(xp + 10, yp + 10, 0xFF0000FF, 0x00000000, "can\'t generate level map", level_id);
-        overall_map.draw_text(xp + 10, yp + 20, 0x000000FF, 0x00000000, "{}", e.what());
-      }
+    } catch (const std::exception& e) {
+      errors[cell_index] = e.what();
+    }
+  };
+
+  parallel_for_each_index(cells.size(), generate_cell, num_threads);
+
+  for (size_t z = 0; z < cells.size(); z++) {
+    if (!errors[z].empty()) {
+      const auto& cell = cells[z];
+      overall_map.write_rect(cell.xp, cell.yp, 90 * 32, 90 * 32, 0xFFFFFFFF);
+      overall_map.draw_text(cell.xp + 10, cell.yp + 10, 0xFF0000FF, 0x00000000, "can\'t generate level map", cell.level_id);
+      overall_map.draw_text(cell.xp + 10, cell.yp + 20, 0x000000FF, 0x00000000, "{}", errors[z]);
     }
   }
 
@@ -3670,10 +3737,8 @@ phosg::ImageRGB888 RealmzScenarioData::generate_land_map(
   }
 
   // Load the positive pattern
-  int16_t resource_id = RealmzGlobalData::pict_resource_id_for_land_type(metadata.land_type);
-  auto positive_pattern = this->scenario_rsf.resource_exists(RESOURCE_TYPE_PICT, resource_id)
-      ? std::move(this->scenario_rsf.decode_PICT(resource_id).image)
-      : std::move(this->global.global_rsf.decode_PICT(resource_id).image);
+  auto positive_pattern_ptr = this->positive_pattern_for_land_type(metadata.land_type);
+  const auto& positive_pattern = *positive_pattern_ptr;
 
   for (size_t y = y0; y < y0 + h; y++) {
     for (size_t x = x0; x < x0 + w; x++) {
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <memory>
+#include <mutex>
 #include <phosg/Image.hh>
 #include <string>
 #include <unordered_map>
@@ -19,8 +21,13 @@ namespace ResourceDASM {
 // TODO: Add disassembly for Data Race and Data Caste here. It seems they were never fully implemented in Realmz
 // anyway, so there may not be any useful examples of them in scenario data in the wild.
 
+// The map generation functions (generate_*_map and render_party_map) may be called from multiple threads at once, but
+// only after decompress_all_resources() has been called on scenario_rsf and on the global data's global_rsf, since
+// resources are otherwise decompressed lazily by the first thread that uses them.
 struct RealmzScenarioData {
-  RealmzScenarioData(const RealmzGlobalData& global, const std::string& scenario_dir, const std::string& scenario_name);
+  // If num_threads is greater than 1, the scenario's files are loaded concurrently
+  RealmzScenarioData(const RealmzGlobalData& global, const std::string& scenario_dir, const std::string& scenario_name,
+      size_t num_threads = 1);
   ~RealmzScenarioData() = default;
 
   /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -594,7 +601,8 @@ struct RealmzScenarioData {
   phosg::ImageRGB888 generate_layout_map(
       const LandLayout& l,
       bool show_random_rects = true,
-      std::function<phosg::ImageRGB888(int16_t, uint8_t, uint8_t, uint8_t, uint8_t, bool)> generate_level_map = nullptr) const;
+      std::function<phosg::ImageRGB888(int16_t, uint8_t, uint8_t, uint8_t, uint8_t, bool)> generate_level_map = nullptr,
+      size_t num_threads = 1) const;
 
   /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -602,12 +610,15 @@ struct RealmzScenarioData {
   std::string desc_for_spell(uint16_t id) const;
   const RealmzGlobalData::ItemStrings& strings_for_item(uint16_t id) const;
   std::string desc_for_item(uint16_t id) const;
+  // Returns the decoded positive tile pattern for a land type, preferring the scenario's PICT over the global one
+  std::shared_ptr<const phosg::ImageRGBA8888N> positive_pattern_for_land_type(const std::string& land_type) const;
 
   const RealmzGlobalData& global;
   std::string scenario_dir;
   std::string name;
   std::unordered_map<std::string, RealmzGlobalData::TileSetDefinition> land_type_to_tileset_definition;
-  std::unordered_map<std::string, phosg::ImageRGB888> positive_pattern_cache;
+  mutable std::mutex positive_pattern_cache_lock;
+  mutable std::unordered_map<std::string, std::shared_ptr<const phosg::ImageRGBA8888N>> positive_pattern_cache;
   ResourceFile scenario_rsf;
   LandLayout layout;
   GlobalMetadata global_metadata;
@@ -26,6 +26,7 @@
 #include "Emulators/M68KEmulator.hh"
 #include "Emulators/PPC32Emulator.hh"
 #include "Lookups.hh"
+#include "Parallel.hh"
 #include "QuickDrawEngine.hh"
 #include "QuickDrawFormats.hh"
 #include "ResourceCompression.hh"
@@ -35,6 +36,13 @@
 
 namespace ResourceDASM {
 
+// Counts the lookups done by the current thread; see lookups_on_current_thread()
+static thread_local uint64_t lookup_count = 0;
+
+uint64_t ResourceFile::lookups_on_current_thread() {
+  return lookup_count;
+}
+
 void ResourceFile::add_name_index_entry(std::shared_ptr<Resource> res) {
   if (!res->name.empty()) {
     this->name_to_resource.emplace(res->name, res);
@@ -107,6 +115,44 @@ bool ResourceFile::add(std::shared_ptr<Resource> res) {
   return emplace_ret.second;
 }
 
+bool ResourceFile::add_unloaded(std::shared_ptr<Resource> res, std::function<std::string()> load_data) {
+  res->load_data = std::move(load_data);
+  return this->add(res);
+}
+
+static void load_data_if_needed(ResourceFile::Resource& res) {
+  if (res.load_data) {
+    res.data = res.load_data();
+    res.load_data = nullptr;
+  }
+}
+
+void ResourceFile::load_data(const std::vector<std::pair<uint32_t, int16_t>>& resources, size_t num_threads) const {
+  std::vector<Resource*> to_load;
+  for (const auto& [type, id] : resources) {
+    auto it = this->key_to_resource.find(this->make_resource_key(type, id));
+    if ((it != this->key_to_resource.end()) && it->second->load_data) {
+      to_load.emplace_back(it->second.get());
+    }
+  }
+  if (to_load.empty()) {
+    return;
+  }
+
+  auto load_one = [&](Resource* const& res) -> void {
+    try {
+      load_data_if_needed(*res);
+    } catch (const std::exception&) {
+      // load_data is still set, so get_resource will try again and throw the error to its caller
+    }
+  };
+  parallel_for_each(to_load, load_one, num_threads);
+}
+
+void ResourceFile::load_all_data(size_t num_threads) const {
+  this->load_data(this->all_resources(), num_threads);
+}
+
 bool ResourceFile::change_id(uint32_t type, int16_t current_id, int16_t new_id) {
   uint64_t current_key = this->make_resource_key(type, current_id);
   uint64_t new_key = this->make_resource_key(type, new_id);
@@ -155,14 +201,17 @@ IndexFormat ResourceFile::index_format() const {
 }
 
 bool ResourceFile::empty() const {
+  lookup_count++;
   return this->key_to_resource.empty();
 }
 
 bool ResourceFile::resource_exists(uint32_t type, int16_t id) const {
+  lookup_count++;
   return this->key_to_resource.count(this->make_resource_key(type, id));
 }
 
 bool ResourceFile::resource_exists(uint32_t type, const char* name) const {
+  lookup_count++;
   auto its = this->name_to_resource.equal_range(name);
   for (; its.first != its.second; its.first++) {
     if (its.first->second->type == type) {
@@ -198,16 +247,20 @@ std::shared_ptr<const ResourceFile::Resource> ResourceFile::decompress_if_reques
 
 std::shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource(
     uint32_t type, int16_t id, uint64_t decompress_flags) const {
+  lookup_count++;
   auto res = this->key_to_resource.at(this->make_resource_key(type, id));
+  load_data_if_needed(*res);
   return this->decompress_if_requested(res, decompress_flags);
 }
 
 std::shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource(
     uint32_t type, const char* name, uint64_t decompress_flags) const {
+  lookup_count++;
   auto its = this->name_to_resource.equal_range(name);
   for (; its.first != its.second; its.first++) {
     auto res = its.first->second;
     if (res->type == type) {
+      load_data_if_needed(*res);
       return this->decompress_if_requested(res, decompress_flags);
     }
   }
@@ -224,11 +277,20 @@ std::shared_ptr<const ResourceFile::Resource> ResourceFile::get_resource_if_exis
   return this->resource_exists(type, name) ? this->get_resource(type, name, decompress_flags) : nullptr;
 }
 
+void ResourceFile::decompress_all_resources(uint64_t decompress_flags) const {
+  this->load_all_data();
+  for (const auto& it : this->key_to_resource) {
+    this->decompress_if_requested(it.second, decompress_flags);
+  }
+}
+
 const std::string& ResourceFile::get_resource_name(uint32_t type, int16_t id) const {
+  lookup_count++;
   return this->key_to_resource.at(this->make_resource_key(type, id))->name;
 }
 
 size_t ResourceFile::count_resources_of_type(uint32_t type) const {
+  lookup_count++;
   size_t ret = 0;
   for (auto it = this->key_to_resource.lower_bound(this->make_resource_key(type, MIN_RES_ID));
       it != this->key_to_resource.end(); it++) {
@@ -241,10 +303,12 @@ size_t ResourceFile::count_resources_of_type(uint32_t type) const {
 }
 
 size_t ResourceFile::count_resources() const {
+  lookup_count++;
   return this->key_to_resource.size();
 }
 
 std::vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) const {
+  lookup_count++;
   std::vector<int16_t> ret;
   for (auto it = this->key_to_resource.lower_bound(this->make_resource_key(type, MIN_RES_ID));
       it != this->key_to_resource.end(); it++) {
@@ -257,6 +321,7 @@ std::vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) const {
 }
 
 std::vector<uint32_t> ResourceFile::all_resource_types() const {
+  lookup_count++;
   std::vector<uint32_t> ret;
   for (auto it : this->key_to_resource) {
     uint32_t type = this->type_from_resource_key(it.first);
@@ -268,6 +333,7 @@ std::vector<uint32_t> ResourceFile::all_resource_types() const {
 }
 
 std::vector<std::pair<uint32_t, int16_t>> ResourceFile::all_resources() const {
+  lookup_count++;
   std::vector<std::pair<uint32_t, int16_t>> ret;
   for (const auto& it : this->key_to_resource) {
     ret.emplace_back(std::make_pair(
@@ -2868,13 +2934,29 @@ std::vector<ColorTableEntry> ResourceFile::decode_CTBL(const void* data, size_t
 
 ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
     const void* vdata, size_t size, bool metadata_only, bool hirf_semantics, bool decompress_ysnd) {
+  ResourceFile::DecodedSoundResource ret;
+  decode_snd_data_into(ret, vdata, size, metadata_only, hirf_semantics, decompress_ysnd);
+  return ret;
+}
+
+void ResourceFile::decode_snd_data_into(
+    DecodedSoundResource& ret,
+    const void* vdata,
+    size_t size,
+    bool metadata_only,
+    bool hirf_semantics,
+    bool decompress_ysnd) {
   if (size < 4) {
     throw std::runtime_error("snd doesn\'t even contain a format code");
   }
 
   phosg::StringReader r(vdata, size);
 
-  ResourceFile::DecodedSoundResource ret;
+  // Reset everything except the sample buffer's storage, which the caller may be reusing across calls
+  std::vector<float> samples = std::move(ret.samples);
+  samples.clear();
+  ret = DecodedSoundResource();
+  ret.samples = std::move(samples);
   ret.num_channels = 1;
 
   // These format codes ('MHWK', 'Cue#', or 'Data') are the type codes of the first chunk for a Mohawk-specific chunk-
@@ -2906,10 +2988,10 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
         ret.sample_rate = data_header.sample_rate;
         ret.num_channels = data_header.num_channels;
         if (!metadata_only) {
-          ret.samples = Audio::convert_samples_dynamic(
-              r.readx(data_header.num_samples * (data_header.sample_bits >> 3)), data_header.sample_bits);
+          size_t data_bytes = data_header.num_samples * (data_header.sample_bits >> 3);
+          Audio::convert_samples_dynamic_into(ret.samples, r.getv(data_bytes), data_bytes, data_header.sample_bits);
         }
-        return ret;
+        return;
       }
     }
     throw std::runtime_error("MHK snd does not contain a Data section");
@@ -2966,7 +3048,7 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
     if (!metadata_only) {
       ret.mp3_data = r.read(r.remaining());
     }
-    return ret;
+    return;
 
   } else {
     throw std::runtime_error("snd is not format 1 or 2");
@@ -3062,9 +3144,9 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
           samples8.push_back(p);
         }
       }
-      ret.samples = Audio::convert_samples<float, uint8_t>(samples8);
+      Audio::convert_samples_into<float, uint8_t>(ret.samples, samples8.data(), samples8.size());
     }
-    return ret;
+    return;
   }
 
   // Uncompressed data can be copied verbatim
@@ -3077,9 +3159,9 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
     size_t num_samples = std::min<size_t>(sample_buffer.data_bytes, r.remaining());
     if (!metadata_only) {
       // Always 8-bit in this case
-      ret.samples = Audio::convert_samples<float, uint8_t>(r.readx(num_samples));
+      Audio::convert_samples_into<float, uint8_t>(ret.samples, r.get_array<uint8_t>(num_samples), num_samples);
     }
-    return ret;
+    return;
 
   } else if ((sample_buffer.encoding == 0xFE) || (sample_buffer.encoding == 0xFF)) {
     // Compressed data will need to be decompressed first
@@ -3103,13 +3185,11 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
         ret.loop_start_sample_offset *= loop_factor;
         ret.loop_end_sample_offset *= loop_factor;
         if (!metadata_only) {
-          ret.samples = Audio::decode_mace(
-              compressed_buffer.data,
-              compressed_buffer.num_frames * (is_mace3 ? 2 : 1) * ret.num_channels,
-              ret.num_channels == 2,
-              is_mace3);
+          size_t data_bytes = compressed_buffer.num_frames * (is_mace3 ? 2 : 1) * ret.num_channels;
+          ret.samples.resize(Audio::mace_decoded_sample_count(data_bytes, is_mace3));
+          Audio::decode_mace(ret.samples.data(), compressed_buffer.data, data_bytes, ret.num_channels == 2, is_mace3);
         }
-        return ret;
+        return;
       }
 
       case 0xFFFF:
@@ -3120,31 +3200,33 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
           uint32_t loop_factor;
           if (compressed_buffer.format == 0x696D6134) { // ima4
             if (!metadata_only) {
-              ret.samples = Audio::decode_ima4(
-                  compressed_buffer.data, num_frames * 34 * ret.num_channels, (ret.num_channels == 2));
+              size_t data_bytes = num_frames * 34 * ret.num_channels;
+              ret.samples.resize(Audio::ima4_decoded_sample_count(data_bytes));
+              Audio::decode_ima4(ret.samples.data(), compressed_buffer.data, data_bytes, (ret.num_channels == 2));
             }
             loop_factor = 4; // TODO: verify this. I don't actually have any examples right now
 
           } else if ((compressed_buffer.format == 0x4D414333) || (compressed_buffer.format == 0x4D414336)) { // MAC3, MAC6
             bool is_mace3 = compressed_buffer.format == 0x4D414333;
             if (!metadata_only) {
-              ret.samples = Audio::decode_mace(
-                  compressed_buffer.data,
-                  num_frames * (is_mace3 ? 2 : 1) * ret.num_channels,
-                  ret.num_channels == 2,
-                  is_mace3);
+              size_t data_bytes = num_frames * (is_mace3 ? 2 : 1) * ret.num_channels;
+              ret.samples.resize(Audio::mace_decoded_sample_count(data_bytes, is_mace3));
+              Audio::decode_mace(
+                  ret.samples.data(), compressed_buffer.data, data_bytes, ret.num_channels == 2, is_mace3);
             }
             loop_factor = is_mace3 ? 3 : 6;
 
           } else if (compressed_buffer.format == 0x756C6177) { // ulaw
             if (!metadata_only) {
-              ret.samples = Audio::decode_ulaw(compressed_buffer.data, num_frames);
+              ret.samples.resize(Audio::ulaw_decoded_sample_count(num_frames));
+              Audio::decode_ulaw(ret.samples.data(), compressed_buffer.data, num_frames);
             }
             loop_factor = 2;
 
           } else if (compressed_buffer.format == 0x616C6177) { // alaw (guess)
             if (!metadata_only) {
-              ret.samples = Audio::decode_alaw(compressed_buffer.data, num_frames);
+              ret.samples.resize(Audio::alaw_decoded_sample_count(num_frames));
+              Audio::decode_alaw(ret.samples.data(), compressed_buffer.data, num_frames);
             }
             loop_factor = 2;
 
@@ -3154,7 +3236,7 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
 
           ret.loop_start_sample_offset *= loop_factor;
           ret.loop_end_sample_offset *= loop_factor;
-          return ret;
+          return;
         }
 
         [[fallthrough]];
@@ -3171,15 +3253,17 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd_data(
         }
 
         if (!metadata_only) {
-          std::string samples_str = r.readx(num_samples * ret.num_channels * (bits_per_sample / 8));
+          size_t data_bytes = num_samples * ret.num_channels * (bits_per_sample / 8);
+          const void* samples_data = r.getv(data_bytes);
           if ((bits_per_sample == 0x10) && (compressed_buffer.format == 0x736F7774)) {
             // 'swot' is little-endian; all other formats should use default behavior
-            ret.samples = Audio::convert_samples<float, phosg::le_int16_t>(samples_str);
+            Audio::convert_samples_into<float, phosg::le_int16_t>(
+                ret.samples, reinterpret_cast<const phosg::le_int16_t*>(samples_data), data_bytes / 2);
           } else {
-            ret.samples = Audio::convert_samples_dynamic(samples_str, bits_per_sample);
+            Audio::convert_samples_dynamic_into(ret.samples, samples_data, data_bytes, bits_per_sample);
           }
         }
-        return ret;
+        return;
       }
 
       default:
@@ -3203,6 +3287,12 @@ ResourceFile::DecodedSoundResource ResourceFile::decode_snd(const void* data, si
   return decode_snd_data(data, size, metadata_only, this->index_format() == IndexFormat::HIRF);
 }
 
+void ResourceFile::decode_snd_into(
+    DecodedSoundResource& ret, std::shared_ptr<const Resource> res, bool metadata_only) const {
+  decode_snd_data_into(
+      ret, res->data.data(), res->data.size(), metadata_only, this->index_format() == IndexFormat::HIRF);
+}
+
 static std::string decompress_soundmusicsys_data(const void* data, size_t size) {
   phosg::StringReader r(data, size);
 
@@ -4155,6 +4245,26 @@ ResourceFile::DecodedFontResource ResourceFile::decode_FONT_data(
     auto& glyph = ret.glyphs.at(ch - header.first_char);
     glyph.offset = r.get_s8();
     glyph.width = r.get_u8();
+
+    // Find the runs of set pixels in this glyph's part of the bitmap (this is done even for missing glyphs, since
+    // BitmapFontRenderer draws them anyway)
+    size_t bitmap_end_x = std::min<size_t>(glyph.bitmap_offset + glyph.bitmap_width, ret.full_bitmap.get_width());
+    for (size_t y = 0; y < ret.full_bitmap.get_height(); y++) {
+      for (size_t x = glyph.bitmap_offset; x < bitmap_end_x;) {
+        if (ret.full_bitmap.read(x, y) != 0x000000FF) {
+          x++;
+          continue;
+        }
+        size_t span_start_x = x;
+        for (; (x < bitmap_end_x) && (ret.full_bitmap.read(x, y) == 0x000000FF); x++) {
+        }
+        glyph.spans.emplace_back(DecodedFontResource::Glyph::Span{
+            static_cast<int16_t>(glyph.offset + static_cast<ssize_t>(span_start_x - glyph.bitmap_offset)),
+            static_cast<uint16_t>(y),
+            static_cast<uint16_t>(x - span_start_x)});
+      }
+    }
+
     if (glyph.offset == -1 && glyph.width == 0xFF) {
       continue;
     }
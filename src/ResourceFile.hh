@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <functional>
 #include <map>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -69,6 +70,9 @@ public:
     std::string name;
     std::string data;
     std::shared_ptr<const Resource> decompressed_resource;
+    // If set, the resource's data hasn't been read yet (see add_unloaded()). This is called to read it the first time
+    // the resource is requested, then cleared.
+    std::function<std::string()> load_data;
 
     Resource();
     Resource(const Resource&) = default;
@@ -87,6 +91,10 @@ public:
   bool add(const Resource& res);
   bool add(Resource&& res);
   bool add(std::shared_ptr<Resource> res);
+  // Adds a resource whose data is read only when it's first requested (or when load_data() or load_all_data() is
+  // called), so index formats that keep each resource in a separate file don't have to read all of them up front.
+  // res->data should be empty; its contents are replaced by the result of load_data.
+  bool add_unloaded(std::shared_ptr<Resource> res, std::function<std::string()> load_data);
   bool remove(uint32_t type, int16_t id);
   bool change_id(uint32_t type, int16_t current_id, int16_t new_id);
   bool rename(uint32_t type, int16_t id, const std::string& new_name);
@@ -101,6 +109,17 @@ public:
   std::shared_ptr<const Resource> get_resource_if_exists(uint32_t type, int16_t id, uint64_t decompression_flags = 0) const;
   std::shared_ptr<const Resource> get_resource_if_exists(uint32_t type, const char* name, uint64_t decompression_flags = 0) const;
   const std::string& get_resource_name(uint32_t type, int16_t id) const;
+  // get_resource() decompresses resources the first time they're requested, which modifies the ResourceFile. This
+  // decompresses all resources up front, so that afterward get_resource() (and the decode functions, which use it) can
+  // be called from multiple threads at once, as long as the same decompression_flags are used.
+  void decompress_all_resources(uint64_t decompression_flags = 0) const;
+  // Reads the data for the given resources (or all resources) that were added with add_unloaded() and haven't been
+  // read yet, on up to num_threads threads (0 = one per CPU core). Callers that will use many resources should call
+  // this first, so the reads can happen in parallel instead of one at a time in get_resource(). If a read fails, the
+  // error is thrown by get_resource() when the resource is requested. Like decompress_all_resources(), this also
+  // makes get_resource() safe to call from multiple threads for these resources.
+  void load_data(const std::vector<std::pair<uint32_t, int16_t>>& resources, size_t num_threads = 0) const;
+  void load_all_data(size_t num_threads = 0) const;
   size_t count_resources_of_type(uint32_t type) const;
   size_t count_resources() const;
   std::vector<int16_t> all_resources_of_type(uint32_t type) const;
@@ -109,6 +128,11 @@ public:
 
   uint32_t find_resource_by_id(int16_t id, const std::vector<uint32_t>& types) const;
 
+  // Returns the number of times the current thread has looked up resources (by name, ID, or type) in any ResourceFile.
+  // Callers can compare this before and after decoding a resource to tell whether the result depended on any other
+  // resources in the file.
+  static uint64_t lookups_on_current_thread();
+
   struct DecodedCodeFragmentEntry {
     uint32_t architecture;
     uint8_t update_level;
@@ -439,12 +463,22 @@ public:
     phosg::ImageG1 full_bitmap;
 
     struct Glyph {
+      // A horizontal run of set pixels. x and y are relative to the glyph's origin (so x includes offset).
+      struct Span {
+        int16_t x;
+        uint16_t y;
+        uint16_t width;
+      };
+
       int16_t ch;
       uint16_t bitmap_offset;
       uint16_t bitmap_width;
       int8_t offset;
       uint8_t width;
       phosg::ImageGA11 img;
+      // The glyph's pixels in full_bitmap, in row-major order. These are computed when the font is decoded, so text
+      // rendering doesn't have to scan the bitmap for every character drawn.
+      std::vector<Span> spans;
     };
     Glyph missing_glyph;
     std::vector<Glyph> glyphs;
@@ -795,6 +829,18 @@ public:
   DecodedSoundResource decode_snd(int16_t id, uint32_t type = RESOURCE_TYPE_snd, bool metadata_only = false) const;
   DecodedSoundResource decode_snd(std::shared_ptr<const Resource> res, bool metadata_only = false) const;
   DecodedSoundResource decode_snd(const void* data, size_t size, bool metadata_only = false) const;
+  // Like decode_snd, but decodes into an existing struct. All fields in ret are overwritten, but the storage for
+  // ret.samples is reused, so when decoding many sounds in a row, passing the same struct each time avoids
+  // allocating a new sample buffer for each one.
+  static void decode_snd_data_into(
+      DecodedSoundResource& ret,
+      const void* vdata,
+      size_t size,
+      bool metadata_only = false,
+      bool hirf_semantics = false,
+      bool decompress_ysnd = false);
+  void decode_snd_into(
+      DecodedSoundResource& ret, std::shared_ptr<const Resource> res, bool metadata_only = false) const;
   DecodedSoundResource decode_csnd(int16_t id, uint32_t type = RESOURCE_TYPE_csnd, bool metadata_only = false) const;
   DecodedSoundResource decode_csnd(std::shared_ptr<const Resource> res, bool metadata_only = false) const;
   DecodedSoundResource decode_csnd(const void* data, size_t size, bool metadata_only = false) const;
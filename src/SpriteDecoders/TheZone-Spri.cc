@@ -2,10 +2,15 @@
 
 #include <string.h>
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
+#include <unordered_map>
 
 #include "../Emulators/M68KEmulator.hh"
 
@@ -25,16 +30,515 @@ struct SpriHeader {
   // uint8_t blitter_code[...EOF]
 } __attribute__((packed));
 
-phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vector<ColorTableEntry>& clut) {
-  phosg::StringReader r(spri_data);
+// These sprites' code almost always consists of straight-line sequences of moves from the input buffer to the output
+// buffer, interspersed with pointer adjustments. Running it in the emulator is correct but slow, since it requires
+// setting up a new memory context and emulator for every sprite, so before doing that we try to translate the code
+// into a list of copy and fill operations by executing it symbolically. This only succeeds if every instruction is
+// one of a small set of moves and address arithmetic instructions, no branches are taken, and all addresses are known
+// offsets from the input buffer, output buffer, or stack pointer. Anything else (including any instruction that reads
+// the output buffer) makes the translation fail, and the sprite is rendered by the emulator instead.
 
-  const auto& header = r.get<SpriHeader>();
-  if (header.area != header.side * header.side) {
-    throw std::runtime_error("sprite is not square");
+struct SpriDrawOp {
+  uint32_t dest_offset;
+  // If is_fill is false, size bytes are copied from the input buffer at src_offset_or_value. If is_fill is true, the
+  // low size bytes of src_offset_or_value are written to the output (in big-endian order). In the latter case, the
+  // same bytes are written to both the color and alpha outputs, just as the emulated code would do.
+  uint32_t src_offset_or_value;
+  uint8_t size;
+  bool is_fill;
+};
+
+class SpriCodeTranslator {
+public:
+  SpriCodeTranslator(const std::string& code, uint16_t side, uint16_t area)
+      : r(code), side(side), area(area) {}
+
+  std::optional<std::vector<SpriDrawOp>> translate() {
+    // The code expects the following stack at entry time:
+    // [A7+00] return addr
+    // [A7+04] input row_bytes
+    // [A7+08] output row_bytes
+    // [A7+0C] input buffer addr
+    // [A7+10] output buffer addr
+    this->a[7] = Value::pointer(Region::STACK, 0);
+    this->stack_store(0x00, Value::return_address(), 4);
+    this->stack_store(0x04, Value::constant(this->side), 4);
+    this->stack_store(0x08, Value::constant(this->side), 4);
+    this->stack_store(0x0C, Value::pointer(Region::INPUT, 0), 4);
+    this->stack_store(0x10, Value::pointer(Region::OUTPUT, 0), 4);
+
+    try {
+      while (!this->execute_one()) {
+      }
+    } catch (const UnsupportedCode&) {
+      return std::nullopt;
+    } catch (const std::exception&) {
+      return std::nullopt; // Most likely ran off the end of the code
+    }
+    return std::move(this->ops);
   }
-  std::string data = r.read(header.area);
-  std::string code = r.read(r.size() - r.where());
 
+private:
+  struct UnsupportedCode {};
+
+  enum class Region {
+    INPUT = 0,
+    OUTPUT,
+    STACK,
+  };
+
+  struct Value {
+    enum class Type {
+      UNKNOWN = 0,
+      CONSTANT,
+      POINTER, // value is an offset from the beginning of region
+      INPUT_DATA, // value is an offset in the input buffer; size is the number of bytes loaded from there
+      RETURN_ADDRESS,
+    };
+    Type type = Type::UNKNOWN;
+    Region region = Region::INPUT;
+    int64_t value = 0;
+    uint8_t size = 4;
+
+    static Value constant(int64_t value) {
+      return Value{Type::CONSTANT, Region::INPUT, value, 4};
+    }
+    static Value pointer(Region region, int64_t offset) {
+      return Value{Type::POINTER, region, offset, 4};
+    }
+    static Value input_data(int64_t offset, uint8_t size) {
+      return Value{Type::INPUT_DATA, Region::INPUT, offset, size};
+    }
+    static Value return_address() {
+      return Value{Type::RETURN_ADDRESS, Region::INPUT, 0, 4};
+    }
+
+    // Returns the low size bytes of this value
+    Value truncate(uint8_t size) const {
+      switch (this->type) {
+        case Type::CONSTANT:
+          return Value::constant(this->value & (0xFFFFFFFFULL >> ((4 - size) * 8)));
+        case Type::INPUT_DATA:
+          // Data is big-endian, so the low bytes of a register are the last bytes that were loaded into it
+          return (size <= this->size) ? Value::input_data(this->value + this->size - size, size) : Value();
+        case Type::POINTER:
+        case Type::RETURN_ADDRESS:
+          return (size == 4) ? *this : Value();
+        default:
+          return Value();
+      }
+    }
+
+    int64_t signed_constant(uint8_t size) const {
+      if (this->type != Type::CONSTANT) {
+        throw UnsupportedCode();
+      }
+      switch (size) {
+        case 1:
+          return static_cast<int8_t>(this->value);
+        case 2:
+          return static_cast<int16_t>(this->value);
+        default:
+          return static_cast<int32_t>(this->value);
+      }
+    }
+
+    Value add(int64_t delta) const {
+      if (this->type == Type::CONSTANT) {
+        return Value::constant((this->value + delta) & 0xFFFFFFFF);
+      } else if (this->type == Type::POINTER) {
+        return Value::pointer(this->region, this->value + delta);
+      } else {
+        return Value();
+      }
+    }
+  };
+
+  struct StackEntry {
+    Value value;
+    uint8_t size;
+  };
+
+  phosg::StringReader r;
+  uint16_t side;
+  uint16_t area;
+  Value d[8];
+  Value a[8];
+  std::map<int64_t, StackEntry> stack;
+  std::vector<SpriDrawOp> ops;
+
+  // The wrapper that calls the sprite code (see decode_Spri_emulated) uses the top 0x14 bytes of a 4KB stack
+  static constexpr int64_t STACK_MIN_OFFSET = 0x14 - 0x1000;
+  static constexpr int64_t STACK_MAX_OFFSET = 0x14;
+
+  static uint8_t size_for_move_bits(uint8_t bits) {
+    // MOVE uses a different size encoding than most other instructions
+    switch (bits) {
+      case 1:
+        return 1;
+      case 3:
+        return 2;
+      case 2:
+        return 4;
+      default:
+        throw UnsupportedCode();
+    }
+  }
+
+  static uint8_t size_for_bits(uint8_t bits) {
+    if (bits > 2) {
+      throw UnsupportedCode();
+    }
+    return 1 << bits;
+  }
+
+  void stack_store(int64_t offset, const Value& value, uint8_t size) {
+    if ((offset < STACK_MIN_OFFSET) || (offset + size > STACK_MAX_OFFSET)) {
+      throw UnsupportedCode();
+    }
+    // Remove any entries that overlap the written range
+    auto it = this->stack.lower_bound(offset - 3);
+    while ((it != this->stack.end()) && (it->first < offset + size)) {
+      if (it->first + it->second.size > offset) {
+        it = this->stack.erase(it);
+      } else {
+        it++;
+      }
+    }
+    this->stack.emplace(offset, StackEntry{value.truncate(size), size});
+  }
+
+  Value stack_load(int64_t offset, uint8_t size) const {
+    if ((offset < STACK_MIN_OFFSET) || (offset + size > STACK_MAX_OFFSET)) {
+      throw UnsupportedCode();
+    }
+    auto it = this->stack.find(offset);
+    return ((it != this->stack.end()) && (it->second.size == size)) ? it->second.value : Value();
+  }
+
+  Value load(const Value& addr, uint8_t size) const {
+    if (addr.type != Value::Type::POINTER) {
+      throw UnsupportedCode();
+    }
+    switch (addr.region) {
+      case Region::INPUT:
+        if ((addr.value < 0) || (addr.value + size > this->area)) {
+          throw UnsupportedCode();
+        }
+        return Value::input_data(addr.value, size);
+      case Region::STACK:
+        return this->stack_load(addr.value, size);
+      default:
+        throw UnsupportedCode(); // The code reads from the output buffer
+    }
+  }
+
+  void store(const Value& addr, const Value& value, uint8_t size) {
+    if (addr.type != Value::Type::POINTER) {
+      throw UnsupportedCode();
+    }
+    switch (addr.region) {
+      case Region::OUTPUT: {
+        if ((addr.value < 0) || (addr.value + size > this->area)) {
+          throw UnsupportedCode();
+        }
+        Value v = value.truncate(size);
+        if (v.type == Value::Type::INPUT_DATA) {
+          this->ops.emplace_back(SpriDrawOp{
+              static_cast<uint32_t>(addr.value), static_cast<uint32_t>(v.value), size, false});
+        } else if (v.type == Value::Type::CONSTANT) {
+          this->ops.emplace_back(SpriDrawOp{
+              static_cast<uint32_t>(addr.value), static_cast<uint32_t>(v.value), size, true});
+        } else {
+          throw UnsupportedCode();
+        }
+        break;
+      }
+      case Region::STACK:
+        this->stack_store(addr.value, value, size);
+        break;
+      default:
+        throw UnsupportedCode(); // The code writes to the input buffer
+    }
+  }
+
+  // Computes the address for a memory addressing mode, applying any postincrement or predecrement
+  Value resolve_address(uint8_t mode, uint8_t reg, uint8_t size) {
+    // Byte-sized pushes and pops on A7 move it by 2 bytes, to keep it aligned
+    uint8_t step = ((reg == 7) && (size == 1)) ? 2 : size;
+    switch (mode) {
+      case 2: // (An)
+        return this->a[reg];
+      case 3: { // (An)+
+        Value ret = this->a[reg];
+        this->a[reg] = this->a[reg].add(step);
+        return ret;
+      }
+      case 4: // -(An)
+        this->a[reg] = this->a[reg].add(-static_cast<int64_t>(step));
+        return this->a[reg];
+      case 5: // (d16, An)
+        return this->a[reg].add(static_cast<int16_t>(this->r.get_u16b()));
+      case 6: { // (d8, An, Xn)
+        uint16_t ext = this->r.get_u16b();
+        if (ext & 0x0100) {
+          throw UnsupportedCode(); // 68020 full extension word format
+        }
+        const Value& index_reg = ((ext & 0x8000) ? this->a : this->d)[(ext >> 12) & 7];
+        int64_t index = index_reg.signed_constant((ext & 0x0800) ? 4 : 2) << ((ext >> 9) & 3);
+        return this->a[reg].add(static_cast<int8_t>(ext & 0xFF) + index);
+      }
+      default:
+        throw UnsupportedCode();
+    }
+  }
+
+  Value read_ea(uint8_t mode, uint8_t reg, uint8_t size) {
+    switch (mode) {
+      case 0: // Dn
+        return this->d[reg].truncate(size);
+      case 1: // An
+        return this->a[reg].truncate(size);
+      case 7:
+        if (reg == 4) { // #imm
+          if (size == 4) {
+            return Value::constant(this->r.get_u32b());
+          }
+          return Value::constant(this->r.get_u16b() & ((size == 1) ? 0xFF : 0xFFFF));
+        }
+        throw UnsupportedCode(); // Absolute and PC-relative addresses
+      default:
+        return this->load(this->resolve_address(mode, reg, size), size);
+    }
+  }
+
+  void write_ea(uint8_t mode, uint8_t reg, uint8_t size, const Value& value) {
+    switch (mode) {
+      case 0: { // Dn
+        Value& dest = this->d[reg];
+        Value v = value.truncate(size);
+        if (size == 4) {
+          dest = v;
+        } else if ((v.type == Value::Type::CONSTANT) && (dest.type == Value::Type::CONSTANT)) {
+          uint32_t mask = 0xFFFFFFFF >> ((4 - size) * 8);
+          dest = Value::constant((dest.value & ~mask) | v.value);
+        } else {
+          // The upper bytes of the register are no longer known, but the low bytes can still be stored
+          dest = (v.type == Value::Type::INPUT_DATA) ? v : Value();
+        }
+        break;
+      }
+      case 1: // An (only via MOVEA, which handles sign extension itself)
+        this->a[reg] = value;
+        break;
+      case 7:
+        throw UnsupportedCode();
+      default:
+        this->store(this->resolve_address(mode, reg, size), value, size);
+    }
+  }
+
+  // Returns true if the sprite code has returned
+  bool execute_one() {
+    uint16_t op = this->r.get_u16b();
+
+    if (op == 0x4E75) { // rts
+      Value ret_addr = this->load(this->a[7], 4);
+      this->a[7] = this->a[7].add(4);
+      if (ret_addr.type != Value::Type::RETURN_ADDRESS) {
+        throw UnsupportedCode();
+      }
+      return true;
+    }
+    if (op == 0x4E71) { // nop
+      return false;
+    }
+
+    uint8_t ea_mode = (op >> 3) & 7;
+    uint8_t ea_reg = op & 7;
+    uint8_t op_reg = (op >> 9) & 7;
+    switch (op >> 12) {
+      case 0x1:
+      case 0x2:
+      case 0x3: { // move, movea
+        uint8_t size = size_for_move_bits(op >> 12);
+        Value v = this->read_ea(ea_mode, ea_reg, size);
+        uint8_t dest_mode = (op >> 6) & 7;
+        if (dest_mode == 1) { // movea
+          if (size == 1) {
+            throw UnsupportedCode();
+          }
+          this->a[op_reg] = (size == 2) ? Value::constant(v.signed_constant(2) & 0xFFFFFFFF) : v;
+        } else {
+          this->write_ea(dest_mode, op_reg, size, v);
+        }
+        return false;
+      }
+
+      case 0x4:
+        if ((op & 0x01C0) == 0x01C0) { // lea
+          if ((ea_mode != 2) && (ea_mode != 5) && (ea_mode != 6)) {
+            throw UnsupportedCode();
+          }
+          this->a[op_reg] = this->resolve_address(ea_mode, ea_reg, 4);
+          return false;
+        }
+        if (((op & 0xFF00) == 0x4200) && (((op >> 6) & 3) != 3)) { // clr
+          this->write_ea(ea_mode, ea_reg, size_for_bits((op >> 6) & 3), Value::constant(0));
+          return false;
+        }
+        if (((op & 0xFB80) == 0x4880) && (ea_mode >= 2)) { // movem
+          this->execute_movem(op);
+          return false;
+        }
+        throw UnsupportedCode();
+
+      case 0x5: { // addq, subq (Scc and DBcc are not supported)
+        if ((op & 0x00C0) == 0x00C0) {
+          throw UnsupportedCode();
+        }
+        int64_t delta = op_reg ? op_reg : 8;
+        if (op & 0x0100) {
+          delta = -delta;
+        }
+        if (ea_mode == 1) {
+          this->a[ea_reg] = this->a[ea_reg].add(delta);
+        } else if (ea_mode == 0) {
+          uint8_t size = size_for_bits((op >> 6) & 3);
+          this->write_ea(0, ea_reg, size, this->d[ea_reg].truncate(size).add(delta));
+        } else {
+          throw UnsupportedCode();
+        }
+        return false;
+      }
+
+      case 0x7: // moveq
+        if (op & 0x0100) {
+          throw UnsupportedCode();
+        }
+        this->d[op_reg] = Value::constant(static_cast<int8_t>(op & 0xFF) & 0xFFFFFFFF);
+        return false;
+
+      case 0x9:
+      case 0xD: { // sub, suba, add, adda
+        bool is_sub = ((op >> 12) == 0x9);
+        uint8_t opmode = (op >> 6) & 7;
+        if ((opmode == 3) || (opmode == 7)) { // adda/suba
+          uint8_t size = (opmode == 3) ? 2 : 4;
+          int64_t delta = this->read_ea(ea_mode, ea_reg, size).signed_constant(size);
+          this->a[op_reg] = this->a[op_reg].add(is_sub ? -delta : delta);
+          return false;
+        }
+        if (opmode <= 2) { // <ea> +/- Dn -> Dn
+          uint8_t size = size_for_bits(opmode);
+          int64_t delta = this->read_ea(ea_mode, ea_reg, size).signed_constant(size);
+          this->write_ea(0, op_reg, size, this->d[op_reg].truncate(size).add(is_sub ? -delta : delta));
+          return false;
+        }
+        throw UnsupportedCode(); // addx, subx, or Dn +/- <ea> -> <ea>
+      }
+
+      default:
+        throw UnsupportedCode();
+    }
+  }
+
+  void execute_movem(uint16_t op) {
+    if (!(op & 0x0040)) {
+      throw UnsupportedCode(); // Word-sized movem sign-extends when loading; not worth supporting
+    }
+    bool mem_to_reg = op & 0x0400;
+    uint8_t ea_mode = (op >> 3) & 7;
+    uint8_t ea_reg = op & 7;
+    uint16_t mask = this->r.get_u16b();
+
+    // Registers are always transferred in the order D0-D7, A0-A7 (ascending memory order), but in predecrement mode
+    // the mask's bit order is reversed
+    std::vector<Value*> regs;
+    for (size_t z = 0; z < 16; z++) {
+      if (mask & (1 << ((ea_mode == 4) ? (15 - z) : z))) {
+        regs.emplace_back((z < 8) ? &this->d[z] : &this->a[z - 8]);
+      }
+    }
+
+    Value addr;
+    if (ea_mode == 4) { // -(An)
+      if (mem_to_reg) {
+        throw UnsupportedCode();
+      }
+      addr = this->a[ea_reg].add(-4 * static_cast<int64_t>(regs.size()));
+    } else if (ea_mode == 3) { // (An)+
+      if (!mem_to_reg) {
+        throw UnsupportedCode();
+      }
+      addr = this->a[ea_reg];
+    } else if ((ea_mode == 2) || (ea_mode == 5) || (ea_mode == 6)) {
+      addr = this->resolve_address(ea_mode, ea_reg, 4);
+    } else {
+      throw UnsupportedCode();
+    }
+
+    if (mem_to_reg) {
+      std::vector<Value> values;
+      for (size_t z = 0; z < regs.size(); z++) {
+        values.emplace_back(this->load(addr.add(z * 4), 4));
+      }
+      for (size_t z = 0; z < regs.size(); z++) {
+        *regs[z] = values[z];
+      }
+    } else {
+      std::vector<Value> values;
+      for (Value* reg : regs) {
+        values.emplace_back(*reg);
+      }
+      for (size_t z = 0; z < regs.size(); z++) {
+        this->store(addr.add(z * 4), values[z], 4);
+      }
+    }
+
+    if (ea_mode == 4) {
+      this->a[ea_reg] = addr;
+    } else if (ea_mode == 3) {
+      this->a[ea_reg] = addr.add(4 * regs.size());
+    }
+  }
+};
+
+// Returns the draw ops for the given sprite code, or nullptr if the code can't be translated. Many sprites share the
+// same code (for example, all sprites of the same shape), so translations are cached for the life of the process.
+static std::shared_ptr<const std::vector<SpriDrawOp>> get_Spri_draw_ops(
+    const std::string& code, uint16_t side, uint16_t area) {
+  static std::mutex cache_lock;
+  static std::unordered_map<std::string, std::shared_ptr<const std::vector<SpriDrawOp>>> cache;
+
+  std::string key(reinterpret_cast<const char*>(&side), sizeof(side));
+  key += code;
+  {
+    std::lock_guard g(cache_lock);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+      return it->second;
+    }
+  }
+
+  std::shared_ptr<const std::vector<SpriDrawOp>> ret;
+  auto ops = SpriCodeTranslator(code, side, area).translate();
+  if (ops.has_value()) {
+    ret = std::make_shared<const std::vector<SpriDrawOp>>(std::move(*ops));
+  }
+
+  std::lock_guard g(cache_lock);
+  cache.emplace(std::move(key), ret);
+  return ret;
+}
+
+static void decode_Spri_emulated(
+    const std::string& data,
+    const std::string& code,
+    uint16_t side,
+    uint16_t area,
+    std::string& output_color,
+    std::string& output_alpha) {
   // To render these sprites with accurate transparency, we have to actually execute the code they contain.
   // Fortunately, the code's interface is fairly simple (and is described below). In its original mode of operation,
   // these code snippets would be writing directly to the screen buffer, so pixels in the sprite that aren't copied to
@@ -57,19 +561,19 @@ phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vecto
 
   // Set up the output regions
   uint32_t output_color_addr = 0x10000000;
-  mem->allocate_at(output_color_addr, header.area);
-  mem->memset(output_color_addr, 0, header.area);
+  mem->allocate_at(output_color_addr, area);
+  mem->memset(output_color_addr, 0, area);
   uint32_t output_alpha_addr = 0x20000000;
-  mem->allocate_at(output_alpha_addr, header.area);
-  mem->memset(output_alpha_addr, 0, header.area);
+  mem->allocate_at(output_alpha_addr, area);
+  mem->memset(output_alpha_addr, 0, area);
 
   // Set up the input regions
   uint32_t input_color_addr = 0x40000000;
-  mem->allocate_at(input_color_addr, header.area);
-  mem->memcpy(input_color_addr, data.data(), header.area);
+  mem->allocate_at(input_color_addr, area);
+  mem->memcpy(input_color_addr, data.data(), area);
   uint32_t input_alpha_addr = 0x50000000;
-  mem->allocate_at(input_alpha_addr, header.area);
-  mem->memset(input_alpha_addr, 0xFF, header.area);
+  mem->allocate_at(input_alpha_addr, area);
+  mem->memset(input_alpha_addr, 0xFF, area);
 
   // Set up the stack
   const uint32_t stack_size = 0x1000;
@@ -99,10 +603,10 @@ phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vecto
   wrapper_code_w.put_u32b(input_color_addr);
   // push.l row_bytes
   wrapper_code_w.put_u16b(0x4879);
-  wrapper_code_w.put_u32b(header.side);
+  wrapper_code_w.put_u32b(side);
   // push.l row_bytes
   wrapper_code_w.put_u16b(0x4879);
-  wrapper_code_w.put_u32b(header.side);
+  wrapper_code_w.put_u32b(side);
   // jsr [code_addr]
   wrapper_code_w.put_u16b(0x4EB9);
   wrapper_code_w.put_u32b(code_addr);
@@ -116,10 +620,10 @@ phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vecto
   wrapper_code_w.put_u32b(input_alpha_addr);
   // push.l row_bytes
   wrapper_code_w.put_u16b(0x4879);
-  wrapper_code_w.put_u32b(header.side);
+  wrapper_code_w.put_u32b(side);
   // push.l row_bytes
   wrapper_code_w.put_u16b(0x4879);
-  wrapper_code_w.put_u32b(header.side);
+  wrapper_code_w.put_u32b(side);
   // jsr [code_addr]
   wrapper_code_w.put_u16b(0x4EB9);
   wrapper_code_w.put_u32b(code_addr);
@@ -142,14 +646,51 @@ phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vecto
   emu.execute();
 
   // The sprite renderer code has executed, giving us two buffers: one with the sprite's (indexed) color data, and
-  // another with the alpha channel. Convert these to an Image and return it.
-  const uint8_t* output_color = mem->at<const uint8_t>(output_color_addr, header.area);
-  const uint8_t* output_alpha = mem->at<const uint8_t>(output_alpha_addr, header.area);
+  // another with the alpha channel
+  output_color.assign(mem->at<const char>(output_color_addr, area), area);
+  output_alpha.assign(mem->at<const char>(output_alpha_addr, area), area);
+}
+
+phosg::ImageRGBA8888N decode_Spri(const std::string& spri_data, const std::vector<ColorTableEntry>& clut) {
+  phosg::StringReader r(spri_data);
+
+  const auto& header = r.get<SpriHeader>();
+  if (header.area != header.side * header.side) {
+    throw std::runtime_error("sprite is not square");
+  }
+  std::string data = r.read(header.area);
+  std::string code = r.read(r.size() - r.where());
+
+  // The output buffers hold the sprite's (indexed) color data and its alpha channel; see decode_Spri_emulated for
+  // why there are two of them
+  std::string output_color;
+  std::string output_alpha;
+  auto ops = get_Spri_draw_ops(code, header.side, header.area);
+  if (ops) {
+    output_color.resize(header.area, '\0');
+    output_alpha.resize(header.area, '\0');
+    for (const auto& op : *ops) {
+      if (op.is_fill) {
+        for (size_t z = 0; z < op.size; z++) {
+          uint8_t v = op.src_offset_or_value >> ((op.size - z - 1) * 8);
+          output_color[op.dest_offset + z] = v;
+          output_alpha[op.dest_offset + z] = v;
+        }
+      } else {
+        memcpy(output_color.data() + op.dest_offset, data.data() + op.src_offset_or_value, op.size);
+        memset(output_alpha.data() + op.dest_offset, 0xFF, op.size);
+      }
+    }
+  } else {
+    decode_Spri_emulated(data, code, header.side, header.area, output_color, output_alpha);
+  }
+
+  // Convert the color and alpha buffers to an Image
   phosg::ImageRGBA8888N ret(header.side, header.side);
   for (size_t y = 0; y < header.side; y++) {
     for (size_t x = 0; x < header.side; x++) {
       size_t z = (y * header.side) + x;
-      ret.write(x, y, clut.at(output_color[z]).c.rgba8888(output_alpha[z]));
+      ret.write(x, y, clut.at(static_cast<uint8_t>(output_color[z])).c.rgba8888(static_cast<uint8_t>(output_alpha[z])));
     }
   }
 
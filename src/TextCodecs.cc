@@ -1,5 +1,8 @@
 #include "TextCodecs.hh"
 
+#include <string.h>
+
+#include <array>
 #include <phosg/Strings.hh>
 
 namespace ResourceDASM {
@@ -56,11 +59,71 @@ static constexpr const char mac_roman_table[0x100][4] = {
     // clang-format on
 };
 
+static constexpr std::array<uint8_t, 0x100> mac_roman_table_lengths = []() {
+  std::array<uint8_t, 0x100> ret{};
+  for (size_t z = 0; z < 0x100; z++) {
+    // Note that this is zero for \x00, which is why NUL bytes are dropped when decoding
+    while (mac_roman_table[z][ret[z]]) {
+      ret[z]++;
+    }
+  }
+  return ret;
+}();
+
+// Bytes 20-7F decode to themselves (except / and : in filenames, which are escaped); everything else has to go
+// through the table
+static inline bool mac_roman_byte_is_plain(uint8_t ch, bool for_filename) {
+  return (ch >= 0x20) && (ch < 0x80) && !(for_filename && should_escape_mac_roman_filename_char(ch));
+}
+
+// Returns true if all 8 bytes in w satisfy mac_roman_byte_is_plain. The byte comparisons are the "determine if a word
+// has a byte less than n" and "has a zero byte" tricks from Bit Twiddling Hacks.
+static inline bool mac_roman_word_is_plain(uint64_t w, bool for_filename) {
+  constexpr uint64_t ONES = 0x0101010101010101;
+  constexpr uint64_t HIGH_BITS = 0x8080808080808080;
+  auto has_zero_byte = [](uint64_t v) -> bool {
+    return ((v - ONES) & ~v & HIGH_BITS) != 0;
+  };
+  if ((w & HIGH_BITS) || ((w - (ONES * 0x20)) & ~w & HIGH_BITS)) {
+    return false; // Some byte is 80 or above, or below 20
+  }
+  return !for_filename || (!has_zero_byte(w ^ (ONES * '/')) && !has_zero_byte(w ^ (ONES * ':')));
+}
+
+void decode_mac_roman_append(std::string& out, const char* data, size_t size, bool for_filename) {
+  // Most text is plain ASCII, so we find runs of bytes that decode to themselves (8 bytes at a time where possible)
+  // and copy each run all at once. Only the bytes between the runs are looked up in the table.
+  size_t offset = 0;
+  while (offset < size) {
+    size_t run_end = offset;
+    for (; run_end + 8 <= size; run_end += 8) {
+      uint64_t w;
+      memcpy(&w, data + run_end, sizeof(w));
+      if (!mac_roman_word_is_plain(w, for_filename)) {
+        break;
+      }
+    }
+    for (; (run_end < size) && mac_roman_byte_is_plain(data[run_end], for_filename); run_end++) {
+    }
+    out.append(data + offset, run_end - offset);
+    if (run_end >= size) {
+      break;
+    }
+
+    uint8_t ch = data[run_end];
+    if (for_filename && should_escape_mac_roman_filename_char(ch)) {
+      out.push_back('_');
+    } else {
+      out.append(mac_roman_table[ch], mac_roman_table_lengths[ch]);
+    }
+    offset = run_end + 1;
+  }
+}
+
 std::string decode_mac_roman(const char* data, size_t size, bool for_filename) {
   std::string ret;
-  while (size--) {
-    ret += decode_mac_roman(*(data++), for_filename);
-  }
+  ret.reserve(size);
+  decode_mac_roman_append(ret, data, size, for_filename);
   return ret;
 }
 
@@ -10,6 +10,9 @@ namespace ResourceDASM {
 std::string decode_mac_roman(const char* data, size_t size, bool for_filename = false);
 std::string decode_mac_roman(const std::string& data, bool for_filename = false);
 std::string decode_mac_roman(char data, bool for_filename = false);
+// Like decode_mac_roman, but appends the decoded text to out instead of returning a new string, so callers that decode
+// many strings can reuse the same buffer.
+void decode_mac_roman_append(std::string& out, const char* data, size_t size, bool for_filename = false);
 
 std::string string_for_resource_type(uint32_t type, bool for_filename = false);
 std::string raw_string_for_resource_type(uint32_t type);
@@ -5,6 +5,7 @@
 #include <phosg/Arguments.hh>
 #include <phosg/Filesystem.hh>
 
+#include "ForkWriter.hh"
 #include "IndexFormats/Formats.hh"
 #include "TextCodecs.hh"
 
@@ -22,15 +23,36 @@ int main(int argc, char** argv) {
   }
   bool separate = args.get<bool>("separate");
 
-  auto decoded = ResourceDASM::parse_binhex(phosg::load_file(input_filename));
-  auto data_f = phosg::fopen_unique(output_filename + (separate ? ".data" : ""), "wb");
-  auto rsrc_f = phosg::fopen_unique(output_filename + (separate ? ".rsrc" : "/..namedfork/rsrc"), "wb");
-  phosg::fwritex(data_f.get(), decoded.data_fork);
-  phosg::fwritex(rsrc_f.get(), decoded.resource_fork);
+  // Decode the input in chunks and write the forks as they're decoded, so large files don't have to fit in memory.
+  // The output files are created only when the decoder produces data for them, and are deleted if decoding fails, so
+  // invalid or truncated input doesn't leave empty or partial files behind.
+  auto in_f = phosg::fopen_unique(input_filename, "rb");
+  ResourceDASM::ForkWriter out(output_filename, separate);
+  ResourceDASM::BinHexDecoder decoder(
+      [&](const void* data, size_t size) -> void {
+        out.write_data(data, size);
+      },
+      [&](const void* data, size_t size) -> void {
+        out.write_resource(data, size);
+      });
+  try {
+    std::string buffer(0x10000, '\0');
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer.data(), 1, buffer.size(), in_f.get())) > 0) {
+      decoder.write(buffer.data(), bytes_read);
+    }
+    decoder.finish();
+    out.finish();
+  } catch (...) {
+    out.abort();
+    throw;
+  }
+
+  const auto& decoded = decoder.header();
   phosg::log_info_f("Note: Decoded filename is \"{}\" with type {}, creator {}, Finder flags 0x{:04X}",
       decoded.file_name, ResourceDASM::string_for_resource_type(decoded.file_type),
       ResourceDASM::string_for_resource_type(decoded.creator_code), decoded.finder_flags);
   phosg::log_info_f("{} bytes in data fork, {} bytes in resource fork",
-      decoded.data_fork.size(), decoded.resource_fork.size());
+      decoder.get_data_fork_size(), decoder.get_resource_fork_size());
   return 0;
 }
@@ -1,31 +1,161 @@
 #include <stdio.h>
+#include <string.h>
 
+#include <algorithm>
 #include <filesystem>
+#include <map>
+#include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "AtomicFile.hh"
 #include "Cli.hh"
+#include "ContentHash.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
+#include "ResourceCompression.hh"
 #include "ResourceFile.hh"
 #include "TextCodecs.hh"
 
 static constexpr char PATH_RSRCFORKSPEC[] = "/..namedfork/rsrc";
 
+// Only these fields are kept for each resource, so resources' data doesn't stay in memory while searching for
+// duplicates
+struct ResourceInfo {
+  uint32_t type;
+  int16_t id;
+  uint32_t stored_size; // Size of the data in the resource fork (which may be compressed)
+  uint64_t size; // Size of the (decompressed) data that was hashed
+  ResourceDASM::ContentHash hash;
+};
+
 struct InputFile {
   const char* filename;
-  ResourceDASM::ResourceFile resources;
-  uint32_t num_deletions;
+  std::string fork_filename;
+  uint64_t fork_size;
+  int64_t fork_mtime;
+  bool hashed;
+  std::vector<ResourceInfo> resources; // Sorted by type, then by ID
+  std::vector<std::pair<uint32_t, int16_t>> deletions;
 };
 
-struct Resource {
-  InputFile& file;
-  std::shared_ptr<const ResourceDASM::ResourceFile::Resource> resource;
-  bool is_duplicate;
+static int64_t mtime_for_file(const std::string& filename) {
+  return std::filesystem::last_write_time(filename).time_since_epoch().count();
+}
+
+static std::vector<ResourceInfo> hash_resources(const std::string& fork_filename) {
+  auto rf = ResourceDASM::parse_resource_fork(phosg::load_file(fork_filename));
+  std::vector<ResourceInfo> ret;
+  for (const auto& [type, id] : rf.all_resources()) {
+    auto stored_res = rf.get_resource(type, id, ResourceDASM::DecompressionFlag::DISABLED);
+    // Compressed resources are compared by their decompressed data
+    auto res = rf.get_resource(type, id);
+    ret.emplace_back(ResourceInfo{type, id, static_cast<uint32_t>(stored_res->data.size()), res->data.size(),
+        ResourceDASM::content_hash(res->data)});
+  }
+  return ret;
+}
+
+// The hash index stores the hashes of all resources in each input file, so that files that haven't changed since the
+// previous run don't have to be read again. Files are identified by their path, size, and modification time.
+//
+// Hash index file format:
+//   HashIndexHeader
+//   For each file:
+//     HashIndexFileEntry
+//     path (path_size bytes)
+//     HashIndexResourceEntry[num_resources]
+
+static constexpr uint32_t HASH_INDEX_MAGIC = 0x44464849; // 'DFHI'
+static constexpr uint32_t HASH_INDEX_VERSION = 1;
+
+struct HashIndexHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_uint64_t num_files;
+} __attribute__((packed));
+
+struct HashIndexFileEntry {
+  phosg::le_uint64_t fork_size;
+  phosg::le_int64_t fork_mtime;
+  phosg::le_uint32_t path_size;
+  phosg::le_uint32_t num_resources;
+} __attribute__((packed));
+
+struct HashIndexResourceEntry {
+  phosg::le_uint32_t type;
+  phosg::le_int16_t id;
+  phosg::le_uint16_t unused;
+  phosg::le_uint32_t stored_size;
+  phosg::le_uint64_t size;
+  phosg::le_uint64_t hash_high;
+  phosg::le_uint64_t hash_low;
+} __attribute__((packed));
+
+struct HashIndexEntry {
+  uint64_t fork_size;
+  int64_t fork_mtime;
+  std::vector<ResourceInfo> resources;
 };
 
+static std::unordered_map<std::string, HashIndexEntry> load_hash_index(const std::string& filename) {
+  std::unordered_map<std::string, HashIndexEntry> ret;
+
+  std::string data;
+  try {
+    data = phosg::load_file(filename);
+  } catch (const phosg::cannot_open_file&) {
+    return ret;
+  }
+
+  try {
+    phosg::StringReader r(data);
+    const auto& header = r.get<HashIndexHeader>();
+    if ((header.magic != HASH_INDEX_MAGIC) || (header.version != HASH_INDEX_VERSION)) {
+      throw std::runtime_error("unknown file format");
+    }
+    for (size_t z = 0; z < header.num_files; z++) {
+      const auto& file_entry = r.get<HashIndexFileEntry>();
+      std::string path = r.read(file_entry.path_size);
+      HashIndexEntry& entry = ret[path];
+      entry.fork_size = file_entry.fork_size;
+      entry.fork_mtime = file_entry.fork_mtime;
+      for (size_t y = 0; y < file_entry.num_resources; y++) {
+        const auto& res_entry = r.get<HashIndexResourceEntry>();
+        entry.resources.emplace_back(ResourceInfo{res_entry.type, res_entry.id, res_entry.stored_size, res_entry.size,
+            ResourceDASM::ContentHash{res_entry.hash_high, res_entry.hash_low}});
+      }
+    }
+  } catch (const std::exception& e) {
+    phosg::fwrite_fmt(stderr, "Ignoring hash index {} ({})\n", filename, e.what());
+    ret.clear();
+  }
+  return ret;
+}
+
+static void save_hash_index(const std::string& filename, const std::unordered_map<std::string, HashIndexEntry>& index) {
+  phosg::StringWriter w;
+  w.put<HashIndexHeader>(HashIndexHeader{HASH_INDEX_MAGIC, HASH_INDEX_VERSION, index.size()});
+  for (const auto& [path, entry] : index) {
+    w.put<HashIndexFileEntry>(HashIndexFileEntry{
+        entry.fork_size, entry.fork_mtime, path.size(), entry.resources.size()});
+    w.write(path);
+    for (const auto& res : entry.resources) {
+      w.put<HashIndexResourceEntry>(HashIndexResourceEntry{
+          res.type, res.id, 0, res.stored_size, res.size, res.hash.high, res.hash.low});
+    }
+  }
+
+  ResourceDASM::save_file_atomic(filename, w.str());
+}
+
 static void print_duplicates(
     int16_t first_id, const std::string& second_filename, const std::set<int16_t>& second_ids) {
   phosg::fwrite_fmt(stderr, "    ID {}: ", first_id);
@@ -54,6 +184,12 @@ the resource with the lowest ID in the earliest input file; the others\n\
 are duplicates. This means it is possible to influence which resources\n\
 are deleted by changing the order of the input files.\n\
 \n\
+Resources are compared by their size and a 128-bit hash of their contents\n\
+(compressed resources are compared by their decompressed contents). Only the\n\
+hashes are kept in memory, so any number of files can be searched at once.\n\
+With --delete, the contents of resources with matching hashes are also\n\
+compared byte for byte before any of them are deleted.\n\
+\n\
 Duplicate resources finder input options:\n\
   --data-fork\n\
       Process the file\'s data fork as if it were the resource fork.\n\
@@ -78,6 +214,20 @@ Duplicate resources finder input options:\n\
   --backup\n\
       Rename the original input file to 'input-filename.bak' before\n\
       writing the new, modified file.\n\
+  --compact\n\
+      Without --backup, duplicates are deleted by rewriting only the resource\n\
+      map of each modified file, which leaves the deleted resources\' data in\n\
+      the file as unused space. This option rewrites each modified file\n\
+      entirely instead, so no unused space remains. (With --backup, each\n\
+      modified file is always written entirely.)\n\
+  --parallel=N\n\
+      Read and hash input files on N threads. If N is 0, use as many threads\n\
+      as there are CPU cores. By default, files are read one at a time.\n\
+  --hash-index=FILENAME\n\
+      Store the hashes of all resources in each input file in this file, and\n\
+      use the stored hashes for files that haven\'t changed since the previous\n\
+      run instead of reading them again. The index can be shared between runs\n\
+      with different input files.\n\
 \n",
       stderr);
 }
@@ -95,6 +245,9 @@ int main(int argc, const char** argv) {
     bool use_data_fork = false;
     bool delete_duplicates = false;
     bool make_backup = false;
+    bool compact = false;
+    ssize_t parallelism = -1;
+    std::string hash_index_filename;
 
     for (int x = 1; x < argc; x++) {
       if (!strncmp(argv[x], "--", 2)) {
@@ -104,6 +257,12 @@ int main(int argc, const char** argv) {
           delete_duplicates = true;
         } else if (!strcmp(argv[x], "--backup")) {
           make_backup = true;
+        } else if (!strcmp(argv[x], "--compact")) {
+          compact = true;
+        } else if (!strncmp(argv[x], "--parallel=", 11)) {
+          parallelism = std::stoll(&argv[x][11], nullptr, 0);
+        } else if (!strncmp(argv[x], "--hash-index=", 13)) {
+          hash_index_filename = &argv[x][13];
         } else if (!strncmp(argv[x], "--target=", 9)) {
           ResourceDASM::ResourceIDs ids(ResourceDASM::ResourceIDs::Init::NONE);
           uint32_t type = parse_cli_type_ids(&argv[x][9], &ids);
@@ -124,86 +283,204 @@ int main(int argc, const char** argv) {
       return 2;
     }
 
-    // Load resource files
+    // Find all input files, and look up their resources in the hash index if possible. Only the hashes of the files'
+    // resources are kept in memory, so many files can be processed at once.
+    std::unordered_map<std::string, HashIndexEntry> hash_index;
+    if (!hash_index_filename.empty()) {
+      hash_index = load_hash_index(hash_index_filename);
+    }
     std::vector<InputFile> input_files;
+    std::vector<size_t> files_to_hash;
     for (const char* basename : input_filenames) {
       std::string filename = basename;
       if (!use_data_fork) {
         filename += PATH_RSRCFORKSPEC;
       }
       if (!std::filesystem::is_directory(filename) && (std::filesystem::file_size(filename) > 0)) {
-        input_files.push_back({basename, ResourceDASM::parse_resource_fork(phosg::load_file(filename)), 0});
+        auto& file = input_files.emplace_back(InputFile{
+            basename, filename, std::filesystem::file_size(filename), mtime_for_file(filename), false, {}, {}});
+        auto index_it = hash_index.find(std::filesystem::absolute(filename).string());
+        if ((index_it != hash_index.end()) &&
+            (index_it->second.fork_size == file.fork_size) &&
+            (index_it->second.fork_mtime == file.fork_mtime)) {
+          file.resources = index_it->second.resources;
+          file.hashed = true;
+        } else {
+          files_to_hash.emplace_back(input_files.size() - 1);
+        }
       } else {
         phosg::fwrite_fmt(stderr, "Input file '{}' does not exist, is empty or is not a file\n", filename);
       }
     }
 
+    // Hash the resources in all files that weren't in the index. Each file is read, hashed, and discarded on its own
+    // thread, so at most one file per thread is in memory at any time.
+    if (!files_to_hash.empty()) {
+      phosg::fwrite_fmt(stderr, "Hashing resources in {} files ({} found in hash index)\n",
+          files_to_hash.size(), input_files.size() - files_to_hash.size());
+    }
+    auto hash_file = [&](const size_t& file_index) -> void {
+      auto& file = input_files[file_index];
+      try {
+        file.resources = hash_resources(file.fork_filename);
+        file.hashed = true;
+      } catch (const std::exception& e) {
+        phosg::fwrite_fmt(stderr, "Input file '{}' cannot be read and will be skipped: {}\n", file.filename, e.what());
+      }
+    };
+    ResourceDASM::parallel_for_each(files_to_hash, hash_file, parallelism);
+    if (!hash_index_filename.empty()) {
+      for (size_t file_index : files_to_hash) {
+        const auto& file = input_files[file_index];
+        if (file.hashed) {
+          hash_index[std::filesystem::absolute(file.fork_filename).string()] = HashIndexEntry{
+              file.fork_size, file.fork_mtime, file.resources};
+        }
+      }
+    }
+
     // Gather existing resource types, if none were specified on the command line
     if (input_res_types.empty()) {
       for (const InputFile& file : input_files) {
-        for (uint32_t type : file.resources.all_resource_types()) {
-          input_res_types.emplace(type, ResourceDASM::ResourceIDs(ResourceDASM::ResourceIDs::Init::ALL));
+        for (const auto& res : file.resources) {
+          input_res_types.emplace(res.type, ResourceDASM::ResourceIDs(ResourceDASM::ResourceIDs::Init::ALL));
         }
       }
     }
 
-    // Find duplicates, one resource type at a time. For this we need to compare every resource with all other
-    // resources of the same type, which could be slow with many large resources across several files. Instead, we
-    // group the resources by their hash. With a decent hash function, this will result in very small groups. Then we
-    // only have to compare resources in a single group to weed out hash collisions: what remains are duplicates.
+    // Find duplicates of each resource type. Resources are grouped by their type, size, and content hash. Within each
+    // group, the resources are in the same order as the input files and their IDs, so the first one is the original and
+    // the others are duplicates. The hash isn't cryptographic, so before anything is deleted, the resources' data is
+    // compared too (see below).
+    struct GroupKey {
+      uint64_t size;
+      ResourceDASM::ContentHash hash;
 
-    uint32_t num_duplicates = 0;
-    for (const auto& [res_type, res_ids] : input_res_types) {
-      std::string res_type_str = ResourceDASM::string_for_resource_type(res_type);
-      phosg::fwrite_fmt(stderr, "Searching for duplicate {} resources with IDs ", res_type_str), res_ids.print(stderr, true);
+      bool operator==(const GroupKey& other) const = default;
+    };
+    struct GroupKeyHash {
+      size_t operator()(const GroupKey& k) const {
+        return std::hash<ResourceDASM::ContentHash>()(k.hash) ^ k.size;
+      }
+    };
 
-      // 1. Group resources
-      std::unordered_map<size_t, std::vector<Resource>> hashed_resources;
+    // 1. Group the resources of each type. Groups with only one resource can't contain duplicates, so they're dropped
+    // here.
+    using ResourceGroup = std::vector<std::pair<InputFile*, const ResourceInfo*>>;
+    struct TypeGroups {
+      uint32_t res_type;
+      const ResourceDASM::ResourceIDs* res_ids;
+      std::vector<ResourceGroup> candidate_groups;
+      std::vector<ResourceGroup> duplicate_groups;
+      size_t num_collisions = 0;
+    };
+    std::vector<TypeGroups> type_groups;
+    for (const auto& [res_type, res_ids] : input_res_types) {
+      std::unordered_map<GroupKey, ResourceGroup, GroupKeyHash> groups;
       for (InputFile& file : input_files) {
-        for (int16_t res_id : file.resources.all_resources_of_type(res_type)) {
-          if (res_ids[res_id]) {
-            auto resource = file.resources.get_resource(res_type, res_id);
-            size_t hash = std::hash<std::string>()(resource->data);
-            hashed_resources[hash].push_back({file, resource, /*is_duplicate*/ false});
+        auto it = std::lower_bound(file.resources.begin(), file.resources.end(), res_type,
+            [](const ResourceInfo& res, uint32_t type) -> bool { return res.type < type; });
+        for (; (it != file.resources.end()) && (it->type == res_type); it++) {
+          if (res_ids[it->id]) {
+            groups[GroupKey{it->size, it->hash}].emplace_back(&file, &*it);
+          }
+        }
+      }
+      auto& tg = type_groups.emplace_back(TypeGroups{res_type, &res_ids, {}, {}, 0});
+      for (auto& [key, resources] : groups) {
+        if (resources.size() > 1) {
+          tg.candidate_groups.emplace_back(std::move(resources));
+        }
+      }
+    }
+
+    // 2. If duplicates will be deleted, read the resources in each group again and split the group by their actual
+    // data, so resources whose hashes collide are never deleted. The candidates of all types are collected first, so
+    // each file is read only once, and only one copy of each distinct resource's data is kept in memory. Files are
+    // processed in input order and resources in type and ID order, so the first resource in each split group is still
+    // the original.
+    if (!delete_duplicates) {
+      for (auto& tg : type_groups) {
+        tg.duplicate_groups = std::move(tg.candidate_groups);
+      }
+    } else {
+      struct Candidate {
+        const ResourceInfo* res;
+        size_t type_index;
+        size_t group_index;
+      };
+      std::vector<std::vector<Candidate>> file_candidates(input_files.size());
+      // For each type and candidate group: distinct data -> index in the type's duplicate_groups
+      std::vector<std::vector<std::vector<std::pair<std::string, size_t>>>> group_contents;
+      for (size_t type_index = 0; type_index < type_groups.size(); type_index++) {
+        const auto& candidate_groups = type_groups[type_index].candidate_groups;
+        group_contents.emplace_back(candidate_groups.size());
+        for (size_t group_index = 0; group_index < candidate_groups.size(); group_index++) {
+          for (const auto& [file, res] : candidate_groups[group_index]) {
+            file_candidates[file - input_files.data()].emplace_back(Candidate{res, type_index, group_index});
+          }
+        }
+      }
+      for (size_t file_index = 0; file_index < input_files.size(); file_index++) {
+        auto& candidates = file_candidates[file_index];
+        if (candidates.empty()) {
+          continue;
+        }
+        // Resources are sorted by type and ID within each file, so this sorts the candidates by type and ID
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) -> bool {
+          return a.res < b.res;
+        });
+        InputFile& file = input_files[file_index];
+        auto rf = ResourceDASM::parse_resource_fork(phosg::load_file(file.fork_filename));
+        for (const auto& candidate : candidates) {
+          auto& tg = type_groups[candidate.type_index];
+          std::string data = rf.get_resource(candidate.res->type, candidate.res->id)->data;
+          auto& contents = group_contents[candidate.type_index][candidate.group_index];
+          auto it = std::find_if(contents.begin(), contents.end(), [&](const auto& c) { return c.first == data; });
+          if (it == contents.end()) {
+            if (!contents.empty()) {
+              tg.num_collisions++;
+            }
+            it = contents.emplace(contents.end(), std::move(data), tg.duplicate_groups.size());
+            tg.duplicate_groups.emplace_back();
           }
+          tg.duplicate_groups[it->second].emplace_back(&file, candidate.res);
         }
       }
+    }
 
-      // 2. Look for duplicates in each group
+    uint32_t num_duplicates = 0;
+    uint64_t duplicate_bytes = 0;
+    for (const auto& tg : type_groups) {
+      std::string res_type_str = ResourceDASM::string_for_resource_type(tg.res_type);
+      phosg::fwrite_fmt(stderr, "Searching for duplicate {} resources with IDs ", res_type_str), tg.res_ids->print(stderr, true);
+      if (tg.num_collisions) {
+        phosg::fwrite_fmt(stderr,
+            "  {} {} resources have the same hash as a different resource and are not duplicates\n",
+            tg.num_collisions, res_type_str);
+      }
+
+      // 3. Collect the duplicates in each group
       //  first filename -> first ID -> second filename -> second ID
       std::map<std::string, std::map<int16_t, std::map<std::string, std::set<int16_t>>>> duplicates;
-
-      for (auto& [hash, resources] : hashed_resources) {
-        // Compare the first resource with those after it, then the second resource
-        // with those after it, and so on. Ignore resources that have already been
-        // determined to be duplicates
-        for (auto first = resources.begin(); first != resources.end(); ++first) {
-          if (!first->is_duplicate) {
-            for (auto second = next(first); second != resources.end(); ++second) {
-              if (!second->is_duplicate) {
-                if (first->resource->data == second->resource->data) {
-                  duplicates[first->file.filename][first->resource->id][second->file.filename].insert(second->resource->id);
-
-                  if (delete_duplicates) {
-                    // Delete duplicate
-                    second->file.resources.remove(second->resource->type, second->resource->id);
-                    ++second->file.num_deletions;
-                  }
-
-                  ++num_duplicates;
-
-                  // Mark resource as duplicate so we don't check it again, then
-                  // continue to look for duplicates, as there might be more than
-                  // one
-                  second->is_duplicate = true;
-                }
-              }
-            }
+      uint32_t type_num_duplicates = 0;
+      uint64_t type_duplicate_bytes = 0;
+      for (const auto& resources : tg.duplicate_groups) {
+        const auto& [first_file, first_res] = resources.front();
+        for (size_t z = 1; z < resources.size(); z++) {
+          const auto& [second_file, second_res] = resources[z];
+          duplicates[first_file->filename][first_res->id][second_file->filename].insert(second_res->id);
+          if (delete_duplicates) {
+            second_file->deletions.emplace_back(second_res->type, second_res->id);
           }
+          type_num_duplicates++;
+          type_duplicate_bytes += second_res->stored_size;
         }
       }
+      num_duplicates += type_num_duplicates;
+      duplicate_bytes += type_duplicate_bytes;
 
-      // 3. Print duplicates
+      // 4. Print duplicates
       if (!duplicates.empty()) {
         for (const auto& [first_filename, first_ids] : duplicates) {
           phosg::fwrite_fmt(stderr, "  The following {} resources in file '{}' have duplicates:\n", res_type_str, first_filename);
@@ -221,34 +498,69 @@ int main(int argc, const char** argv) {
             }
           }
         }
+        phosg::fwrite_fmt(stderr, "  {} duplicate {} resources ({} bytes reclaimable)\n",
+            type_num_duplicates, res_type_str, type_duplicate_bytes);
       }
     }
 
     // If any resources were deleted, write the modified files to disk
     if (delete_duplicates) {
-      for (const InputFile& file : input_files) {
-        if (file.num_deletions > 0) {
+      for (InputFile& file : input_files) {
+        if (!file.deletions.empty()) {
           std::string filename = file.filename;
           if (make_backup) {
-            std::filesystem::rename(filename, filename + ".bak");
-          }
-          std::string output_data = serialize_resource_fork(file.resources);
+            // The original file's data isn't in memory anymore, so it has to be read again here
+            auto rf = ResourceDASM::parse_resource_fork(phosg::load_file(file.fork_filename));
+            for (const auto& [type, id] : file.deletions) {
+              rf.remove(type, id);
+            }
+            std::string output_data = serialize_resource_fork(rf);
 
-          if (!use_data_fork) {
-            if (make_backup) {
+            std::filesystem::rename(filename, filename + ".bak");
+            if (!use_data_fork) {
               // Attempting to open the resource fork of a nonexistent file will fail without creating the file, so we
               // touch the file first to make sure it will exist when we write the output.
               (void)phosg::fopen_unique(filename, "a+");
+              filename += PATH_RSRCFORKSPEC;
+            }
+            phosg::save_file(filename, output_data);
+
+          } else {
+            // Only the resource map needs to be rewritten here (unless compacting); the data of the remaining resources
+            // doesn't move
+            ResourceDASM::ResourceForkEditor editor(file.fork_filename);
+            for (const auto& [type, id] : file.deletions) {
+              if (!editor.remove(type, id)) {
+                throw std::logic_error("duplicate resource is missing from resource map");
+              }
+            }
+            if (compact) {
+              editor.compact();
+            } else {
+              editor.save();
             }
-            filename += PATH_RSRCFORKSPEC;
           }
-          phosg::save_file(filename, output_data);
-          phosg::fwrite_fmt(stderr, "Saved file '{}' with {} deletions\n", file.filename, file.num_deletions);
+          phosg::fwrite_fmt(stderr, "Saved file '{}' with {} deletions\n", file.filename, file.deletions.size());
+
+          // The remaining resources didn't change, so the index entry can be updated without reading the file again
+          if (!hash_index_filename.empty()) {
+            std::set<std::pair<uint32_t, int16_t>> deleted(file.deletions.begin(), file.deletions.end());
+            std::erase_if(file.resources, [&](const ResourceInfo& res) -> bool {
+              return deleted.count(std::make_pair(res.type, res.id));
+            });
+            hash_index[std::filesystem::absolute(file.fork_filename).string()] = HashIndexEntry{
+                std::filesystem::file_size(file.fork_filename), mtime_for_file(file.fork_filename), file.resources};
+          }
         }
       }
     }
 
-    phosg::fwrite_fmt(stderr, "Found{} {} duplicates\n", delete_duplicates ? " and deleted" : "", num_duplicates);
+    if (!hash_index_filename.empty()) {
+      save_hash_index(hash_index_filename, hash_index);
+    }
+
+    phosg::fwrite_fmt(stderr, "Found{} {} duplicates ({} bytes)\n",
+        delete_duplicates ? " and deleted" : "", num_duplicates, duplicate_bytes);
 
     return 0;
   } catch (const std::exception& e) {
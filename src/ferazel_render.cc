@@ -11,8 +11,10 @@
 #include <stdexcept>
 #include <vector>
 
+#include "DecodedImageCache.hh"
 #include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 
 struct SpritePictDefinition {
@@ -748,106 +750,125 @@ struct FerazelsWandLevel {
   }
 } __attribute__((packed));
 
-static std::shared_ptr<phosg::ImageRGBA8888N> decode_PICT_cached(
-    int16_t id,
-    std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>>& cache,
-    ResourceDASM::ResourceFile& rf) {
-  try {
-    return cache.at(id);
-  } catch (const std::out_of_range&) {
-    try {
-      auto decode_result = rf.decode_PICT(id);
-      if (!decode_result.embedded_image_format.empty()) {
-        throw std::runtime_error(std::format("PICT {} is an embedded image", id));
-      }
-      return cache.emplace(id, std::make_shared<phosg::ImageRGBA8888N>(std::move(decode_result.image))).first->second;
-
-    } catch (const std::out_of_range&) {
-      return nullptr;
-    }
-  }
-}
-
-static std::shared_ptr<phosg::ImageRGBA8888N> truncate_whitespace(std::shared_ptr<phosg::ImageRGBA8888N> img) {
+static phosg::ImageRGBA8888N truncate_whitespace(const phosg::ImageRGBA8888N& img) {
   // Top rows
   size_t x, y;
-  for (y = 0; y < img->get_height(); y++) {
-    for (x = 0; x < img->get_width(); x++) {
-      uint32_t c = img->read(x, y);
+  for (y = 0; y < img.get_height(); y++) {
+    for (x = 0; x < img.get_width(); x++) {
+      uint32_t c = img.read(x, y);
       if ((c & 0xFFFFFF00) != 0xFFFFFF00) {
         break;
       }
     }
-    if (x != img->get_width()) {
+    if (x != img.get_width()) {
       break;
     }
   }
   size_t top_rows_to_remove = y;
-  if (top_rows_to_remove == img->get_height()) {
+  if (top_rows_to_remove == img.get_height()) {
     // Entire image is white; remove all of it
-    return std::make_shared<phosg::ImageRGBA8888N>();
+    return phosg::ImageRGBA8888N();
   }
 
   // Left columns
-  for (x = 0; x < img->get_width(); x++) {
-    for (y = 0; y < img->get_height(); y++) {
-      uint32_t c = img->read(x, y);
+  for (x = 0; x < img.get_width(); x++) {
+    for (y = 0; y < img.get_height(); y++) {
+      uint32_t c = img.read(x, y);
       if ((c & 0xFFFFFF00) != 0xFFFFFF00) {
         break;
       }
     }
-    if (y != img->get_height()) {
+    if (y != img.get_height()) {
       break;
     }
   }
   size_t left_columns_to_remove = y;
-  if (left_columns_to_remove == img->get_width()) {
+  if (left_columns_to_remove == img.get_width()) {
     throw std::logic_error("entire image is white, but did not catch this already");
   }
 
   // Bottom rows
-  for (y = img->get_height() - 1; y > 0; y--) {
-    for (x = 0; x < img->get_width(); x++) {
-      uint32_t c = img->read(x, y);
+  for (y = img.get_height() - 1; y > 0; y--) {
+    for (x = 0; x < img.get_width(); x++) {
+      uint32_t c = img.read(x, y);
       if ((c & 0xFFFFFF00) != 0xFFFFFF00) {
         break;
       }
     }
-    if (x != img->get_width()) {
+    if (x != img.get_width()) {
       break;
     }
   }
-  size_t bottom_rows_to_remove = img->get_height() - 1 - y;
-  if (bottom_rows_to_remove == img->get_height()) {
+  size_t bottom_rows_to_remove = img.get_height() - 1 - y;
+  if (bottom_rows_to_remove == img.get_height()) {
     throw std::logic_error("entire image is white, but did not catch this already");
   }
 
   // Left columns
-  for (x = img->get_width() - 1; x > 0; x--) {
-    for (y = 0; y < img->get_height(); y++) {
-      uint32_t c = img->read(x, y);
+  for (x = img.get_width() - 1; x > 0; x--) {
+    for (y = 0; y < img.get_height(); y++) {
+      uint32_t c = img.read(x, y);
       if ((c & 0xFFFFFF00) != 0xFFFFFF00) {
         break;
       }
     }
-    if (y != img->get_height()) {
+    if (y != img.get_height()) {
       break;
     }
   }
-  size_t right_columns_to_remove = img->get_width() - 1 - x;
-  if (right_columns_to_remove == img->get_width()) {
+  size_t right_columns_to_remove = img.get_width() - 1 - x;
+  if (right_columns_to_remove == img.get_width()) {
     throw std::logic_error("entire image is white, but did not catch this already");
   }
 
   if (top_rows_to_remove || bottom_rows_to_remove || left_columns_to_remove || right_columns_to_remove) {
-    auto new_image = std::make_shared<phosg::ImageRGBA8888N>(
-        img->get_width() - left_columns_to_remove - right_columns_to_remove,
-        img->get_height() - top_rows_to_remove - bottom_rows_to_remove);
-    new_image->copy_from(
-        *img, 0, 0, new_image->get_width(), new_image->get_height(), left_columns_to_remove, top_rows_to_remove);
+    phosg::ImageRGBA8888N new_image(
+        img.get_width() - left_columns_to_remove - right_columns_to_remove,
+        img.get_height() - top_rows_to_remove - bottom_rows_to_remove);
+    new_image.copy_from(
+        img, 0, 0, new_image.get_width(), new_image.get_height(), left_columns_to_remove, top_rows_to_remove);
     return new_image;
   } else {
-    return img;
+    return img.copy();
+  }
+}
+
+// Decodes a PICT through the shared image cache. options may be empty, "reverse_horizontal", or
+// "truncate_whitespace"; the transformed images are cached separately from the original. Returns nullptr if the PICT
+// doesn't exist.
+static std::shared_ptr<const phosg::ImageRGBA8888N> decode_PICT_cached(
+    ResourceDASM::DecodedImageCache& cache,
+    const std::string& file_key,
+    const ResourceDASM::ResourceFile& rf,
+    int16_t id,
+    const std::string& options = "") {
+  try {
+    return cache.get_resource(file_key, rf, ResourceDASM::RESOURCE_TYPE_PICT, id, options,
+        [&](const ResourceDASM::ResourceFile::Resource& res) -> phosg::ImageRGBA8888N {
+          if (!options.empty()) {
+            auto orig = decode_PICT_cached(cache, file_key, rf, id);
+            if (!orig) {
+              throw std::out_of_range(std::format("cannot decode PICT {}", id));
+            }
+            if (options == "reverse_horizontal") {
+              auto ret = orig->copy();
+              ret.reverse_horizontal();
+              return ret;
+            } else if (options == "truncate_whitespace") {
+              return truncate_whitespace(*orig);
+            } else {
+              throw std::logic_error("unknown PICT decode options: " + options);
+            }
+          }
+
+          auto decode_result = rf.decode_PICT(res.data.data(), res.data.size());
+          if (!decode_result.embedded_image_format.empty()) {
+            throw std::runtime_error(std::format("PICT {} is an embedded image", id));
+          }
+          return std::move(decode_result.image);
+        });
+  } catch (const std::out_of_range&) {
+    return nullptr;
   }
 }
 
@@ -885,7 +906,15 @@ Options:\n\
       Render the parallax foreground at the bottom with the given opacity\n\
       (0-255; default 0).\n\
   --print-unused-pict-ids\n\
-      When done, print the IDs of all the PICT resources that were not used.\n\n" IMAGE_SAVER_HELP);
+      When done, print the IDs of all the PICT resources that were not used.\n\
+  --cache-dir=DIR\n\
+      Store decoded images in this directory, and reuse them in later runs\n\
+      instead of decoding them again. Stale images are never deleted from\n\
+      this directory; to purge it, delete the directory.\n\
+  --parallel=N\n\
+      Render N levels at once. If N is 0, use one thread per CPU core. The\n\
+      resource files are only parsed once, and decoded images are shared\n\
+      between all threads.\n\n" IMAGE_SAVER_HELP);
 }
 
 int main(int argc, char** argv) {
@@ -897,6 +926,8 @@ int main(int argc, char** argv) {
   bool render_sprites = true;
   uint8_t parallax_foreground_opacity = 0;
   bool print_unused_pict_ids = false;
+  std::string cache_dir;
+  ssize_t parallelism = -1;
   ResourceDASM::ImageSaver image_saver;
 
   std::string levels_filename = "Ferazel\'s Wand World Data";
@@ -935,6 +966,10 @@ int main(int argc, char** argv) {
       render_parallax_backgrounds = false;
     } else if (!strcmp(argv[z], "--print-unused-pict-ids")) {
       print_unused_pict_ids = true;
+    } else if (!strncmp(argv[z], "--cache-dir=", 12)) {
+      cache_dir = &argv[z][12];
+    } else if (!strncmp(argv[z], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[z][11], nullptr, 0);
     } else if (!image_saver.process_cli_arg(argv[z])) {
       phosg::fwrite_fmt(stderr, "invalid option: {}\n", argv[z]);
       print_usage();
@@ -954,13 +989,12 @@ int main(int argc, char** argv) {
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>> backgrounds_cache;
-  std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>> sprites_cache;
-  std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>> reversed_sprites_cache;
+  ResourceDASM::DecodedImageCache image_cache(cache_dir);
+  ResourceDASM::ImageWriteQueue write_queue(image_saver);
 
-  for (int16_t level_id : level_resources) {
+  auto render_level = [&](const int16_t& level_id) -> void {
     if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+      return;
     }
 
     std::string level_data = levels.get_resource(level_resource_type, level_id)->data;
@@ -968,7 +1002,7 @@ int main(int argc, char** argv) {
 
     if (level->signature != 0x04277DC9) {
       phosg::fwrite_fmt(stderr, "... {} (incorrect signature: {:08X})\n", level_id, level->signature);
-      continue;
+      return;
     }
 
     // If we're rendering sprites, find out how much space to reserve for out-of-bounds sprites
@@ -1013,7 +1047,8 @@ int main(int argc, char** argv) {
           }
 
           int16_t pict_id = sprite_def ? sprite_def->pict_id : sprite.type.load();
-          std::shared_ptr<phosg::ImageRGBA8888N> sprite_pict = decode_PICT_cached(pict_id, sprites_cache, sprites);
+          std::shared_ptr<const phosg::ImageRGBA8888N> sprite_pict = decode_PICT_cached(
+              image_cache, sprites_filename, sprites, pict_id);
           if (sprite_pict.get()) {
             sprite_right = sprite.x + sprite_pict->get_width();
             sprite_bottom = sprite.y + sprite_pict->get_height();
@@ -1061,18 +1096,20 @@ int main(int argc, char** argv) {
     phosg::ImageRGB888 result = full_result.view(left_space, top_space, level->width * 32, level->height * 32);
 
     if (render_parallax_backgrounds) {
-      std::shared_ptr<phosg::ImageRGBA8888N> pxback_pict;
+      std::shared_ptr<const phosg::ImageRGBA8888N> pxback_pict;
 
       if (level->abstract_background) {
         phosg::fwrite_fmt(stderr, "... (Level {}) abstract background\n", level_id);
         if (level->abstract_background == 1) {
-          pxback_pict = decode_PICT_cached(6000, sprites_cache, sprites);
+          pxback_pict = decode_PICT_cached(image_cache, sprites_filename, sprites, 6000);
         } else if (level->abstract_background == 6) {
           // This one is animated with all frames in one PICT; just pick the first frame
-          std::shared_ptr<phosg::ImageRGBA8888N> loaded = decode_PICT_cached(357, backgrounds_cache, backgrounds);
+          std::shared_ptr<const phosg::ImageRGBA8888N> loaded = decode_PICT_cached(
+              image_cache, backgrounds_filename, backgrounds, 357);
           if (loaded.get()) {
-            pxback_pict = std::make_shared<phosg::ImageRGBA8888N>(128, 128);
-            pxback_pict->copy_from_with_blend(*loaded, 0, 0, 128, 128, 0, 0);
+            auto first_frame = std::make_shared<phosg::ImageRGBA8888N>(128, 128);
+            first_frame->copy_from_with_blend(*loaded, 0, 0, 128, 128, 0, 0);
+            pxback_pict = first_frame;
           }
         } else if (level->abstract_background != 0) {
           // 2=magic (600? 601?)
@@ -1094,7 +1131,8 @@ int main(int argc, char** argv) {
           }
         }
       } else {
-        pxback_pict = decode_PICT_cached(level->parallax_background_pict_id, backgrounds_cache, backgrounds);
+        pxback_pict = decode_PICT_cached(
+            image_cache, backgrounds_filename, backgrounds, level->parallax_background_pict_id);
 
         if (pxback_pict.get()) {
           phosg::fwrite_fmt(stderr, "... (Level {}) parallax background\n", level_id);
@@ -1200,20 +1238,19 @@ int main(int argc, char** argv) {
     const auto* foreground_tiles = level->foreground_tiles();
     const auto* background_tiles = level->background_tiles();
     if (foreground_opacity || background_opacity) {
-      std::shared_ptr<phosg::ImageRGBA8888N> foreground_blend_mask_pict = foreground_opacity
-          ? decode_PICT_cached(185, sprites_cache, sprites)
+      std::shared_ptr<const phosg::ImageRGBA8888N> foreground_blend_mask_pict = foreground_opacity
+          ? decode_PICT_cached(image_cache, sprites_filename, sprites, 185)
           : nullptr;
       // TODO: are these the right defaults?
-      std::shared_ptr<phosg::ImageRGBA8888N> foreground_pict = decode_PICT_cached(
-          level->foreground_tile_pict_id ? level->foreground_tile_pict_id.load() : 200,
-          backgrounds_cache, backgrounds);
-      std::shared_ptr<phosg::ImageRGBA8888N> background_pict = decode_PICT_cached(
-          level->background_tile_pict_id ? level->background_tile_pict_id.load() : 203,
-          backgrounds_cache, backgrounds);
-      std::shared_ptr<phosg::ImageRGBA8888N> orig_wall_tile_pict = decode_PICT_cached(
-          level->wall_tile_pict_id ? level->wall_tile_pict_id.load() : 206,
-          backgrounds_cache, backgrounds);
-      std::shared_ptr<phosg::ImageRGBA8888N> wall_tile_pict = orig_wall_tile_pict.get() ? truncate_whitespace(orig_wall_tile_pict) : nullptr;
+      std::shared_ptr<const phosg::ImageRGBA8888N> foreground_pict = decode_PICT_cached(
+          image_cache, backgrounds_filename, backgrounds,
+          level->foreground_tile_pict_id ? level->foreground_tile_pict_id.load() : 200);
+      std::shared_ptr<const phosg::ImageRGBA8888N> background_pict = decode_PICT_cached(
+          image_cache, backgrounds_filename, backgrounds,
+          level->background_tile_pict_id ? level->background_tile_pict_id.load() : 203);
+      std::shared_ptr<const phosg::ImageRGBA8888N> wall_tile_pict = decode_PICT_cached(
+          image_cache, backgrounds_filename, backgrounds,
+          level->wall_tile_pict_id ? level->wall_tile_pict_id.load() : 206, "truncate_whitespace");
 
       if (background_opacity) {
         phosg::fwrite_fmt(stderr, "... (Level {}) background tiles\n", level_id);
@@ -1503,18 +1540,9 @@ int main(int argc, char** argv) {
           }
 
           int16_t pict_id = sprite_def ? sprite_def->pict_id : sprite.type.load();
-          std::shared_ptr<phosg::ImageRGBA8888N> sprite_pict = decode_PICT_cached(pict_id, sprites_cache, sprites);
-
-          if (sprite_pict.get() && sprite_def && sprite_def->reverse_horizontal) {
-            try {
-              sprite_pict = reversed_sprites_cache.at(pict_id);
-            } catch (const std::out_of_range&) {
-              auto reversed_image = std::make_shared<phosg::ImageRGBA8888N>(sprite_pict->copy());
-              reversed_image->reverse_horizontal();
-              reversed_sprites_cache.emplace(pict_id, reversed_image);
-              sprite_pict = reversed_image;
-            }
-          }
+          std::shared_ptr<const phosg::ImageRGBA8888N> sprite_pict = decode_PICT_cached(
+              image_cache, sprites_filename, sprites, pict_id,
+              (sprite_def && sprite_def->reverse_horizontal) ? "reverse_horizontal" : "");
 
           if (sprite_pict.get()) {
             size_t src_x = 0;
@@ -1822,7 +1850,8 @@ int main(int argc, char** argv) {
     }
 
     if (parallax_foreground_opacity > 0) {
-      std::shared_ptr<phosg::ImageRGBA8888N> pxmid_pict = decode_PICT_cached(level->parallax_middle_pict_id, backgrounds_cache, backgrounds);
+      std::shared_ptr<const phosg::ImageRGBA8888N> pxmid_pict = decode_PICT_cached(
+          image_cache, backgrounds_filename, backgrounds, level->parallax_middle_pict_id);
 
       if (pxmid_pict.get()) {
         phosg::fwrite_fmt(stderr, "... (Level {}) parallax foreground\n", level_id);
@@ -1857,15 +1886,24 @@ int main(int argc, char** argv) {
     }
 
     std::string result_filename = std::format("{}_Level_{}_{}", levels_filename, level_id, sanitized_name);
-    result_filename = image_saver.save_image(full_result, result_filename);
+    result_filename = write_queue.save_image(full_result, result_filename);
     phosg::fwrite_fmt(stderr, "... (Level {}) -> {}\n", level_id, result_filename);
+  };
+
+  if (ResourceDASM::resolve_num_threads(parallelism) > 1) {
+    // The resource files and image cache are shared between all the rendering threads
+    levels.decompress_all_resources();
+    sprites.decompress_all_resources();
+    backgrounds.decompress_all_resources();
   }
+  ResourceDASM::parallel_for_each(level_resources, render_level, parallelism);
+  write_queue.finish();
 
   if (print_unused_pict_ids) {
     auto sprite_pict_ids = sprites.all_resources_of_type(ResourceDASM::RESOURCE_TYPE_PICT);
     sort(sprite_pict_ids.begin(), sprite_pict_ids.end());
     for (int16_t pict_id : sprite_pict_ids) {
-      if (!sprites_cache.count(pict_id)) {
+      if (!image_cache.was_requested(sprites_filename, ResourceDASM::RESOURCE_TYPE_PICT, pict_id)) {
         phosg::fwrite_fmt(stderr, "sprite pict {} UNUSED\n", pict_id);
       } else {
         phosg::fwrite_fmt(stderr, "sprite pict {} used\n", pict_id);
@@ -1874,7 +1912,7 @@ int main(int argc, char** argv) {
     auto background_pict_ids = backgrounds.all_resources_of_type(ResourceDASM::RESOURCE_TYPE_PICT);
     sort(background_pict_ids.begin(), background_pict_ids.end());
     for (int16_t pict_id : background_pict_ids) {
-      if (!backgrounds_cache.count(pict_id)) {
+      if (!image_cache.was_requested(backgrounds_filename, ResourceDASM::RESOURCE_TYPE_PICT, pict_id)) {
         phosg::fwrite_fmt(stderr, "background pict {} UNUSED\n", pict_id);
       } else {
         phosg::fwrite_fmt(stderr, "background pict {} used\n", pict_id);
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,14 +8,20 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <filesystem>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Strings.hh>
+#include <set>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "ExecutableFormats/GameCubeImages.hh"
+#include "FileCopy.hh"
+#include "Parallel.hh"
 
 struct FST {
   std::vector<ResourceDASM::FSTEntry> entries;
@@ -31,23 +38,35 @@ struct FST {
     return this->entries.size() * sizeof(ResourceDASM::FSTEntry) + this->strings.size();
   }
 
-  void write(FILE* f) const {
-    phosg::fwritex(f, this->entries.data(), sizeof(ResourceDASM::FSTEntry) * this->entries.size());
-    phosg::fwritex(f, this->strings.str());
-    while (ftell(f) & 0xFF) {
-      fputc(0, f);
-    }
+  std::string data() const {
+    std::string ret(reinterpret_cast<const char*>(this->entries.data()),
+        sizeof(ResourceDASM::FSTEntry) * this->entries.size());
+    ret += this->strings.str();
+    ret.resize((ret.size() + 0xFF) & ~0xFF, '\0');
+    return ret;
   }
 };
 
+int64_t mtime_for_file(const std::string& filename) {
+  return std::filesystem::last_write_time(filename).time_since_epoch().count();
+}
+
 struct File {
   std::string src_path;
   std::string name;
   size_t image_offset;
   size_t size;
+  int64_t mtime;
+  // The hash of the file's contents (see hash_file), if it's known
+  uint64_t hash = 0;
+  bool has_hash = false;
+  bool needs_write = true;
 
   explicit File(const std::string& src_path)
-      : src_path(src_path), name(phosg::basename(this->src_path)), size(std::filesystem::file_size(this->src_path)) {
+      : src_path(src_path),
+        name(phosg::basename(this->src_path)),
+        size(std::filesystem::file_size(this->src_path)),
+        mtime(mtime_for_file(this->src_path)) {
     phosg::log_info_f("Add file: {} (as {})", this->src_path, this->name);
   }
 
@@ -78,6 +97,20 @@ struct Directory {
   }
 };
 
+// Returns a hash of the first size bytes of a file, without reading more than COPY_CHUNK_SIZE bytes into memory at
+// once. This is FNV-1a, which isn't cryptographic, but is enough to detect source files whose contents have changed.
+uint64_t hash_file(const std::string& path, uint64_t size) {
+  phosg::scoped_fd fd(path, O_RDONLY);
+  std::string buffer(std::min<uint64_t>(size, ResourceDASM::COPY_CHUNK_SIZE), '\0');
+  uint64_t hash = phosg::fnv1a64(buffer.data(), 0); // The initial FNV-1a state
+  for (uint64_t offset = 0; offset < size; offset += buffer.size()) {
+    size_t chunk_size = std::min<uint64_t>(size - offset, buffer.size());
+    phosg::preadx(fd, buffer.data(), chunk_size, offset);
+    hash = phosg::fnv1a64(buffer.data(), chunk_size, hash);
+  }
+  return hash;
+}
+
 size_t align(size_t offset, size_t alignment) {
   return (offset + alignment - 1) & ~(alignment - 1);
 }
@@ -125,6 +158,272 @@ FST generate_fst(const Directory& root) {
   return fst;
 }
 
+// The layout of an image written by a previous gcmasm run, used when building incrementally. All offsets here are
+// relative to the beginning of the GCM data (that is, they don't include the TGC header, if present).
+struct ExistingImage {
+  struct Extent {
+    size_t offset;
+    size_t size;
+    // These describe the source file that was copied into this extent, and come from the build index
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+    bool has_hash = false;
+    bool indexed = false;
+  };
+
+  std::string header_data;
+  size_t dol_offset;
+  size_t fst_offset;
+  std::unordered_map<std::string, Extent> files; // Keyed by path within the image, e.g. "dir/subdir/file.bin"
+  std::set<size_t> allocated_offsets; // Offsets of default.dol, the FST, and all nonempty files
+
+  // Returns the number of bytes available at offset before the next allocated region begins
+  size_t capacity_at(size_t offset) const {
+    auto it = this->allocated_offsets.upper_bound(offset);
+    return (it == this->allocated_offsets.end()) ? SIZE_MAX : (*it - offset);
+  }
+};
+
+ExistingImage load_existing_image(const std::string& filename, bool tgc) {
+  ExistingImage ret;
+  phosg::scoped_fd fd(filename, O_RDONLY);
+
+  // Only TGC images with the layout that gcmasm produces are supported here, since the file offsets in the FST are
+  // assumed to be relative to the GCM header
+  size_t gcm_offset = 0;
+  if (tgc) {
+    std::string tgc_header_data = phosg::preadx(fd, sizeof(ResourceDASM::TGCHeader), 0);
+    const auto* tgc_header = reinterpret_cast<const ResourceDASM::TGCHeader*>(tgc_header_data.data());
+    if ((tgc_header->magic != 0xAE0F38A2) ||
+        (tgc_header->header_size != sizeof(ResourceDASM::TGCHeader)) ||
+        (tgc_header->file_area != sizeof(ResourceDASM::TGCHeader)) ||
+        (tgc_header->file_offset_base != 0)) {
+      throw std::runtime_error("existing image is not a TGC image generated by gcmasm");
+    }
+    gcm_offset = sizeof(ResourceDASM::TGCHeader);
+  }
+
+  ret.header_data = phosg::preadx(fd, sizeof(ResourceDASM::GCMHeader), gcm_offset);
+  const auto* header = reinterpret_cast<const ResourceDASM::GCMHeader*>(ret.header_data.data());
+  if (header->gc_magic != 0xC2339F3D) {
+    throw std::runtime_error("existing image is not a GCM image");
+  }
+  ret.dol_offset = header->dol_offset;
+  ret.fst_offset = header->fst_offset;
+
+  std::string fst_data = phosg::preadx(fd, header->fst_size, gcm_offset + header->fst_offset);
+  const auto* fst = reinterpret_cast<const ResourceDASM::FSTEntry*>(fst_data.data());
+  size_t num_entries = (fst_data.size() >= sizeof(ResourceDASM::FSTEntry)) ? fst[0].size.end_entry_num.load() : 0;
+  if ((num_entries == 0) || (num_entries > fst_data.size() / sizeof(ResourceDASM::FSTEntry))) {
+    throw std::runtime_error("existing image has an invalid FST");
+  }
+  const char* string_table = fst_data.data() + sizeof(ResourceDASM::FSTEntry) * num_entries;
+  size_t string_table_size = fst_data.size() - sizeof(ResourceDASM::FSTEntry) * num_entries;
+
+  std::function<void(size_t, size_t, const std::string&)> add_entries;
+  add_entries = [&](size_t start, size_t end, const std::string& prefix) -> void {
+    for (size_t x = start; x < end; x++) {
+      size_t string_offset = fst[x].string_offset();
+      if (string_offset >= string_table_size) {
+        throw std::runtime_error("existing image has an invalid FST entry name");
+      }
+      const char* name_ptr = &string_table[string_offset];
+      std::string name(name_ptr, strnlen(name_ptr, string_table_size - string_offset));
+      if (fst[x].is_dir()) {
+        size_t end_entry_num = fst[x].size.end_entry_num;
+        if ((end_entry_num <= x) || (end_entry_num > end)) {
+          throw std::runtime_error("existing image has an invalid FST directory entry");
+        }
+        add_entries(x + 1, end_entry_num, prefix + name + "/");
+        x = end_entry_num - 1;
+      } else {
+        ret.files.emplace(prefix + name, ExistingImage::Extent{fst[x].offset.file, fst[x].size.file});
+        if (fst[x].size.file) {
+          ret.allocated_offsets.emplace(fst[x].offset.file);
+        }
+      }
+    }
+  };
+  add_entries(1, num_entries, "");
+  ret.allocated_offsets.emplace(ret.dol_offset);
+  ret.allocated_offsets.emplace(ret.fst_offset);
+
+  return ret;
+}
+
+// When building incrementally, gcmasm keeps a build index next to the image, which records where each file is in the
+// image, and the size, modification time, and (with --incremental=hash) content hash of the source file that was
+// copied there. Whether a file has changed is decided by comparing it to its entry in the index, not to the image's
+// modification time. The index is deleted before the image is modified, and is written again only after the entire
+// image (including the FST and headers) has been written and synced to disk, so if a build fails or is interrupted,
+// there's no index and the next incremental build rebuilds the image entirely instead of trusting its contents.
+//
+// Build index file format:
+//   BuildIndexHeader
+//   For each file in the FST: BuildIndexFileEntry, then the file's path within the image (path_size bytes)
+
+static constexpr uint32_t BUILD_INDEX_MAGIC = 0x47434D49; // 'GCMI'
+static constexpr uint32_t BUILD_INDEX_VERSION = 1;
+
+struct BuildIndexHeader {
+  phosg::le_uint32_t magic;
+  phosg::le_uint32_t version;
+  phosg::le_uint64_t image_size;
+  phosg::le_int64_t image_mtime;
+  phosg::le_uint64_t num_files;
+} __attribute__((packed));
+
+struct BuildIndexFileEntry {
+  phosg::le_uint64_t offset;
+  phosg::le_uint64_t size;
+  phosg::le_int64_t mtime;
+  phosg::le_uint64_t hash;
+  phosg::le_uint32_t path_size;
+  uint8_t has_hash;
+  uint8_t unused[3];
+} __attribute__((packed));
+
+std::string build_index_filename(const std::string& image_filename) {
+  return image_filename + ".gcmasm-index";
+}
+
+// Adds the information from the image's build index to existing. Throws if the index is missing or doesn't match the
+// image exactly.
+void load_build_index(ExistingImage& existing, const std::string& image_filename) {
+  std::string index_filename = build_index_filename(image_filename);
+  std::string data;
+  try {
+    data = phosg::load_file(index_filename);
+  } catch (const phosg::cannot_open_file&) {
+    throw std::runtime_error(std::format(
+        "{} is missing; the image was not built with --incremental, or the last build did not finish", index_filename));
+  }
+
+  phosg::StringReader r(data);
+  const auto& header = r.get<BuildIndexHeader>();
+  if ((header.magic != BUILD_INDEX_MAGIC) || (header.version != BUILD_INDEX_VERSION)) {
+    throw std::runtime_error(std::format("{} has an unknown format", index_filename));
+  }
+  if ((header.image_size != std::filesystem::file_size(image_filename)) ||
+      (header.image_mtime != mtime_for_file(image_filename))) {
+    throw std::runtime_error(std::format("the image was modified after {} was written", index_filename));
+  }
+  if (header.num_files != existing.files.size()) {
+    throw std::runtime_error(std::format("{} does not match the image\'s FST", index_filename));
+  }
+  for (size_t z = 0; z < header.num_files; z++) {
+    const auto& entry = r.get<BuildIndexFileEntry>();
+    std::string path = r.read(entry.path_size);
+    auto it = existing.files.find(path);
+    if ((path.size() != entry.path_size) ||
+        (it == existing.files.end()) ||
+        it->second.indexed ||
+        (it->second.offset != entry.offset) ||
+        (it->second.size != entry.size)) {
+      throw std::runtime_error(std::format("{} does not match the image\'s FST", index_filename));
+    }
+    it->second.mtime = entry.mtime;
+    it->second.hash = entry.hash;
+    it->second.has_hash = !!entry.has_hash;
+    it->second.indexed = true;
+  }
+  if (!r.eof()) {
+    throw std::runtime_error(std::format("{} has extra data at the end", index_filename));
+  }
+}
+
+void save_build_index(const Directory& root, const std::string& image_filename) {
+  std::vector<std::pair<std::string, const File*>> files;
+  std::function<void(const Directory&, const std::string&)> add_dir;
+  add_dir = [&](const Directory& dir, const std::string& prefix) -> void {
+    for (const auto& it : dir.directories) {
+      add_dir(*it.second, prefix + it.first + "/");
+    }
+    for (const auto& it : dir.files) {
+      files.emplace_back(prefix + it.first, it.second.get());
+    }
+  };
+  add_dir(root, "");
+
+  phosg::StringWriter w;
+  w.put<BuildIndexHeader>(BuildIndexHeader{BUILD_INDEX_MAGIC, BUILD_INDEX_VERSION,
+      std::filesystem::file_size(image_filename), mtime_for_file(image_filename), files.size()});
+  for (const auto& [path, file] : files) {
+    w.put<BuildIndexFileEntry>(BuildIndexFileEntry{
+        file->image_offset, file->size, file->mtime, file->hash, path.size(), file->has_hash, {}});
+    w.write(path);
+  }
+  phosg::save_file(build_index_filename(image_filename), w.str());
+}
+
+// Like allocate_image_offsets, but for incremental builds. Files that still fit where they were in the existing image
+// stay there, and are only rewritten if they changed since the image was built: that is, if their size or
+// modification time differs from the build index, or (if compare_hashes is true) if their size or content hash
+// differs. All other files are placed after the end of the retained data. Returns the end offset of all file data.
+size_t allocate_image_offsets_incremental(
+    Directory& root, const ExistingImage& existing, size_t min_offset, bool compare_hashes) {
+  size_t num_unchanged = 0;
+  size_t num_rewritten = 0;
+  std::vector<File*> relocated_files;
+  std::function<void(Directory&, const std::string&)> place_dir;
+  place_dir = [&](Directory& dir, const std::string& prefix) -> void {
+    for (auto& it : dir.directories) {
+      place_dir(*it.second, prefix + it.first + "/");
+    }
+    for (auto& it : dir.files) {
+      File& file = *it.second;
+      auto existing_it = existing.files.find(prefix + it.first);
+      if (existing_it == existing.files.end()) {
+        relocated_files.emplace_back(&file);
+        continue;
+      }
+      const auto& extent = existing_it->second;
+      size_t capacity = extent.size ? existing.capacity_at(extent.offset) : 0;
+      if ((file.size != 0) && (file.size > capacity)) {
+        relocated_files.emplace_back(&file);
+        continue;
+      }
+      file.image_offset = extent.offset;
+      bool unchanged;
+      if (file.size != extent.size) {
+        unchanged = false;
+      } else if (compare_hashes) {
+        unchanged = file.has_hash && extent.has_hash && (file.hash == extent.hash);
+      } else {
+        unchanged = (file.mtime == extent.mtime);
+      }
+      if (unchanged && !file.has_hash) {
+        // Keep the previous hash in the new build index, so a later --incremental=hash build can still use it
+        file.hash = extent.hash;
+        file.has_hash = extent.has_hash;
+      }
+      file.needs_write = (file.size != 0) && !unchanged;
+      min_offset = std::max<size_t>(min_offset, file.image_offset + file.size);
+      if (file.needs_write) {
+        num_rewritten++;
+      } else {
+        num_unchanged++;
+      }
+    }
+  };
+  place_dir(root, "");
+
+  for (File* file : relocated_files) {
+    file->image_offset = align(min_offset, 0x8000);
+    min_offset = file->image_offset + file->size;
+  }
+
+  phosg::log_info_f("{} files unchanged, {} files to be rewritten in place, {} files to be relocated or added",
+      num_unchanged, num_rewritten, relocated_files.size());
+  return min_offset;
+}
+
+enum class IncrementalMode {
+  NONE = 0,
+  MTIME, // --incremental
+  HASH, // --incremental=hash
+};
+
 struct HeaderParams {
   int64_t game_id = -1;
   int32_t company_id = -1;
@@ -137,9 +436,24 @@ struct HeaderParams {
   bool tgc = false;
 };
 
-void compile_image(FILE* out, const std::string& in_path, const HeaderParams& header_params) {
+// Copies a file's contents into the output image at the given offset. This uses only positioned writes on the output
+// file, so multiple threads can call it with the same out_fd.
+void copy_file_into_image(int out_fd, uint64_t out_offset, const std::string& src_path, uint64_t size) {
+  phosg::scoped_fd src_fd(src_path, O_RDONLY);
+  ResourceDASM::copy_fd_range(src_fd, 0, out_fd, out_offset, size);
+}
+
+void compile_image(
+    int out_fd,
+    const std::string& out_path,
+    const std::string& in_path,
+    const HeaderParams& header_params,
+    ssize_t parallelism,
+    IncrementalMode incremental,
+    const ExistingImage* existing) {
   Directory root_dir(in_path);
   phosg::log_info_f("All files collected");
+  size_t num_threads = ResourceDASM::resolve_num_threads(parallelism);
 
   auto default_dol_it = root_dir.files.find("default.dol");
   if (default_dol_it == root_dir.files.end()) {
@@ -165,11 +479,59 @@ void compile_image(FILE* out, const std::string& in_path, const HeaderParams& he
     phosg::log_info_f("__gcm_header__.bin found");
   }
 
+  // With --incremental=hash, every file's contents are hashed, both to compare them to the build index and to record
+  // them in the new one
+  if (incremental == IncrementalMode::HASH) {
+    std::vector<File*> files_to_hash;
+    std::function<void(Directory&)> add_files_to_hash = [&](Directory& dir) -> void {
+      for (auto& it : dir.directories) {
+        add_files_to_hash(*it.second);
+      }
+      for (auto& it : dir.files) {
+        files_to_hash.emplace_back(it.second.get());
+      }
+    };
+    add_files_to_hash(root_dir);
+    ResourceDASM::parallel_for_each(files_to_hash, [&](File* const& file) -> void {
+      file->hash = hash_file(file->src_path, file->size);
+      file->has_hash = true;
+    }, num_threads);
+    phosg::log_info_f("{} files hashed", files_to_hash.size());
+  }
+
   size_t apploader_offset = 0x2440;
-  size_t default_dol_offset = align(apploader_offset + apploader_bin->size, 0x100);
-  size_t file_data_start_offset = align(default_dol_offset + default_dol->size, 0x100);
+  if (existing && (apploader_bin->size > existing->capacity_at(apploader_offset))) {
+    phosg::log_warning_f("apploader.bin no longer fits in the existing image; rebuilding it entirely");
+    existing = nullptr;
+    if (ftruncate(out_fd, 0)) {
+      throw std::runtime_error(std::format("cannot truncate output file: {}", strerror(errno)));
+    }
+  }
 
-  size_t fst_offset = align(allocate_image_offsets(root_dir, file_data_start_offset), 0x100);
+  size_t default_dol_offset;
+  size_t fst_offset;
+  if (existing) {
+    // default.dol is always rewritten, since it's small; it's moved after the file data only if it no longer fits
+    bool dol_fits = (default_dol->size <= existing->capacity_at(existing->dol_offset));
+    size_t min_offset = dol_fits
+        ? (existing->dol_offset + default_dol->size)
+        : (apploader_offset + apploader_bin->size);
+    size_t file_data_end_offset = allocate_image_offsets_incremental(
+        root_dir, *existing, min_offset, incremental == IncrementalMode::HASH);
+    if (dol_fits) {
+      default_dol_offset = existing->dol_offset;
+    } else {
+      default_dol_offset = align(file_data_end_offset, 0x100);
+      file_data_end_offset = default_dol_offset + default_dol->size;
+      phosg::log_info_f("default.dol no longer fits in its previous location; moving it to {:08X}", default_dol_offset);
+    }
+    fst_offset = align(file_data_end_offset, 0x100);
+
+  } else {
+    default_dol_offset = align(apploader_offset + apploader_bin->size, 0x100);
+    size_t file_data_start_offset = align(default_dol_offset + default_dol->size, 0x100);
+    fst_offset = align(allocate_image_offsets(root_dir, file_data_start_offset), 0x100);
+  }
 
   auto fst = generate_fst(root_dir);
 
@@ -179,15 +541,20 @@ void compile_image(FILE* out, const std::string& in_path, const HeaderParams& he
     phosg::log_info_f("File size: {} bytes ({})", file_size, size_str);
   }
 
+  // When building incrementally without __gcm_header__.bin, the existing image's header is used as the base header, so
+  // options given in the original build don't need to be given again
   std::string header_data;
   if (header_bin) {
     header_data = header_bin->data();
     if (header_data.size() != 0x2440) {
       throw std::runtime_error("__gcm_header__.bin is incorrect size");
     }
+  } else if (existing) {
+    header_data = existing->header_data;
   } else {
     header_data.resize(0x2440, '\0');
   }
+  bool has_base_header = header_bin || existing;
 
   ResourceDASM::GCMHeader* header = reinterpret_cast<ResourceDASM::GCMHeader*>(header_data.data());
   if (header_params.game_id >= 0) {
@@ -204,7 +571,7 @@ void compile_image(FILE* out, const std::string& in_path, const HeaderParams& he
   }
   if (header_params.audio_streaming >= 0) {
     header->audio_streaming = header_params.audio_streaming;
-  } else if (!header_bin) {
+  } else if (!has_base_header) {
     header->audio_streaming = 1;
   }
   if (header_params.stream_buffer_size >= 0) {
@@ -218,19 +585,77 @@ void compile_image(FILE* out, const std::string& in_path, const HeaderParams& he
   header->fst_offset = fst_offset;
   header->fst_size = fst.bytes();
   header->fst_max_size = header->fst_size; // TODO: Support multi-disc games here
-  if (!header_bin) {
+  if (!has_base_header) {
+    header->gc_magic = 0xC2339F3D;
     header->memory_size = 0x01800000;
   }
   if (header_params.region_code >= 0) {
     header->region_code = header_params.region_code;
-  } else if (!header_bin) {
+  } else if (!has_base_header) {
     header->region_code = 1;
   }
 
-  size_t gcm_offset;
-  if (header_params.tgc) {
-    gcm_offset = sizeof(ResourceDASM::TGCHeader);
+  // The layout is now complete. The output file is first extended to its final size without writing anything, so all
+  // alignment padding between files remains sparse (on filesystems that support it) and reads as zeroes. All the file
+  // data is written and synced to disk before the FST and headers, so the new FST never refers to data that hasn't
+  // been written yet.
+  size_t gcm_offset = header_params.tgc ? sizeof(ResourceDASM::TGCHeader) : 0;
+  std::string fst_data = fst.data();
+  if (ftruncate(out_fd, gcm_offset + fst_offset + fst_data.size())) {
+    throw std::runtime_error(std::format("cannot resize output file: {}", strerror(errno)));
+  }
+
+  // All files (including the apploader and default.dol) are copied directly from the source files into the image. In
+  // incremental builds, files that are already present in the image are skipped.
+  struct WriteTask {
+    const File* file;
+    size_t image_offset;
+  };
+  std::vector<WriteTask> tasks;
+  tasks.emplace_back(WriteTask{apploader_bin.get(), apploader_offset});
+  tasks.emplace_back(WriteTask{default_dol.get(), default_dol_offset});
+  std::function<void(const Directory&)> add_write_tasks = [&](const Directory& dir) -> void {
+    for (const auto& it : dir.directories) {
+      add_write_tasks(*it.second);
+    }
+    for (const auto& it : dir.files) {
+      if (it.second->needs_write) {
+        tasks.emplace_back(WriteTask{it.second.get(), it.second->image_offset});
+      }
+    }
+  };
+  add_write_tasks(root_dir);
+
+  // Errors are reported for each file, and the remaining files are still written, so a single run reports every file
+  // that can't be written. The build still fails at the end if any file wasn't written, since the image is incomplete;
+  // in that case, the FST and headers aren't written either.
+  std::atomic<size_t> num_failed_files = 0;
+  auto write_file_data = [&](const WriteTask& task) -> void {
+    try {
+      copy_file_into_image(out_fd, task.image_offset + gcm_offset, task.file->src_path, task.file->size);
+      phosg::log_info_f("{} written", task.file->name);
+    } catch (const std::exception& e) {
+      phosg::log_error_f("Failed to write {}: {}", task.file->name, e.what());
+      num_failed_files++;
+    }
+  };
+  if (num_threads > 1) {
+    phosg::log_info_f("Writing {} files on {} threads", tasks.size(), num_threads);
+  }
+  ResourceDASM::parallel_for_each(tasks, write_file_data, num_threads);
+  if (num_failed_files > 0) {
+    throw std::runtime_error(std::format("{} of {} files could not be written", num_failed_files.load(), tasks.size()));
+  }
+  if (fsync(out_fd)) {
+    throw std::runtime_error(std::format("cannot sync output file: {}", strerror(errno)));
+  }
 
+  phosg::pwritex(out_fd, fst_data.data(), fst_data.size(), fst_offset + gcm_offset);
+  phosg::log_info_f("FST written");
+  phosg::pwritex(out_fd, header_data.data(), header_data.size(), gcm_offset);
+  phosg::log_info_f("GCM header written");
+
+  if (header_params.tgc) {
     std::string tgc_header_data;
     tgc_header_data.resize(gcm_offset, '\0');
 
@@ -247,38 +672,17 @@ void compile_image(FILE* out, const std::string& in_path, const HeaderParams& he
     tgc_header->file_area_size = fst_offset - gcm_offset;
     tgc_header->file_offset_base = 0;
 
-    fseek(out, 0, SEEK_SET);
-    phosg::fwritex(out, tgc_header_data);
+    phosg::pwritex(out_fd, tgc_header_data.data(), tgc_header_data.size(), 0);
     phosg::log_info_f("TGC header written");
-  } else {
-    gcm_offset = 0;
   }
 
-  fseek(out, gcm_offset, SEEK_SET);
-  phosg::fwritex(out, header_data);
-  phosg::log_info_f("GCM header written");
-
-  fseek(out, apploader_offset + gcm_offset, SEEK_SET);
-  phosg::fwritex(out, apploader_bin->data());
-  phosg::log_info_f("Apploader written");
-  fseek(out, default_dol_offset + gcm_offset, SEEK_SET);
-  phosg::fwritex(out, default_dol->data());
-  phosg::log_info_f("default.dol written");
-  fseek(out, fst_offset + gcm_offset, SEEK_SET);
-  fst.write(out);
-  phosg::log_info_f("FST written");
-
-  std::function<void(FILE*, const Directory&)> write_files_data = [&](FILE* out, const Directory& dir) -> void {
-    for (const auto& it : dir.directories) {
-      write_files_data(out, *it.second);
-    }
-    for (const auto& it : dir.files) {
-      fseek(out, it.second->image_offset + gcm_offset, SEEK_SET);
-      phosg::fwritex(out, it.second->data());
-      phosg::log_info_f("{} written", it.second->name);
+  if (incremental != IncrementalMode::NONE) {
+    if (fsync(out_fd)) {
+      throw std::runtime_error(std::format("cannot sync output file: {}", strerror(errno)));
     }
-  };
-  write_files_data(out, root_dir);
+    save_build_index(root_dir, out_path);
+    phosg::log_info_f("Build index written");
+  }
 
   phosg::log_info_f("Complete");
 }
@@ -310,6 +714,23 @@ Options:\n\
       Set region code (0=JP, 1=NA, 2=EU, 3=region-free, 4=KR).\n\
   --tgc\n\
       Repack as TGC instead of GCM.\n\
+  --incremental\n\
+  --incremental=hash\n\
+      If the output file already exists, update it instead of rebuilding it.\n\
+      Files that still fit in their previous locations in the image are left\n\
+      there, and are only rewritten if their sizes or modification times have\n\
+      changed since the last build (or with --incremental=hash, if their sizes\n\
+      or contents have changed; this reads every file, but also detects changes\n\
+      that don\'t affect modification times). Other files are appended to the\n\
+      image, and the FST is regenerated. Space used by deleted or moved files is\n\
+      not reclaimed. The previous build\'s state is kept in a build index next to\n\
+      the image (OUTPUT.gcmasm-index), which is written only when a build\n\
+      completes successfully. If the index is missing or doesn\'t match the image\n\
+      (for example, because the previous build failed or was interrupted, or the\n\
+      image was built without --incremental), the image is rebuilt entirely.\n\
+  --parallel=N\n\
+      Copy files into the image on N threads. If N is 0, use as many threads as\n\
+      there are CPU cores. By default, files are copied one at a time.\n\
 ");
 }
 
@@ -322,6 +743,8 @@ int main(int argc, char** argv) {
   const char* dir_path = nullptr;
   std::string out_path;
   HeaderParams header_params;
+  ssize_t parallelism = -1;
+  IncrementalMode incremental = IncrementalMode::NONE;
   for (int x = 1; x < argc; x++) {
     if (!strncmp(argv[x], "--game-id=", 10)) {
       if (strlen(argv[x]) != 16) {
@@ -343,6 +766,12 @@ int main(int argc, char** argv) {
       header_params.internal_name = &argv[x][7];
     } else if (!strncmp(argv[x], "--region=", 9)) {
       header_params.region_code = strtoul(&argv[x][9], nullptr, 0);
+    } else if (!strcmp(argv[x], "--incremental")) {
+      incremental = IncrementalMode::MTIME;
+    } else if (!strcmp(argv[x], "--incremental=hash")) {
+      incremental = IncrementalMode::HASH;
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
     } else if (!strncmp(argv[x], "--tgc", 5)) {
       header_params.tgc = true;
     } else if (!dir_path) {
@@ -366,8 +795,24 @@ int main(int argc, char** argv) {
     out_path += ".gcm";
   }
 
-  auto out = phosg::fopen_unique(out_path, "wb");
-  compile_image(out.get(), dir_path, header_params);
+  std::unique_ptr<ExistingImage> existing;
+  if ((incremental != IncrementalMode::NONE) && std::filesystem::is_regular_file(out_path)) {
+    try {
+      auto loaded = std::make_unique<ExistingImage>(load_existing_image(out_path, header_params.tgc));
+      load_build_index(*loaded, out_path);
+      existing = std::move(loaded);
+      phosg::log_info_f("Existing image contains {} files; building incrementally", existing->files.size());
+    } catch (const std::exception& e) {
+      phosg::log_warning_f("Cannot build incrementally ({}); rebuilding image entirely", e.what());
+    }
+  }
+
+  // The build index describes the image as it is now, so it must be deleted before the image is modified. It's
+  // written again after the build is complete.
+  std::filesystem::remove(build_index_filename(out_path));
+
+  phosg::scoped_fd out_fd(out_path, O_RDWR | O_CREAT | (existing ? 0 : O_TRUNC), 0644);
+  compile_image(out_fd, out_path, dir_path, header_params, parallelism, incremental, existing.get());
 
   return 0;
 }
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,11 +12,15 @@
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
+#include <stdexcept>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "ExecutableFormats/DOLFile.hh"
 #include "ExecutableFormats/GameCubeImages.hh"
+#include "FileCopy.hh"
+#include "Parallel.hh"
 
 union ImageHeader {
   ResourceDASM::GCMHeader gcm;
@@ -49,58 +54,83 @@ uint32_t dol_file_size(const ResourceDASM::DOLFile::Header* dol) {
   return max_offset;
 }
 
-void parse_until(
-    FILE* f,
+// A file to be written to the output directory, whose contents are a contiguous range of the disc image
+struct ExtractionTask {
+  std::string out_filename;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Walks the FST and produces the list of files to extract. Directories are created here (before any extraction
+// begins), so the extraction tasks can run in any order and on any thread.
+void collect_fst_entries(
+    std::vector<ExtractionTask>& tasks,
     const ResourceDASM::FSTEntry* fst,
     const char* string_table,
-    int start,
-    int end,
+    uint32_t start,
+    uint32_t end,
     int64_t base_offset,
+    const std::string& dir_prefix,
     const std::unordered_set<std::string>& target_filenames) {
 
-  int x;
-  std::string pwd = std::filesystem::current_path().string();
-  pwd += '/';
-  size_t pwd_end = pwd.size();
-  for (x = start; x < end; x++) {
+  for (uint32_t x = start; x < end; x++) {
+    const char* name = &string_table[fst[x].string_offset()];
     if (fst[x].is_dir()) {
       phosg::fwrite_fmt(stderr, "> entry: {:08X} $ {:08X} {:08X} {:08X} {}{}/\n", x,
           fst[x].dir_flag_string_offset.load(),
           fst[x].offset.file.load(),
           fst[x].size.file.load(),
-          pwd,
-          &string_table[fst[x].string_offset()]);
-
-      pwd += sanitize_filename(&string_table[fst[x].dir_flag_string_offset & 0x00FFFFFF]);
-      std::filesystem::create_directories(pwd);
-      std::filesystem::current_path(pwd);
-      parse_until(f, fst, string_table, x + 1, fst[x].size.end_entry_num, base_offset, target_filenames);
-      pwd.resize(pwd_end);
-      std::filesystem::current_path(pwd);
+          dir_prefix,
+          name);
 
-      x = fst[x].size.end_entry_num - 1;
+      uint32_t end_entry_num = fst[x].size.end_entry_num;
+      if (end_entry_num <= x || end_entry_num > end) {
+        throw std::runtime_error(std::format("directory entry {:08X} has invalid end entry number", x));
+      }
+      std::string subdir = dir_prefix + sanitize_filename(name);
+      std::filesystem::create_directories(subdir);
+      collect_fst_entries(tasks, fst, string_table, x + 1, end_entry_num, base_offset, subdir + "/", target_filenames);
+      x = end_entry_num - 1;
 
     } else {
       phosg::fwrite_fmt(stderr, "> entry: {:08X} $ {:08X} {:08X} {:08X} {}{}\n", x,
           fst[x].dir_flag_string_offset.load(),
           fst[x].offset.file.load(),
           fst[x].size.file.load(),
-          pwd, &string_table[fst[x].string_offset()]);
-
-      if (target_filenames.empty() ||
-          target_filenames.count(&string_table[fst[x].string_offset()])) {
-        std::string filename = sanitize_filename(&string_table[fst[x].string_offset()]);
-        try {
-          fseek(f, fst[x].offset.file + base_offset, SEEK_SET);
-          phosg::save_file(filename, phosg::freadx(f, fst[x].size.file));
-        } catch (const std::exception& e) {
-          phosg::fwrite_fmt(stderr, "!!! failed to write file: {}\n", e.what());
-        }
+          dir_prefix,
+          name);
+
+      if (target_filenames.empty() || target_filenames.count(name)) {
+        tasks.emplace_back(ExtractionTask{
+            dir_prefix + sanitize_filename(name), fst[x].offset.file + base_offset, fst[x].size.file});
       }
     }
   }
 }
 
+// Copies a range of the input file to a new file. This uses only positioned reads on the input file, so multiple
+// threads can call it with the same src_fd.
+void copy_file_extent(int src_fd, uint64_t offset, uint64_t size, const std::string& out_filename) {
+  phosg::scoped_fd out_fd(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ResourceDASM::copy_fd_range(src_fd, offset, out_fd, 0, size);
+}
+
+void print_usage(const char* argv0) {
+  phosg::fwrite_fmt(stderr, "\
+Usage: {} [options] <filename> [files_to_extract]\n\
+\n\
+Extracts the files from a GameCube disc image (GCM) or embedded disc image\n\
+(TGC) into the current directory. If any files_to_extract are given, only files\n\
+with those names are extracted.\n\
+\n\
+Options:\n\
+  --gcm: Treat the input as a GCM image, regardless of its header.\n\
+  --tgc: Treat the input as a TGC image, regardless of its header.\n\
+  --parallel=N: Extract files on N threads. If N is 0, use as many threads as\n\
+      there are CPU cores. The default behavior is to extract one file at a time.\n\
+", argv0);
+}
+
 enum Format {
   UNKNOWN = 0,
   GCM = 1,
@@ -110,18 +140,21 @@ enum Format {
 int main(int argc, char** argv) {
 
   if (argc < 2) {
-    phosg::fwrite_fmt(stderr, "Usage: {} [--gcm|--tgc] <filename> [files_to_extract]\n", argv[0]);
+    print_usage(argv[0]);
     return -1;
   }
 
   Format format = Format::UNKNOWN;
   const char* filename = nullptr;
+  ssize_t parallelism = -1;
   std::unordered_set<std::string> target_filenames;
   for (int x = 1; x < argc; x++) {
     if (!strcmp(argv[x], "--gcm")) {
       format = Format::GCM;
     } else if (!strcmp(argv[x], "--tgc")) {
       format = Format::TGC;
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
     } else if (!filename) {
       filename = argv[x];
     } else {
@@ -133,10 +166,9 @@ int main(int argc, char** argv) {
     return -1;
   }
 
-  auto f = phosg::fopen_unique(filename, "rb");
+  phosg::scoped_fd fd(filename, O_RDONLY);
 
-  std::string header_data(sizeof(ImageHeader), '\0');
-  phosg::freadx(f.get(), header_data.data(), header_data.size());
+  std::string header_data = phosg::preadx(fd, sizeof(ImageHeader), 0);
   const ImageHeader* header = reinterpret_cast<const ImageHeader*>(header_data.data());
   if (format == Format::UNKNOWN) {
     if (header->gcm.gc_magic == 0xC2339F3D) {
@@ -172,32 +204,32 @@ int main(int argc, char** argv) {
     return -3;
   }
 
+  // All output files are collected into this list first, then extracted afterward. Only the headers and FST are read
+  // into memory; file contents are copied directly from the image to the output files.
+  std::vector<ExtractionTask> tasks;
+
   // If there are target filenames and default.dol isn't specified, don't extract it
   if (target_filenames.empty() || target_filenames.count("default.dol")) {
-    fseek(f.get(), dol_offset, SEEK_SET);
-    std::string dol_data = phosg::freadx(f.get(), sizeof(ResourceDASM::DOLFile::Header));
-    uint32_t dol_size = dol_file_size(reinterpret_cast<const ResourceDASM::DOLFile::Header*>(dol_data.data()));
-
-    dol_data += phosg::freadx(f.get(), dol_size - sizeof(ResourceDASM::DOLFile::Header));
-
-    phosg::save_file("default.dol", dol_data);
+    std::string dol_header_data = phosg::preadx(fd, sizeof(ResourceDASM::DOLFile::Header), dol_offset);
+    uint32_t dol_size = dol_file_size(reinterpret_cast<const ResourceDASM::DOLFile::Header*>(dol_header_data.data()));
+    tasks.emplace_back(ExtractionTask{"default.dol", dol_offset, std::max<uint64_t>(dol_size, dol_header_data.size())});
   }
 
   if (target_filenames.empty() || target_filenames.count("__gcm_header__.bin")) {
-    fseek(f.get(), gcm_offset, SEEK_SET);
-    phosg::save_file("__gcm_header__.bin", phosg::freadx(f.get(), 0x2440));
+    tasks.emplace_back(ExtractionTask{"__gcm_header__.bin", gcm_offset, 0x2440});
   }
 
   if (target_filenames.empty() || target_filenames.count("apploader.bin")) {
-    fseek(f.get(), gcm_offset + 0x2440, SEEK_SET);
-    std::string data = phosg::freadx(f.get(), sizeof(ResourceDASM::ApploaderHeader));
+    std::string data = phosg::preadx(fd, sizeof(ResourceDASM::ApploaderHeader), gcm_offset + 0x2440);
     const auto* header = reinterpret_cast<const ResourceDASM::ApploaderHeader*>(data.data());
-    data += phosg::freadx(f.get(), header->size + header->trailer_size);
-    phosg::save_file("apploader.bin", data);
+    uint64_t apploader_size = sizeof(ResourceDASM::ApploaderHeader) + header->size + header->trailer_size;
+    tasks.emplace_back(ExtractionTask{"apploader.bin", gcm_offset + 0x2440, apploader_size});
   }
 
-  fseek(f.get(), fst_offset, SEEK_SET);
-  std::string fst_data = phosg::freadx(f.get(), fst_size);
+  std::string fst_data = phosg::preadx(fd, fst_size, fst_offset);
+  if (fst_data.size() < sizeof(ResourceDASM::FSTEntry)) {
+    throw std::runtime_error("FST is too small");
+  }
   const ResourceDASM::FSTEntry* fst = reinterpret_cast<const ResourceDASM::FSTEntry*>(fst_data.data());
 
   // If there are target filenames and fst.bin isn't specified, don't extract it
@@ -205,11 +237,28 @@ int main(int argc, char** argv) {
     phosg::save_file("fst.bin", fst_data);
   }
 
-  int num_entries = fst[0].size.end_entry_num;
+  uint32_t num_entries = fst[0].size.end_entry_num;
   phosg::fwrite_fmt(stderr, "> root: {:08X} files\n", num_entries);
+  if (num_entries > fst_data.size() / sizeof(ResourceDASM::FSTEntry)) {
+    throw std::runtime_error("FST entry count is too large");
+  }
 
-  char* string_table = (char*)fst + (sizeof(ResourceDASM::FSTEntry) * num_entries);
-  parse_until(f.get(), fst, string_table, 1, num_entries, base_offset, target_filenames);
+  const char* string_table = fst_data.data() + (sizeof(ResourceDASM::FSTEntry) * num_entries);
+  collect_fst_entries(tasks, fst, string_table, 1, num_entries, base_offset, "", target_filenames);
+
+  auto extract_task = [&](const ExtractionTask& task) -> void {
+    try {
+      copy_file_extent(fd, task.offset, task.size, task.out_filename);
+    } catch (const std::exception& e) {
+      phosg::fwrite_fmt(stderr, "!!! failed to write file {}: {}\n", task.out_filename, e.what());
+    }
+  };
+
+  size_t num_threads = ResourceDASM::resolve_num_threads(parallelism);
+  if (num_threads > 1) {
+    phosg::fwrite_fmt(stderr, "extracting {} files on {} threads\n", tasks.size(), num_threads);
+  }
+  ResourceDASM::parallel_for_each(tasks, extract_task, num_threads);
 
   return 0;
 }
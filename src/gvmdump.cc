@@ -11,7 +11,11 @@
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include "Parallel.hh"
 
 struct GVMFileEntry {
   phosg::be_uint16_t file_num;
@@ -105,6 +109,103 @@ uint32_t decode_rgb565(uint16_t c) {
       0x000000FF; // A
 }
 
+// Textures are decoded with lookup tables instead of calling the above functions for every pixel. The tables are built
+// on first use, which is thread-safe since they're function-local statics.
+static const std::vector<uint32_t>& rgb5a3_table() {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> ret(0x10000);
+    for (size_t z = 0; z < 0x10000; z++) {
+      ret[z] = decode_rgb5a3(z);
+    }
+    return ret;
+  }();
+  return table;
+}
+
+static const std::vector<uint32_t>& rgb565_table() {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> ret(0x10000);
+    for (size_t z = 0; z < 0x10000; z++) {
+      ret[z] = decode_rgb565(z);
+    }
+    return ret;
+  }();
+  return table;
+}
+
+static inline uint16_t get_u16b(const uint8_t* data) {
+  return (data[0] << 8) | data[1];
+}
+
+// Decodes a texture stored as a sequence of BlockW x BlockH pixel blocks, each of which is block_bytes long. The blocks
+// are ordered left to right, then top to bottom. decode_block is called for each block and must fill in all of the
+// block's pixels, in row-major order; pixels that are outside the image's bounds are discarded.
+template <size_t BlockW, size_t BlockH, typename DecodeBlockT>
+static void decode_blocks(
+    phosg::ImageRGBA8888N& result,
+    const uint8_t* data,
+    size_t size,
+    size_t block_bytes,
+    DecodeBlockT&& decode_block) {
+  size_t w = result.get_width();
+  size_t h = result.get_height();
+  size_t num_blocks = ((w + BlockW - 1) / BlockW) * ((h + BlockH - 1) / BlockH);
+  if (size < num_blocks * block_bytes) {
+    throw std::runtime_error("data size is too small");
+  }
+
+  uint32_t block[BlockW * BlockH];
+  for (size_t y = 0; y < h; y += BlockH) {
+    for (size_t x = 0; x < w; x += BlockW) {
+      decode_block(data, block);
+      data += block_bytes;
+      for (size_t yy = 0; (yy < BlockH) && (y + yy < h); yy++) {
+        for (size_t xx = 0; (xx < BlockW) && (x + xx < w); xx++) {
+          result.write(x + xx, y + yy, block[yy * BlockW + xx]);
+        }
+      }
+    }
+  }
+}
+
+// Decodes one 4x4 DXT1 (CMPR) block; out has a row stride of 8 pixels, since DXT1 blocks are grouped in 2x2 squares
+static void decode_dxt1_subblock(const uint8_t* data, uint32_t* out) {
+  const auto& rgb565 = rgb565_table();
+  uint16_t color1 = get_u16b(data);
+  uint16_t color2 = get_u16b(data + 2);
+  uint32_t color_table[4];
+  color_table[0] = rgb565[color1];
+  color_table[1] = rgb565[color2];
+  if (color1 > color2) {
+    color_table[2] = phosg::rgba8888(
+        (((phosg::get_r(color_table[0]) * 2) + phosg::get_r(color_table[1])) / 3),
+        (((phosg::get_g(color_table[0]) * 2) + phosg::get_g(color_table[1])) / 3),
+        (((phosg::get_b(color_table[0]) * 2) + phosg::get_b(color_table[1])) / 3),
+        0xFF);
+    color_table[3] = phosg::rgba8888(
+        (((phosg::get_r(color_table[1]) * 2) + phosg::get_r(color_table[0])) / 3),
+        (((phosg::get_g(color_table[1]) * 2) + phosg::get_g(color_table[0])) / 3),
+        (((phosg::get_b(color_table[1]) * 2) + phosg::get_b(color_table[0])) / 3),
+        0xFF);
+  } else {
+    color_table[2] = phosg::rgba8888(
+        ((phosg::get_r(color_table[0]) + phosg::get_r(color_table[1])) / 2),
+        ((phosg::get_g(color_table[0]) + phosg::get_g(color_table[1])) / 2),
+        ((phosg::get_b(color_table[0]) + phosg::get_b(color_table[1])) / 2),
+        0xFF);
+    color_table[3] = 0x00000000;
+  }
+
+  for (size_t yy = 0; yy < 4; yy++) {
+    uint8_t pixels = data[4 + yy];
+    uint32_t* out_row = out + yy * 8;
+    out_row[0] = color_table[(pixels >> 6) & 3];
+    out_row[1] = color_table[(pixels >> 4) & 3];
+    out_row[2] = color_table[(pixels >> 2) & 3];
+    out_row[3] = color_table[pixels & 3];
+  }
+}
+
 std::vector<uint32_t> decode_gvp(const std::string& data) {
   phosg::StringReader r(data.data(), data.size());
   auto header = r.get<GVPHeader>();
@@ -191,138 +292,82 @@ phosg::ImageRGBA8888N decode_gvr(const std::string& data, const std::vector<uint
     throw std::runtime_error("width/height must be multiples of 4 for dxt1 format");
   }
 
+  // Indexed formats look up colors in a 256-entry copy of the color table, so indexes past the end of a short color
+  // table don't need to be checked for each pixel; they decode as transparent black.
+  std::vector<uint32_t> clut256;
+  if ((header.data_format == GVRDataFormat::INDEXED_4) || (header.data_format == GVRDataFormat::INDEXED_8)) {
+    if (!clut) {
+      throw std::runtime_error("a color table is required");
+    }
+    clut256 = *clut;
+    clut256.resize(0x100, 0x00000000);
+  }
+
+  const uint8_t* pixel_data = reinterpret_cast<const uint8_t*>(data.data()) + sizeof(GVRHeader);
+  size_t pixel_data_size = data.size() - sizeof(GVRHeader);
+
   phosg::ImageRGBA8888N result(header.width, header.height, true);
   switch (header.data_format) {
     case GVRDataFormat::RGB5A3:
-      // 4x4 blocks of pixels
-      for (size_t y = 0; y < header.height; y += 4) {
-        for (size_t x = 0; x < header.width; x += 4) {
-          for (size_t yy = 0; yy < 4; yy++) {
-            for (size_t xx = 0; xx < 4; xx++) {
-              result.write(x + xx, y + yy, decode_rgb5a3(r.get_u16b()));
-            }
-          }
+    case GVRDataFormat::RGB565: {
+      // 4x4 blocks of 16-bit pixels
+      const auto& table = (header.data_format == GVRDataFormat::RGB5A3) ? rgb5a3_table() : rgb565_table();
+      decode_blocks<4, 4>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        for (size_t z = 0; z < 16; z++) {
+          out[z] = table[get_u16b(block_data + z * 2)];
         }
-      }
+      });
       break;
+    }
 
     case GVRDataFormat::INDEXED_4:
-      if (!clut) {
-        throw std::runtime_error("a color table is required");
-      }
-      // 4x4 blocks of pixels
-      for (size_t y = 0; y < header.height; y += 8) {
-        for (size_t x = 0; x < header.width; x += 8) {
-          for (size_t yy = 0; yy < 8; yy++) {
-            for (size_t xx = 0; xx < 8; xx += 2) {
-              uint8_t indexes = r.get_u8();
-              result.write(x + xx, y + yy, clut->at((indexes >> 4) & 0x0F));
-              result.write(x + xx + 1, y + yy, clut->at(indexes & 0x0F));
-            }
-          }
+      // 8x8 blocks of 4-bit indexes
+      decode_blocks<8, 8>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        for (size_t z = 0; z < 32; z++) {
+          out[z * 2] = clut256[block_data[z] >> 4];
+          out[z * 2 + 1] = clut256[block_data[z] & 0x0F];
         }
-      }
+      });
       break;
 
     case GVRDataFormat::INDEXED_8:
-      if (!clut) {
-        throw std::runtime_error("a color table is required");
-      }
-      // 4x4 blocks of pixels
-      for (size_t y = 0; y < header.height; y += 4) {
-        for (size_t x = 0; x < header.width; x += 8) {
-          for (size_t yy = 0; yy < 4; yy++) {
-            for (size_t xx = 0; xx < 8; xx++) {
-              uint8_t index = r.get_u8();
-              result.write(x + xx, y + yy, clut->at(index));
-            }
-          }
+      // 8x4 blocks of 8-bit indexes
+      decode_blocks<8, 4>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        for (size_t z = 0; z < 32; z++) {
+          out[z] = clut256[block_data[z]];
         }
-      }
+      });
       break;
 
     case GVRDataFormat::INTENSITY_4:
-      // 4x4 blocks of pixels
-      for (size_t y = 0; y < header.height; y += 8) {
-        for (size_t x = 0; x < header.width; x += 8) {
-          for (size_t yy = 0; yy < 8; yy++) {
-            for (size_t xx = 0; xx < 8; xx += 2) {
-              uint8_t v = r.get_u8();
-              uint8_t v1 = (v & 0xF0) | (v >> 4);
-              uint8_t v2 = (v & 0x0F) | (v << 4);
-              result.write(x + xx, y + yy, (v1 << 24) | (v1 << 16) | (v1 << 8) | 0xFF);
-              result.write(x + xx + 1, y + yy, (v2 << 24) | (v2 << 16) | (v2 << 8) | 0xFF);
-            }
-          }
+      // 8x8 blocks of 4-bit intensities
+      decode_blocks<8, 8>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        for (size_t z = 0; z < 32; z++) {
+          uint32_t v1 = (block_data[z] >> 4) * 0x11;
+          uint32_t v2 = (block_data[z] & 0x0F) * 0x11;
+          out[z * 2] = (v1 * 0x01010100) | 0xFF;
+          out[z * 2 + 1] = (v2 * 0x01010100) | 0xFF;
         }
-      }
+      });
       break;
 
     case GVRDataFormat::INTENSITY_8:
-      // 4x4 blocks of pixels
-      for (size_t y = 0; y < header.height; y += 4) {
-        for (size_t x = 0; x < header.width; x += 8) {
-          for (size_t yy = 0; yy < 4; yy++) {
-            for (size_t xx = 0; xx < 8; xx++) {
-              uint8_t v = r.get_u8();
-              result.write(x + xx, y + yy, (v << 24) | (v << 16) | (v << 8) | 0xFF);
-            }
-          }
+      // 8x4 blocks of 8-bit intensities
+      decode_blocks<8, 4>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        for (size_t z = 0; z < 32; z++) {
+          out[z] = (block_data[z] * 0x01010100) | 0xFF;
         }
-      }
+      });
       break;
 
     case GVRDataFormat::DXT1:
-      for (size_t y = 0; y < header.height; y += 8) {
-        for (size_t x = 0; x < header.width; x += 8) {
-          for (size_t yy = 0; yy < 8; yy += 4) {
-            for (size_t xx = 0; xx < 8; xx += 4) {
-              uint32_t color_table[4];
-              uint16_t color1 = r.get_u16b(); // RGB565
-              uint16_t color2 = r.get_u16b(); // RGB565
-              color_table[0] = phosg::rgba8888(
-                  ((color1 >> 8) & 0xF8) | ((color1 >> 13) & 0x07),
-                  ((color1 >> 3) & 0xFC) | ((color1 >> 9) & 0x03),
-                  ((color1 << 3) & 0xF8) | ((color1 >> 2) & 0x07),
-                  0xFF);
-              color_table[1] = phosg::rgba8888(
-                  ((color2 >> 8) & 0xF8) | ((color2 >> 13) & 0x07),
-                  ((color2 >> 3) & 0xFC) | ((color2 >> 9) & 0x03),
-                  ((color2 << 3) & 0xF8) | ((color2 >> 2) & 0x07),
-                  0xFF);
-              if (color1 > color2) {
-                color_table[2] = phosg::rgba8888(
-                    (((phosg::get_r(color_table[0]) * 2) + phosg::get_r(color_table[1])) / 3),
-                    (((phosg::get_g(color_table[0]) * 2) + phosg::get_g(color_table[1])) / 3),
-                    (((phosg::get_b(color_table[0]) * 2) + phosg::get_b(color_table[1])) / 3),
-                    0xFF);
-                color_table[3] = phosg::rgba8888(
-                    (((phosg::get_r(color_table[1]) * 2) + phosg::get_r(color_table[0])) / 3),
-                    (((phosg::get_g(color_table[1]) * 2) + phosg::get_g(color_table[0])) / 3),
-                    (((phosg::get_b(color_table[1]) * 2) + phosg::get_b(color_table[0])) / 3),
-                    0xFF);
-              } else {
-                color_table[2] = phosg::rgba8888(
-                    ((phosg::get_r(color_table[0]) + phosg::get_r(color_table[1])) / 2),
-                    ((phosg::get_g(color_table[0]) + phosg::get_g(color_table[1])) / 2),
-                    ((phosg::get_b(color_table[0]) + phosg::get_b(color_table[1])) / 2),
-                    0xFF);
-                color_table[3] = 0x00000000;
-              }
-
-              for (size_t yyy = 0; yyy < 4; yyy++) {
-                uint8_t pixels = r.get_u8();
-                for (size_t xxx = 0; xxx < 4; xxx++) {
-                  size_t effective_x = x + xx + xxx;
-                  size_t effective_y = y + yy + yyy;
-                  uint8_t color_index = (pixels >> (6 - (xxx * 2))) & 3;
-                  result.write(effective_x, effective_y, color_table[color_index]);
-                }
-              }
-            }
-          }
-        }
-      }
+      // 8x8 blocks, each made of four 4x4 DXT1 blocks
+      decode_blocks<8, 8>(result, pixel_data, pixel_data_size, 32, [&](const uint8_t* block_data, uint32_t* out) {
+        decode_dxt1_subblock(block_data, out);
+        decode_dxt1_subblock(block_data + 8, out + 4);
+        decode_dxt1_subblock(block_data + 16, out + 32);
+        decode_dxt1_subblock(block_data + 24, out + 36);
+      });
       break;
 
     default:
@@ -332,21 +377,47 @@ phosg::ImageRGBA8888N decode_gvr(const std::string& data, const std::vector<uint
   return result;
 }
 
+void print_usage(const char* argv0) {
+  phosg::fwrite_fmt(stderr, "\
+Usage: {} [--parallel=N] <filename.gvm|gvr> [color_table.gvp]\n\
+\n\
+Options:\n\
+  --parallel=N: Decode the textures in a GVM archive on N threads. If N is 0,\n\
+      use as many threads as there are CPU cores. By default, textures are\n\
+      decoded one at a time.\n\
+", argv0);
+}
+
 int main(int argc, char** argv) {
-  if (argc < 2 || argc > 3) {
-    phosg::fwrite_fmt(stderr, "Usage: {} <filename.gvm|gvr> [color_table.gvp]\n", argv[0]);
+  const char* filename = nullptr;
+  const char* clut_filename = nullptr;
+  ssize_t parallelism = -1;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
+    } else if (!filename) {
+      filename = argv[x];
+    } else if (!clut_filename) {
+      clut_filename = argv[x];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!filename) {
+    print_usage(argv[0]);
     return 1;
   }
 
-  std::string data = phosg::load_file(argv[1]);
+  std::string data = phosg::load_file(filename);
   if (data.size() < 8) {
     phosg::fwrite_fmt(stderr, "file is too small\n");
     return 2;
   }
 
   std::vector<uint32_t> clut;
-  if (argc == 3) {
-    clut = decode_gvp(phosg::load_file(argv[2]));
+  if (clut_filename) {
+    clut = decode_gvp(phosg::load_file(clut_filename));
   }
 
   uint32_t magic = *reinterpret_cast<const phosg::be_uint32_t*>(data.data());
@@ -357,7 +428,7 @@ int main(int argc, char** argv) {
     }
     try {
       auto decoded = decode_gvr(data, clut.empty() ? nullptr : &clut);
-      phosg::save_file(std::string(argv[1]) + ".bmp", decoded.serialize(phosg::ImageFormat::WINDOWS_BITMAP));
+      phosg::save_file(std::string(filename) + ".bmp", decoded.serialize(phosg::ImageFormat::WINDOWS_BITMAP));
     } catch (const std::exception& e) {
       phosg::fwrite_fmt(stderr, "failed to decode gvr: {}\n", e.what());
       return 2;
@@ -373,38 +444,59 @@ int main(int argc, char** argv) {
       phosg::fwrite_fmt(stderr, "warning: gvm header may be corrupt\n");
     }
 
-    phosg::fwrite_fmt(stderr, "{}: {} files\n", argv[1], gvm->num_files.load());
+    phosg::fwrite_fmt(stderr, "{}: {} files\n", filename, gvm->num_files.load());
+
+    // The textures' offsets depend on the sizes of all previous textures, so find them all first, then decode them
+    struct Entry {
+      size_t index;
+      std::string filename;
+      size_t offset;
+      size_t size;
+    };
+    std::vector<Entry> entries;
     size_t offset = gvm->header_size + 8;
     for (size_t x = 0; x < gvm->num_files; x++) {
-      std::string filename = argv[1];
-      filename += '_';
+      std::string entry_filename = filename;
+      entry_filename += '_';
       for (const char* ch = gvm->entries[x].name; *ch; ch++) {
         if (*ch < 0x20 || *ch > 0x7E) {
-          filename += std::format("_x{:02X}", *ch);
+          entry_filename += std::format("_x{:02X}", *ch);
         } else {
-          filename += *ch;
+          entry_filename += *ch;
         }
       }
-      filename += ".gvr";
+      entry_filename += ".gvr";
 
+      if (offset + sizeof(GVRHeader) > data.size()) {
+        phosg::fwrite_fmt(stderr, "gvm file is truncated; stopping at file {}\n", x + 1);
+        break;
+      }
       const GVRHeader* gvr = reinterpret_cast<const GVRHeader*>(data.data() + offset);
       if (gvr->magic != 0x47565254) {
         phosg::fwrite_fmt(stderr, "warning: gvr header may be corrupt\n");
       }
+      size_t size = std::min<size_t>(gvr->data_size + 8, data.size() - offset);
+      entries.emplace_back(Entry{x, std::move(entry_filename), offset, size});
+      offset += (gvr->data_size + 8);
+    }
 
-      std::string gvr_contents = data.substr(offset, gvr->data_size + 8);
+    auto process_entry = [&](const Entry& entry) -> void {
+      std::string gvr_contents = data.substr(entry.offset, entry.size);
       try {
         auto decoded = decode_gvr(gvr_contents, clut.empty() ? nullptr : &clut);
-        phosg::save_file(filename + ".bmp", decoded.serialize(phosg::ImageFormat::WINDOWS_BITMAP));
-        phosg::fwrite_fmt(stdout, "> {:04} = {:08X}:{:08X} => {}.bmp\n", x + 1, offset, gvr->data_size + 8, filename);
+        phosg::save_file(entry.filename + ".bmp", decoded.serialize(phosg::ImageFormat::WINDOWS_BITMAP));
+        phosg::fwrite_fmt(stdout, "> {:04} = {:08X}:{:08X} => {}.bmp\n",
+            entry.index + 1, entry.offset, entry.size, entry.filename);
       } catch (const std::exception& e) {
         phosg::fwrite_fmt(stderr, "failed to decode gvr: {}\n", e.what());
       }
 
-      phosg::fwrite_fmt(stdout, "> {:04} = {:08X}:{:08X} => {}\n", x + 1, offset, gvr->data_size + 8, filename);
-      phosg::save_file(filename, gvr_contents);
-      offset += (gvr->data_size + 8);
-    }
+      phosg::fwrite_fmt(stdout, "> {:04} = {:08X}:{:08X} => {}\n",
+          entry.index + 1, entry.offset, entry.size, entry.filename);
+      phosg::save_file(entry.filename, gvr_contents);
+    };
+
+    ResourceDASM::parallel_for_each(entries, process_entry, parallelism);
 
   } else {
     phosg::fwrite_fmt(stderr, "file signature is incorrect\n");
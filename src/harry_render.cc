@@ -5,13 +5,16 @@
 #include <algorithm>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <vector>
 
+#include "DecodedImageCache.hh"
 #include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 #include "SpriteDecoders/Decoders.hh"
 
@@ -341,28 +344,25 @@ static const std::unordered_map<int16_t, SpriteDefinition> sprite_defs({
     {21000, SpriteDefinition(3801)}, // note
 });
 
-static std::shared_ptr<phosg::ImageRGBA8888N> decode_PICT_with_transparency_cached(
-    int16_t id,
-    std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>>& cache,
-    ResourceDASM::ResourceFile& rf) {
+static std::shared_ptr<const phosg::ImageRGBA8888N> decode_PICT_with_transparency_cached(
+    ResourceDASM::DecodedImageCache& cache,
+    const std::string& file_key,
+    const ResourceDASM::ResourceFile& rf,
+    int16_t id) {
   try {
-    return cache.at(id);
-  } catch (const std::out_of_range&) {
-    try {
-      auto decode_result = rf.decode_PICT(id);
-      if (!decode_result.embedded_image_format.empty()) {
-        throw std::runtime_error(std::format("PICT {} is an embedded image", id));
-      }
-
-      // Convert white pixels to transparent pixels
-      decode_result.image.set_alpha_from_mask_color(0xFFFFFFFF);
-
-      auto emplace_ret = cache.emplace(id, std::make_shared<phosg::ImageRGBA8888N>(std::move(decode_result.image)));
-      return emplace_ret.first->second;
+    return cache.get_resource(file_key, rf, ResourceDASM::RESOURCE_TYPE_PICT, id, "white_transparent",
+        [&](const ResourceDASM::ResourceFile::Resource& res) -> phosg::ImageRGBA8888N {
+          auto decode_result = rf.decode_PICT(res.data.data(), res.data.size());
+          if (!decode_result.embedded_image_format.empty()) {
+            throw std::runtime_error(std::format("PICT {} is an embedded image", id));
+          }
 
-    } catch (const std::out_of_range&) {
-      return nullptr;
-    }
+          // Convert white pixels to transparent pixels
+          decode_result.image.set_alpha_from_mask_color(0xFFFFFFFF);
+          return std::move(decode_result.image);
+        });
+  } catch (const std::out_of_range&) {
+    return nullptr;
   }
 }
 
@@ -387,7 +387,15 @@ Options:\n\
   --skip-render-sprites\n\
       Don\'t render sprites.\n\
   --print-unused-pict-ids\n\
-      When done, print the IDs of all the PICT resources that were not used.\n\n" IMAGE_SAVER_HELP);
+      When done, print the IDs of all the PICT resources that were not used.\n\
+  --cache-dir=DIR\n\
+      Store decoded images in this directory, and reuse them in later runs\n\
+      instead of decoding them again. Stale images are never deleted from\n\
+      this directory; to purge it, delete the directory.\n\
+  --parallel=N\n\
+      Render N levels at once. If N is 0, use one thread per CPU core. The\n\
+      resource files are only parsed once, and decoded images are shared\n\
+      between all threads.\n\n" IMAGE_SAVER_HELP);
 }
 
 int main(int argc, char** argv) {
@@ -400,6 +408,8 @@ int main(int argc, char** argv) {
   std::string levels_filename = "Episode 1";
   std::string sprites_filename = "Harry Graphics";
   std::string clut_filename;
+  std::string cache_dir;
+  ssize_t parallelism = -1;
 
   for (int z = 1; z < argc; z++) {
     if (!strcmp(argv[z], "--help") || !strcmp(argv[z], "-h")) {
@@ -419,6 +429,10 @@ int main(int argc, char** argv) {
       render_background_tiles = false;
     } else if (!strcmp(argv[z], "--skip-render-sprites")) {
       render_sprites = false;
+    } else if (!strncmp(argv[z], "--cache-dir=", 12)) {
+      cache_dir = &argv[z][12];
+    } else if (!strncmp(argv[z], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[z][11], nullptr, 0);
     } else if (!image_saver.process_cli_arg(argv[z])) {
       phosg::fwrite_fmt(stderr, "invalid option: {}\n", argv[z]);
       print_usage();
@@ -445,12 +459,14 @@ int main(int argc, char** argv) {
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>> world_pict_cache;
-  std::unordered_map<int16_t, std::shared_ptr<phosg::ImageRGBA8888N>> sprites_cache;
+  ResourceDASM::DecodedImageCache image_cache(cache_dir);
+  ResourceDASM::ImageWriteQueue write_queue(image_saver);
+  // Sprites are decoded with the external color table, so it must be part of their cache keys
+  std::string sprite_options = std::format("clut={:016X}", phosg::fnv1a64(clut_data.data(), clut_data.size()));
 
-  for (int16_t level_id : level_resources) {
+  auto render_level = [&](const int16_t& level_id) -> void {
     if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+      return;
     }
 
     std::string level_data = levels.get_resource(level_resource_type, level_id)->data;
@@ -459,12 +475,12 @@ int main(int argc, char** argv) {
     phosg::ImageRGBA8888N result(128 * 32, 128 * 32);
 
     if ((foreground_opacity != 0) || render_background_tiles) {
-      std::shared_ptr<phosg::ImageRGBA8888N> foreground_pict = level->foreground_pict_id
-          ? decode_PICT_with_transparency_cached(level->foreground_pict_id, world_pict_cache, levels)
-          : decode_PICT_with_transparency_cached(181, sprites_cache, sprites);
-      std::shared_ptr<phosg::ImageRGBA8888N> background_pict = level->background_pict_id
-          ? decode_PICT_with_transparency_cached(level->background_pict_id, world_pict_cache, levels)
-          : decode_PICT_with_transparency_cached(180, sprites_cache, sprites);
+      std::shared_ptr<const phosg::ImageRGBA8888N> foreground_pict = level->foreground_pict_id
+          ? decode_PICT_with_transparency_cached(image_cache, levels_filename, levels, level->foreground_pict_id)
+          : decode_PICT_with_transparency_cached(image_cache, sprites_filename, sprites, 181);
+      std::shared_ptr<const phosg::ImageRGBA8888N> background_pict = level->background_pict_id
+          ? decode_PICT_with_transparency_cached(image_cache, levels_filename, levels, level->background_pict_id)
+          : decode_PICT_with_transparency_cached(image_cache, sprites_filename, sprites, 180);
       for (size_t y = 0; y < 128; y++) {
         for (size_t x = 0; x < 128; x++) {
           if (render_background_tiles) {
@@ -525,17 +541,14 @@ int main(int argc, char** argv) {
           render_text_as_unknown = true;
         }
 
-        std::shared_ptr<phosg::ImageRGBA8888N> sprite_pict;
+        std::shared_ptr<const phosg::ImageRGBA8888N> sprite_pict;
         if (sprite_def && sprite_def->hrsp_id) {
           try {
-            sprite_pict = sprites_cache.at(sprite_def->hrsp_id);
+            sprite_pict = image_cache.get_resource(sprites_filename, sprites, 0x48725370, sprite_def->hrsp_id, // HrSp
+                sprite_options, [&](const ResourceDASM::ResourceFile::Resource& res) -> phosg::ImageRGBA8888N {
+                  return ResourceDASM::decode_HrSp(res.data, clut, 16);
+                });
           } catch (const std::out_of_range&) {
-            try {
-              const auto& data = sprites.get_resource(0x48725370, sprite_def->hrsp_id)->data; // HrSp
-              sprite_pict = std::make_shared<phosg::ImageRGBA8888N>(decode_HrSp(data, clut, 16));
-              sprites_cache.emplace(sprite_def->hrsp_id, sprite_pict);
-            } catch (const std::out_of_range&) {
-            }
           }
         }
 
@@ -585,9 +598,17 @@ int main(int argc, char** argv) {
 
     std::string result_filename = std::format("Harry_Level_{}_{}",
         level_id, sanitized_name);
-    result_filename = image_saver.save_image(result, result_filename);
+    result_filename = write_queue.save_image(result, result_filename);
     phosg::fwrite_fmt(stderr, "... {}\n", result_filename);
+  };
+
+  if (ResourceDASM::resolve_num_threads(parallelism) > 1) {
+    // The resource files and image cache are shared between all the rendering threads
+    levels.decompress_all_resources();
+    sprites.decompress_all_resources();
   }
+  ResourceDASM::parallel_for_each(level_resources, render_level, parallelism);
+  write_queue.finish();
 
   return 0;
 }
@@ -3,15 +3,18 @@
 #include <string.h>
 
 #include <algorithm>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 #include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 #include "SpriteDecoders/Decoders.hh"
 
@@ -187,6 +190,10 @@ Options:\n\
       Draw normal tiles with this opacity (0-255; default 255).\n\
   --object-opacity=N\n\
       Draw objects with this opacity (0-255; default 255).\n\
+  --parallel=N\n\
+      Render N levels at once. If N is 0, use one thread per CPU core. The\n\
+      graphics file is only decoded once, and the decoded images are shared\n\
+      between all threads.\n\
 \n" IMAGE_SAVER_HELP);
 }
 
@@ -203,6 +210,7 @@ int main(int argc, char** argv) {
   uint32_t erase_color = 0x00000000;
   bool show_unused_images = false;
   bool use_shpd_v2 = false;
+  ssize_t parallelism = -1;
   ResourceDASM::ImageSaver image_saver;
   for (int z = 1; z < argc; z++) {
     if (!strcmp(argv[z], "--help") || !strcmp(argv[z], "-h")) {
@@ -232,6 +240,8 @@ int main(int argc, char** argv) {
       tile_opacity = strtoul(&argv[z][15], nullptr, 0);
     } else if (!strncmp(argv[z], "--object-opacity=", 17)) {
       object_opacity = strtoul(&argv[z][17], nullptr, 0);
+    } else if (!strncmp(argv[z], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[z][11], nullptr, 0);
     } else if (!image_saver.process_cli_arg(argv[z])) {
       phosg::fwrite_fmt(stderr, "invalid option: {}\n", argv[z]);
       print_usage();
@@ -263,13 +273,24 @@ int main(int argc, char** argv) {
   auto level_resources = levels.all_resources_of_type(level_resource_type);
   sort(level_resources.begin(), level_resources.end());
 
-  std::vector<std::vector<LemmingsObjectDefinition>> object_defs_cache;
+  // Object definitions are shared by all levels with the same ground type; both of these are shared between the
+  // rendering threads (if --parallel is given), so they're protected by locks
+  std::unordered_map<uint16_t, std::vector<LemmingsObjectDefinition>> object_defs_cache;
+  std::mutex object_defs_cache_lock;
   std::unordered_set<std::string> used_erase_image_names;
   std::unordered_set<std::string> used_image_names;
+  std::mutex used_image_names_lock;
+  auto mark_image_used = [&](const std::string& name, bool is_erase) -> void {
+    if (show_unused_images) {
+      std::lock_guard g(used_image_names_lock);
+      (is_erase ? used_erase_image_names : used_image_names).emplace(name);
+    }
+  };
+  ResourceDASM::ImageWriteQueue write_queue(image_saver);
 
-  for (int16_t level_id : level_resources) {
+  auto render_level = [&](const int16_t& level_id) -> void {
     if (!target_levels.empty() && !target_levels.count(level_id)) {
-      continue;
+      return;
     }
 
     std::string level_data = levels.get_resource(level_resource_type, level_id)->data;
@@ -283,27 +304,30 @@ int main(int argc, char** argv) {
       throw std::runtime_error("invalid ground type in level");
     }
 
-    if (object_defs_cache.size() <= level->ground_type) {
-      object_defs_cache.resize(level->ground_type + 1);
-    }
-    if (object_defs_cache[level->ground_type].empty()) {
-      constexpr uint32_t object_def_resource_type = 0x4F424A44; // OBJD
-      const std::string& data = levels.get_resource(object_def_resource_type, level->ground_type)->data;
-      if (data.size() % sizeof(LemmingsObjectDefinition)) {
-        throw std::runtime_error(std::format(
-            "object definition list size is incorrect: expected a multiple of {} bytes, received {} bytes",
-            sizeof(LemmingsObjectDefinition), level_data.size()));
-      }
-      size_t count = data.size() / sizeof(LemmingsObjectDefinition);
+    const std::vector<LemmingsObjectDefinition>* obj_defs_ptr;
+    {
+      std::lock_guard g(object_defs_cache_lock);
+      auto cache_it = object_defs_cache.find(level->ground_type);
+      if (cache_it == object_defs_cache.end()) {
+        constexpr uint32_t object_def_resource_type = 0x4F424A44; // OBJD
+        const std::string& data = levels.get_resource(object_def_resource_type, level->ground_type)->data;
+        if (data.size() % sizeof(LemmingsObjectDefinition)) {
+          throw std::runtime_error(std::format(
+              "object definition list size is incorrect: expected a multiple of {} bytes, received {} bytes",
+              sizeof(LemmingsObjectDefinition), level_data.size()));
+        }
+        size_t count = data.size() / sizeof(LemmingsObjectDefinition);
 
-      const auto* res_obj_defs = reinterpret_cast<const LemmingsObjectDefinition*>(data.data());
-      std::vector<LemmingsObjectDefinition> obj_defs;
-      while (obj_defs.size() < count) {
-        obj_defs.emplace_back(res_obj_defs[obj_defs.size()]);
+        const auto* res_obj_defs = reinterpret_cast<const LemmingsObjectDefinition*>(data.data());
+        std::vector<LemmingsObjectDefinition> obj_defs;
+        while (obj_defs.size() < count) {
+          obj_defs.emplace_back(res_obj_defs[obj_defs.size()]);
+        }
+        cache_it = object_defs_cache.emplace(level->ground_type, std::move(obj_defs)).first;
       }
-      object_defs_cache[level->ground_type] = std::move(obj_defs);
+      obj_defs_ptr = &cache_it->second;
     }
-    const auto& obj_defs = object_defs_cache.at(level->ground_type);
+    const auto& obj_defs = *obj_defs_ptr;
 
     // Note: We use the alpha channel to denote what type of pixel each pixel is during rendering (0x00 = nothing,
     // 0xFF = tile, 0xE0 = object, 0xD0 = annotation). Before saving the result, though, we delete the alpha channel
@@ -313,9 +337,7 @@ int main(int argc, char** argv) {
     // Render special image, if one is given
     if (level->iff_number != 0) {
       std::string img_name = std::format("{}_Special{}_0", 1699 + level->iff_number, level->iff_number - 1);
-      if (show_unused_images) {
-        used_image_names.emplace(img_name);
-      }
+      mark_image_used(img_name, false);
       const auto& img = shapes.at(img_name);
       result.copy_from(img.image, (result.get_width() - img.image.get_width()) / 2 - 16, 0, img.image.get_width(),
           img.image.get_height(), 0, 0);
@@ -335,13 +357,7 @@ int main(int argc, char** argv) {
         ssize_t orig_tile_x = tile.x();
         ssize_t orig_tile_y = tile.y();
 
-        if (show_unused_images) {
-          if (tile.erase()) {
-            used_erase_image_names.emplace(tile_name);
-          } else {
-            used_image_names.emplace(tile_name);
-          }
-        }
+        mark_image_used(tile_name, tile.erase());
         const auto& tile_img = shapes.at(tile_name);
         phosg::ImageRGBA8888N reverse_tile_img;
         const phosg::ImageRGBA8888N* img_to_render = &tile_img.image;
@@ -411,9 +427,7 @@ int main(int argc, char** argv) {
           "{}_Objects{}_{}", level->ground_type + 1600, level->ground_type + 1, def.seq_base);
       bool image_valid = true;
       try {
-        if (show_unused_images) {
-          used_image_names.emplace(img_name);
-        }
+        mark_image_used(img_name, false);
         const auto& img = shapes.at(img_name);
         img_x += img.origin_x;
         img_y += img.origin_y;
@@ -450,9 +464,7 @@ int main(int argc, char** argv) {
               "{}_Objects{}_{}", level->ground_type + 1600, level->ground_type + 1, def.seq_base + def.seq_length);
 
           try {
-            if (show_unused_images) {
-              used_image_names.emplace(subimg_name);
-            }
+            mark_image_used(subimg_name, false);
             const auto& subimg = shapes.at(subimg_name);
             ssize_t subimg_x = img_x;
             ssize_t subimg_y = img_y + img.image.get_height();
@@ -532,9 +544,16 @@ int main(int argc, char** argv) {
 
     std::string result_filename = std::format("Lemmings_Level_{}_{}", level_id, sanitized_name);
     // Delete alpha channel, as described above
-    result_filename = image_saver.save_image(result.change_pixel_format<phosg::PixelFormat::RGB888>(), result_filename);
+    result_filename = write_queue.save_image(result.change_pixel_format<phosg::PixelFormat::RGB888>(), result_filename);
     phosg::fwrite_fmt(stderr, "... {}\n", result_filename);
+  };
+
+  if (ResourceDASM::resolve_num_threads(parallelism) > 1) {
+    // The decoded shapes are only read while rendering, so they're shared between all threads without locking
+    levels.decompress_all_resources();
   }
+  ResourceDASM::parallel_for_each(level_resources, render_level, parallelism);
+  write_queue.finish();
 
   if (show_unused_images) {
     for (const auto& it : shapes) {
@@ -5,6 +5,7 @@
 #include <phosg/Arguments.hh>
 #include <phosg/Filesystem.hh>
 
+#include "ForkWriter.hh"
 #include "IndexFormats/Formats.hh"
 
 int main(int argc, char** argv) {
@@ -21,10 +22,29 @@ int main(int argc, char** argv) {
   }
   bool separate = args.get<bool>("separate");
 
-  auto decoded = ResourceDASM::parse_macbinary(phosg::load_file(input_filename));
-  auto data_f = phosg::fopen_unique(output_filename + (separate ? ".data" : ""), "wb");
-  auto rsrc_f = phosg::fopen_unique(output_filename + (separate ? ".rsrc" : "/..namedfork/rsrc"), "wb");
-  phosg::fwritex(data_f.get(), decoded.first.getv(decoded.first.size()), decoded.first.size());
-  phosg::fwritex(rsrc_f.get(), decoded.second.getv(decoded.second.size()), decoded.second.size());
+  // Decode the input in chunks and write the forks as they're decoded, so large files don't have to fit in memory.
+  // The output files are created only when the decoder produces data for them, and are deleted if decoding fails, so
+  // invalid or truncated input doesn't leave empty or partial files behind.
+  auto in_f = phosg::fopen_unique(input_filename, "rb");
+  ResourceDASM::ForkWriter out(output_filename, separate);
+  ResourceDASM::MacBinaryDecoder decoder(
+      [&](const void* data, size_t size) -> void {
+        out.write_data(data, size);
+      },
+      [&](const void* data, size_t size) -> void {
+        out.write_resource(data, size);
+      });
+  try {
+    std::string buffer(0x10000, '\0');
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer.data(), 1, buffer.size(), in_f.get())) > 0) {
+      decoder.write(buffer.data(), bytes_read);
+    }
+    decoder.finish();
+    out.finish();
+  } catch (...) {
+    out.abort();
+    throw;
+  }
   return 0;
 }
@@ -1,6 +1,8 @@
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -10,6 +12,7 @@
 
 #include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 
 struct MonkeyShinesRoom {
@@ -143,6 +146,11 @@ std::vector<std::unordered_map<int16_t, std::pair<int16_t, int16_t>>> generate_r
 void print_usage() {
   phosg::fwrite_fmt(stderr, "\
 Usage: mshines_render [options] input_filename [output_prefix]\n\
+\n\
+Options:\n\
+  --parallel=N\n\
+      Render N connected groups of rooms at once. If N is 0, use one thread per\n\
+      CPU core.\n\
 \n" IMAGE_SAVER_HELP);
 }
 
@@ -150,10 +158,13 @@ int main(int argc, char** argv) {
   ResourceDASM::ImageSaver image_saver;
   std::string filename;
   std::string out_prefix;
+  ssize_t parallelism = -1;
 
   for (int x = 1; x < argc; x++) {
     if (image_saver.process_cli_arg(argv[x])) {
       // Nothing
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
     } else if (filename.empty()) {
       filename = argv[x];
     } else if (out_prefix.empty()) {
@@ -201,10 +212,24 @@ int main(int argc, char** argv) {
   std::unordered_map<int16_t, const phosg::ImageRGB888> background_ppat_cache;
   auto emplace_ret = background_ppat_cache.emplace(1000, rf.decode_ppat(1000).pattern);
   const phosg::ImageRGB888* default_background_ppat = &emplace_ret.first->second;
+  std::mutex background_ppat_cache_lock;
 
-  size_t component_number = 0;
   auto placement_maps = generate_room_placement_maps(room_resource_ids);
-  for (const auto& placement_map : placement_maps) {
+
+  // Components that don't contain a start room are numbered in order, so assign their numbers before rendering
+  std::vector<size_t> component_indexes;
+  std::vector<size_t> component_numbers;
+  size_t next_component_number = 0;
+  for (size_t z = 0; z < placement_maps.size(); z++) {
+    const auto& placement_map = placement_maps[z];
+    component_indexes.emplace_back(z);
+    component_numbers.emplace_back(
+        (placement_map.count(1000) || placement_map.count(10000)) ? 0 : next_component_number++);
+  }
+
+  ResourceDASM::ImageWriteQueue write_queue(image_saver);
+  auto render_component = [&](const size_t& component_index) -> void {
+    const auto& placement_map = placement_maps[component_index];
     // First figure out the width and height of this component
     uint16_t w_rooms = 0, h_rooms = 0;
     bool component_contains_start = false, component_contains_bonus_start = false;
@@ -246,8 +271,10 @@ int main(int argc, char** argv) {
       // just in case the room dimensions aren't a multiple of the ppat dimensions
       const phosg::ImageRGB888* background_ppat = nullptr;
       try {
+        std::lock_guard g(background_ppat_cache_lock);
         background_ppat = &background_ppat_cache.at(room->background_ppat_id);
       } catch (const std::out_of_range&) {
+        std::lock_guard g(background_ppat_cache_lock);
         try {
           auto ppat_id = room->background_ppat_id;
           auto emplace_ret = background_ppat_cache.emplace(
@@ -395,13 +422,17 @@ int main(int argc, char** argv) {
     } else if (component_contains_bonus_start) {
       result_filename = out_prefix + "_bonus";
     } else {
-      result_filename = std::format("{}_{}", out_prefix,
-          component_number);
-      component_number++;
+      result_filename = std::format("{}_{}", out_prefix, component_numbers[component_index]);
     }
-    result_filename = image_saver.save_image(result, result_filename);
+    result_filename = write_queue.save_image(result, result_filename);
     phosg::fwrite_fmt(stderr, "... {}\n", result_filename);
+  };
+
+  if (ResourceDASM::resolve_num_threads(parallelism) > 1) {
+    rf.decompress_all_resources();
   }
+  ResourceDASM::parallel_for_each(component_indexes, render_component, parallelism);
+  write_queue.finish();
 
   return 0;
 }
@@ -1,13 +1,19 @@
 #include <inttypes.h>
 
+#include <memory>
+#include <mutex>
 #include <phosg/Arguments.hh>
 #include <phosg/Encoding.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Image.hh>
 #include <phosg/Strings.hh>
 #include <string>
 #include <unordered_set>
 
+#include "DecodedImageCache.hh"
+#include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "ResourceFile.hh"
 #include "SpriteDecoders/Decoders.hh"
 
@@ -756,11 +762,22 @@ struct LevelKindDefinition {
   std::unique_ptr<const ResourceDASM::ResourceFile> resource_file;
   std::unordered_map<int16_t, int16_t> ctbl_id_for_shap_id;
   std::unordered_map<int16_t, const std::vector<ResourceDASM::ColorTableEntry>> decoded_color_tables;
-  std::unordered_map<int16_t, const phosg::ImageRGBA8888N> decoded_shapes;
   std::unordered_map<int16_t, const CustomRoomDefinition> decoded_custom_rooms;
 
+  // get_SHAP is called for every tile, so each SHAP is looked up in the image cache only once. There's a slot for
+  // every SHAP ID from the start, so the map itself is never modified and the slots can be filled from any thread.
+  struct DecodedSHAP {
+    std::once_flag once;
+    std::shared_ptr<const phosg::ImageRGBA8888N> image;
+  };
+  std::unordered_map<int16_t, DecodedSHAP> decoded_shaps;
+
   LevelKindDefinition(std::string&& resource_filename, std::unordered_map<int16_t, int16_t>&& ctbl_id_for_shap_id)
-      : resource_filename(resource_filename), ctbl_id_for_shap_id(ctbl_id_for_shap_id) {}
+      : resource_filename(resource_filename), ctbl_id_for_shap_id(ctbl_id_for_shap_id) {
+    for (const auto& [shap_id, _] : this->ctbl_id_for_shap_id) {
+      this->decoded_shaps.try_emplace(shap_id);
+    }
+  }
 
   const ResourceDASM::ResourceFile& get_rf() {
     if (!this->resource_file) {
@@ -785,16 +802,22 @@ struct LevelKindDefinition {
     }
   }
 
-  const phosg::ImageRGBA8888N& get_SHAP(int16_t id) {
-    try {
-      return this->decoded_shapes.at(id);
-    } catch (const std::out_of_range&) {
+  const phosg::ImageRGBA8888N& get_SHAP(ResourceDASM::DecodedImageCache& image_cache, int16_t id) {
+    auto& slot = this->decoded_shaps.at(id);
+    // If this throws, the slot stays empty and the next call tries again
+    std::call_once(slot.once, [&]() -> void {
       const auto& rf = this->get_rf();
       int16_t ctbl_id = this->ctbl_id_for_shap_id.at(id);
-      auto [it, _] = this->decoded_shapes.emplace(
-          id, decode_SHAP(rf.get_resource(RESOURCE_TYPE_SHAP, id)->data, this->get_CTBL(ctbl_id)));
-      return it->second;
-    }
+      auto shap_res = rf.get_resource(RESOURCE_TYPE_SHAP, id);
+      auto ctbl_res = rf.get_resource(ResourceDASM::RESOURCE_TYPE_CTBL, ctbl_id);
+      uint64_t source_hash = phosg::fnv1a64(shap_res->data.data(), shap_res->data.size());
+      source_hash = phosg::fnv1a64(ctbl_res->data.data(), ctbl_res->data.size(), source_hash);
+      slot.image = image_cache.get(this->resource_filename, RESOURCE_TYPE_SHAP, id, std::format("ctbl={}", ctbl_id),
+          source_hash, [&]() -> std::shared_ptr<const phosg::ImageRGBA8888N> {
+            return std::make_shared<phosg::ImageRGBA8888N>(decode_SHAP(shap_res->data, this->get_CTBL(ctbl_id)));
+          });
+    });
+    return *slot.image;
   }
 
   const CustomRoomDefinition& get_CUST(int16_t id) {
@@ -806,6 +829,27 @@ struct LevelKindDefinition {
       return it->second;
     }
   }
+
+  // Loads the resource file and decodes all color tables and custom rooms, so that the getters above don't modify this
+  // object afterward (other than filling get_SHAP's slots, which is thread-safe), and can then be called from multiple
+  // threads. Resources that can't be decoded are skipped here; the getters will throw when they're requested later, as
+  // they would without preloading.
+  void preload() {
+    const auto& rf = this->get_rf();
+    rf.decompress_all_resources();
+    for (const auto& [_, ctbl_id] : this->ctbl_id_for_shap_id) {
+      try {
+        this->get_CTBL(ctbl_id);
+      } catch (const std::exception&) {
+      }
+    }
+    for (int16_t cust_id : rf.all_resources_of_type(RESOURCE_TYPE_CUST)) {
+      try {
+        this->get_CUST(cust_id);
+      } catch (const std::exception&) {
+      }
+    }
+  }
 };
 
 std::unordered_map<uint16_t, LevelKindDefinition> load_level_kinds(const std::string& data_dir) {
@@ -1056,12 +1100,15 @@ int main(int argc, char** argv) {
     output_dir = ".";
   }
   bool render_graphics = !args.get<bool>("skip-graphics");
+  ResourceDASM::DecodedImageCache image_cache(args.get<std::string>("cache-dir", false));
+  ssize_t parallelism = args.get<ssize_t>("parallel", -1);
   args.assert_none_unused();
 
   auto prince_rsrc = ResourceDASM::parse_resource_fork(phosg::load_file(data_dir + "/Prince.rsrc/..namedfork/rsrc"));
   auto level_kind_defs = load_level_kinds(data_dir);
+  ResourceDASM::ImageWriteQueue write_queue{ResourceDASM::ImageSaver()};
 
-  for (const auto& res_id : prince_rsrc.all_resources_of_type(RESOURCE_TYPE_LEVL)) {
+  auto render_level = [&](const int16_t& res_id) -> void {
     auto res = prince_rsrc.get_resource(RESOURCE_TYPE_LEVL, res_id);
     if (res->data.size() != sizeof(PrinceOfPersia2Level)) {
       throw std::runtime_error(std::format("invalid LEVL resource with ID {}", res_id));
@@ -1113,7 +1160,7 @@ int main(int argc, char** argv) {
                 ssize_t seg_offset_x = (room_tile_mods[z].bg_segment_id & 3) * TILE_W_PIXELS;
                 ssize_t seg_offset_bottom = ((room_tile_mods[z].bg_segment_id >> 2) & 3) * TILE_H_PIXELS;
                 int16_t shap_id = 3500 + room_tile_mods[z].bg_index;
-                const auto& shap = level_kind->get_SHAP(shap_id);
+                const auto& shap = level_kind->get_SHAP(image_cache, shap_id);
                 ssize_t seg_offset_y = shap.h - seg_offset_bottom - TILE_H_PIXELS;
                 ssize_t vert_blank_lines = std::max<ssize_t>(0, -seg_offset_y);
                 const auto shap_view = shap.view(
@@ -1131,7 +1178,7 @@ int main(int argc, char** argv) {
                   size_t tile_x = (z % 10) * TILE_W_PIXELS;
                   size_t tile_y = (z / 10) * TILE_H_PIXELS;
                   int16_t shap_id = 3551 + room_tile_mods[z].fg_index;
-                  const auto& shap = level_kind->get_SHAP(shap_id);
+                  const auto& shap = level_kind->get_SHAP(image_cache, shap_id);
                   ssize_t vert_blank_lines = std::max<ssize_t>(0, TILE_H_PIXELS - shap.h);
                   room_map.copy_from_with_blend(
                       shap, tile_x, tile_y + vert_blank_lines, shap.w, shap.h, 0, 0);
@@ -1160,7 +1207,7 @@ int main(int argc, char** argv) {
                   ssize_t piece_x = room_x + piece.left_offset;
                   ssize_t piece_bottom_y = room_y + piece.vert_offset;
                   try {
-                    const auto& shap = level_kind->get_SHAP(piece.shap_id);
+                    const auto& shap = level_kind->get_SHAP(image_cache, piece.shap_id);
                     map.copy_from_with_blend(shap, piece_x, piece_bottom_y - shap.h, shap.w, shap.h, 0, 0);
                     // map.draw_rect(piece_x, piece_bottom_y - shap.h, shap.w, shap.h, 0xFFFF00FF);
                     // map.draw_text(piece_x + 2, piece_bottom_y + 2, 0xFFFF00FF, "^ CUST:{}#{}\nSHAP:{}\nL:{} B:{}\nX:{} Y:{}\nW:{} H:{}\nT:{}",
@@ -1304,11 +1351,23 @@ int main(int argc, char** argv) {
         map.draw_text(room_x, room_y, 0xFF000000 | overlay_alpha, "     RM{:02X}", room_id);
       }
 
-      std::string filename = format("{}/pop2_level{}_part{}.bmp", output_dir, res_id, component.component_id);
-      phosg::save_file(filename, map.serialize(phosg::ImageFormat::WINDOWS_BITMAP));
+      std::string filename = write_queue.save_image(
+          map, std::format("{}/pop2_level{}_part{}", output_dir, res_id, component.component_id));
       phosg::log_info_f("... {}", filename);
     }
+  };
+
+  auto level_ids = prince_rsrc.all_resources_of_type(RESOURCE_TYPE_LEVL);
+  if (ResourceDASM::resolve_num_threads(parallelism) > 1) {
+    // Resources are decompressed and level kind data is decoded lazily, which isn't thread-safe, so do all of that
+    // before starting any threads
+    prince_rsrc.decompress_all_resources();
+    for (auto& [_, level_kind] : level_kind_defs) {
+      level_kind.preload();
+    }
   }
+  ResourceDASM::parallel_for_each(level_ids, render_level, parallelism);
+  write_queue.finish();
 
   return 0;
 }
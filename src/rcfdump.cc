@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +8,18 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <filesystem>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "FileCopy.hh"
+#include "Parallel.hh"
+
 struct RCFHeader {
   char ident[0x20];
   phosg::be_uint32_t unknown;
@@ -31,66 +38,164 @@ struct RCFIndexEntry {
   phosg::be_uint32_t size;
 } __attribute__((packed));
 
-std::vector<std::string> parse_names_index(const std::string& data, size_t offset) {
+struct NamedIndexEntry {
+  std::string name;
+  RCFIndexEntry entry;
+};
+
+// The archive is never read in its entirety; only the header and index are read up front, and each file's data is
+// read only if that file is extracted. All reads are positioned, so the same fd can be used from multiple threads.
+
+std::vector<std::string> parse_names_index(int fd, size_t file_size, size_t offset) {
+  // The names index doesn't have an overall size field, so it's read in chunks as needed
+  std::string data;
+  auto ensure_available = [&](size_t pos, size_t size) -> void {
+    while (data.size() < pos + size) {
+      size_t read_offset = offset + data.size();
+      if (read_offset >= file_size) {
+        throw std::runtime_error("names index extends beyond end of file");
+      }
+      data += phosg::preadx(fd, std::min<size_t>(0x10000, file_size - read_offset), read_offset);
+    }
+  };
+
   // For some reason this isn't reverse-endian... weird
-  uint32_t num_names = *reinterpret_cast<const phosg::le_uint32_t*>(&data[offset]);
-  offset += 8;
+  ensure_available(0, 8);
+  uint32_t num_names = *reinterpret_cast<const phosg::le_uint32_t*>(&data[0]);
+  size_t pos = 8;
 
   std::vector<std::string> ret;
   while (ret.size() < num_names) {
-    uint32_t len = *reinterpret_cast<const phosg::le_uint32_t*>(&data[offset]);
-    ret.emplace_back(&data[offset + 4], len - 1);
-    offset += (len + 8);
+    ensure_available(pos, 4);
+    uint32_t len = *reinterpret_cast<const phosg::le_uint32_t*>(&data[pos]);
+    if (len == 0) {
+      throw std::runtime_error("name has invalid length");
+    }
+    ensure_available(pos + 4, len);
+    ret.emplace_back(&data[pos + 4], len - 1);
+    pos += (len + 8);
   }
 
   return ret;
 }
 
-std::unordered_map<std::string, RCFIndexEntry> get_index(const std::string& data, size_t offset) {
-  RCFIndexHeader header;
-  memcpy(&header, &data[offset], sizeof(RCFIndexHeader));
+std::vector<NamedIndexEntry> get_index(int fd, size_t file_size, size_t offset) {
+  std::string header_data = phosg::preadx(fd, sizeof(RCFIndexHeader), offset);
+  const auto* header = reinterpret_cast<const RCFIndexHeader*>(header_data.data());
   offset += sizeof(RCFIndexHeader);
 
-  std::vector<std::string> names = parse_names_index(data, header.names_offset);
-  if (header.count != names.size()) {
+  std::vector<std::string> names = parse_names_index(fd, file_size, header->names_offset);
+  if (header->count != names.size()) {
     throw std::runtime_error("name count and file count do not match");
   }
 
-  std::unordered_map<std::string, RCFIndexEntry> ret;
-  while (ret.size() < header.count) {
-    const std::string& name = names.at(ret.size());
-    auto& entry = ret[name];
-
-    memcpy(&entry, &data[offset], sizeof(RCFIndexEntry));
-    offset += sizeof(RCFIndexEntry);
+  std::string entries_data = phosg::preadx(fd, sizeof(RCFIndexEntry) * header->count, offset);
+  const auto* entries = reinterpret_cast<const RCFIndexEntry*>(entries_data.data());
+
+  // If a name appears more than once, only the first entry with that name is kept, so no two entries are ever
+  // extracted to the same file
+  std::vector<NamedIndexEntry> ret;
+  ret.reserve(names.size());
+  std::unordered_set<std::string> seen_names;
+  for (size_t z = 0; z < names.size(); z++) {
+    if (seen_names.emplace(names[z]).second) {
+      ret.emplace_back(NamedIndexEntry{std::move(names[z]), entries[z]});
+    }
   }
-
   return ret;
 }
 
+// Copies a range of the input file to a new file
+void copy_file_extent(int src_fd, uint64_t offset, uint64_t size, const std::string& out_filename) {
+  phosg::scoped_fd out_fd(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ResourceDASM::copy_fd_range(src_fd, offset, out_fd, 0, size);
+}
+
+void print_usage() {
+  phosg::fwrite_fmt(stderr, "\
+Usage: rcfdump [options] <filename> [name-or-pattern ...]\n\
+\n\
+Extracts files from an RCF archive into the current directory. If any names or\n\
+patterns are given, only files whose names match at least one of them are\n\
+extracted; patterns may use shell-style wildcards (*, ?, and [...]). Only the\n\
+archive's index and the extracted files' data are read from the archive.\n\
+\n\
+Options:\n\
+  --list: Print the index entries that would be extracted, but don't extract\n\
+      anything.\n\
+  --parallel=N: Extract files on N threads. If N is 0, use as many threads as\n\
+      there are CPU cores. By default, files are extracted one at a time.\n\
+");
+}
+
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    phosg::fwrite_fmt(stderr, "Usage: rcfdump <filename>\n");
+  const char* filename = nullptr;
+  std::vector<std::string> patterns;
+  bool list_only = false;
+  ssize_t parallelism = -1;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--list")) {
+      list_only = true;
+    } else if (!strncmp(argv[x], "--parallel=", 11)) {
+      parallelism = std::stoll(&argv[x][11], nullptr, 0);
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else if (!filename) {
+      filename = argv[x];
+    } else {
+      patterns.emplace_back(argv[x]);
+    }
+  }
+  if (!filename) {
+    print_usage();
     return -1;
   }
 
-  std::string data = phosg::load_file(argv[1]);
-  RCFHeader header;
-  memcpy(&header, data.data(), sizeof(RCFHeader));
-  if (strcmp(header.ident, "RADCORE CEMENT LIBRARY")) {
+  phosg::scoped_fd fd(filename, O_RDONLY);
+  size_t file_size = std::filesystem::file_size(filename);
+  if (file_size < sizeof(RCFHeader)) {
     phosg::fwrite_fmt(stderr, "file does not appear to be an rcf archive\n");
     return 2;
   }
 
-  auto index = get_index(data, header.index_offset);
-
-  for (const auto& it : index) {
-    const std::string& name = it.first;
-    const auto& entry = it.second;
-    phosg::fwrite_fmt(stdout, "... {:08X} {:08X} {:08X} {}\n", entry.crc32.load(), entry.offset.load(), entry.size.load(), name);
+  RCFHeader header;
+  phosg::preadx(fd, &header, sizeof(RCFHeader), 0);
+  if (strncmp(header.ident, "RADCORE CEMENT LIBRARY", sizeof(header.ident))) {
+    phosg::fwrite_fmt(stderr, "file does not appear to be an rcf archive\n");
+    return 2;
+  }
 
-    phosg::save_file(name, data.substr(entry.offset, entry.size));
+  auto index = get_index(fd, file_size, header.index_offset);
+
+  std::vector<NamedIndexEntry> entries_to_extract;
+  for (auto& it : index) {
+    bool matches = patterns.empty();
+    for (size_t z = 0; !matches && (z < patterns.size()); z++) {
+      matches = !fnmatch(patterns[z].c_str(), it.name.c_str(), 0);
+    }
+    if (matches) {
+      phosg::fwrite_fmt(stdout, "... {:08X} {:08X} {:08X} {}\n",
+          it.entry.crc32.load(), it.entry.offset.load(), it.entry.size.load(), it.name);
+      entries_to_extract.emplace_back(std::move(it));
+    }
   }
+  if (list_only) {
+    return 0;
+  }
+
+  auto extract_entry = [&](const NamedIndexEntry& it) -> void {
+    try {
+      if (static_cast<uint64_t>(it.entry.offset) + it.entry.size > file_size) {
+        throw std::runtime_error("file extends beyond the end of the archive");
+      }
+      copy_file_extent(fd, it.entry.offset, it.entry.size, it.name);
+    } catch (const std::exception& e) {
+      phosg::fwrite_fmt(stderr, "!!! failed to write file {}: {}\n", it.name, e.what());
+    }
+  };
+
+  ResourceDASM::parallel_for_each(entries_to_extract, extract_entry, parallelism);
 
   return 0;
 }
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 
 #include <filesystem>
+#include <mutex>
 #include <phosg/Arguments.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
@@ -14,6 +15,7 @@
 
 #include "ImageSaver.hh"
 #include "IndexFormats/Formats.hh"
+#include "Parallel.hh"
 #include "RealmzGlobalData.hh"
 #include "RealmzSaveData.hh"
 #include "RealmzScenarioData.hh"
@@ -24,7 +26,8 @@ int disassemble_scenario(
     const ResourceDASM::ImageSaver* image_saver,
     bool show_unused_tile_ids,
     bool generate_maps_as_json,
-    bool show_random_rects) {
+    bool show_random_rects,
+    size_t num_threads) {
 
   // Make necessary directories for output
   std::filesystem::create_directories(out_dir);
@@ -152,8 +155,13 @@ int disassemble_scenario(
     }
   }
 
+  // Resources are decompressed lazily, which isn't thread-safe, so do it before generating maps on multiple threads
+  if (num_threads > 1) {
+    scen.scenario_rsf.decompress_all_resources();
+  }
+
   // Generate dungeon maps
-  for (size_t z = 0; z < scen.dungeon_maps.size(); z++) {
+  ResourceDASM::parallel_for_each_index(scen.dungeon_maps.size(), [&](size_t z) -> void {
     std::string filename = std::format("{}/dungeon_{}", out_dir, z);
     if (generate_maps_as_json) {
       filename += ".json";
@@ -165,12 +173,13 @@ int disassemble_scenario(
       filename = image_saver->save_image(map, filename);
       phosg::log_info_f("... {}", filename);
     }
-  }
+  }, num_threads);
 
   // Generate land maps
+  std::mutex used_tiles_lock;
   std::unordered_set<int16_t> used_negative_tiles;
   std::unordered_map<std::string, std::unordered_set<uint8_t>> used_positive_tiles;
-  for (size_t z = 0; z < scen.land_maps.size(); z++) {
+  ResourceDASM::parallel_for_each_index(scen.land_maps.size(), [&](size_t z) -> void {
     std::string filename = std::format("{}/land_{}", out_dir, z);
     try {
       if (generate_maps_as_json) {
@@ -179,15 +188,24 @@ int disassemble_scenario(
         phosg::save_file(filename, s);
         phosg::log_info_f("... {}", filename);
       } else {
-        phosg::ImageRGB888 map = scen.generate_land_map(
-            z, 0, 0, 90, 90, show_random_rects, -1, -1, nullptr, nullptr, nullptr, nullptr, &used_negative_tiles, &used_positive_tiles);
+        std::unordered_set<int16_t> level_used_negative_tiles;
+        std::unordered_map<std::string, std::unordered_set<uint8_t>> level_used_positive_tiles;
+        phosg::ImageRGB888 map = scen.generate_land_map(z, 0, 0, 90, 90, show_random_rects, -1, -1, nullptr, nullptr,
+            nullptr, nullptr, &level_used_negative_tiles, &level_used_positive_tiles);
+        {
+          std::lock_guard g(used_tiles_lock);
+          used_negative_tiles.insert(level_used_negative_tiles.begin(), level_used_negative_tiles.end());
+          for (const auto& [land_type, tile_ids] : level_used_positive_tiles) {
+            used_positive_tiles[land_type].insert(tile_ids.begin(), tile_ids.end());
+          }
+        }
         filename = image_saver->save_image(map, filename);
         phosg::log_info_f("... {}", filename);
       }
     } catch (const std::exception& e) {
       phosg::log_info_f("### {} FAILED: {}", filename, e.what());
     }
-  }
+  }, num_threads);
 
   // Generate party maps
   for (size_t z = 0; z < scen.party_maps.size(); z++) {
@@ -215,7 +233,8 @@ int disassemble_scenario(
       }
     }
 
-    phosg::ImageRGB888 connected_map = scen.generate_layout_map(layout_component, show_random_rects);
+    phosg::ImageRGB888 connected_map = scen.generate_layout_map(
+        layout_component, show_random_rects, nullptr, num_threads);
     filename = image_saver->save_image(connected_map, filename);
     phosg::log_info_f("... {}", filename);
   }
@@ -451,6 +470,10 @@ Options:\n\
       use as many threads as there are CPU cores in the system. If this option\n\
       is given, DATA-DIR should point to the base Realmz directory (with Data\n\
       Files and Scenarios subdirectories) instead of the Data Files directory.\n\
+  --scenario-threads=N: Load each scenario\'s files and generate its maps on N\n\
+      threads. If N=0, use as many threads as there are CPU cores in the\n\
+      system. The default is 1. This can be combined with --parallel, but the\n\
+      total number of threads used may then be up to the product of the two.\n\
 \n" IMAGE_SAVER_HELP);
 }
 
@@ -465,6 +488,7 @@ int main(int argc, char** argv) {
   bool script_only = false;
   bool show_random_rects = true;
   ssize_t parallelism = -1;
+  size_t scenario_threads = 1;
   for (int x = 1; x < argc; x++) {
     if (image_saver.process_cli_arg(argv[x])) {
       // Nothing
@@ -478,6 +502,8 @@ int main(int argc, char** argv) {
       show_random_rects = false;
     } else if (!strncmp(argv[x], "--parallel=", 11)) {
       parallelism = std::stoll(&argv[x][11], nullptr, 0);
+    } else if (!strncmp(argv[x], "--scenario-threads=", 19)) {
+      scenario_threads = std::stoull(&argv[x][19], nullptr, 0);
     } else if (data_dir.empty()) {
       data_dir = argv[x];
     } else if (scenario_dir.empty()) {
@@ -497,6 +523,7 @@ int main(int argc, char** argv) {
     print_usage();
     return 2;
   }
+  scenario_threads = ResourceDASM::resolve_num_threads(scenario_threads);
 
   if (parallelism >= 0) {
     // Use scenario_dir as out_dir; out_dir must be empty
@@ -505,13 +532,15 @@ int main(int argc, char** argv) {
     }
     out_dir = std::move(scenario_dir);
     if (parallelism == 0) {
-      parallelism = std::thread::hardware_concurrency();
+      parallelism = ResourceDASM::resolve_num_threads(parallelism);
       phosg::log_info_f("Setting parallelism to {} to match system CPU count", parallelism);
     }
 
     std::string global_data_dir = std::format("{}/Data Files", data_dir);
     phosg::log_info_f("Loading shared resources from {}", global_data_dir);
     ResourceDASM::RealmzGlobalData global(global_data_dir);
+    // The global resources are used by all threads, so they must not be decompressed lazily
+    global.global_rsf.decompress_all_resources();
 
     std::string scenarios_dir = std::format("{}/Scenarios", data_dir);
     phosg::log_info_f("Collecting scenarios from {}", scenarios_dir);
@@ -534,25 +563,27 @@ int main(int argc, char** argv) {
 
     std::sort(scenario_names.begin(), scenario_names.end());
 
-    auto disassemble_item = [&](const std::string& scen_name, size_t) -> bool {
+    auto disassemble_item = [&](const std::string& scen_name) -> void {
       if (scen_name.empty()) {
-        return disassemble_global_data(global, out_dir + "/Data Files", script_only ? nullptr : &image_saver);
+        disassemble_global_data(global, out_dir + "/Data Files", script_only ? nullptr : &image_saver);
       } else {
         phosg::log_info_f("Loading scenario: {}", scen_name);
-        ResourceDASM::RealmzScenarioData scen(global, std::format("{}/{}", scenarios_dir, scen_name), scen_name);
+        ResourceDASM::RealmzScenarioData scen(
+            global, std::format("{}/{}", scenarios_dir, scen_name), scen_name, scenario_threads);
         phosg::log_info_f("Disassembling scenario: {}", scen_name);
         std::string scen_out_dir = std::format("{}/{}", out_dir, scen_name);
-        return disassemble_scenario(
+        disassemble_scenario(
             scen,
             scen_out_dir,
             script_only ? nullptr : &image_saver,
             show_unused_tile_ids,
             generate_maps_as_json,
-            show_random_rects);
+            show_random_rects,
+            scenario_threads);
       }
     };
 
-    phosg::parallel_range(scenario_names, disassemble_item, parallelism);
+    ResourceDASM::parallel_for_each(scenario_names, disassemble_item, parallelism);
 
   } else if (save_dir.empty()) { // Disassembling global data
     // Use scenario_dir as out_dir when out_dir is empty (this is the global data case)
@@ -564,7 +595,10 @@ int main(int argc, char** argv) {
     std::string scenario_name = (slash_pos == std::string::npos) ? scenario_dir : scenario_dir.substr(slash_pos + 1);
 
     ResourceDASM::RealmzGlobalData global(data_dir);
-    ResourceDASM::RealmzScenarioData scen(global, scenario_dir, scenario_name);
+    if (scenario_threads > 1) {
+      global.global_rsf.decompress_all_resources();
+    }
+    ResourceDASM::RealmzScenarioData scen(global, scenario_dir, scenario_name, scenario_threads);
 
     if (out_dir.empty()) { // Disassembling a scenario
       // Use save_dir as out_dir when out_dir is empty
@@ -574,7 +608,8 @@ int main(int argc, char** argv) {
           script_only ? nullptr : &image_saver,
           show_unused_tile_ids,
           generate_maps_as_json,
-          show_random_rects);
+          show_random_rects,
+          scenario_threads);
     } else {
       ResourceDASM::RealmzSaveData save(scen, save_dir);
       return disassemble_saved_game(save, out_dir, script_only ? nullptr : &image_saver);
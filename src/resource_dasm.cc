@@ -26,6 +26,9 @@
 #include "Audio/Codecs.hh"
 #include "Audio/WAVFile.hh"
 #include "Cli.hh"
+#include "ContentHash.hh"
+#include "ContentStore.hh"
+#include "ExportManifest.hh"
 #include "Emulators/M68KEmulator.hh"
 #include "Emulators/PPC32Emulator.hh"
 #include "Emulators/X86Emulator.hh"
@@ -56,6 +59,9 @@ static constexpr char FILENAME_FORMAT_STANDARD_TYPE_XDIRS[] = "%f/%t/%i%N";
 static constexpr char FILENAME_FORMAT_TYPE_FIRST[] = "%t/%f_%i%n";
 static constexpr char FILENAME_FORMAT_TYPE_FIRST_DIRS[] = "%t/%f/%i%n";
 
+static const std::string CONTENT_STORE_MANIFEST_FILENAME = "content_store_manifest.tsv";
+static const std::string EXPORT_MANIFEST_FILENAME = "resource_dasm_manifest.bin";
+
 static std::string disassembly_for_dcmp(const ResourceDASM::ResourceFile::DecodedDecompressorResource& dcmp) {
   std::multimap<uint32_t, std::string> labels;
   if (dcmp.init_label >= 0) {
@@ -79,6 +85,15 @@ private:
     }
   }
 
+  // Creates the directories that will contain filename, and deletes the file if it already exists. Output files may be
+  // hard links to content store entries (which are shared with other output directories), so they must always be
+  // replaced with new files rather than overwritten in place.
+  void prepare_output_file(const std::string& filename) {
+    this->ensure_directories_exist(filename);
+    std::error_code ec;
+    std::filesystem::remove(filename, ec);
+  }
+
   std::string output_filename(
       const std::string& base_filename,
       const uint32_t* res_type,
@@ -136,7 +151,7 @@ private:
           case 'n':
             if (!res_name.empty()) {
               result += '_';
-              result += ResourceDASM::decode_mac_roman(res_name, true);
+              ResourceDASM::decode_mac_roman_append(result, res_name.data(), res_name.size(), true);
             }
             break;
 
@@ -194,14 +209,23 @@ private:
     return ret;
   }
 
+  // Records a file written by the current decoder, if the current resource's outputs are being added to the content
+  // store
+  void note_written_file(const std::string& filename) {
+    if (this->written_files) {
+      this->written_files->emplace_back(filename);
+    }
+  }
+
   void write_decoded_data(
       const std::string& base_filename,
       std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res,
       const std::string& after,
       const std::string& data) {
     std::string filename = this->output_filename(base_filename, res, after);
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename);
     phosg::save_file(filename, data);
+    this->note_written_file(filename);
     phosg::fwrite_fmt(stderr, "... {}\n", filename);
   }
 
@@ -224,8 +248,9 @@ private:
       const std::string& after,
       const phosg::Image<Format>& img) {
     std::string filename = this->output_filename(base_filename, res, after);
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename + "." + this->image_saver.file_extension());
     filename = this->image_saver.save_image(img, filename);
+    this->note_written_file(filename);
     phosg::fwrite_fmt(stderr, "... {}\n", filename);
   }
 
@@ -543,6 +568,10 @@ private:
 
   void write_icns(
       const std::string& base_filename, const std::shared_ptr<const ResourceDASM::ResourceFile::Resource>& icon) {
+    // Whether this writes anything depends on which other resources were already exported, so the result can't be
+    // reused for other files
+    this->decode_used_exporter_state = true;
+
     // Already exported? Save time and don't export it again
     if (exported_family_icns.find(icon->id) != exported_family_icns.end()) {
       return;
@@ -800,7 +829,8 @@ private:
 
   void write_decoded_snd(
       const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
-    this->write_decoded_sound(base_filename, res, "", this->current_rf->decode_snd(res));
+    this->current_rf->decode_snd_into(this->decoded_snd_buffer, res);
+    this->write_decoded_sound(base_filename, res, "", this->decoded_snd_buffer);
   }
 
   void write_decoded_csnd(
@@ -857,7 +887,7 @@ private:
 
     {
       std::string description_filename = this->output_filename(base_filename, res, "_description.txt");
-      this->ensure_directories_exist(description_filename);
+      this->prepare_output_file(description_filename);
       auto f = phosg::fopen_unique(description_filename, "wt");
       phosg::fwrite_fmt(f.get(), "\
 # source_bit_depth = {} ({} color table)\n\
@@ -900,6 +930,7 @@ private:
       phosg::fwrite_fmt(f.get(), "#   bitmap offset: {}; width: {}\n", decoded.missing_glyph.bitmap_offset, decoded.missing_glyph.bitmap_width);
       phosg::fwrite_fmt(f.get(), "#   character offset: {}; width: {}\n", decoded.missing_glyph.offset, decoded.missing_glyph.width);
 
+      this->note_written_file(description_filename);
       phosg::fwrite_fmt(stderr, "... {}\n", description_filename);
     }
 
@@ -1391,7 +1422,7 @@ private:
     auto decoded = this->current_rf->decode_thng(res);
 
     std::string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename);
     auto f = phosg::fopen_unique(filename, "wt");
 
     auto decode_string = [](std::shared_ptr<const ResourceDASM::ResourceFile::Resource>& res) -> std::string {
@@ -1469,6 +1500,7 @@ private:
       }
     }
 
+    this->note_written_file(filename);
     phosg::fwrite_fmt(stderr, "... {}\n", filename);
   }
 
@@ -1498,9 +1530,10 @@ private:
   void write_decoded_pef(const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
     auto pef = this->current_rf->decode_pef(res);
     std::string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename);
     auto f = phosg::fopen_unique(filename, "wt");
     pef.print(f.get());
+    this->note_written_file(filename);
     phosg::fwrite_fmt(stderr, "... {}\n", filename);
   }
 
@@ -1510,12 +1543,13 @@ private:
         ? this->current_rf->decode_expt(res)
         : this->current_rf->decode_nsrd(res);
     std::string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename);
     auto f = phosg::fopen_unique(filename, "wt");
     fputs("Mixed-mode manager header:\n", f.get());
     phosg::print_data(f.get(), decoded.header);
     fputc('\n', f.get());
     decoded.pef.print(f.get());
+    this->note_written_file(filename);
     phosg::fwrite_fmt(stderr, "... {}\n", filename);
   }
 
@@ -1612,8 +1646,9 @@ private:
     auto decoded = this->current_rf->decode_DITL(res);
 
     std::string filename = this->output_filename(base_filename, res, ".txt");
-    this->ensure_directories_exist(filename);
+    this->prepare_output_file(filename);
     auto f = phosg::fopen_unique(filename, "wt");
+    this->note_written_file(filename);
     phosg::fwrite_fmt(f.get(), "# {} entries\n", decoded.size());
 
     for (size_t z = 0; z < decoded.size(); z++) {
@@ -2029,6 +2064,28 @@ private:
       phosg::fwrite_fmt(stderr, ">>> {}\n", filename);
     }
 
+    // For incremental exports, skip the file entirely if it hasn't changed since the previous export and all of its
+    // outputs still exist. Directory-format inputs have no single size or modification time, so they're always
+    // loaded, but unchanged resources in them are still skipped.
+    const ResourceDASM::ExportManifest::File* previous_file = nullptr;
+    ResourceDASM::ExportManifest::File current_file;
+    if (this->incremental) {
+      if (auto it = this->previous_manifest.files.find(filename); it != this->previous_manifest.files.end()) {
+        previous_file = &it->second;
+      }
+      if (this->index_format != ResourceDASM::IndexFormat::DIRECTORY) {
+        current_file.size = std::filesystem::file_size(resource_fork_filename);
+        current_file.mtime = std::filesystem::last_write_time(resource_fork_filename).time_since_epoch().count();
+        if (previous_file && (previous_file->size == current_file.size) &&
+            (previous_file->mtime == current_file.mtime) && this->all_file_outputs_exist(*previous_file)) {
+          phosg::fwrite_fmt(stderr, "... (up to date)\n");
+          this->current_manifest.files.emplace(filename, *previous_file);
+          this->incremental_stats.files_up_to_date++;
+          return previous_file->exported;
+        }
+      }
+    }
+
     // Compute the base filename
     size_t last_slash_pos = filename.rfind('/');
     std::string base_filename = (last_slash_pos == std::string::npos) ? filename : filename.substr(last_slash_pos + 1);
@@ -2040,7 +2097,8 @@ private:
           this->open_resource_file(ResourceDASM::parse_resource_fork(phosg::load_file(resource_fork_filename)));
           break;
         case ResourceDASM::IndexFormat::DIRECTORY:
-          this->open_resource_file(ResourceDASM::load_resource_file_from_directory(resource_fork_filename));
+          this->open_resource_file(ResourceDASM::load_resource_file_from_directory(
+              resource_fork_filename, this->directory_index_filename));
           break;
         case ResourceDASM::IndexFormat::BINHEX:
           this->open_resource_file(ResourceDASM::parse_binhex_resource_fork(phosg::load_file(resource_fork_filename)));
@@ -2054,16 +2112,20 @@ private:
               phosg::load_file(resource_fork_filename)));
           break;
         case ResourceDASM::IndexFormat::MOHAWK:
-          this->open_resource_file(ResourceDASM::parse_mohawk(phosg::load_file(resource_fork_filename)));
+          this->open_resource_file(ResourceDASM::parse_mohawk(
+              ResourceDASM::ArchiveData::map_file(resource_fork_filename)));
           break;
         case ResourceDASM::IndexFormat::HIRF:
-          this->open_resource_file(ResourceDASM::parse_hirf(phosg::load_file(resource_fork_filename)));
+          this->open_resource_file(ResourceDASM::parse_hirf(
+              ResourceDASM::ArchiveData::map_file(resource_fork_filename)));
           break;
         case ResourceDASM::IndexFormat::DC_DATA:
-          this->open_resource_file(ResourceDASM::parse_dc_data(phosg::load_file(resource_fork_filename)));
+          this->open_resource_file(ResourceDASM::parse_dc_data(
+              ResourceDASM::ArchiveData::map_file(resource_fork_filename)));
           break;
         case ResourceDASM::IndexFormat::CBAG:
-          this->open_resource_file(ResourceDASM::parse_cbag(phosg::load_file(resource_fork_filename)));
+          this->open_resource_file(ResourceDASM::parse_cbag(
+              ResourceDASM::ArchiveData::map_file(resource_fork_filename)));
           break;
         default:
           throw std::logic_error("invalid index format");
@@ -2086,6 +2148,16 @@ private:
     try {
       auto resources = this->current_rf->all_resources();
 
+      // If the resources' data hasn't been read yet (as for the directory index format), read all the selected
+      // resources at once, so the reads can happen in parallel
+      std::vector<std::pair<uint32_t, int16_t>> selected_resources;
+      for (const auto& it : resources) {
+        if (is_included(it.first, it.second) && !is_excluded(it.first, it.second)) {
+          selected_resources.emplace_back(it);
+        }
+      }
+      this->current_rf->load_data(selected_resources);
+
       bool has_INST = false;
       bool has_CODE = false;
       for (const auto& it : resources) {
@@ -2100,7 +2172,30 @@ private:
         if (it.first == ResourceDASM::RESOURCE_TYPE_CODE) {
           has_CODE = true;
         }
-        ret |= this->export_resource(base_filename, res);
+
+        if (!this->incremental) {
+          ret |= this->export_resource(base_filename, res).exported;
+          continue;
+        }
+
+        // Resources whose outputs depend on other resources are always exported again if anything in the file
+        // changed, since we don't know which other resources they used
+        auto key = this->resource_output_key(res);
+        const auto* previous_res = previous_file ? previous_file->find_resource(it.first, it.second) : nullptr;
+        if (previous_res && !previous_res->context_dependent && (previous_res->key == key) &&
+            this->all_outputs_exist(previous_res->outputs)) {
+          current_file.resources.emplace_back(*previous_res);
+          ret |= previous_res->exported;
+          this->incremental_stats.resources_up_to_date++;
+          continue;
+        }
+        auto result = this->export_resource(base_filename, res);
+        auto& manifest_res = current_file.resources.emplace_back(ResourceDASM::ExportManifest::Resource{
+            it.first, it.second, key, result.exported, result.context_dependent, {}});
+        for (const auto& output_filename : result.filenames) {
+          manifest_res.outputs.emplace_back(this->relative_output_filename(output_filename));
+        }
+        ret |= result.exported;
       }
 
       // Special case: if we disassembled any INSTs and there are any decoders (that is, --skip-decode wasn't
@@ -2111,6 +2206,7 @@ private:
         try {
           auto json = this->generate_json_for_SONG(base_filename, nullptr);
           phosg::save_file(json_filename, json.serialize(phosg::JSON::SerializeOption::FORMAT));
+          current_file.outputs.emplace_back(this->relative_output_filename(json_filename));
           phosg::fwrite_fmt(stderr, "... {}\n", json_filename);
         } catch (const std::exception& e) {
           phosg::fwrite_fmt(stderr, "failed to write smssynth env template {}: {}\n", json_filename, e.what());
@@ -2125,12 +2221,18 @@ private:
         try {
           auto archive = this->generate_decomp_archive();
           phosg::save_file(filename, archive.data);
+          current_file.outputs.emplace_back(this->relative_output_filename(filename));
           phosg::fwrite_fmt(stderr, "... {} (base = 0x{:08X}, a5 = 0x{:08X})\n", filename, archive.base, archive.a5);
         } catch (const std::exception& e) {
           phosg::fwrite_fmt(stderr, "failed to write decomp archive {}: {}\n", filename, e.what());
         }
       }
 
+      if (this->incremental) {
+        current_file.exported = ret;
+        this->current_manifest.files[filename] = std::move(current_file);
+      }
+
     } catch (const std::exception& e) {
       phosg::fwrite_fmt(stderr, "failed on {}: {}\n", filename, e.what());
     }
@@ -2190,6 +2292,8 @@ public:
   ~ResourceExporter() = default;
 
   ResourceDASM::IndexFormat index_format = ResourceDASM::IndexFormat::RESOURCE_FORK;
+  // For the directory index format, the list of resources is cached in this file if it's not empty
+  std::string directory_index_filename;
   bool use_data_fork = false;
   std::string filename_format = FILENAME_FORMAT_STANDARD;
   SaveRawBehavior save_raw = SaveRawBehavior::IF_DECODE_FAILS;
@@ -2207,12 +2311,49 @@ public:
   bool export_icon_family_as_icns = true;
   bool should_generate_decomp_archive = false;
   ResourceDASM::ImageSaver image_saver;
+  // If set, decoded outputs are shared between all exported files via this store (see export_resource)
+  std::unique_ptr<ResourceDASM::ContentStore> content_store;
+  // If true, outputs are moved into the content store and listed in a manifest file in each output directory, instead
+  // of being hard-linked into the output directories
+  bool content_store_manifest = false;
+
+  struct ContentStoreStats {
+    size_t hits = 0;
+    size_t stored = 0;
+    size_t not_storable = 0;
+  };
+  ContentStoreStats content_store_stats;
+  // If true, an export manifest is kept in the output directory, and files and resources whose outputs there are
+  // still up to date aren't exported again
+  bool incremental = false;
+  // Describes the options that choose which resources are exported; these are part of the export manifest's options
+  // hash, since the manifest only describes the resources that were chosen
+  std::string selection_config;
+
+  struct IncrementalStats {
+    size_t files_up_to_date = 0;
+    size_t resources_up_to_date = 0;
+  };
+  IncrementalStats incremental_stats;
 
 private:
   std::string base_out_dir; // Fixed part of filename (e.g. <file>.out)
   std::string out_dir; // Recursive part of filename (dirs after <file>.out)
   std::unique_ptr<ResourceDASM::ResourceFile> current_rf;
   std::unordered_set<int32_t> exported_family_icns;
+  // Reused across snd resources so we don't allocate a new sample buffer for each one
+  ResourceDASM::ResourceFile::DecodedSoundResource decoded_snd_buffer;
+  // Describes any changes made to type_to_decode_fn, so content store entries made with different decoders aren't
+  // mixed up
+  std::string decoder_config;
+  // State for the content store (see export_resource)
+  std::vector<std::string>* written_files = nullptr;
+  uint64_t decode_lookups = 0;
+  bool decode_used_exporter_state = false;
+  std::string content_store_manifest_data;
+  // Export manifests for incremental exports (see disassemble_file)
+  ResourceDASM::ExportManifest previous_manifest;
+  ResourceDASM::ExportManifest current_manifest;
 
 public:
   void open_resource_file(ResourceDASM::ResourceFile&& rf) {
@@ -2222,20 +2363,31 @@ public:
   void set_decoder_alias(uint32_t from_type, uint32_t to_type) {
     try {
       this->type_to_decode_fn[to_type] = this->type_to_decode_fn.at(from_type);
+      this->decoder_config += std::format("alias:{:08X}:{:08X};", from_type, to_type);
     } catch (const std::out_of_range&) {
     }
   }
 
   void disable_external_decoders() {
     this->type_to_decode_fn[ResourceDASM::RESOURCE_TYPE_PICT] = &ResourceExporter::write_decoded_PICT_internal;
+    this->decoder_config += "no_external;";
   }
 
   void disable_all_decoders() {
     this->type_to_decode_fn.clear();
+    this->decoder_config += "none;";
   }
 
-  bool export_resource(const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
+  struct ExportResult {
+    bool exported = false;
+    // True if the outputs depend on anything other than the resource itself and the export options (for example,
+    // other resources in the same file)
+    bool context_dependent = false;
+    std::vector<std::string> filenames;
+  };
 
+  ExportResult export_resource(
+      const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
     bool decompression_failed = res->flags & ResourceDASM::ResourceFlag::FLAG_DECOMPRESSION_FAILED;
     bool is_compressed = res->flags & ResourceDASM::ResourceFlag::FLAG_COMPRESSED;
     bool was_compressed = res->flags & ResourceDASM::ResourceFlag::FLAG_DECOMPRESSED;
@@ -2249,12 +2401,198 @@ public:
     }
     if ((this->target_compressed_behavior == TargetCompressedBehavior::TARGET) &&
         !(is_compressed || was_compressed || decompression_failed)) {
-      return false;
+      return ExportResult();
     } else if ((this->target_compressed_behavior == TargetCompressedBehavior::SKIP) &&
         (is_compressed || was_compressed || decompression_failed)) {
+      return ExportResult();
+    }
+
+    // The content store is only used when exporting whole files (not with --decode-single-resource)
+    if (this->content_store && !base_filename.empty() && !this->base_out_dir.empty()) {
+      return this->export_resource_with_content_store(base_filename, res);
+    }
+    return this->decode_resource_tracked(base_filename, res);
+  }
+
+  // Decodes a resource, recording which files were written and whether the decoder looked at anything other than the
+  // resource itself
+  ExportResult decode_resource_tracked(
+      const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
+    ExportResult ret;
+    this->written_files = &ret.filenames;
+    this->decode_lookups = 0;
+    this->decode_used_exporter_state = false;
+    try {
+      ret.exported = this->decode_resource(base_filename, res);
+    } catch (...) {
+      this->written_files = nullptr;
+      throw;
+    }
+    this->written_files = nullptr;
+    ret.context_dependent = (this->decode_lookups != 0) || this->decode_used_exporter_state;
+    return ret;
+  }
+
+  static uint32_t remapped_type_for_resource(uint32_t type, int16_t id) {
+    uint32_t remapped_type = type;
+    try {
+      remapped_type = remap_resource_type_id.at({type, id});
+    } catch (const std::out_of_range&) {
+    }
+    try {
+      remapped_type = remap_resource_type.at(remapped_type);
+    } catch (const std::out_of_range&) {
+    }
+    return remapped_type;
+  }
+
+  // Describes the options that affect the contents of exported files
+  std::string decode_options_description() const {
+    // Change this if any decoder's output format changes, so that old content store entries and export manifests
+    // aren't used
+    static constexpr uint32_t DECODERS_VERSION = 1;
+
+    return std::format(
+        "v{} save_raw={} decompress_flags={:X} skip_templates={} icon_family={}{} image_ext={} preprocessor={} "
+        "decoders={}",
+        DECODERS_VERSION,
+        static_cast<int>(this->save_raw),
+        this->decompress_flags,
+        this->skip_templates,
+        this->export_icon_family_as_image ? 'i' : '-',
+        this->export_icon_family_as_icns ? 'c' : '-',
+        this->image_saver.file_extension(),
+        phosg::join(this->external_preprocessor_command, " "),
+        this->decoder_config);
+  }
+
+  // Returns the key that identifies a resource's outputs (in the content store and in export manifests). This includes
+  // everything the outputs can depend on other than the other resources in the file (decodes that look at other
+  // resources are handled separately), and the TMPL that would be used to decode the resource if there's no built-in
+  // decoder for it. The resource's name is included because some decoders write it into their output.
+  ResourceDASM::ContentHash resource_output_key(std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) const {
+    std::string tmpl_hash = "none";
+    if (!this->skip_templates && this->current_rf.get()) {
+      std::string tmpl_name = ResourceDASM::raw_string_for_resource_type(
+          remapped_type_for_resource(res->type, res->id));
+      auto tmpl_res = this->current_rf->get_resource_if_exists(ResourceDASM::RESOURCE_TYPE_TMPL, tmpl_name.c_str());
+      if (tmpl_res) {
+        tmpl_hash = ResourceDASM::content_hash(tmpl_res->data).hex();
+      }
+    }
+
+    std::string header = std::format("type={:08X} id={} flags={:02X} name={} tmpl={} {}",
+        res->type,
+        res->id,
+        res->flags,
+        ResourceDASM::content_hash(res->name).hex(),
+        tmpl_hash,
+        this->decode_options_description());
+    uint64_t seed = ResourceDASM::content_hash(header).low;
+    return ResourceDASM::content_hash(res->data, seed);
+  }
+
+  // Exports a resource via the content store. If an identical resource was exported before (from any file, with the
+  // same options), its outputs are linked into the output directory (or listed in the manifest) instead of being
+  // decoded again. Otherwise, the resource is decoded normally, and if its outputs didn't depend on anything outside
+  // the resource itself, they're added to the store.
+  ExportResult export_resource_with_content_store(
+      const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
+    auto key = this->resource_output_key(res);
+    std::string output_prefix = this->output_filename(base_filename, res, "");
+
+    auto entry = this->content_store->get(key);
+    if (entry) {
+      ExportResult ret;
+      ret.exported = entry->exported;
+      if (this->content_store_manifest) {
+        this->add_content_store_manifest_entries(key, *entry, output_prefix);
+      } else {
+        ret.filenames = this->content_store->link_entry(key, *entry, output_prefix);
+        for (const auto& filename : ret.filenames) {
+          phosg::fwrite_fmt(stderr, "... {} (from content store)\n", filename);
+        }
+      }
+      this->content_store_stats.hits++;
+      return ret;
+    }
+
+    auto ret = this->decode_resource_tracked(base_filename, res);
+    if (!ret.context_dependent && ResourceDASM::ContentStore::can_store(output_prefix, ret.filenames)) {
+      auto new_entry = this->content_store->put(
+          key, ret.exported, output_prefix, ret.filenames, this->content_store_manifest);
+      if (this->content_store_manifest) {
+        this->add_content_store_manifest_entries(key, new_entry, output_prefix);
+        ret.filenames.clear(); // They were moved into the store
+      }
+      this->content_store_stats.stored++;
+    } else {
+      this->content_store_stats.not_storable++;
+    }
+    return ret;
+  }
+
+  // Returns the given output filename relative to the output directory
+  std::string relative_output_filename(const std::string& filename) const {
+    if (!this->base_out_dir.empty() && filename.starts_with(this->base_out_dir + "/")) {
+      return filename.substr(this->base_out_dir.size() + 1);
+    }
+    return filename;
+  }
+
+  // Returns true if all of the given files (relative to the output directory) exist
+  bool all_outputs_exist(const std::vector<std::string>& relative_filenames) const {
+    for (const auto& filename : relative_filenames) {
+      if (!std::filesystem::is_regular_file(
+              this->base_out_dir.empty() ? filename : (this->base_out_dir + "/" + filename))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool all_file_outputs_exist(const ResourceDASM::ExportManifest::File& file) const {
+    if (!this->all_outputs_exist(file.outputs)) {
       return false;
     }
+    for (const auto& res : file.resources) {
+      if (!this->all_outputs_exist(res.outputs)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns a hash of all the options that affect which resources are exported and what the outputs are
+  ResourceDASM::ContentHash export_options_hash() const {
+    std::string description = std::format(
+        "{} filename_format={} index_format={} data_fork={} compressed={} decomp_archive={} selection={}",
+        this->decode_options_description(),
+        this->filename_format,
+        static_cast<int>(this->index_format),
+        this->use_data_fork,
+        static_cast<int>(this->target_compressed_behavior),
+        this->should_generate_decomp_archive,
+        this->selection_config);
+    return ResourceDASM::content_hash(description);
+  }
+
+  void add_content_store_manifest_entries(
+      const ResourceDASM::ContentHash& key,
+      const ResourceDASM::ContentStore::Entry& entry,
+      const std::string& output_prefix) {
+    // Manifest paths are relative to the output directory
+    std::string relative_prefix = this->relative_output_filename(output_prefix);
+    for (const auto& suffix : entry.suffixes) {
+      std::string store_filename = this->content_store->filename_for_entry(key, suffix);
+      this->content_store_manifest_data += std::format("{}{}\t{}\n", relative_prefix, suffix, store_filename);
+      phosg::fwrite_fmt(stderr, "... {}{} => {}\n", output_prefix, suffix, store_filename);
+    }
+  }
 
+  bool decode_resource(
+      const std::string& base_filename, std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res) {
+    bool is_compressed = res->flags & ResourceDASM::ResourceFlag::FLAG_COMPRESSED;
     bool write_raw = (this->save_raw == SaveRawBehavior::ALWAYS);
     ResourceDASM::ResourceFile::Resource preprocessed_res;
     std::shared_ptr<const ResourceDASM::ResourceFile::Resource> res_to_decode = res;
@@ -2289,15 +2627,7 @@ stderr ({} bytes):\n\
 
     // Decode if possible. If decompression failed, don't bother trying to
     // decode the resource.
-    uint32_t remapped_type = res->type;
-    try {
-      remapped_type = remap_resource_type_id.at({res_to_decode->type, res_to_decode->id});
-    } catch (const std::out_of_range&) {
-    }
-    try {
-      remapped_type = remap_resource_type.at(remapped_type);
-    } catch (const std::out_of_range&) {
-    }
+    uint32_t remapped_type = remapped_type_for_resource(res_to_decode->type, res_to_decode->id);
 
     resource_decode_fn decode_fn = nullptr;
     try {
@@ -2307,6 +2637,8 @@ stderr ({} bytes):\n\
 
     bool decoded = false;
     if (!is_compressed && decode_fn) {
+      // If the decoder looks at any other resources, its output can't be put in the content store
+      uint64_t lookups_before = ResourceDASM::ResourceFile::lookups_on_current_thread();
       try {
         (this->*decode_fn)(base_filename, res_to_decode);
         decoded = true;
@@ -2319,6 +2651,7 @@ stderr ({} bytes):\n\
           phosg::fwrite_fmt(stderr, "warning: failed to decode resource {}:{}: {}\n", type_str, res->id, e.what());
         }
       }
+      this->decode_lookups += ResourceDASM::ResourceFile::lookups_on_current_thread() - lookups_before;
     }
     // If there's no built-in decoder and there's a context ResourceFile, try to use a TMPL resource to decode it
     if (!is_compressed && !decoded && !this->skip_templates && this->current_rf.get()) {
@@ -2385,7 +2718,7 @@ stderr ({} bytes):\n\
 
       std::string out_filename_after = std::format(".{}", out_ext);
       std::string out_filename = this->output_filename(base_filename, res_to_decode, out_filename_after);
-      this->ensure_directories_exist(out_filename);
+      this->prepare_output_file(out_filename);
 
       try {
         // Hack: PICT resources, when saved to disk, should be prepended with a
@@ -2398,6 +2731,7 @@ stderr ({} bytes):\n\
         } else {
           phosg::save_file(out_filename, res_to_decode->data);
         }
+        this->note_written_file(out_filename);
         phosg::fwrite_fmt(stderr, "... {}\n", out_filename);
       } catch (const std::exception& e) {
         phosg::fwrite_fmt(stderr, "warning: failed to save raw data: {}\n", e.what());
@@ -2408,7 +2742,34 @@ stderr ({} bytes):\n\
 
   bool disassemble(const std::string& filename, const std::string& base_out_dir) {
     this->base_out_dir = base_out_dir;
-    return this->disassemble_path(filename);
+    this->content_store_manifest_data.clear();
+
+    std::string export_manifest_filename = this->base_out_dir.empty()
+        ? EXPORT_MANIFEST_FILENAME
+        : (this->base_out_dir + "/" + EXPORT_MANIFEST_FILENAME);
+    if (this->incremental) {
+      auto options_hash = this->export_options_hash();
+      this->previous_manifest = ResourceDASM::ExportManifest::load(export_manifest_filename, options_hash);
+      this->current_manifest = ResourceDASM::ExportManifest(options_hash);
+    }
+
+    bool ret = this->disassemble_path(filename);
+
+    if (this->incremental) {
+      // Only the files that were found in this export are kept in the manifest
+      this->ensure_directories_exist(export_manifest_filename);
+      this->current_manifest.save(export_manifest_filename);
+      this->previous_manifest.files.clear();
+    }
+    if (this->content_store && this->content_store_manifest && !this->content_store_manifest_data.empty()) {
+      std::string manifest_filename = this->base_out_dir.empty()
+          ? CONTENT_STORE_MANIFEST_FILENAME
+          : (this->base_out_dir + "/" + CONTENT_STORE_MANIFEST_FILENAME);
+      this->ensure_directories_exist(manifest_filename);
+      phosg::save_file(manifest_filename, this->content_store_manifest_data);
+      phosg::fwrite_fmt(stderr, "... {}\n", manifest_filename);
+    }
+    return ret;
   }
 };
 
@@ -2610,6 +2971,12 @@ Resource disassembly input options:\n\
         dc-data: DC Data file\n\
         cbag: CBag archive\n\
       If the index format is not resource-fork, --data-fork is implied.\n\
+  --directory-index=FILENAME\n\
+      With --index-format=directory, cache the list of resources in FILENAME, so\n\
+      later runs on the same directory don\'t have to list every subdirectory.\n\
+      The cache is rebuilt automatically if any of the directories have changed.\n\
+      FILENAME should not be inside the input directory, since writing it there\n\
+      would make the cache appear out of date on every run.\n\
   --target=TYPE[:ID]\n\
       Only extract resources of this type and optionally IDs (can be given\n\
       multiple times). To specify characters with special meanings or\n\
@@ -2771,6 +3138,34 @@ Resource disassembly output options:\n\
       files from SONG resources will not play with smssynth unless you manually put\n\
       the required sound and MIDI resources in the same directory as the SONG JSON\n\
       after decoding.\n\
+  --content-store=DIR\n\
+      Share decoded outputs between all exported files (and between runs) via a\n\
+      content-addressed store in DIR. Each distinct resource is decoded only\n\
+      once; when an identical resource (same type, ID, name, attributes, and\n\
+      data) is exported again with the same options, its outputs are hard-linked\n\
+      from the store instead. Resources whose decoders look at other resources\n\
+      (for example, icons with separate masks, or SONGs) are always decoded\n\
+      normally. DIR should be on the same filesystem as the output directory;\n\
+      if it isn\'t, outputs are copied instead of linked. Delete DIR after\n\
+      updating resource_dasm, since it may contain outputs from older decoders.\n\
+  --content-store-manifest\n\
+      With --content-store, move stored outputs into the store instead of\n\
+      linking them into the output directory, and write a list of them to\n\
+      content_store_manifest.tsv in the output directory. Each line of this file\n\
+      has an output filename (relative to the output directory) and the\n\
+      corresponding file in the store, separated by a tab.\n\
+  --incremental\n\
+      Keep a manifest of everything exported in the output directory, and on\n\
+      later exports into the same directory, skip input files and resources\n\
+      whose outputs are already up to date. An input file is skipped without\n\
+      being read if its size and modification time haven\'t changed since the\n\
+      previous export and all of its outputs still exist. In files that have\n\
+      changed, resources whose data hasn\'t changed are skipped, unless their\n\
+      outputs depend on other resources in the file. Changing any option that\n\
+      affects which resources are exported or how they\'re decoded causes\n\
+      everything to be exported again. Outputs of resources that were deleted\n\
+      from the input files are not deleted. This option cannot be used with\n\
+      --content-store-manifest.\n\
 \n" IMAGE_SAVER_HELP
         "Resource-type specific options:\n\
   --icon-family-format=image,icns\n\
@@ -2791,6 +3186,23 @@ Resource file modification options:\n\
       exists, it is replaced with the new resource.\n\
   --delete-resource=TYPE:ID\n\
       Delete this resource in the output file.\n\
+  --change-resource-id=TYPE:OLDID:NEWID\n\
+      Change the ID of this resource in the output file.\n\
+  --rename-resource=TYPE:ID[:NAME]\n\
+      Change the name of this resource in the output file. If NAME is not\n\
+      given, the resource\'s name is removed.\n\
+  --in-place\n\
+      Modify the input file\'s resource fork instead of writing an output file.\n\
+      Only the resource map is read and rewritten; the data of added resources\n\
+      is appended to the end of the resource fork, and the data of existing\n\
+      resources is not moved. The previous resource map and the data of deleted\n\
+      resources are left in the file as unused space (see --compact).\n\
+  --compact\n\
+      Remove all unused space from the resource fork. With --in-place, this\n\
+      rewrites the entire input resource fork; this option may be given without\n\
+      any other modifications. Without --in-place, the output file never\n\
+      contains unused space, so this option has no effect other than allowing\n\
+      the file to be rewritten without any other modifications.\n\
   --data-fork\n\
       Read the input file\'s data fork as if it were the resource fork.\n\
   --output-data-fork\n\
@@ -2837,11 +3249,20 @@ int main(int argc, char** argv) {
   bool parse_data = false;
   bool create_resource_map = false;
   bool use_output_data_fork = false; // Only used if modify_resource_map == true
+  bool modify_in_place = false; // Only used if modify_resource_map == true
+  bool compact_resource_map = false; // Only used if modify_resource_map == true
   int32_t disassemble_system_dcmp_id = 0x7FFFFFFF;
   int32_t disassemble_system_ncmp_id = 0x7FFFFFFF;
   uint32_t describe_system_template_type = 0;
   for (int x = 1; x < argc; x++) {
     if (argv[x][0] == '-') {
+      // These options choose which resources are exported (--skip-decode and similar options are also recorded here,
+      // which is harmless)
+      if (!strncmp(argv[x], "--target", 8) || !strncmp(argv[x], "--skip-", 7)) {
+        exporter.selection_config += argv[x];
+        exporter.selection_config += '\n';
+      }
+
       if (!strncmp(argv[x], "--disassemble-system-dcmp=", 26)) {
         disassemble_system_dcmp_id = strtol(&argv[x][26], nullptr, 0);
       } else if (!strncmp(argv[x], "--disassemble-system-ncmp=", 26)) {
@@ -2854,6 +3275,8 @@ int main(int argc, char** argv) {
       } else if (!strcmp(argv[x], "--index-format=directory")) {
         exporter.index_format = ResourceDASM::IndexFormat::DIRECTORY;
         exporter.use_data_fork = true;
+      } else if (!strncmp(argv[x], "--directory-index=", 18)) {
+        exporter.directory_index_filename = &argv[x][18];
       } else if (!strcmp(argv[x], "--index-format=as/ad")) {
         exporter.index_format = ResourceDASM::IndexFormat::APPLESINGLE_APPLEDOUBLE;
         exporter.use_data_fork = true;
@@ -2953,11 +3376,41 @@ int main(int argc, char** argv) {
         op.res_id = stol(tokens[1]);
         modifications.emplace_back(std::move(op));
 
-        // TODO: Implement some more modification options. Specifically:
-        // --change-resource-id=TYPE:OLDID:NEWID
-        // --rename-resource=TYPE:ID:NAME
-        // --rename-resource=TYPE:ID
-        // The implementations should already be correct; we just need the CLI option parsers here.
+      } else if (!strncmp(argv[x], "--change-resource-id=", 21)) {
+        modify_resource_map = true;
+        auto tokens = phosg::split(&argv[x][21], ':');
+        if (tokens.size() != 3) {
+          throw std::invalid_argument("--change-resource-id argument must be TYPE:OLDID:NEWID");
+        }
+        ModificationOperation op;
+        op.op_type = ModificationOperation::Type::CHANGE_ID;
+        op.res_type = ResourceDASM::parse_cli_type(tokens[0].c_str());
+        op.res_id = stol(tokens[1]);
+        op.new_res_id = stol(tokens[2]);
+        modifications.emplace_back(std::move(op));
+
+      } else if (!strncmp(argv[x], "--rename-resource=", 18)) {
+        modify_resource_map = true;
+        auto tokens = phosg::split(&argv[x][18], ':');
+        if (tokens.size() < 2) {
+          throw std::invalid_argument("--rename-resource argument must be TYPE:ID[:NAME]");
+        }
+        ModificationOperation op;
+        op.op_type = ModificationOperation::Type::RENAME;
+        op.res_type = ResourceDASM::parse_cli_type(tokens[0].c_str());
+        op.res_id = stol(tokens[1]);
+        if (tokens.size() > 2) {
+          std::vector<std::string> name_tokens(make_move_iterator(tokens.begin() + 2), make_move_iterator(tokens.end()));
+          op.res_name = phosg::join(name_tokens, ":");
+        }
+        modifications.emplace_back(std::move(op));
+
+      } else if (!strcmp(argv[x], "--in-place")) {
+        modify_resource_map = true;
+        modify_in_place = true;
+      } else if (!strcmp(argv[x], "--compact")) {
+        modify_resource_map = true;
+        compact_resource_map = true;
 
       } else if (!strcmp(argv[x], "--parse-data")) {
         parse_data = true;
@@ -3063,6 +3516,13 @@ int main(int argc, char** argv) {
       } else if (!strcmp(argv[x], "--skip-templates")) {
         exporter.skip_templates = true;
 
+      } else if (!strncmp(argv[x], "--content-store=", 16)) {
+        exporter.content_store = std::make_unique<ResourceDASM::ContentStore>(&argv[x][16]);
+      } else if (!strcmp(argv[x], "--content-store-manifest")) {
+        exporter.content_store_manifest = true;
+      } else if (!strcmp(argv[x], "--incremental")) {
+        exporter.incremental = true;
+
       } else if (!strcmp(argv[x], "--skip-decompression")) {
         exporter.decompress_flags |= ResourceDASM::DecompressionFlag::DISABLED;
 
@@ -3124,7 +3584,7 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (modify_resource_map && modifications.empty() && !create_resource_map) {
+  if (modify_resource_map && modifications.empty() && !create_resource_map && !compact_resource_map) {
     throw std::runtime_error("multiple incompatible modes were specified");
   }
 
@@ -3163,18 +3623,29 @@ int main(int argc, char** argv) {
 
       const auto& res = rf.get_resource(type, id, exporter.decompress_flags);
       exporter.open_resource_file(std::move(rf));
-      return exporter.export_resource(filename, res) ? 0 : 3;
+      return exporter.export_resource(filename, res).exported ? 0 : 3;
 
     } else {
       if (out_dir.empty()) {
         out_dir = filename + ".out";
       }
       std::filesystem::create_directories(out_dir);
-      if (!exporter.disassemble(filename, out_dir)) {
-        return 3;
-      } else {
-        return 0;
+      if (exporter.incremental && exporter.content_store_manifest) {
+        // The content store manifest is rewritten on each export, so it would be missing any skipped outputs
+        throw std::invalid_argument("--incremental cannot be used with --content-store-manifest");
+      }
+      bool exported = exporter.disassemble(filename, out_dir);
+      if (exporter.content_store) {
+        const auto& stats = exporter.content_store_stats;
+        phosg::fwrite_fmt(stderr, "content store: {} hits, {} new entries, {} resources not storable\n",
+            stats.hits, stats.stored, stats.not_storable);
+      }
+      if (exporter.incremental) {
+        const auto& stats = exporter.incremental_stats;
+        phosg::fwrite_fmt(stderr, "incremental export: skipped {} unchanged files and {} unchanged resources\n",
+            stats.files_up_to_date, stats.resources_up_to_date);
       }
+      return exported ? 0 : 3;
     }
 
   } else { // modify_resource_map == true
@@ -3183,9 +3654,8 @@ int main(int argc, char** argv) {
       return 2;
     }
 
-    std::string input_data;
+    std::string input_filename;
     if (!create_resource_map) {
-      std::string input_filename;
       if (exporter.use_data_fork) {
         input_filename = filename;
       } else if (std::filesystem::is_regular_file(filename + RESOURCE_FORK_FILENAME_SUFFIX)) {
@@ -3193,12 +3663,79 @@ int main(int argc, char** argv) {
       } else if (std::filesystem::is_regular_file(filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX)) {
         input_filename = filename + RESOURCE_FORK_FILENAME_SHORT_SUFFIX;
       }
-      input_data = phosg::load_file(input_filename);
+    }
 
+    // This works with both ResourceFile and ResourceForkEditor, which have the same modification functions
+    auto apply_modifications = [&](auto& rf) -> void {
+      for (const auto& op : modifications) {
+        std::string type_str = ResourceDASM::string_for_resource_type(op.res_type);
+        switch (op.op_type) {
+          case ModificationOperation::Type::ADD: {
+            ResourceDASM::ResourceFile::Resource res;
+            res.type = op.res_type;
+            res.id = op.res_id;
+            res.flags = op.res_flags;
+            res.name = op.res_name;
+            res.data = phosg::load_file(op.filename);
+            size_t data_bytes = res.data.size();
+            if (!rf.add(std::move(res))) {
+              throw std::runtime_error("cannot add resource");
+            }
+            phosg::fwrite_fmt(stderr, "... (add) {}:{} flags={:02X} name=\"{}\" data=\"{}\" ({} bytes) OK\n",
+                type_str, op.res_id, op.res_flags, op.res_name, op.filename, data_bytes);
+            break;
+          }
+          case ModificationOperation::Type::DELETE:
+            if (!rf.remove(op.res_type, op.res_id)) {
+              throw std::runtime_error("cannot delete resource");
+            }
+            phosg::fwrite_fmt(stderr, "... (delete) {}:{} OK\n", type_str, op.res_id);
+            break;
+          case ModificationOperation::Type::CHANGE_ID:
+            if (!rf.change_id(op.res_type, op.res_id, op.new_res_id)) {
+              throw std::runtime_error("cannot change resource id");
+            }
+            phosg::fwrite_fmt(stderr, "... (change id) {}:{}=>{} OK\n", type_str, op.res_id, op.new_res_id);
+            break;
+          case ModificationOperation::Type::RENAME:
+            if (!rf.rename(op.res_type, op.res_id, op.res_name)) {
+              throw std::runtime_error("cannot rename resource");
+            }
+            phosg::fwrite_fmt(stderr, "... (rename) {}:{}=>\"{}\" OK\n", type_str, op.res_id, op.res_name);
+            break;
+          default:
+            throw std::logic_error("invalid modification operation");
+        }
+      }
+    };
+
+    if (modify_in_place) {
+      if (create_resource_map || use_output_data_fork || !out_dir.empty()) {
+        throw std::invalid_argument(
+            "--in-place cannot be used with --create, --output-data-fork, or an output filename");
+      }
+      if (input_filename.empty()) {
+        throw std::runtime_error("input file does not have a resource fork");
+      }
+
+      // Only the resource map is read here; resource data is only read if the file is compacted
+      ResourceDASM::ResourceForkEditor editor(input_filename);
+      phosg::fwrite_fmt(stderr, "... (load input map) {} resources\n", editor.size());
+      apply_modifications(editor);
+      if (compact_resource_map) {
+        phosg::fwrite_fmt(stderr, "... (compact output) {} bytes written\n", editor.compact());
+      } else {
+        phosg::fwrite_fmt(stderr, "... (update output) {} bytes written\n", editor.save());
+      }
+      return 0;
+    }
+
+    std::string input_data;
+    if (!create_resource_map) {
+      input_data = phosg::load_file(input_filename);
       if (out_dir.empty()) {
         out_dir = filename + ".out";
       }
-
     } else {
       if (!out_dir.empty()) {
         throw std::invalid_argument("only an output filename should be given if creating a resource map");
@@ -3209,46 +3746,7 @@ int main(int argc, char** argv) {
     phosg::fwrite_fmt(stderr, "... (load input) {} bytes\n", input_data.size());
 
     auto rf = ResourceDASM::parse_resource_fork(input_data);
-    for (const auto& op : modifications) {
-      std::string type_str = ResourceDASM::string_for_resource_type(op.res_type);
-      switch (op.op_type) {
-        case ModificationOperation::Type::ADD: {
-          ResourceDASM::ResourceFile::Resource res;
-          res.type = op.res_type;
-          res.id = op.res_id;
-          res.flags = op.res_flags;
-          res.name = op.res_name;
-          res.data = phosg::load_file(op.filename);
-          size_t data_bytes = res.data.size();
-          if (!rf.add(std::move(res))) {
-            throw std::runtime_error("cannot add resource");
-          }
-          phosg::fwrite_fmt(stderr, "... (add) {}:{} flags={:02X} name=\"{}\" data=\"{}\" ({} bytes) OK\n",
-              type_str, op.res_id, op.res_flags, op.res_name, op.filename, data_bytes);
-          break;
-        }
-        case ModificationOperation::Type::DELETE:
-          if (!rf.remove(op.res_type, op.res_id)) {
-            throw std::runtime_error("cannot delete resource");
-          }
-          phosg::fwrite_fmt(stderr, "... (delete) {}:{} OK\n", type_str, op.res_id);
-          break;
-        case ModificationOperation::Type::CHANGE_ID:
-          if (!rf.change_id(op.res_type, op.res_id, op.new_res_id)) {
-            throw std::runtime_error("cannot change resource id");
-          }
-          phosg::fwrite_fmt(stderr, "... (change id) {}:{}=>{} OK\n", type_str, op.res_id, op.new_res_id);
-          break;
-        case ModificationOperation::Type::RENAME:
-          if (!rf.rename(op.res_type, op.res_id, op.res_name)) {
-            throw std::runtime_error("cannot rename resource");
-          }
-          phosg::fwrite_fmt(stderr, "... (rename) {}:{}=>\"{}\" OK\n", type_str, op.res_id, op.res_name);
-          break;
-        default:
-          throw std::logic_error("invalid modification operation");
-      }
-    }
+    apply_modifications(rf);
 
     if (!use_output_data_fork) {
       out_dir += RESOURCE_FORK_FILENAME_SUFFIX;
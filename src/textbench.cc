@@ -0,0 +1,134 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <functional>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "TextCodecs.hh"
+
+void print_usage() {
+  phosg::fwrite_fmt(stderr, "\
+Usage: textbench [options]\n\
+\n\
+Measures the speed of MacRoman to UTF-8 decoding, comparing the original\n\
+byte-at-a-time implementation with decode_mac_roman and\n\
+decode_mac_roman_append (reusing the same output buffer).\n\
+\n\
+Options:\n\
+  --size=N\n\
+      Decode N bytes of input per iteration (default 4194304).\n\
+  --iterations=N\n\
+      Decode the input N times for each implementation (default 20).\n\
+  --high-percent=N\n\
+      When generating input, make N percent of the bytes non-ASCII (default 2).\n\
+      The rest are printable ASCII, with a carriage return about every 70\n\
+      bytes.\n\
+  --input=FILENAME\n\
+      Use the contents of this file as the input instead of generating it.\n\
+  --filename\n\
+      Decode with for_filename = true.\n\
+");
+}
+
+// This is how decode_mac_roman used to work: one std::string per input byte
+static std::string decode_mac_roman_bytewise(const std::string& data, bool for_filename) {
+  std::string ret;
+  for (char ch : data) {
+    ret += ResourceDASM::decode_mac_roman(ch, for_filename);
+  }
+  return ret;
+}
+
+static uint64_t run_benchmark(size_t iterations, std::function<void()> fn) {
+  uint64_t start = phosg::now();
+  for (size_t z = 0; z < iterations; z++) {
+    fn();
+  }
+  return phosg::now() - start;
+}
+
+int main(int argc, char** argv) {
+  size_t size = 0x400000;
+  size_t iterations = 20;
+  size_t high_percent = 2;
+  const char* input_filename = nullptr;
+  bool for_filename = false;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--size=", 7)) {
+      size = strtoull(&argv[x][7], nullptr, 0);
+    } else if (!strncmp(argv[x], "--iterations=", 13)) {
+      iterations = strtoull(&argv[x][13], nullptr, 0);
+    } else if (!strncmp(argv[x], "--high-percent=", 15)) {
+      high_percent = strtoull(&argv[x][15], nullptr, 0);
+    } else if (!strncmp(argv[x], "--input=", 8)) {
+      input_filename = &argv[x][8];
+    } else if (!strcmp(argv[x], "--filename")) {
+      for_filename = true;
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else {
+      phosg::fwrite_fmt(stderr, "invalid option: {}\n", argv[x]);
+      print_usage();
+      return 2;
+    }
+  }
+
+  std::string data;
+  if (input_filename) {
+    data = phosg::load_file(input_filename);
+  } else {
+    std::mt19937 rng(0);
+    data.resize(size);
+    for (auto& ch : data) {
+      if ((rng() % 100) < high_percent) {
+        ch = 0x80 + (rng() % 0x80);
+      } else if ((rng() % 70) == 0) {
+        ch = '\r';
+      } else {
+        ch = 0x20 + (rng() % 0x5F);
+      }
+    }
+  }
+  if (data.empty() || (iterations == 0)) {
+    throw std::invalid_argument("input must not be empty and iterations must be nonzero");
+  }
+
+  // Check that all the implementations produce the same result before timing them
+  std::string expected = decode_mac_roman_bytewise(data, for_filename);
+  if (ResourceDASM::decode_mac_roman(data, for_filename) != expected) {
+    throw std::logic_error("decode_mac_roman result does not match bytewise decoder");
+  }
+  std::string buffer;
+  ResourceDASM::decode_mac_roman_append(buffer, data.data(), data.size(), for_filename);
+  if (buffer != expected) {
+    throw std::logic_error("decode_mac_roman_append result does not match bytewise decoder");
+  }
+
+  uint64_t bytewise_usecs = run_benchmark(iterations, [&]() {
+    auto decoded = decode_mac_roman_bytewise(data, for_filename);
+  });
+  uint64_t alloc_usecs = run_benchmark(iterations, [&]() {
+    auto decoded = ResourceDASM::decode_mac_roman(data, for_filename);
+  });
+  uint64_t append_usecs = run_benchmark(iterations, [&]() {
+    buffer.clear();
+    ResourceDASM::decode_mac_roman_append(buffer, data.data(), data.size(), for_filename);
+  });
+
+  double total_bytes = static_cast<double>(data.size()) * iterations;
+  phosg::fwrite_fmt(stdout, "Decoding {} bytes {} times per implementation{}\n",
+      data.size(), iterations, for_filename ? " (for filename)" : "");
+  phosg::fwrite_fmt(stdout, "IMPLEMENTATION           MB/s\n");
+  phosg::fwrite_fmt(stdout, "bytewise (original)  {:8.1f}\n", total_bytes / std::max<uint64_t>(bytewise_usecs, 1));
+  phosg::fwrite_fmt(stdout, "decode_mac_roman     {:8.1f}\n", total_bytes / std::max<uint64_t>(alloc_usecs, 1));
+  phosg::fwrite_fmt(stdout, "append (reused)      {:8.1f}\n", total_bytes / std::max<uint64_t>(append_usecs, 1));
+
+  return 0;
+}
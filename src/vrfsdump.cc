@@ -1,5 +1,7 @@
 #include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <filesystem>
@@ -7,6 +9,8 @@
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 struct VRFSBlock {
   phosg::be_uint32_t type; // 'VRFS'
@@ -36,22 +40,59 @@ struct FileBlock {
 } __attribute__((packed));
 
 void print_usage() {
-  phosg::fwrite_fmt(stderr, "Usage: vrfsdump input-filename [output-dir]\n\n");
+  phosg::fwrite_fmt(stderr, "\
+Usage: vrfsdump [--list] input-filename [output-dir]\n\
+\n\
+Extracts all files from a VRFS archive into output-dir (by default, the input\n\
+filename with .out appended). If --list is given, prints the archive's\n\
+directory structure and file sizes instead of extracting anything; file\n\
+contents are skipped without being read.\n\
+\n");
+}
+
+static constexpr size_t COPY_CHUNK_SIZE = 0x10000;
+
+// Reads a block header whose type field has already been read
+template <typename T>
+static T read_block_header(FILE* f, uint32_t type) {
+  T ret;
+  ret.type = type;
+  phosg::freadx(f, reinterpret_cast<uint8_t*>(&ret) + sizeof(ret.type), sizeof(T) - sizeof(ret.type));
+  return ret;
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2 || argc > 3) {
+  bool list_only = false;
+  std::string input_filename;
+  std::string output_dir;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--list")) {
+      list_only = true;
+    } else if (!strcmp(argv[x], "--help")) {
+      print_usage();
+      return 0;
+    } else if (input_filename.empty()) {
+      input_filename = argv[x];
+    } else if (output_dir.empty()) {
+      output_dir = argv[x];
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+  if (input_filename.empty()) {
     print_usage();
     return 1;
   }
-
-  std::string input_filename = argv[1];
-  std::string output_dir = (argc > 2) ? argv[2] : (input_filename + ".out");
-
-  std::filesystem::create_directories(output_dir);
-  std::filesystem::current_path(output_dir);
+  if (output_dir.empty()) {
+    output_dir = input_filename + ".out";
+  }
+  if (!list_only) {
+    std::filesystem::create_directories(output_dir);
+  }
 
   struct DirectoryStackEntry {
+    std::string path;
     size_t num_directories_remaining;
     size_t num_files_remaining;
 
@@ -60,19 +101,31 @@ int main(int argc, char** argv) {
     }
   };
   std::vector<DirectoryStackEntry> dir_stack;
+  auto archive_path = [&](const std::string& path) -> std::string {
+    return (path.size() > output_dir.size()) ? path.substr(output_dir.size() + 1) : ".";
+  };
   auto clear_dir_stack = [&]() {
     while (!dir_stack.empty() && dir_stack.back().done()) {
       dir_stack.pop_back();
-      std::filesystem::current_path(std::filesystem::current_path().parent_path());
     }
   };
 
-  std::string data = phosg::load_file(input_filename);
-  phosg::StringReader r(data);
-  while (!r.eof()) {
-    switch (r.get_u32b(false)) {
+  // The archive is read sequentially through a FILE*, so only the stdio buffer, one block header, and one chunk of
+  // file data are in memory at any time, regardless of the archive's size
+  auto f = phosg::fopen_unique(input_filename, "rb");
+  std::string copy_buffer;
+  for (;;) {
+    phosg::be_uint32_t type;
+    size_t bytes_read = fread(&type, 1, sizeof(type), f.get());
+    if (bytes_read == 0) {
+      break;
+    } else if (bytes_read != sizeof(type)) {
+      throw std::runtime_error("archive ends with an incomplete block");
+    }
+
+    switch (type) {
       case 0x56524653: // 'VRFS'
-        r.skip(sizeof(VRFSBlock));
+        read_block_header<VRFSBlock>(f.get(), type);
         break;
       case 0x64697220: { // 'dir '
         if (!dir_stack.empty()) {
@@ -82,34 +135,52 @@ int main(int argc, char** argv) {
           }
           entry.num_directories_remaining--;
         }
-        const auto& header = r.get<DirectoryBlock>();
-        std::string name = r.read(header.name_length);
-        phosg::fwrite_fmt(stderr, "(dir) {} ({} subdirectories, {} files)\n",
-            name, header.num_subdirectories, header.num_files);
-        dir_stack.emplace_back(DirectoryStackEntry{header.num_subdirectories, header.num_files});
+        auto header = read_block_header<DirectoryBlock>(f.get(), type);
+        std::string name = phosg::freadx(f.get(), header.name_length);
+        std::string path = dir_stack.empty() ? output_dir : dir_stack.back().path;
         if (!name.empty()) {
-          std::filesystem::create_directories(name);
-          std::filesystem::current_path(name);
+          path += '/';
+          path += name;
+          if (!list_only) {
+            std::filesystem::create_directories(path);
+          }
         }
+        phosg::fwrite_fmt(list_only ? stdout : stderr, "(dir) {} ({} subdirectories, {} files)\n",
+            list_only ? archive_path(path) : name, header.num_subdirectories, header.num_files);
+        dir_stack.emplace_back(DirectoryStackEntry{std::move(path), header.num_subdirectories, header.num_files});
         clear_dir_stack();
         break;
       }
       case 0x66696C65: { // 'file'
         if (dir_stack.empty()) {
           throw std::runtime_error("file outside of any directory");
+        }
+        auto header = read_block_header<FileBlock>(f.get(), type);
+        std::string name = phosg::freadx(f.get(), header.name_length);
+        std::string path = dir_stack.back().path + "/" + name;
+        dir_stack.back().num_files_remaining--;
+
+        if (list_only) {
+          if (fseeko(f.get(), header.size, SEEK_CUR)) {
+            throw std::runtime_error("cannot skip file data");
+          }
+          phosg::fwrite_fmt(stdout, "(file) {} (0x{:X} bytes)\n", archive_path(path), header.size);
         } else {
-          auto& entry = dir_stack.back();
-          entry.num_files_remaining--;
+          auto out_f = phosg::fopen_unique(path, "wb");
+          for (size_t remaining = header.size; remaining > 0;) {
+            size_t chunk_size = std::min<size_t>(remaining, COPY_CHUNK_SIZE);
+            copy_buffer.resize(chunk_size);
+            phosg::freadx(f.get(), copy_buffer.data(), chunk_size);
+            phosg::fwritex(out_f.get(), copy_buffer.data(), chunk_size);
+            remaining -= chunk_size;
+          }
+          phosg::fwrite_fmt(stderr, "(file) {} (0x{:X} bytes)\n", name, header.size);
         }
-        const auto& header = r.get<FileBlock>();
-        std::string name = r.read(header.name_length);
-        phosg::save_file(name, r.read(header.size));
-        phosg::fwrite_fmt(stderr, "(file) {} (0x{:X} bytes)\n", name, header.size);
         clear_dir_stack();
         break;
       }
       default:
-        throw std::runtime_error(std::format("unsupported block type: {:08X}", r.get_u32b(false)));
+        throw std::runtime_error(std::format("unsupported block type: {:08X}", type.load()));
     }
   }
 